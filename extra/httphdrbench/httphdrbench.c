@@ -0,0 +1,352 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2017-2025, Soner Tari <sonertari@gmail.com>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Benchmark of the HTTP request header filter: the httphdr streaming parser
+ * against the previous implementation, which read each line with
+ * evbuffer_readln(), matched names with strncasecmp(), and wrote lines back
+ * with evbuffer_add_printf().  Both filter a typical browser request with
+ * the rules protohttp applies to parent conns with the default options.
+ *
+ * Usage: httphdrbench [iterations]
+ */
+
+#include "httphdr.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <event2/buffer.h>
+
+#define SSLPROXY_KEY		"SSLproxy:"
+#define SSLPROXY_KEY_LEN	strlen(SSLPROXY_KEY)
+
+static const char request[] =
+	"GET /search?q=sslproxy&ie=UTF-8 HTTP/1.1\r\n"
+	"Host: www.example.com\r\n"
+	"Connection: keep-alive\r\n"
+	"Upgrade-Insecure-Requests: 1\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+	"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+	"Sec-Fetch-Site: same-origin\r\n"
+	"Sec-Fetch-Mode: navigate\r\n"
+	"Sec-Fetch-Dest: document\r\n"
+	"Referer: https://www.example.com/\r\n"
+	"Accept-Encoding: gzip, deflate, br\r\n"
+	"Accept-Language: en-US,en;q=0.9\r\n"
+	"Cookie: session=0123456789abcdef0123456789abcdef; prefs=dark\r\n"
+	"\r\n";
+
+typedef struct bench_ctx {
+	char *http_method;
+	char *http_uri;
+	char *http_host;
+	char *http_content_type;
+	int seen_req_header;
+	int sent_http_conn_close;
+	int not_valid;
+	unsigned int seen_keyword_count;
+	httphdr_parser_t parser;
+} bench_ctx_t;
+
+static void
+bench_ctx_reset(bench_ctx_t *b)
+{
+	free(b->http_method);
+	free(b->http_uri);
+	free(b->http_host);
+	free(b->http_content_type);
+	memset(b, 0, sizeof(bench_ctx_t));
+}
+
+static char *
+bench_strndup(const char *s, size_t n)
+{
+	char *p = malloc(n + 1);
+
+	if (p) {
+		memcpy(p, s, n);
+		p[n] = '\0';
+	}
+	return p;
+}
+
+/*
+ * The previous filter, as in protohttp_filter_request_header_line() before
+ * httphdr, with the default options: Referer removed, Accept-Encoding kept.
+ */
+static char *
+readln_filter_line(const char *line, bench_ctx_t *b)
+{
+	if (!b->http_method) {
+		const char *space1, *space2;
+
+		space1 = strchr(line, ' ');
+		space2 = space1 ? strchr(space1 + 1, ' ') : NULL;
+		if (!space1) {
+			b->seen_req_header = 1;
+			b->not_valid = 1;
+		} else {
+			b->http_method = bench_strndup(line, space1 - line);
+			space1++;
+			if (!space2) {
+				b->seen_req_header = 1;
+				space2 = space1 + strlen(space1);
+			}
+			b->http_uri = bench_strndup(space1, space2 - space1);
+		}
+	} else if (!b->http_host && !strncasecmp(line, "Host:", 5)) {
+		b->http_host = strdup(line + 5 + strspn(line + 5, " \t"));
+		b->seen_keyword_count++;
+	} else if (!strncasecmp(line, "Content-Type:", 13)) {
+		b->http_content_type = strdup(line + 13 + strspn(line + 13, " \t"));
+		b->seen_keyword_count++;
+	} else if (!strncasecmp(line, "Connection:", 11)) {
+		b->sent_http_conn_close = 1;
+		b->seen_keyword_count++;
+		return strdup("Connection: close");
+	} else if (!strncasecmp(line, "Referer:", 8)) {
+		b->seen_keyword_count++;
+		return NULL;
+	} else if (!strncasecmp(line, "Upgrade:", 8) || !strncasecmp(line, "Keep-Alive:", 11)) {
+		b->seen_keyword_count++;
+		return NULL;
+	} else if (!strncasecmp(line, SSLPROXY_KEY, SSLPROXY_KEY_LEN)) {
+		return NULL;
+	} else if (line[0] == '\0') {
+		b->seen_req_header = 1;
+		if (!b->sent_http_conn_close)
+			return strdup("Connection: close\r\n");
+	}
+	return (char *)line;
+}
+
+static void
+readln_filter(struct evbuffer *inbuf, struct evbuffer *outbuf, bench_ctx_t *b)
+{
+	char *line;
+
+	while (!b->seen_req_header && (line = evbuffer_readln(inbuf, NULL, EVBUFFER_EOL_CRLF))) {
+		char *replace = readln_filter_line(line, b);
+		if (replace == line) {
+			evbuffer_add_printf(outbuf, "%s\r\n", line);
+		} else if (replace) {
+			evbuffer_add_printf(outbuf, "%s\r\n", replace);
+			free(replace);
+		}
+		free(line);
+	}
+	if (b->seen_req_header && evbuffer_get_length(inbuf))
+		evbuffer_add_buffer(outbuf, inbuf);
+}
+
+/*
+ * The httphdr line callback with the same rules, as in the current
+ * protohttp_filter_request_header_line() without keep-alive.
+ */
+static int
+httphdr_filter_line(httphdr_line_t *line, void *arg)
+{
+	bench_ctx_t *b = arg;
+
+	if (!b->http_method) {
+		const char *end = line->buf + line->len;
+		const char *space1, *space2;
+
+		space1 = memchr(line->buf, ' ', line->len);
+		space2 = space1 ? memchr(space1 + 1, ' ', end - space1 - 1) : NULL;
+		if (!space1) {
+			b->seen_req_header = 1;
+			b->not_valid = 1;
+			return HTTPHDR_DONE;
+		}
+		b->http_method = bench_strndup(line->buf, space1 - line->buf);
+		space1++;
+		if (!space2) {
+			b->seen_req_header = 1;
+			b->http_uri = bench_strndup(space1, end - space1);
+			return HTTPHDR_DONE;
+		}
+		b->http_uri = bench_strndup(space1, space2 - space1);
+		return HTTPHDR_KEEP;
+	}
+
+	switch (line->id) {
+	case HTTPHDR_HOST:
+		if (!b->http_host) {
+			b->http_host = bench_strndup(line->value, line->value_len);
+			b->seen_keyword_count++;
+		}
+		break;
+	case HTTPHDR_CONTENT_TYPE:
+		free(b->http_content_type);
+		b->http_content_type = bench_strndup(line->value, line->value_len);
+		b->seen_keyword_count++;
+		break;
+	case HTTPHDR_CONNECTION:
+		b->seen_keyword_count++;
+		b->sent_http_conn_close = 1;
+		line->insert = "Connection: close";
+		return HTTPHDR_DROP;
+	case HTTPHDR_REFERER:
+	case HTTPHDR_UPGRADE:
+	case HTTPHDR_KEEP_ALIVE:
+		b->seen_keyword_count++;
+		return HTTPHDR_DROP;
+	case HTTPHDR_SSLPROXY:
+		return HTTPHDR_DROP;
+	default:
+		if (line->len == 0) {
+			b->seen_req_header = 1;
+			if (!b->sent_http_conn_close)
+				line->insert = "Connection: close";
+			return HTTPHDR_DONE;
+		}
+		break;
+	}
+	return HTTPHDR_KEEP;
+}
+
+static void
+httphdr_filter_req(struct evbuffer *inbuf, struct evbuffer *outbuf, bench_ctx_t *b)
+{
+	if (httphdr_filter(inbuf, outbuf, &b->parser, httphdr_filter_line, b) == -1) {
+		fprintf(stderr, "httphdr_filter failed\n");
+		exit(EXIT_FAILURE);
+	}
+	if (b->seen_req_header && evbuffer_get_length(inbuf))
+		evbuffer_add_buffer(outbuf, inbuf);
+}
+
+typedef void (*bench_filter_t)(struct evbuffer *, struct evbuffer *, bench_ctx_t *);
+
+/*
+ * Filter the request once, passed in one read, or in two reads split in the
+ * middle of a line if split is set, and return the filtered request.
+ */
+static struct evbuffer *
+bench_once(bench_filter_t filter, bench_ctx_t *b, struct evbuffer *inbuf, struct evbuffer *outbuf, int split)
+{
+	size_t len = sizeof(request) - 1;
+	size_t half = split ? len / 2 : len;
+
+	evbuffer_add(inbuf, request, half);
+	filter(inbuf, outbuf, b);
+	if (half < len) {
+		evbuffer_add(inbuf, request + half, len - half);
+		filter(inbuf, outbuf, b);
+	}
+	return outbuf;
+}
+
+static double
+bench_run(const char *name, bench_filter_t filter, long n, int split)
+{
+	struct evbuffer *inbuf = evbuffer_new();
+	struct evbuffer *outbuf = evbuffer_new();
+	bench_ctx_t b;
+	struct timespec t0, t1;
+
+	if (!inbuf || !outbuf) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	memset(&b, 0, sizeof(b));
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (long i = 0; i < n; i++) {
+		bench_once(filter, &b, inbuf, outbuf, split);
+		evbuffer_drain(outbuf, evbuffer_get_length(outbuf));
+		bench_ctx_reset(&b);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	double us = ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / 1e3 / n;
+	printf("%-8s %-6s %ld iterations: %.3f us per header\n", name, split ? "split" : "whole", n, us);
+
+	evbuffer_free(inbuf);
+	evbuffer_free(outbuf);
+	return us;
+}
+
+/*
+ * Make sure both filters produce the same output before timing them.
+ */
+static void
+bench_check(int split)
+{
+	struct evbuffer *in1 = evbuffer_new(), *out1 = evbuffer_new();
+	struct evbuffer *in2 = evbuffer_new(), *out2 = evbuffer_new();
+	bench_ctx_t b1, b2;
+
+	memset(&b1, 0, sizeof(b1));
+	memset(&b2, 0, sizeof(b2));
+	bench_once(readln_filter, &b1, in1, out1, split);
+	bench_once(httphdr_filter_req, &b2, in2, out2, split);
+
+	size_t len = evbuffer_get_length(out1);
+	if (len != evbuffer_get_length(out2) ||
+			memcmp(evbuffer_pullup(out1, -1), evbuffer_pullup(out2, -1), len) ||
+			b1.seen_keyword_count != b2.seen_keyword_count ||
+			strcmp(b1.http_host, b2.http_host) || strcmp(b1.http_uri, b2.http_uri)) {
+		fprintf(stderr, "Filters disagree:\n%.*s\n---\n%.*s\n",
+		        (int)len, (char *)evbuffer_pullup(out1, -1),
+		        (int)evbuffer_get_length(out2), (char *)evbuffer_pullup(out2, -1));
+		exit(EXIT_FAILURE);
+	}
+
+	bench_ctx_reset(&b1);
+	bench_ctx_reset(&b2);
+	evbuffer_free(in1);
+	evbuffer_free(out1);
+	evbuffer_free(in2);
+	evbuffer_free(out2);
+}
+
+int
+main(int argc, char *argv[])
+{
+	long n = argc > 1 ? strtol(argv[1], NULL, 10) : 1000000;
+
+	if (n <= 0) {
+		fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	for (int split = 0; split <= 1; split++) {
+		bench_check(split);
+		double old = bench_run("readln", readln_filter, n, split);
+		double new = bench_run("httphdr", httphdr_filter_req, n, split);
+		printf("speedup %.2fx\n", old / new);
+	}
+	return EXIT_SUCCESS;
+}
+
+/* vim: set noet ft=c: */
@@ -55,6 +55,7 @@
 #define NONNULL(...)    __attribute__((nonnull(__VA_ARGS__)))
 #define PURE            __attribute__((pure))
 #define INLINE          __attribute__((always_inline))
+#define ALIGNED(n)      __attribute__((aligned(n)))
 
 /*
  * Branch prediction macros.
@@ -32,10 +32,218 @@
 #include "khash.h"
 
 #include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
 
 /*
  * Generic, thread-safe cache.
+ *
+ * The cache is split into CACHE_SHARDS shards, each with its own map and
+ * lock, so that threads looking up different keys do not serialize on a
+ * single lock.  Keys are assigned to shards by the hash_cb of the cache type.
+ * Per-shard lock statistics are kept to see how much contention remains.
+ *
+ * Each shard can be bounded in number of entries and bytes.  When a shard is
+ * full, entries are evicted using the CLOCK approximation of LRU: the clock
+ * hand sweeps over the map buckets, clearing the reference bit of entries
+ * which have been looked up since the last pass, and evicting the first entry
+ * found without it.  The values stored in the maps are cache_entry_t
+ * wrappers which carry the reference bit and size of the entries.
+ */
+
+typedef struct cache_entry {
+	cache_val_t val;
+	size_t size;
+	int ref;
+} cache_entry_t;
+
+/*
+ * Select the shard for key.  The maps use the low bits of the same hash to
+ * select buckets, so the shard index is taken from the high bits of the
+ * (Fibonacci) scrambled hash, which keeps the buckets of each shard evenly
+ * populated.
+ */
+static inline cache_shard_t *
+cache_shard(cache_t *cache, cache_key_t key)
+{
+	unsigned int h = cache->hash_cb(key) * 2654435769U;
+	return &cache->shards[h >> (32 - CACHE_SHARDS_BITS)];
+}
+
+static void
+cache_shard_lock_stats(cache_shard_t *shard, int contended)
+{
+	__atomic_add_fetch(&shard->locks, 1, __ATOMIC_RELAXED);
+	if (contended)
+		__atomic_add_fetch(&shard->contended, 1, __ATOMIC_RELAXED);
+}
+
+static void
+cache_shard_wrlock(cache_t *cache, cache_shard_t *shard)
+{
+	int contended;
+
+	if (cache->rwlock) {
+		if ((contended = pthread_rwlock_trywrlock(&shard->rwlock)))
+			pthread_rwlock_wrlock(&shard->rwlock);
+	} else {
+		if ((contended = pthread_mutex_trylock(&shard->mutex)))
+			pthread_mutex_lock(&shard->mutex);
+	}
+	cache_shard_lock_stats(shard, contended);
+}
+
+static void
+cache_shard_rdlock(cache_t *cache, cache_shard_t *shard)
+{
+	int contended;
+
+	if (!cache->rwlock) {
+		cache_shard_wrlock(cache, shard);
+		return;
+	}
+	if ((contended = pthread_rwlock_tryrdlock(&shard->rwlock)))
+		pthread_rwlock_rdlock(&shard->rwlock);
+	cache_shard_lock_stats(shard, contended);
+}
+
+static void
+cache_shard_unlock(cache_t *cache, cache_shard_t *shard)
+{
+	if (cache->rwlock)
+		pthread_rwlock_unlock(&shard->rwlock);
+	else
+		pthread_mutex_unlock(&shard->mutex);
+}
+
+static int
+cache_shard_lock_init(cache_t *cache, cache_shard_t *shard)
+{
+	if (cache->rwlock)
+		return pthread_rwlock_init(&shard->rwlock, NULL) ? -1 : 0;
+	return pthread_mutex_init(&shard->mutex, NULL) ? -1 : 0;
+}
+
+static void
+cache_shard_lock_destroy(cache_t *cache, cache_shard_t *shard)
+{
+	if (cache->rwlock)
+		pthread_rwlock_destroy(&shard->rwlock);
+	else
+		pthread_mutex_destroy(&shard->mutex);
+}
+
+/*
+ * Free all entries in the map of shard and the map itself.
+ */
+static void
+cache_shard_free(cache_t *cache, cache_shard_t *shard)
+{
+	cache_map_t map = shard->map;
+	cache_entry_t *e;
+	khiter_t it;
+
+	for (it = cache->begin_cb(map); it != cache->end_cb(map); it++) {
+		if (cache->exist_cb(map, it)) {
+			e = cache->get_val_cb(map, it);
+			cache->free_key_cb(cache->get_key_cb(map, it));
+			cache->free_val_cb(e->val);
+			free(e);
+		}
+	}
+	cache->map_free_cb(map);
+}
+
+/*
+ * Remove the entry at it from map and free its key and value.
+ */
+static void
+cache_shard_del(cache_t *cache, cache_shard_t *shard, khiter_t it)
+{
+	cache_entry_t *e = cache->get_val_cb(shard->map, it);
+
+	shard->entries--;
+	shard->bytes -= e->size;
+	cache->free_val_cb(e->val);
+	free(e);
+	cache->free_key_cb(cache->get_key_cb(shard->map, it));
+	cache->del_cb(shard->map, it);
+}
+
+/*
+ * Advance the clock hand by steps buckets, dropping invalid entries.
+ * Returns the number of entries dropped.
+ */
+static size_t
+cache_shard_sweep(cache_t *cache, cache_shard_t *shard, size_t steps)
+{
+	cache_map_t map = shard->map;
+	cache_iter_t end = cache->end_cb(map);
+	cache_entry_t *e;
+	size_t n = 0;
+	khiter_t it;
+
+	if (end == 0)
+		return 0;
+	if (steps > end)
+		steps = end;
+	while (steps--) {
+		if (shard->hand >= end)
+			shard->hand = 0;
+		it = shard->hand++;
+		if (cache->exist_cb(map, it)) {
+			e = cache->get_val_cb(map, it);
+			if (!cache->unpackverify_val_cb(e->val, 0)) {
+				cache_shard_del(cache, shard, it);
+				n++;
+			}
+		}
+	}
+	return n;
+}
+
+/*
+ * Evict the entry under the clock hand which has not been referenced since
+ * the last pass.  Returns 0 if an entry was evicted, -1 if the shard is empty.
+ */
+static int
+cache_shard_evict(cache_t *cache, cache_shard_t *shard)
+{
+	cache_map_t map = shard->map;
+	cache_iter_t end = cache->end_cb(map);
+	cache_entry_t *e;
+	khiter_t it;
+	size_t i;
+
+	if (!shard->entries)
+		return -1;
+
+	/* at most two passes: the first clears all reference bits */
+	for (i = 0; i < 2 * (size_t)end + 1; i++) {
+		if (shard->hand >= end)
+			shard->hand = 0;
+		it = shard->hand++;
+		if (!cache->exist_cb(map, it))
+			continue;
+		e = cache->get_val_cb(map, it);
+		if (__atomic_exchange_n(&e->ref, 0, __ATOMIC_RELAXED))
+			continue;
+		cache_shard_del(cache, shard, it);
+		__atomic_add_fetch(&shard->evicted, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	return -1;
+}
+
+/*
+ * Whether one more entry of size bytes would exceed the limits of shard.
  */
+static inline int
+cache_shard_full(cache_t *cache, cache_shard_t *shard, size_t size)
+{
+	return (cache->max_entries && shard->entries >= cache->max_entries) ||
+	       (cache->max_bytes && shard->bytes + size > cache->max_bytes);
+}
 
 /*
  * Create a new cache based on the initializer callback init_cb.
@@ -44,17 +252,32 @@ cache_t *
 cache_new(cache_init_cb_t init_cb)
 {
 	cache_t *cache;
+	int i;
 
-	if (!(cache = malloc(sizeof(cache_t))))
+	if (posix_memalign((void **)&cache, __alignof__(cache_shard_t),
+	                   sizeof(cache_t)))
 		return NULL;
-
-	if (pthread_mutex_init(&cache->mutex, NULL)) {
-		free(cache);
-		return NULL;
-	}
+	memset(cache, 0, sizeof(cache_t));
 
 	init_cb(cache);
+
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		if (!(cache->shards[i].map = cache->map_new_cb()))
+			goto err;
+		if (cache_shard_lock_init(cache, &cache->shards[i]) == -1) {
+			cache->map_free_cb(cache->shards[i].map);
+			goto err;
+		}
+	}
 	return cache;
+
+err:
+	while (--i >= 0) {
+		cache_shard_lock_destroy(cache, &cache->shards[i]);
+		cache->map_free_cb(cache->shards[i].map);
+	}
+	free(cache);
+	return NULL;
 }
 
 /*
@@ -63,7 +286,13 @@ cache_new(cache_init_cb_t init_cb)
 int
 cache_reinit(cache_t *cache)
 {
-	return pthread_mutex_init(&cache->mutex, NULL) ? -1 : 0;
+	int i;
+
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		if (cache_shard_lock_init(cache, &cache->shards[i]) == -1)
+			return -1;
+	}
+	return 0;
 }
 
 /*
@@ -73,97 +302,216 @@ cache_reinit(cache_t *cache)
 void
 cache_free(cache_t *cache)
 {
-	khiter_t it;
+	int i;
 
-	for (it = cache->begin_cb(); it != cache->end_cb(); it++) {
-		if (cache->exist_cb(it)) {
-			cache->free_key_cb(cache->get_key_cb(it));
-			cache->free_val_cb(cache->get_val_cb(it));
-		}
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		cache_shard_free(cache, &cache->shards[i]);
+		cache_shard_lock_destroy(cache, &cache->shards[i]);
 	}
-	cache->fini_cb();
-	pthread_mutex_destroy(&cache->mutex);
 	free(cache);
 }
 
-void
+/*
+ * Garbage collect the cache incrementally: advance the clock hand of each
+ * shard by CACHE_GC_STEPS buckets, locking one shard at a time, so that
+ * lookups are never stalled by a scan of the whole cache.  Returns the
+ * number of invalid entries dropped.
+ */
+size_t
 cache_gc(cache_t *cache)
 {
-	khiter_t it;
-	cache_val_t val;
+	cache_shard_t *shard;
+	size_t n = 0;
+	int i;
 
-	pthread_mutex_lock(&cache->mutex);
-	for (it = cache->begin_cb(); it != cache->end_cb(); it++) {
-		if (cache->exist_cb(it)) {
-			val = cache->get_val_cb(it);
-			if (!cache->unpackverify_val_cb(val, 0)) {
-				cache->free_val_cb(val);
-				cache->free_key_cb(cache->get_key_cb(it));
-				cache->del_cb(it);
-			}
-		}
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		shard = &cache->shards[i];
+		cache_shard_wrlock(cache, shard);
+		n += cache_shard_sweep(cache, shard, CACHE_GC_STEPS);
+		cache_shard_unlock(cache, shard);
 	}
-	pthread_mutex_unlock(&cache->mutex);
+	return n;
 }
 
 cache_val_t
 cache_get(cache_t *cache, cache_key_t key)
 {
+	cache_shard_t *shard;
 	cache_val_t rval = NULL;
+	cache_entry_t *e;
+	int invalid = 0;
 	khiter_t it;
 
 	if (!key)
 		return NULL;
 
-	pthread_mutex_lock(&cache->mutex);
-	it = cache->get_cb(key);
-	if (it != cache->end_cb()) {
-		cache_val_t val;
-		val = cache->get_val_cb(it);
-		if (!(rval = cache->unpackverify_val_cb(val, 1))) {
-			cache->free_val_cb(val);
-			cache->free_key_cb(cache->get_key_cb(it));
-			cache->del_cb(it);
+	shard = cache_shard(cache, key);
+
+	cache_shard_rdlock(cache, shard);
+	it = cache->get_cb(shard->map, key);
+	if (it != cache->end_cb(shard->map)) {
+		e = cache->get_val_cb(shard->map, it);
+		if ((rval = cache->unpackverify_val_cb(e->val, 1))) {
+			/* readers may race on the reference bit, hence atomic */
+			__atomic_store_n(&e->ref, 1, __ATOMIC_RELAXED);
+		} else if (cache->rwlock) {
+			invalid = 1;
+		} else {
+			cache_shard_del(cache, shard, it);
+		}
+	}
+	cache_shard_unlock(cache, shard);
+
+	if (invalid) {
+		/* The entry may have changed while the shard was unlocked */
+		cache_shard_wrlock(cache, shard);
+		it = cache->get_cb(shard->map, key);
+		if (it != cache->end_cb(shard->map)) {
+			e = cache->get_val_cb(shard->map, it);
+			if (!cache->unpackverify_val_cb(e->val, 0))
+				cache_shard_del(cache, shard, it);
 		}
+		cache_shard_unlock(cache, shard);
 	}
+
 	cache->free_key_cb(key);
-	pthread_mutex_unlock(&cache->mutex);
 	return rval;
 }
 
-void
-cache_set(cache_t *cache, cache_key_t key, cache_val_t val)
+/*
+ * Insert val for key, replacing any existing entry.  If merge is set, val is
+ * first merged with the replaced entry, if still valid, using merge_val_cb,
+ * and a copy of the resulting value is returned; otherwise returns NULL.
+ * Both happen under the shard lock, so concurrent merges do not get lost.
+ */
+static cache_val_t
+cache_put(cache_t *cache, cache_key_t key, cache_val_t val, int merge)
 {
+	cache_shard_t *shard;
+	cache_val_t rval = NULL;
+	cache_entry_t *e, *old;
 	khiter_t it;
 	int ret;
 
 	if (!key || !val)
-		return;
+		return NULL;
 
-	pthread_mutex_lock(&cache->mutex);
-	it = cache->put_cb(key, &ret);
-	if (!ret) {
+	if (!(e = malloc(sizeof(cache_entry_t)))) {
 		cache->free_key_cb(key);
-		cache->free_val_cb(cache->get_val_cb(it));
+		cache->free_val_cb(val);
+		return NULL;
+	}
+	e->val = val;
+	e->ref = 0;
+
+	shard = cache_shard(cache, key);
+
+	cache_shard_wrlock(cache, shard);
+	cache_shard_sweep(cache, shard, CACHE_SWEEP_STEPS);
+
+	/* Make room before inserting, a resize would move the entries */
+	it = cache->get_cb(shard->map, key);
+	if (it != cache->end_cb(shard->map)) {
+		old = cache->get_val_cb(shard->map, it);
+		if (merge && cache->unpackverify_val_cb(old->val, 0))
+			cache->merge_val_cb(val, old->val);
+		cache_shard_del(cache, shard, it);
 	}
-	cache->set_val_cb(it, val);
-	pthread_mutex_unlock(&cache->mutex);
+	e->size = cache->size_cb(key, val);
+	while (cache_shard_full(cache, shard, e->size)) {
+		if (cache_shard_evict(cache, shard) == -1)
+			break;
+	}
+
+	it = cache->put_cb(shard->map, key, &ret);
+	if (ret == -1) {
+		cache->free_key_cb(key);
+		cache->free_val_cb(val);
+		free(e);
+	} else {
+		cache->set_val_cb(shard->map, it, e);
+		shard->entries++;
+		shard->bytes += e->size;
+		if (merge)
+			rval = cache->unpackverify_val_cb(val, 1);
+	}
+	cache_shard_unlock(cache, shard);
+	return rval;
+}
+
+void
+cache_set(cache_t *cache, cache_key_t key, cache_val_t val)
+{
+	cache_put(cache, key, val, 0);
+}
+
+/*
+ * Like cache_set(), but merge val with the existing valid entry for key, if
+ * any, using the merge_val_cb of the cache type, e.g. to add up counters.
+ * Returns a copy of the merged value as cache_get() would, or NULL on error.
+ */
+cache_val_t
+cache_merge(cache_t *cache, cache_key_t key, cache_val_t val)
+{
+	return cache_put(cache, key, val, 1);
 }
 
 void
 cache_del(cache_t *cache, cache_key_t key)
 {
+	cache_shard_t *shard;
 	khiter_t it;
 
-	pthread_mutex_lock(&cache->mutex);
-	it = cache->get_cb(key);
-	if (it != cache->end_cb()) {
-		cache->free_val_cb(cache->get_val_cb(it));
-		cache->free_key_cb(cache->get_key_cb(it));
-		cache->del_cb(it);
+	if (!key)
+		return;
+
+	shard = cache_shard(cache, key);
+
+	cache_shard_wrlock(cache, shard);
+	it = cache->get_cb(shard->map, key);
+	if (it != cache->end_cb(shard->map)) {
+		cache_shard_del(cache, shard, it);
 	}
 	cache->free_key_cb(key);
-	pthread_mutex_unlock(&cache->mutex);
+	cache_shard_unlock(cache, shard);
+}
+
+/*
+ * Limit the cache to max_entries entries and max_bytes bytes, 0 for no limit.
+ * The limits are divided evenly among the shards.  Entries exceeding the new
+ * limits are evicted by subsequent cache_set() calls.
+ */
+void
+cache_set_limits(cache_t *cache, size_t max_entries, size_t max_bytes)
+{
+	cache->max_entries = (max_entries + CACHE_SHARDS - 1) / CACHE_SHARDS;
+	cache->max_bytes = (max_bytes + CACHE_SHARDS - 1) / CACHE_SHARDS;
+}
+
+/*
+ * Sum up the lock statistics of all shards and reset them.  The shard with
+ * the most contended lock acquisitions is reported in max_shard.
+ */
+void
+cache_get_stats(cache_t *cache, cache_stats_t *stats)
+{
+	unsigned long long contended;
+	int i;
+
+	memset(stats, 0, sizeof(cache_stats_t));
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		stats->locks += __atomic_exchange_n(&cache->shards[i].locks, 0,
+		                                    __ATOMIC_RELAXED);
+		contended = __atomic_exchange_n(&cache->shards[i].contended, 0,
+		                                __ATOMIC_RELAXED);
+		stats->contended += contended;
+		stats->evicted += __atomic_exchange_n(&cache->shards[i].evicted, 0,
+		                                      __ATOMIC_RELAXED);
+		if (contended > stats->max_contended) {
+			stats->max_contended = contended;
+			stats->max_shard = i;
+		}
+	}
 }
 
 /* vim: set noet ft=c: */
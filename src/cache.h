@@ -32,27 +32,83 @@
 #include "attrib.h"
 
 #include <pthread.h>
+#include <stddef.h>
 
 typedef void * cache_val_t;
 typedef void * cache_key_t;
+typedef void * cache_map_t;
 typedef unsigned int cache_iter_t; /* must match khiter_t */
 
-typedef cache_iter_t (*cache_begin_cb_t)(void);
-typedef cache_iter_t (*cache_end_cb_t)(void);
-typedef int (*cache_exist_cb_t)(cache_iter_t);
-typedef void (*cache_del_cb_t)(cache_iter_t);
-typedef cache_iter_t (*cache_get_cb_t)(cache_key_t);
-typedef cache_iter_t (*cache_put_cb_t)(cache_key_t, int *);
+/*
+ * Number of shards per cache.  Each shard owns its own map and lock, and keys
+ * are assigned to shards by their hash value.
+ */
+#define CACHE_SHARDS_BITS 4
+#define CACHE_SHARDS (1 << CACHE_SHARDS_BITS)
+
+/*
+ * Number of map buckets the clock hand of a shard is advanced by on every
+ * cache_set(), and on every cache_gc() tick, dropping invalid entries as it
+ * passes.  Expiry is thus spread over cache operations and timer ticks,
+ * instead of scanning the whole cache at once.
+ */
+#define CACHE_SWEEP_STEPS 4
+#define CACHE_GC_STEPS 1024
+
+typedef cache_iter_t (*cache_begin_cb_t)(cache_map_t);
+typedef cache_iter_t (*cache_end_cb_t)(cache_map_t);
+typedef int (*cache_exist_cb_t)(cache_map_t, cache_iter_t);
+typedef void (*cache_del_cb_t)(cache_map_t, cache_iter_t);
+typedef cache_iter_t (*cache_get_cb_t)(cache_map_t, cache_key_t);
+typedef cache_iter_t (*cache_put_cb_t)(cache_map_t, cache_key_t, int *);
 typedef void (*cache_free_key_cb_t)(cache_key_t);
 typedef void (*cache_free_val_cb_t)(cache_val_t);
-typedef cache_key_t (*cache_get_key_cb_t)(cache_iter_t);
-typedef cache_val_t (*cache_get_val_cb_t)(cache_iter_t);
-typedef void (*cache_set_val_cb_t)(cache_iter_t, cache_val_t);
+typedef cache_key_t (*cache_get_key_cb_t)(cache_map_t, cache_iter_t);
+typedef cache_val_t (*cache_get_val_cb_t)(cache_map_t, cache_iter_t);
+typedef void (*cache_set_val_cb_t)(cache_map_t, cache_iter_t, cache_val_t);
+typedef void (*cache_merge_val_cb_t)(cache_val_t, cache_val_t);
 typedef cache_val_t (*cache_unpackverify_val_cb_t)(cache_val_t, int);
-typedef void (*cache_fini_cb_t)(void);
+typedef unsigned int (*cache_hash_cb_t)(cache_key_t);
+typedef size_t (*cache_size_cb_t)(cache_key_t, cache_val_t);
+typedef cache_map_t (*cache_map_new_cb_t)(void);
+typedef void (*cache_map_free_cb_t)(cache_map_t);
 
-typedef struct cache {
+typedef struct cache_shard {
+	/* only one of the locks is used, depending on cache->rwlock */
 	pthread_mutex_t mutex;
+	pthread_rwlock_t rwlock;
+	cache_map_t map;
+
+	/* number of entries and their approximate size in bytes */
+	size_t entries;
+	size_t bytes;
+	/* clock hand, the next map bucket to sweep or evict */
+	cache_iter_t hand;
+
+	/* lock acquisitions, and those which had to wait for another thread */
+	unsigned long long locks;
+	unsigned long long contended;
+	/* entries evicted to stay within the limits */
+	unsigned long long evicted;
+} ALIGNED(64) cache_shard_t;
+
+typedef struct cache_stats {
+	unsigned long long locks;
+	unsigned long long contended;
+	unsigned long long max_contended;
+	unsigned int max_shard;
+	unsigned long long evicted;
+} cache_stats_t;
+
+typedef struct cache {
+	cache_shard_t shards[CACHE_SHARDS];
+
+	/* use read-write locks, for read-mostly caches */
+	unsigned int rwlock : 1;
+
+	/* per shard limits, 0 for unlimited */
+	size_t max_entries;
+	size_t max_bytes;
 
 	cache_begin_cb_t begin_cb;
 	cache_end_cb_t end_cb;
@@ -65,8 +121,12 @@ typedef struct cache {
 	cache_get_key_cb_t get_key_cb;
 	cache_get_val_cb_t get_val_cb;
 	cache_set_val_cb_t set_val_cb;
+	cache_merge_val_cb_t merge_val_cb;
 	cache_unpackverify_val_cb_t unpackverify_val_cb;
-	cache_fini_cb_t fini_cb;
+	cache_hash_cb_t hash_cb;
+	cache_size_cb_t size_cb;
+	cache_map_new_cb_t map_new_cb;
+	cache_map_free_cb_t map_free_cb;
 } cache_t;
 
 typedef void (*cache_init_cb_t)(struct cache *);
@@ -74,10 +134,13 @@ typedef void (*cache_init_cb_t)(struct cache *);
 cache_t * cache_new(cache_init_cb_t) MALLOC;
 int cache_reinit(cache_t *) NONNULL(1) WUNRES;
 void cache_free(cache_t *) NONNULL(1);
-void cache_gc(cache_t *) NONNULL(1);
+size_t cache_gc(cache_t *) NONNULL(1);
 cache_val_t cache_get(cache_t *, cache_key_t) NONNULL(1) WUNRES;
 void cache_set(cache_t *, cache_key_t, cache_val_t) NONNULL(1);
+cache_val_t cache_merge(cache_t *, cache_key_t, cache_val_t) NONNULL(1) WUNRES;
 void cache_del(cache_t *, cache_key_t) NONNULL(1);
+void cache_set_limits(cache_t *, size_t, size_t) NONNULL(1);
+void cache_get_stats(cache_t *, cache_stats_t *) NONNULL(1,2);
 
 #endif /* !CACHE_H */
 
@@ -66,41 +66,44 @@ kh_dynbuf_hash_func(dynbuf_t *b)
 KHASH_INIT(dynbufmap_t, dynbuf_t*, dynbuf_t*, 1, kh_dynbuf_hash_func,
            kh_dynbuf_hash_equal)
 
-static khash_t(dynbufmap_t) *dstsessmap;
-
 static cache_iter_t
-cachedsess_begin_cb(void)
+cachedsess_begin_cb(UNUSED cache_map_t map)
 {
-	return kh_begin(dstsessmap);
+	return kh_begin(map);
 }
 
 static cache_iter_t
-cachedsess_end_cb(void)
+cachedsess_end_cb(cache_map_t map)
 {
+	khash_t(dynbufmap_t) *dstsessmap = map;
 	return kh_end(dstsessmap);
 }
 
 static int
-cachedsess_exist_cb(cache_iter_t it)
+cachedsess_exist_cb(cache_map_t map, cache_iter_t it)
 {
+	khash_t(dynbufmap_t) *dstsessmap = map;
 	return kh_exist(dstsessmap, it);
 }
 
 static void
-cachedsess_del_cb(cache_iter_t it)
+cachedsess_del_cb(cache_map_t map, cache_iter_t it)
 {
+	khash_t(dynbufmap_t) *dstsessmap = map;
 	kh_del(dynbufmap_t, dstsessmap, it);
 }
 
 static cache_iter_t
-cachedsess_get_cb(cache_key_t key)
+cachedsess_get_cb(cache_map_t map, cache_key_t key)
 {
+	khash_t(dynbufmap_t) *dstsessmap = map;
 	return kh_get(dynbufmap_t, dstsessmap, key);
 }
 
 static cache_iter_t
-cachedsess_put_cb(cache_key_t key, int *ret)
+cachedsess_put_cb(cache_map_t map, cache_key_t key, int *ret)
 {
+	khash_t(dynbufmap_t) *dstsessmap = map;
 	return kh_put(dynbufmap_t, dstsessmap, key, ret);
 }
 
@@ -117,20 +120,23 @@ cachedsess_free_val_cb(cache_val_t val)
 }
 
 static cache_key_t
-cachedsess_get_key_cb(cache_iter_t it)
+cachedsess_get_key_cb(cache_map_t map, cache_iter_t it)
 {
+	khash_t(dynbufmap_t) *dstsessmap = map;
 	return kh_key(dstsessmap, it);
 }
 
 static cache_val_t
-cachedsess_get_val_cb(cache_iter_t it)
+cachedsess_get_val_cb(cache_map_t map, cache_iter_t it)
 {
+	khash_t(dynbufmap_t) *dstsessmap = map;
 	return kh_val(dstsessmap, it);
 }
 
 static void
-cachedsess_set_val_cb(cache_iter_t it, cache_val_t val)
+cachedsess_set_val_cb(cache_map_t map, cache_iter_t it, cache_val_t val)
 {
+	khash_t(dynbufmap_t) *dstsessmap = map;
 	kh_val(dstsessmap, it) = val;
 }
 
@@ -155,17 +161,33 @@ cachedsess_unpackverify_val_cb(cache_val_t val, int copy)
 	return ((void*)-1);
 }
 
+static unsigned int
+cachedsess_hash_cb(cache_key_t key)
+{
+	return kh_dynbuf_hash_func(key);
+}
+
+static size_t
+cachedsess_size_cb(cache_key_t key, cache_val_t val)
+{
+	return ((dynbuf_t *)key)->sz + ((dynbuf_t *)val)->sz;
+}
+
+static cache_map_t
+cachedsess_map_new_cb(void)
+{
+	return kh_init(dynbufmap_t);
+}
+
 static void
-cachedsess_fini_cb(void)
+cachedsess_map_free_cb(cache_map_t map)
 {
-	kh_destroy(dynbufmap_t, dstsessmap);
+	kh_destroy(dynbufmap_t, map);
 }
 
 void
 cachedsess_init_cb(cache_t *cache)
 {
-	dstsessmap = kh_init(dynbufmap_t);
-
 	cache->begin_cb                 = cachedsess_begin_cb;
 	cache->end_cb                   = cachedsess_end_cb;
 	cache->exist_cb                 = cachedsess_exist_cb;
@@ -178,7 +200,10 @@ cachedsess_init_cb(cache_t *cache)
 	cache->get_val_cb               = cachedsess_get_val_cb;
 	cache->set_val_cb               = cachedsess_set_val_cb;
 	cache->unpackverify_val_cb      = cachedsess_unpackverify_val_cb;
-	cache->fini_cb                  = cachedsess_fini_cb;
+	cache->hash_cb                  = cachedsess_hash_cb;
+	cache->size_cb                  = cachedsess_size_cb;
+	cache->map_new_cb               = cachedsess_map_new_cb;
+	cache->map_free_cb              = cachedsess_map_free_cb;
 }
 
 cache_key_t
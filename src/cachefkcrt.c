@@ -56,41 +56,44 @@ kh_x509fpr_hash_func(void *b)
 KHASH_INIT(sha1map_t, void*, void*, 1, kh_x509fpr_hash_func,
            kh_x509fpr_hash_equal)
 
-static khash_t(sha1map_t) *certmap;
-
 static cache_iter_t
-cachefkcrt_begin_cb(void)
+cachefkcrt_begin_cb(UNUSED cache_map_t map)
 {
-	return kh_begin(certmap);
+	return kh_begin(map);
 }
 
 static cache_iter_t
-cachefkcrt_end_cb(void)
+cachefkcrt_end_cb(cache_map_t map)
 {
+	khash_t(sha1map_t) *certmap = map;
 	return kh_end(certmap);
 }
 
 static int
-cachefkcrt_exist_cb(cache_iter_t it)
+cachefkcrt_exist_cb(cache_map_t map, cache_iter_t it)
 {
+	khash_t(sha1map_t) *certmap = map;
 	return kh_exist(certmap, it);
 }
 
 static void
-cachefkcrt_del_cb(cache_iter_t it)
+cachefkcrt_del_cb(cache_map_t map, cache_iter_t it)
 {
+	khash_t(sha1map_t) *certmap = map;
 	kh_del(sha1map_t, certmap, it);
 }
 
 static cache_iter_t
-cachefkcrt_get_cb(cache_key_t key)
+cachefkcrt_get_cb(cache_map_t map, cache_key_t key)
 {
+	khash_t(sha1map_t) *certmap = map;
 	return kh_get(sha1map_t, certmap, key);
 }
 
 static cache_iter_t
-cachefkcrt_put_cb(cache_key_t key, int *ret)
+cachefkcrt_put_cb(cache_map_t map, cache_key_t key, int *ret)
 {
+	khash_t(sha1map_t) *certmap = map;
 	return kh_put(sha1map_t, certmap, key, ret);
 }
 
@@ -107,20 +110,23 @@ cachefkcrt_free_val_cb(cache_val_t val)
 }
 
 static cache_key_t
-cachefkcrt_get_key_cb(cache_iter_t it)
+cachefkcrt_get_key_cb(cache_map_t map, cache_iter_t it)
 {
+	khash_t(sha1map_t) *certmap = map;
 	return kh_key(certmap, it);
 }
 
 static cache_val_t
-cachefkcrt_get_val_cb(cache_iter_t it)
+cachefkcrt_get_val_cb(cache_map_t map, cache_iter_t it)
 {
+	khash_t(sha1map_t) *certmap = map;
 	return kh_val(certmap, it);
 }
 
 static void
-cachefkcrt_set_val_cb(cache_iter_t it, cache_val_t val)
+cachefkcrt_set_val_cb(cache_map_t map, cache_iter_t it, cache_val_t val)
 {
+	khash_t(sha1map_t) *certmap = map;
 	kh_val(certmap, it) = val;
 }
 
@@ -136,17 +142,35 @@ cachefkcrt_unpackverify_val_cb(cache_val_t val, int copy)
 	return ((void*)-1);
 }
 
+static unsigned int
+cachefkcrt_hash_cb(cache_key_t key)
+{
+	return kh_x509fpr_hash_func(key);
+}
+
+static size_t
+cachefkcrt_size_cb(UNUSED cache_key_t key, cache_val_t val)
+{
+	int sz = i2d_X509(val, NULL);
+
+	return SSL_X509_FPRSZ + (sz > 0 ? (size_t)sz : 0);
+}
+
+static cache_map_t
+cachefkcrt_map_new_cb(void)
+{
+	return kh_init(sha1map_t);
+}
+
 static void
-cachefkcrt_fini_cb(void)
+cachefkcrt_map_free_cb(cache_map_t map)
 {
-	kh_destroy(sha1map_t, certmap);
+	kh_destroy(sha1map_t, map);
 }
 
 void
 cachefkcrt_init_cb(cache_t *cache)
 {
-	certmap = kh_init(sha1map_t);
-
 	cache->begin_cb                 = cachefkcrt_begin_cb;
 	cache->end_cb                   = cachefkcrt_end_cb;
 	cache->exist_cb                 = cachefkcrt_exist_cb;
@@ -159,7 +183,10 @@ cachefkcrt_init_cb(cache_t *cache)
 	cache->get_val_cb               = cachefkcrt_get_val_cb;
 	cache->set_val_cb               = cachefkcrt_set_val_cb;
 	cache->unpackverify_val_cb      = cachefkcrt_unpackverify_val_cb;
-	cache->fini_cb                  = cachefkcrt_fini_cb;
+	cache->hash_cb                  = cachefkcrt_hash_cb;
+	cache->size_cb                  = cachefkcrt_size_cb;
+	cache->map_new_cb               = cachefkcrt_map_new_cb;
+	cache->map_free_cb              = cachefkcrt_map_free_cb;
 }
 
 cache_key_t
@@ -32,11 +32,13 @@
 #include "cachetgcrt.h"
 #include "cachessess.h"
 #include "cachedsess.h"
+#include "cachesslctx.h"
+#include "cachesnicrt.h"
+#include "cachepass.h"
 #include "log.h"
 #include "attrib.h"
 
 #include <string.h>
-#include <pthread.h>
 
 #include <netinet/in.h>
 
@@ -44,17 +46,9 @@ cache_t *cachemgr_fkcrt;
 cache_t *cachemgr_tgcrt;
 cache_t *cachemgr_ssess;
 cache_t *cachemgr_dsess;
-
-/*
- * Garbage collector thread entry point.
- * Calls the _gc() method on the cache passed as argument, then returns.
- */
-static void *
-cachemgr_gc_thread(UNUSED void * arg)
-{
-	cache_gc(arg);
-	return NULL;
-}
+cache_t *cachemgr_sslctx;
+cache_t *cachemgr_snicrt;
+cache_t *cachemgr_pass;
 
 /*
  * Pre-initialize the caches.
@@ -65,22 +59,34 @@ int
 cachemgr_preinit(void)
 {
 	if (!(cachemgr_fkcrt = cache_new(cachefkcrt_init_cb)))
-		goto out4;
+		goto out7;
 	if (!(cachemgr_tgcrt = cache_new(cachetgcrt_init_cb)))
-		goto out3;
+		goto out6;
 	if (!(cachemgr_ssess = cache_new(cachessess_init_cb)))
-		goto out2;
+		goto out5;
 	if (!(cachemgr_dsess = cache_new(cachedsess_init_cb)))
+		goto out4;
+	if (!(cachemgr_sslctx = cache_new(cachesslctx_init_cb)))
+		goto out3;
+	if (!(cachemgr_snicrt = cache_new(cachesnicrt_init_cb)))
+		goto out2;
+	if (!(cachemgr_pass = cache_new(cachepass_init_cb)))
 		goto out1;
 	return 0;
 
 out1:
-	cache_free(cachemgr_ssess);
+	cache_free(cachemgr_snicrt);
 out2:
-	cache_free(cachemgr_tgcrt);
+	cache_free(cachemgr_sslctx);
 out3:
-	cache_free(cachemgr_fkcrt);
+	cache_free(cachemgr_dsess);
 out4:
+	cache_free(cachemgr_ssess);
+out5:
+	cache_free(cachemgr_tgcrt);
+out6:
+	cache_free(cachemgr_fkcrt);
+out7:
 	return -1;
 }
 
@@ -99,6 +105,12 @@ cachemgr_init(void)
 		return -1;
 	if (cache_reinit(cachemgr_dsess))
 		return -1;
+	if (cache_reinit(cachemgr_sslctx))
+		return -1;
+	if (cache_reinit(cachemgr_snicrt))
+		return -1;
+	if (cache_reinit(cachemgr_pass))
+		return -1;
 	return 0;
 }
 
@@ -110,6 +122,9 @@ cachemgr_init(void)
 void
 cachemgr_fini(void)
 {
+	cache_free(cachemgr_pass);
+	cache_free(cachemgr_snicrt);
+	cache_free(cachemgr_sslctx);
 	cache_free(cachemgr_dsess);
 	cache_free(cachemgr_ssess);
 	cache_free(cachemgr_tgcrt);
@@ -117,53 +132,47 @@ cachemgr_fini(void)
 }
 
 /*
- * Garbage collect all the cache contents; free's up resources occupied by
- * certificates and sessions which are no longer valid.
- * This function returns after the cleanup completed and all threads are
- * joined.
+ * Limit each of the fkcrt, ssess and dsess caches to max_entries entries and
+ * max_bytes bytes, 0 for no limit.  The tgcrt cache is not limited, since
+ * target certs are loaded only once at startup.  The sslctx cache holds an
+ * SSL_CTX per forged cert, and the snicrt cache a forged cert per SNI, so
+ * both are given the same limits as fkcrt.
  */
 void
-cachemgr_gc(void)
+cachemgr_set_limits(size_t max_entries, size_t max_bytes)
 {
-	pthread_t fkcrt_thr, dsess_thr, ssess_thr;
-	int rv;
-
-	/* the tgcrt cache does not need cleanup */
+	cache_set_limits(cachemgr_fkcrt, max_entries, max_bytes);
+	cache_set_limits(cachemgr_sslctx, max_entries, max_bytes);
+	cache_set_limits(cachemgr_snicrt, max_entries, max_bytes);
+	cache_set_limits(cachemgr_ssess, max_entries, max_bytes);
+	cache_set_limits(cachemgr_dsess, max_entries, max_bytes);
+}
 
-	rv = pthread_create(&fkcrt_thr, NULL, cachemgr_gc_thread,
-	                    cachemgr_fkcrt);
-	if (rv) {
-		log_err_level_printf(LOG_CRIT, "cachemgr_gc: pthread_create failed: %s\n",
-		               strerror(rv));
-	}
-	rv = pthread_create(&ssess_thr, NULL, cachemgr_gc_thread,
-	                    cachemgr_ssess);
-	if (rv) {
-		log_err_level_printf(LOG_CRIT, "cachemgr_gc: pthread_create failed: %s\n",
-		               strerror(rv));
-	}
-	rv = pthread_create(&dsess_thr, NULL, cachemgr_gc_thread,
-	                    cachemgr_dsess);
-	if (rv) {
-		log_err_level_printf(LOG_CRIT, "cachemgr_gc: pthread_create failed: %s\n",
-		               strerror(rv));
-	}
+/*
+ * Limit the pass cache to max_entries entries, 0 for no limit.  It is limited
+ * separately, since its entries are tiny compared to those of the other
+ * caches, and it only needs to hold the sites interception fails for.
+ */
+void
+cachemgr_set_pass_limit(size_t max_entries)
+{
+	cache_set_limits(cachemgr_pass, max_entries, 0);
+}
 
-	rv = pthread_join(fkcrt_thr, NULL);
-	if (rv) {
-		log_err_level_printf(LOG_CRIT, "cachemgr_gc: pthread_join failed: %s\n",
-		               strerror(rv));
-	}
-	rv = pthread_join(ssess_thr, NULL);
-	if (rv) {
-		log_err_level_printf(LOG_CRIT, "cachemgr_gc: pthread_join failed: %s\n",
-		               strerror(rv));
-	}
-	rv = pthread_join(dsess_thr, NULL);
-	if (rv) {
-		log_err_level_printf(LOG_CRIT, "cachemgr_gc: pthread_join failed: %s\n",
-		               strerror(rv));
-	}
+/*
+ * Garbage collect a slice of the cache contents; free's up resources
+ * occupied by certificates and sessions which are no longer valid.
+ * Each call only sweeps a bounded number of buckets per shard, see
+ * cache_gc(), so this is meant to be called on a short periodic timer.
+ * Returns the number of entries dropped.
+ */
+size_t
+cachemgr_gc(void)
+{
+	/* the tgcrt cache does not need cleanup */
+	return cache_gc(cachemgr_fkcrt) + cache_gc(cachemgr_ssess) +
+	       cache_gc(cachemgr_dsess) + cache_gc(cachemgr_sslctx) +
+	       cache_gc(cachemgr_snicrt) + cache_gc(cachemgr_pass);
 }
 
 /* vim: set noet ft=c: */
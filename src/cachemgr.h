@@ -34,16 +34,24 @@
 #include "cachetgcrt.h"
 #include "cachessess.h"
 #include "cachedsess.h"
+#include "cachesslctx.h"
+#include "cachesnicrt.h"
+#include "cachepass.h"
 
 extern cache_t *cachemgr_fkcrt;
 extern cache_t *cachemgr_tgcrt;
 extern cache_t *cachemgr_ssess;
 extern cache_t *cachemgr_dsess;
+extern cache_t *cachemgr_sslctx;
+extern cache_t *cachemgr_snicrt;
+extern cache_t *cachemgr_pass;
 
 int cachemgr_preinit(void) WUNRES;
 int cachemgr_init(void) WUNRES;
 void cachemgr_fini(void);
-void cachemgr_gc(void);
+void cachemgr_set_limits(size_t, size_t);
+void cachemgr_set_pass_limit(size_t);
+size_t cachemgr_gc(void);
 
 #define cachemgr_fkcrt_get(key) \
         cache_get(cachemgr_fkcrt, cachefkcrt_mkkey(key))
@@ -84,6 +92,33 @@ void cachemgr_gc(void);
 #define cachemgr_dsess_del(addr, addrlen, sni) \
         cache_del(cachemgr_dsess, cachedsess_mkkey((addr), (addrlen), (sni)))
 
+#define cachemgr_sslctx_get(crt, opts) \
+        cache_get(cachemgr_sslctx, cachesslctx_mkkey((crt), (opts)))
+#define cachemgr_sslctx_set(crt, opts, val) \
+        cache_set(cachemgr_sslctx, cachesslctx_mkkey((crt), (opts)), \
+                                   cachesslctx_mkval(val))
+#define cachemgr_sslctx_del(crt, opts) \
+        cache_del(cachemgr_sslctx, cachesslctx_mkkey((crt), (opts)))
+
+#define cachemgr_snicrt_get(sni) \
+        cache_get(cachemgr_snicrt, cachesnicrt_mkkey(sni))
+#define cachemgr_snicrt_set(sni, crt, origcrt) \
+        cache_set(cachemgr_snicrt, cachesnicrt_mkkey(sni), \
+                                   cachesnicrt_mkval((crt), (origcrt)))
+#define cachemgr_snicrt_del(sni) \
+        cache_del(cachemgr_snicrt, cachesnicrt_mkkey(sni))
+
+#define cachemgr_pass_get(addr, addrlen, sni) \
+        cache_get(cachemgr_pass, cachepass_mkkey((addr), (addrlen), (sni)))
+#define cachemgr_pass_set(addr, addrlen, sni, failures, ttl) \
+        cache_set(cachemgr_pass, cachepass_mkkey((addr), (addrlen), (sni)), \
+                                 cachepass_mkval((failures), (ttl)))
+#define cachemgr_pass_add(addr, addrlen, sni, failures, ttl) \
+        cache_merge(cachemgr_pass, cachepass_mkkey((addr), (addrlen), (sni)), \
+                                   cachepass_mkval((failures), (ttl)))
+#define cachemgr_pass_del(addr, addrlen, sni) \
+        cache_del(cachemgr_pass, cachepass_mkkey((addr), (addrlen), (sni)))
+
 #endif /* !CACHEMGR_H */
 
 /* vim: set noet ft=c: */
@@ -0,0 +1,268 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2017-2025, Soner Tari <sonertari@gmail.com>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "cachepass.h"
+
+#include "dynbuf.h"
+#include "khash.h"
+
+#include <netinet/in.h>
+
+/*
+ * Cache for sites SSL interception has failed for, either because the client
+ * rejected the forged cert, e.g. due to cert pinning, or because the server
+ * required a client cert.  Conns to these sites are passed through once the
+ * number of failures reaches the configured threshold, until the record
+ * expires.
+ *
+ * key: dynbuf_t *  original destination IP address, port and SNI string
+ * val: pass_t *    number of failures and expiry time
+ */
+
+static inline khint_t
+kh_dynbuf_hash_func(dynbuf_t *b)
+{
+	khint_t *p = (khint_t *)b->buf;
+	khint_t h = 0;
+	int rem;
+
+	if ((rem = b->sz % sizeof(khint_t))) {
+		memcpy(&h, b->buf + b->sz - rem, rem);
+	}
+
+	while (p < (khint_t*)(b->buf + b->sz - rem)) {
+		h ^= *p++;
+	}
+
+	return h;
+}
+
+#define kh_dynbuf_hash_equal(a, b) \
+        (((a)->sz == (b)->sz) && \
+         (memcmp((a)->buf, (b)->buf, (a)->sz) == 0))
+
+KHASH_INIT(passmap_t, dynbuf_t*, pass_t*, 1, kh_dynbuf_hash_func,
+           kh_dynbuf_hash_equal)
+
+static cache_iter_t
+cachepass_begin_cb(UNUSED cache_map_t map)
+{
+	return kh_begin(map);
+}
+
+static cache_iter_t
+cachepass_end_cb(cache_map_t map)
+{
+	khash_t(passmap_t) *passmap = map;
+	return kh_end(passmap);
+}
+
+static int
+cachepass_exist_cb(cache_map_t map, cache_iter_t it)
+{
+	khash_t(passmap_t) *passmap = map;
+	return kh_exist(passmap, it);
+}
+
+static void
+cachepass_del_cb(cache_map_t map, cache_iter_t it)
+{
+	khash_t(passmap_t) *passmap = map;
+	kh_del(passmap_t, passmap, it);
+}
+
+static cache_iter_t
+cachepass_get_cb(cache_map_t map, cache_key_t key)
+{
+	khash_t(passmap_t) *passmap = map;
+	return kh_get(passmap_t, passmap, key);
+}
+
+static cache_iter_t
+cachepass_put_cb(cache_map_t map, cache_key_t key, int *ret)
+{
+	khash_t(passmap_t) *passmap = map;
+	return kh_put(passmap_t, passmap, key, ret);
+}
+
+static void
+cachepass_free_key_cb(cache_key_t key)
+{
+	dynbuf_free(key);
+}
+
+static void
+cachepass_free_val_cb(cache_val_t val)
+{
+	free(val);
+}
+
+static cache_key_t
+cachepass_get_key_cb(cache_map_t map, cache_iter_t it)
+{
+	khash_t(passmap_t) *passmap = map;
+	return kh_key(passmap, it);
+}
+
+static cache_val_t
+cachepass_get_val_cb(cache_map_t map, cache_iter_t it)
+{
+	khash_t(passmap_t) *passmap = map;
+	return kh_val(passmap, it);
+}
+
+static void
+cachepass_set_val_cb(cache_map_t map, cache_iter_t it, cache_val_t val)
+{
+	khash_t(passmap_t) *passmap = map;
+	kh_val(passmap, it) = val;
+}
+
+/*
+ * Add up the failures of the new record and the one it replaces.
+ */
+static void
+cachepass_merge_val_cb(cache_val_t val, cache_val_t old)
+{
+	((pass_t *)val)->failures += ((pass_t *)old)->failures;
+}
+
+static cache_val_t
+cachepass_unpackverify_val_cb(cache_val_t val, int copy)
+{
+	pass_t *pass = val;
+	pass_t *cpy;
+
+	if (pass->expires <= time(NULL))
+		return NULL;
+	if (copy) {
+		if (!(cpy = malloc(sizeof(pass_t))))
+			return NULL;
+		memcpy(cpy, pass, sizeof(pass_t));
+		return cpy;
+	}
+	return ((void*)-1);
+}
+
+static unsigned int
+cachepass_hash_cb(cache_key_t key)
+{
+	return kh_dynbuf_hash_func(key);
+}
+
+static size_t
+cachepass_size_cb(cache_key_t key, UNUSED cache_val_t val)
+{
+	return ((dynbuf_t *)key)->sz + sizeof(pass_t);
+}
+
+static cache_map_t
+cachepass_map_new_cb(void)
+{
+	return kh_init(passmap_t);
+}
+
+static void
+cachepass_map_free_cb(cache_map_t map)
+{
+	kh_destroy(passmap_t, map);
+}
+
+void
+cachepass_init_cb(cache_t *cache)
+{
+	cache->begin_cb                 = cachepass_begin_cb;
+	cache->end_cb                   = cachepass_end_cb;
+	cache->exist_cb                 = cachepass_exist_cb;
+	cache->del_cb                   = cachepass_del_cb;
+	cache->get_cb                   = cachepass_get_cb;
+	cache->put_cb                   = cachepass_put_cb;
+	cache->free_key_cb              = cachepass_free_key_cb;
+	cache->free_val_cb              = cachepass_free_val_cb;
+	cache->get_key_cb               = cachepass_get_key_cb;
+	cache->get_val_cb               = cachepass_get_val_cb;
+	cache->set_val_cb               = cachepass_set_val_cb;
+	cache->merge_val_cb             = cachepass_merge_val_cb;
+	cache->unpackverify_val_cb      = cachepass_unpackverify_val_cb;
+	cache->hash_cb                  = cachepass_hash_cb;
+	cache->size_cb                  = cachepass_size_cb;
+	cache->map_new_cb               = cachepass_map_new_cb;
+	cache->map_free_cb              = cachepass_map_free_cb;
+}
+
+cache_key_t
+cachepass_mkkey(const struct sockaddr *addr, UNUSED const socklen_t addrlen,
+                const char *sni)
+{
+	dynbuf_t tmp, *db;
+	short port;
+	size_t snilen;
+
+	switch (((struct sockaddr_storage *)addr)->ss_family) {
+		case AF_INET:
+			tmp.buf = (unsigned char *)
+			          &((struct sockaddr_in*)addr)->sin_addr;
+			tmp.sz = sizeof(struct in_addr);
+			port = ((struct sockaddr_in*)addr)->sin_port;
+			break;
+		case AF_INET6:
+			tmp.buf = (unsigned char *)
+			          &((struct sockaddr_in6*)addr)->sin6_addr;
+			tmp.sz = sizeof(struct in6_addr);
+			port = ((struct sockaddr_in6*)addr)->sin6_port;
+			break;
+		default:
+			return NULL;
+	}
+
+	snilen = sni ? strlen(sni) : 0;
+	if (!(db = dynbuf_new_alloc(tmp.sz + sizeof(port) + snilen)))
+		return NULL;
+	memcpy(db->buf, tmp.buf, tmp.sz);
+	memcpy(db->buf + tmp.sz, (char*)&port, sizeof(port));
+	if (sni)
+		memcpy(db->buf + tmp.sz + sizeof(port), sni, snilen);
+	return db;
+}
+
+/*
+ * The record expires ttl seconds after the last failure.
+ */
+cache_val_t
+cachepass_mkval(unsigned int failures, unsigned int ttl)
+{
+	pass_t *pass;
+
+	if (!(pass = malloc(sizeof(pass_t))))
+		return NULL;
+	pass->failures = failures;
+	pass->expires = time(NULL) + ttl;
+	return pass;
+}
+
+/* vim: set noet ft=c: */
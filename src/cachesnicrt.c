@@ -0,0 +1,208 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2017-2025, Soner Tari <sonertari@gmail.com>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "cachesnicrt.h"
+
+#include "khash.h"
+
+/*
+ * Cache for forged certificates by SNI, used to start the client handshake
+ * before the server cert is known.
+ *
+ * key: char *      SNI hostname
+ * val: snicrt_t *  forged cert and fingerprint of original server cert
+ */
+
+KHASH_INIT(snimap_t, char*, void*, 1, kh_str_hash_func, kh_str_hash_equal)
+
+void
+snicrt_free(snicrt_t *snicrt)
+{
+	X509_free(snicrt->crt);
+	free(snicrt);
+}
+
+static cache_iter_t
+cachesnicrt_begin_cb(UNUSED cache_map_t map)
+{
+	return kh_begin(map);
+}
+
+static cache_iter_t
+cachesnicrt_end_cb(cache_map_t map)
+{
+	khash_t(snimap_t) *certmap = map;
+	return kh_end(certmap);
+}
+
+static int
+cachesnicrt_exist_cb(cache_map_t map, cache_iter_t it)
+{
+	khash_t(snimap_t) *certmap = map;
+	return kh_exist(certmap, it);
+}
+
+static void
+cachesnicrt_del_cb(cache_map_t map, cache_iter_t it)
+{
+	khash_t(snimap_t) *certmap = map;
+	kh_del(snimap_t, certmap, it);
+}
+
+static cache_iter_t
+cachesnicrt_get_cb(cache_map_t map, cache_key_t key)
+{
+	khash_t(snimap_t) *certmap = map;
+	return kh_get(snimap_t, certmap, key);
+}
+
+static cache_iter_t
+cachesnicrt_put_cb(cache_map_t map, cache_key_t key, int *ret)
+{
+	khash_t(snimap_t) *certmap = map;
+	return kh_put(snimap_t, certmap, key, ret);
+}
+
+static void
+cachesnicrt_free_key_cb(cache_key_t key)
+{
+	free(key);
+}
+
+static void
+cachesnicrt_free_val_cb(cache_val_t val)
+{
+	snicrt_free(val);
+}
+
+static cache_key_t
+cachesnicrt_get_key_cb(cache_map_t map, cache_iter_t it)
+{
+	khash_t(snimap_t) *certmap = map;
+	return kh_key(certmap, it);
+}
+
+static cache_val_t
+cachesnicrt_get_val_cb(cache_map_t map, cache_iter_t it)
+{
+	khash_t(snimap_t) *certmap = map;
+	return kh_val(certmap, it);
+}
+
+static void
+cachesnicrt_set_val_cb(cache_map_t map, cache_iter_t it, cache_val_t val)
+{
+	khash_t(snimap_t) *certmap = map;
+	kh_val(certmap, it) = val;
+}
+
+static cache_val_t
+cachesnicrt_unpackverify_val_cb(cache_val_t val, int copy)
+{
+	snicrt_t *snicrt = val;
+	snicrt_t *cpy;
+
+	if (!ssl_x509_is_valid(snicrt->crt))
+		return NULL;
+	if (copy) {
+		if (!(cpy = malloc(sizeof(snicrt_t))))
+			return NULL;
+		memcpy(cpy, snicrt, sizeof(snicrt_t));
+		ssl_x509_refcount_inc(cpy->crt);
+		return cpy;
+	}
+	return ((void*)-1);
+}
+
+static unsigned int
+cachesnicrt_hash_cb(cache_key_t key)
+{
+	return kh_str_hash_func(key);
+}
+
+static size_t
+cachesnicrt_size_cb(cache_key_t key, cache_val_t val)
+{
+	int sz = i2d_X509(((snicrt_t *)val)->crt, NULL);
+
+	return strlen(key) + 1 + sizeof(snicrt_t) + (sz > 0 ? (size_t)sz : 0);
+}
+
+static cache_map_t
+cachesnicrt_map_new_cb(void)
+{
+	return kh_init(snimap_t);
+}
+
+static void
+cachesnicrt_map_free_cb(cache_map_t map)
+{
+	kh_destroy(snimap_t, map);
+}
+
+void
+cachesnicrt_init_cb(cache_t *cache)
+{
+	cache->begin_cb                 = cachesnicrt_begin_cb;
+	cache->end_cb                   = cachesnicrt_end_cb;
+	cache->exist_cb                 = cachesnicrt_exist_cb;
+	cache->del_cb                   = cachesnicrt_del_cb;
+	cache->get_cb                   = cachesnicrt_get_cb;
+	cache->put_cb                   = cachesnicrt_put_cb;
+	cache->free_key_cb              = cachesnicrt_free_key_cb;
+	cache->free_val_cb              = cachesnicrt_free_val_cb;
+	cache->get_key_cb               = cachesnicrt_get_key_cb;
+	cache->get_val_cb               = cachesnicrt_get_val_cb;
+	cache->set_val_cb               = cachesnicrt_set_val_cb;
+	cache->unpackverify_val_cb      = cachesnicrt_unpackverify_val_cb;
+	cache->hash_cb                  = cachesnicrt_hash_cb;
+	cache->size_cb                  = cachesnicrt_size_cb;
+	cache->map_new_cb               = cachesnicrt_map_new_cb;
+	cache->map_free_cb              = cachesnicrt_map_free_cb;
+}
+
+cache_key_t
+cachesnicrt_mkkey(const char *sni)
+{
+	return strdup(sni);
+}
+
+cache_val_t
+cachesnicrt_mkval(X509 *valcrt, X509 *origcrt)
+{
+	snicrt_t *snicrt;
+
+	if (!(snicrt = malloc(sizeof(snicrt_t))))
+		return NULL;
+	ssl_x509_fingerprint_sha1(origcrt, snicrt->origfpr);
+	ssl_x509_refcount_inc(valcrt);
+	snicrt->crt = valcrt;
+	return snicrt;
+}
+
+/* vim: set noet ft=c: */
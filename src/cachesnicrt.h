@@ -0,0 +1,56 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2017-2025, Soner Tari <sonertari@gmail.com>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CACHESNICRT_H
+#define CACHESNICRT_H
+
+#include "cache.h"
+#include "attrib.h"
+#include "ssl.h"
+
+#include <openssl/x509.h>
+
+/*
+ * Forged cert last used for an SNI, together with the fingerprint of the
+ * original server cert it was forged from.
+ */
+typedef struct snicrt {
+	X509 *crt;
+	unsigned char origfpr[SSL_X509_FPRSZ];
+} snicrt_t;
+
+void snicrt_free(snicrt_t *) NONNULL(1);
+
+void cachesnicrt_init_cb(struct cache *) NONNULL(1);
+
+cache_key_t cachesnicrt_mkkey(const char *) NONNULL(1) WUNRES;
+cache_val_t cachesnicrt_mkval(X509 *, X509 *) NONNULL(1,2) WUNRES;
+
+#endif /* !CACHESNICRT_H */
+
+/* vim: set noet ft=c: */
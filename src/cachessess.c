@@ -64,41 +64,44 @@ kh_dynbuf_hash_func(dynbuf_t *b)
 KHASH_INIT(dynbufmap_t, dynbuf_t*, dynbuf_t*, 1, kh_dynbuf_hash_func,
            kh_dynbuf_hash_equal)
 
-static khash_t(dynbufmap_t) *srcsessmap;
-
 static cache_iter_t
-cachessess_begin_cb(void)
+cachessess_begin_cb(UNUSED cache_map_t map)
 {
-	return kh_begin(srcsessmap);
+	return kh_begin(map);
 }
 
 static cache_iter_t
-cachessess_end_cb(void)
+cachessess_end_cb(cache_map_t map)
 {
+	khash_t(dynbufmap_t) *srcsessmap = map;
 	return kh_end(srcsessmap);
 }
 
 static int
-cachessess_exist_cb(cache_iter_t it)
+cachessess_exist_cb(cache_map_t map, cache_iter_t it)
 {
+	khash_t(dynbufmap_t) *srcsessmap = map;
 	return kh_exist(srcsessmap, it);
 }
 
 static void
-cachessess_del_cb(cache_iter_t it)
+cachessess_del_cb(cache_map_t map, cache_iter_t it)
 {
+	khash_t(dynbufmap_t) *srcsessmap = map;
 	kh_del(dynbufmap_t, srcsessmap, it);
 }
 
 static cache_iter_t
-cachessess_get_cb(cache_key_t key)
+cachessess_get_cb(cache_map_t map, cache_key_t key)
 {
+	khash_t(dynbufmap_t) *srcsessmap = map;
 	return kh_get(dynbufmap_t, srcsessmap, key);
 }
 
 static cache_iter_t
-cachessess_put_cb(cache_key_t key, int *ret)
+cachessess_put_cb(cache_map_t map, cache_key_t key, int *ret)
 {
+	khash_t(dynbufmap_t) *srcsessmap = map;
 	return kh_put(dynbufmap_t, srcsessmap, key, ret);
 }
 
@@ -115,20 +118,23 @@ cachessess_free_val_cb(cache_val_t val)
 }
 
 static cache_key_t
-cachessess_get_key_cb(cache_iter_t it)
+cachessess_get_key_cb(cache_map_t map, cache_iter_t it)
 {
+	khash_t(dynbufmap_t) *srcsessmap = map;
 	return kh_key(srcsessmap, it);
 }
 
 static cache_val_t
-cachessess_get_val_cb(cache_iter_t it)
+cachessess_get_val_cb(cache_map_t map, cache_iter_t it)
 {
+	khash_t(dynbufmap_t) *srcsessmap = map;
 	return kh_val(srcsessmap, it);
 }
 
 static void
-cachessess_set_val_cb(cache_iter_t it, cache_val_t val)
+cachessess_set_val_cb(cache_map_t map, cache_iter_t it, cache_val_t val)
 {
+	khash_t(dynbufmap_t) *srcsessmap = map;
 	kh_val(srcsessmap, it) = val;
 }
 
@@ -153,17 +159,33 @@ cachessess_unpackverify_val_cb(cache_val_t val, int copy)
 	return ((void*)-1);
 }
 
+static unsigned int
+cachessess_hash_cb(cache_key_t key)
+{
+	return kh_dynbuf_hash_func(key);
+}
+
+static size_t
+cachessess_size_cb(cache_key_t key, cache_val_t val)
+{
+	return ((dynbuf_t *)key)->sz + ((dynbuf_t *)val)->sz;
+}
+
+static cache_map_t
+cachessess_map_new_cb(void)
+{
+	return kh_init(dynbufmap_t);
+}
+
 static void
-cachessess_fini_cb(void)
+cachessess_map_free_cb(cache_map_t map)
 {
-	kh_destroy(dynbufmap_t, srcsessmap);
+	kh_destroy(dynbufmap_t, map);
 }
 
 void
 cachessess_init_cb(cache_t *cache)
 {
-	srcsessmap = kh_init(dynbufmap_t);
-
 	cache->begin_cb                 = cachessess_begin_cb;
 	cache->end_cb                   = cachessess_end_cb;
 	cache->exist_cb                 = cachessess_exist_cb;
@@ -176,7 +198,10 @@ cachessess_init_cb(cache_t *cache)
 	cache->get_val_cb               = cachessess_get_val_cb;
 	cache->set_val_cb               = cachessess_set_val_cb;
 	cache->unpackverify_val_cb      = cachessess_unpackverify_val_cb;
-	cache->fini_cb                  = cachessess_fini_cb;
+	cache->hash_cb                  = cachessess_hash_cb;
+	cache->size_cb                  = cachessess_size_cb;
+	cache->map_new_cb               = cachessess_map_new_cb;
+	cache->map_free_cb              = cachessess_map_free_cb;
 }
 
 cache_key_t
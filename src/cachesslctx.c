@@ -0,0 +1,226 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2017-2025, Soner Tari <sonertari@gmail.com>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "cachesslctx.h"
+
+#include "ssl.h"
+#include "khash.h"
+
+#include <stdint.h>
+
+/*
+ * Cache for fully configured src SSL_CTX instances, so that repeat conns to
+ * the same site only need SSL_new().
+ *
+ * key: cachesslctx_key_t *  fingerprint of the src server cert and the
+ *                           conn options the SSL_CTX was configured with
+ * val: SSL_CTX *            SSL_CTX with the cert, chain and key loaded
+ */
+
+typedef struct cachesslctx_key {
+	unsigned char fpr[SSL_X509_FPRSZ];
+	const void *conn_opts;
+} cachesslctx_key_t;
+
+static inline khint_t
+kh_sslctxkey_hash_func(cachesslctx_key_t *k)
+{
+	khint_t *p = (khint_t*)(k->fpr + SSL_X509_FPRSZ);
+	khint_t h = 0;
+
+	/* assumes fpr is uniformly distributed */
+	while (--p >= (khint_t*)k->fpr)
+		h ^= *p;
+	/* conn opts are allocated, hence the low bits are always zero */
+	return h ^ (khint_t)((uintptr_t)k->conn_opts >> 4);
+}
+
+#define kh_sslctxkey_hash_equal(a, b) \
+        (((a)->conn_opts == (b)->conn_opts) && \
+         (memcmp((a)->fpr, (b)->fpr, SSL_X509_FPRSZ) == 0))
+
+KHASH_INIT(sslctxmap_t, cachesslctx_key_t*, void*, 1, kh_sslctxkey_hash_func,
+           kh_sslctxkey_hash_equal)
+
+static cache_iter_t
+cachesslctx_begin_cb(UNUSED cache_map_t map)
+{
+	return kh_begin(map);
+}
+
+static cache_iter_t
+cachesslctx_end_cb(cache_map_t map)
+{
+	khash_t(sslctxmap_t) *sslctxmap = map;
+	return kh_end(sslctxmap);
+}
+
+static int
+cachesslctx_exist_cb(cache_map_t map, cache_iter_t it)
+{
+	khash_t(sslctxmap_t) *sslctxmap = map;
+	return kh_exist(sslctxmap, it);
+}
+
+static void
+cachesslctx_del_cb(cache_map_t map, cache_iter_t it)
+{
+	khash_t(sslctxmap_t) *sslctxmap = map;
+	kh_del(sslctxmap_t, sslctxmap, it);
+}
+
+static cache_iter_t
+cachesslctx_get_cb(cache_map_t map, cache_key_t key)
+{
+	khash_t(sslctxmap_t) *sslctxmap = map;
+	return kh_get(sslctxmap_t, sslctxmap, key);
+}
+
+static cache_iter_t
+cachesslctx_put_cb(cache_map_t map, cache_key_t key, int *ret)
+{
+	khash_t(sslctxmap_t) *sslctxmap = map;
+	return kh_put(sslctxmap_t, sslctxmap, key, ret);
+}
+
+static void
+cachesslctx_free_key_cb(cache_key_t key)
+{
+	free(key);
+}
+
+static void
+cachesslctx_free_val_cb(cache_val_t val)
+{
+	SSL_CTX_free(val);
+}
+
+static cache_key_t
+cachesslctx_get_key_cb(cache_map_t map, cache_iter_t it)
+{
+	khash_t(sslctxmap_t) *sslctxmap = map;
+	return kh_key(sslctxmap, it);
+}
+
+static cache_val_t
+cachesslctx_get_val_cb(cache_map_t map, cache_iter_t it)
+{
+	khash_t(sslctxmap_t) *sslctxmap = map;
+	return kh_val(sslctxmap, it);
+}
+
+static void
+cachesslctx_set_val_cb(cache_map_t map, cache_iter_t it, cache_val_t val)
+{
+	khash_t(sslctxmap_t) *sslctxmap = map;
+	kh_val(sslctxmap, it) = val;
+}
+
+static cache_val_t
+cachesslctx_unpackverify_val_cb(cache_val_t val, int copy)
+{
+	X509 *crt = SSL_CTX_get0_certificate(val);
+
+	if (!crt || !ssl_x509_is_valid(crt))
+		return NULL;
+	if (copy) {
+		ssl_sslctx_refcount_inc(val);
+		return val;
+	}
+	return ((void*)-1);
+}
+
+static unsigned int
+cachesslctx_hash_cb(cache_key_t key)
+{
+	return kh_sslctxkey_hash_func(key);
+}
+
+static size_t
+cachesslctx_size_cb(UNUSED cache_key_t key, cache_val_t val)
+{
+	X509 *crt = SSL_CTX_get0_certificate(val);
+	int sz = crt ? i2d_X509(crt, NULL) : 0;
+
+	/* the SSL_CTX itself, its cert and the leaf key, roughly */
+	return sizeof(cachesslctx_key_t) + 4096 + (sz > 0 ? (size_t)sz : 0);
+}
+
+static cache_map_t
+cachesslctx_map_new_cb(void)
+{
+	return kh_init(sslctxmap_t);
+}
+
+static void
+cachesslctx_map_free_cb(cache_map_t map)
+{
+	kh_destroy(sslctxmap_t, map);
+}
+
+void
+cachesslctx_init_cb(cache_t *cache)
+{
+	cache->begin_cb                 = cachesslctx_begin_cb;
+	cache->end_cb                   = cachesslctx_end_cb;
+	cache->exist_cb                 = cachesslctx_exist_cb;
+	cache->del_cb                   = cachesslctx_del_cb;
+	cache->get_cb                   = cachesslctx_get_cb;
+	cache->put_cb                   = cachesslctx_put_cb;
+	cache->free_key_cb              = cachesslctx_free_key_cb;
+	cache->free_val_cb              = cachesslctx_free_val_cb;
+	cache->get_key_cb               = cachesslctx_get_key_cb;
+	cache->get_val_cb               = cachesslctx_get_val_cb;
+	cache->set_val_cb               = cachesslctx_set_val_cb;
+	cache->unpackverify_val_cb      = cachesslctx_unpackverify_val_cb;
+	cache->hash_cb                  = cachesslctx_hash_cb;
+	cache->size_cb                  = cachesslctx_size_cb;
+	cache->map_new_cb               = cachesslctx_map_new_cb;
+	cache->map_free_cb              = cachesslctx_map_free_cb;
+}
+
+cache_key_t
+cachesslctx_mkkey(X509 *keycrt, const void *conn_opts)
+{
+	cachesslctx_key_t *key;
+
+	if (!(key = malloc(sizeof(cachesslctx_key_t))))
+		return NULL;
+	ssl_x509_fingerprint_sha1(keycrt, key->fpr);
+	key->conn_opts = conn_opts;
+	return key;
+}
+
+cache_val_t
+cachesslctx_mkval(SSL_CTX *valsslctx)
+{
+	ssl_sslctx_refcount_inc(valsslctx);
+	return valsslctx;
+}
+
+/* vim: set noet ft=c: */
@@ -41,41 +41,44 @@
 
 KHASH_INIT(cstrmap_t, char*, void*, 1, kh_str_hash_func, kh_str_hash_equal)
 
-static khash_t(cstrmap_t) *certmap;
-
 static cache_iter_t
-cachetgcrt_begin_cb(void)
+cachetgcrt_begin_cb(UNUSED cache_map_t map)
 {
-	return kh_begin(certmap);
+	return kh_begin(map);
 }
 
 static cache_iter_t
-cachetgcrt_end_cb(void)
+cachetgcrt_end_cb(cache_map_t map)
 {
+	khash_t(cstrmap_t) *certmap = map;
 	return kh_end(certmap);
 }
 
 static int
-cachetgcrt_exist_cb(cache_iter_t it)
+cachetgcrt_exist_cb(cache_map_t map, cache_iter_t it)
 {
+	khash_t(cstrmap_t) *certmap = map;
 	return kh_exist(certmap, it);
 }
 
 static void
-cachetgcrt_del_cb(cache_iter_t it)
+cachetgcrt_del_cb(cache_map_t map, cache_iter_t it)
 {
+	khash_t(cstrmap_t) *certmap = map;
 	kh_del(cstrmap_t, certmap, it);
 }
 
 static cache_iter_t
-cachetgcrt_get_cb(cache_key_t key)
+cachetgcrt_get_cb(cache_map_t map, cache_key_t key)
 {
+	khash_t(cstrmap_t) *certmap = map;
 	return kh_get(cstrmap_t, certmap, key);
 }
 
 static cache_iter_t
-cachetgcrt_put_cb(cache_key_t key, int *ret)
+cachetgcrt_put_cb(cache_map_t map, cache_key_t key, int *ret)
 {
+	khash_t(cstrmap_t) *certmap = map;
 	return kh_put(cstrmap_t, certmap, key, ret);
 }
 
@@ -92,20 +95,23 @@ cachetgcrt_free_val_cb(cache_val_t val)
 }
 
 static cache_key_t
-cachetgcrt_get_key_cb(cache_iter_t it)
+cachetgcrt_get_key_cb(cache_map_t map, cache_iter_t it)
 {
+	khash_t(cstrmap_t) *certmap = map;
 	return kh_key(certmap, it);
 }
 
 static cache_val_t
-cachetgcrt_get_val_cb(cache_iter_t it)
+cachetgcrt_get_val_cb(cache_map_t map, cache_iter_t it)
 {
+	khash_t(cstrmap_t) *certmap = map;
 	return kh_val(certmap, it);
 }
 
 static void
-cachetgcrt_set_val_cb(cache_iter_t it, cache_val_t val)
+cachetgcrt_set_val_cb(cache_map_t map, cache_iter_t it, cache_val_t val)
 {
+	khash_t(cstrmap_t) *certmap = map;
 	kh_val(certmap, it) = val;
 }
 
@@ -119,16 +125,36 @@ cachetgcrt_unpackverify_val_cb(cache_val_t val, int copy)
 	return ((void*)-1);
 }
 
+static unsigned int
+cachetgcrt_hash_cb(cache_key_t key)
+{
+	return kh_str_hash_func(key);
+}
+
+static size_t
+cachetgcrt_size_cb(cache_key_t key, UNUSED cache_val_t val)
+{
+	/* the cert_t is shared with other keys, count the key only */
+	return strlen(key) + 1;
+}
+
+static cache_map_t
+cachetgcrt_map_new_cb(void)
+{
+	return kh_init(cstrmap_t);
+}
+
 static void
-cachetgcrt_fini_cb(void)
+cachetgcrt_map_free_cb(cache_map_t map)
 {
-	kh_destroy(cstrmap_t, certmap);
+	kh_destroy(cstrmap_t, map);
 }
 
 void
 cachetgcrt_init_cb(cache_t *cache)
 {
-	certmap = kh_init(cstrmap_t);
+	/* populated at startup and looked up on every conn, read-mostly */
+	cache->rwlock                   = 1;
 
 	cache->begin_cb                 = cachetgcrt_begin_cb;
 	cache->end_cb                   = cachetgcrt_end_cb;
@@ -142,7 +168,10 @@ cachetgcrt_init_cb(cache_t *cache)
 	cache->get_val_cb               = cachetgcrt_get_val_cb;
 	cache->set_val_cb               = cachetgcrt_set_val_cb;
 	cache->unpackverify_val_cb      = cachetgcrt_unpackverify_val_cb;
-	cache->fini_cb                  = cachetgcrt_fini_cb;
+	cache->hash_cb                  = cachetgcrt_hash_cb;
+	cache->size_cb                  = cachetgcrt_size_cb;
+	cache->map_new_cb               = cachetgcrt_map_new_cb;
+	cache->map_free_cb              = cachetgcrt_map_free_cb;
 }
 
 cache_key_t
@@ -0,0 +1,297 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2017-2025, Soner Tari <sonertari@gmail.com>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "cryptopool.h"
+
+#include "thrqueue.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/*
+ * Bounded pool of worker threads for expensive crypto operations, such as
+ * forging certificates, which would otherwise stall all the conns on the
+ * event loop of a conn handling thread.  Jobs are queued on a bounded
+ * thrqueue and picked up by the first idle worker.  Completed jobs are
+ * posted back to the completion queue given on submission, which runs the
+ * done callbacks of the jobs on the event base of the owning thread.
+ */
+
+struct cryptopool {
+	thrqueue_t *queue;
+	pthread_t *thr;
+	int num_thr;
+	int running;
+	pthread_mutex_t stats_mutex;
+	cryptopool_stats_t stats;
+};
+
+struct cryptopool_compq {
+	struct event *ev;
+	pthread_mutex_t mutex;
+	cryptopool_job_t *head;
+	cryptopool_job_t *tail;
+};
+
+static unsigned long long
+cryptopool_elapsed_us(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long)(now.tv_sec - start->tv_sec) * 1000000 +
+	       (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/*
+ * Run the done callbacks of completed jobs, on the thread of the event base.
+ */
+static void
+cryptopool_compq_cb(UNUSED evutil_socket_t fd, UNUSED short what, void *arg)
+{
+	cryptopool_compq_t *compq = arg;
+	cryptopool_job_t *job;
+
+	pthread_mutex_lock(&compq->mutex);
+	job = compq->head;
+	compq->head = NULL;
+	compq->tail = NULL;
+	pthread_mutex_unlock(&compq->mutex);
+
+	while (job) {
+		cryptopool_job_t *next = job->next;
+		job->done(job, 0);
+		job = next;
+	}
+}
+
+static void
+cryptopool_compq_post(cryptopool_compq_t *compq, cryptopool_job_t *job)
+{
+	job->next = NULL;
+
+	pthread_mutex_lock(&compq->mutex);
+	if (compq->tail) {
+		compq->tail->next = job;
+	} else {
+		compq->head = job;
+	}
+	compq->tail = job;
+	pthread_mutex_unlock(&compq->mutex);
+
+	// Event bases are created after evthread_use_pthreads(), so this is thread-safe
+	event_active(compq->ev, 0, 0);
+}
+
+/*
+ * Create a completion queue on the event base of a thread.
+ */
+cryptopool_compq_t *
+cryptopool_compq_new(struct event_base *evbase)
+{
+	cryptopool_compq_t *compq;
+
+	if (!(compq = malloc(sizeof(cryptopool_compq_t))))
+		return NULL;
+	memset(compq, 0, sizeof(cryptopool_compq_t));
+
+	if (pthread_mutex_init(&compq->mutex, NULL)) {
+		free(compq);
+		return NULL;
+	}
+	compq->ev = event_new(evbase, -1, 0, cryptopool_compq_cb, compq);
+	if (!compq->ev) {
+		pthread_mutex_destroy(&compq->mutex);
+		free(compq);
+		return NULL;
+	}
+	return compq;
+}
+
+/*
+ * Free the completion queue, canceling the completed jobs not run yet.
+ * The pool should have been freed before, so that no more jobs are posted.
+ */
+void
+cryptopool_compq_free(cryptopool_compq_t *compq)
+{
+	cryptopool_job_t *job = compq->head;
+
+	while (job) {
+		cryptopool_job_t *next = job->next;
+		job->done(job, 1);
+		job = next;
+	}
+	event_free(compq->ev);
+	pthread_mutex_destroy(&compq->mutex);
+	free(compq);
+}
+
+static void *
+cryptopool_thr(void *arg)
+{
+	cryptopool_t *pool = arg;
+	cryptopool_job_t *job;
+
+	// Dequeue returns NULL only after the pool is stopped and the queue is empty
+	while ((job = thrqueue_dequeue(pool->queue))) {
+		job->work(job);
+
+		unsigned long long latency = cryptopool_elapsed_us(&job->submitted);
+
+		pthread_mutex_lock(&pool->stats_mutex);
+		pool->stats.depth--;
+		pool->stats.jobs++;
+		pool->stats.latency_sum += latency;
+		if (pool->stats.max_latency < latency)
+			pool->stats.max_latency = latency;
+		pthread_mutex_unlock(&pool->stats_mutex);
+
+		// @attention Do not access the job after posting it, it may have been freed already
+		cryptopool_compq_post(job->compq, job);
+	}
+	return NULL;
+}
+
+/*
+ * Create a new pool of num_thr worker threads, with a queue of qsz jobs,
+ * but do not start the threads yet.
+ */
+cryptopool_t *
+cryptopool_new(int num_thr, size_t qsz)
+{
+	cryptopool_t *pool;
+
+	if (!(pool = malloc(sizeof(cryptopool_t))))
+		goto out0;
+	memset(pool, 0, sizeof(cryptopool_t));
+	if (!(pool->thr = malloc(num_thr * sizeof(pthread_t))))
+		goto out1;
+	if (!(pool->queue = thrqueue_new(qsz)))
+		goto out2;
+	if (pthread_mutex_init(&pool->stats_mutex, NULL))
+		goto out3;
+	pool->num_thr = num_thr;
+	return pool;
+
+out3:
+	thrqueue_free(pool->queue);
+out2:
+	free(pool->thr);
+out1:
+	free(pool);
+out0:
+	return NULL;
+}
+
+/*
+ * Start the worker threads of the pool.
+ * Returns -1 on failure, 0 on success.
+ */
+int
+cryptopool_start(cryptopool_t *pool)
+{
+	for (int i = 0; i < pool->num_thr; i++) {
+		if (pthread_create(&pool->thr[i], NULL, cryptopool_thr, pool)) {
+			log_err_level_printf(LOG_CRIT, "Failed to start crypto thread %d\n", i);
+			return -1;
+		}
+		pool->running++;
+	}
+	log_dbg_printf("Started %d crypto threads\n", pool->num_thr);
+	return 0;
+}
+
+/*
+ * Stop the worker threads after they finish all queued jobs, and free the
+ * pool.  The completed jobs are left on their completion queues.
+ */
+void
+cryptopool_free(cryptopool_t *pool)
+{
+	thrqueue_unblock_dequeue(pool->queue);
+	for (int i = 0; i < pool->running; i++) {
+		pthread_join(pool->thr[i], NULL);
+	}
+	thrqueue_free(pool->queue);
+	pthread_mutex_destroy(&pool->stats_mutex);
+	free(pool->thr);
+	free(pool);
+}
+
+/*
+ * Submit a job to the pool, to be run on a worker thread and then posted to
+ * compq.  Never blocks.
+ * Returns -1 if the queue is full, in which case the caller should run the
+ * job itself, 0 on success.
+ */
+int
+cryptopool_submit(cryptopool_t *pool, cryptopool_job_t *job,
+                  cryptopool_compq_t *compq)
+{
+	job->compq = compq;
+	job->next = NULL;
+	clock_gettime(CLOCK_MONOTONIC, &job->submitted);
+
+	// Count the job before enqueueing, a worker may finish it right away
+	pthread_mutex_lock(&pool->stats_mutex);
+	pool->stats.depth++;
+	if (pool->stats.max_depth < pool->stats.depth)
+		pool->stats.max_depth = pool->stats.depth;
+	pthread_mutex_unlock(&pool->stats_mutex);
+
+	if (!thrqueue_enqueue_nb(pool->queue, job)) {
+		pthread_mutex_lock(&pool->stats_mutex);
+		pool->stats.depth--;
+		pool->stats.rejected++;
+		pthread_mutex_unlock(&pool->stats_mutex);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Get the pool statistics collected since the last call, and reset them.
+ * The current queue depth is not reset, but max depth restarts from it.
+ */
+void
+cryptopool_get_stats(cryptopool_t *pool, cryptopool_stats_t *stats)
+{
+	pthread_mutex_lock(&pool->stats_mutex);
+	*stats = pool->stats;
+	pool->stats.max_depth = pool->stats.depth;
+	pool->stats.jobs = 0;
+	pool->stats.rejected = 0;
+	pool->stats.latency_sum = 0;
+	pool->stats.max_latency = 0;
+	pthread_mutex_unlock(&pool->stats_mutex);
+}
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,83 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2017-2025, Soner Tari <sonertari@gmail.com>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CRYPTOPOOL_H
+#define CRYPTOPOOL_H
+
+#include "attrib.h"
+
+#include <stddef.h>
+#include <time.h>
+#include <event2/event.h>
+
+typedef struct cryptopool cryptopool_t;
+typedef struct cryptopool_compq cryptopool_compq_t;
+typedef struct cryptopool_job cryptopool_job_t;
+
+// Runs on a pool thread, must not touch any state owned by the submitter
+typedef void (*cryptopool_work_func_t)(cryptopool_job_t *);
+// Runs on the thread of the completion queue, canceled is 1 on shutdown
+typedef void (*cryptopool_done_func_t)(cryptopool_job_t *, int);
+
+/*
+ * A job is embedded as the first member of a caller defined struct, which
+ * holds the input and output of the job.
+ */
+struct cryptopool_job {
+	cryptopool_work_func_t work;
+	cryptopool_done_func_t done;
+	cryptopool_compq_t *compq;
+	struct timespec submitted;
+	cryptopool_job_t *next;
+};
+
+typedef struct cryptopool_stats {
+	// Jobs queued or running at the moment
+	size_t depth;
+	size_t max_depth;
+	size_t jobs;
+	// Jobs rejected because the queue was full
+	size_t rejected;
+	// Latency from submission to completion, in microseconds
+	unsigned long long latency_sum;
+	unsigned long long max_latency;
+} cryptopool_stats_t;
+
+cryptopool_t * cryptopool_new(int, size_t) MALLOC;
+int cryptopool_start(cryptopool_t *) NONNULL(1) WUNRES;
+void cryptopool_free(cryptopool_t *) NONNULL(1);
+int cryptopool_submit(cryptopool_t *, cryptopool_job_t *,
+                      cryptopool_compq_t *) NONNULL(1,2,3) WUNRES;
+void cryptopool_get_stats(cryptopool_t *, cryptopool_stats_t *) NONNULL(1,2);
+
+cryptopool_compq_t * cryptopool_compq_new(struct event_base *) NONNULL(1) MALLOC;
+void cryptopool_compq_free(cryptopool_compq_t *) NONNULL(1);
+
+#endif /* !CRYPTOPOOL_H */
+
+/* vim: set noet ft=c: */
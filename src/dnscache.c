@@ -0,0 +1,449 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2017-2025, Soner Tari <sonertari@gmail.com>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "dnscache.h"
+
+#include "khash.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <event2/util.h>
+
+/*
+ * Cache of the addresses hostnames resolve to, for resolving the SNI of conns
+ * to their dst addresses.  Each conn handling thread owns one on top of its
+ * evdns base, so there is no locking.
+ *
+ * The hosts file is looked up first on cache misses, as getaddrinfo does.
+ * Its answers are not cached, since they are found without a query.  Other
+ * names are resolved by A or AAAA queries to honor the TTL of the answers.
+ * Lookups of a name while a query for it is in flight wait for the answer to
+ * that query, and popular names are resolved again before they expire.
+ */
+
+typedef struct dnscache_waiter {
+	dnscache_cb_t cb;
+	void *arg;
+	struct dnscache_waiter *next;
+} dnscache_waiter_t;
+
+typedef struct dnscache_entry {
+	dnscache_t *cache;
+	// Address family followed by the name, the key of the entry
+	char *key;
+	const char *name;
+	int af;
+	// Set once resolved, until expired
+	unsigned int valid : 1;
+	// Set while a query is in flight, the entry must not be freed then
+	unsigned int querying : 1;
+	// 0 for an address, or the EVUTIL_EAI_* code of a negative answer
+	int err;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	unsigned int ttl;
+	time_t expires;
+	// Hits since the name was resolved
+	size_t hits;
+	dnscache_waiter_t *waiters;
+} dnscache_entry_t;
+
+KHASH_INIT(dnsmap_t, char*, dnscache_entry_t*, 1, kh_str_hash_func, kh_str_hash_equal)
+
+struct dnscache {
+	struct evdns_base *dnsbase;
+	// Base without nameservers, for looking up the hosts file only
+	struct evdns_base *hostsbase;
+	khash_t(dnsmap_t) *map;
+	dnscache_stats_t stats;
+};
+
+static void dnscache_resolve_cb(int, char, int, int, void *, void *);
+
+/*
+ * The evdns base must outlive the cache.
+ */
+dnscache_t *
+dnscache_new(struct event_base *evbase, struct evdns_base *dnsbase)
+{
+	dnscache_t *cache;
+
+	if (!(cache = malloc(sizeof(dnscache_t))))
+		return NULL;
+	memset(cache, 0, sizeof(dnscache_t));
+	if (!(cache->map = kh_init(dnsmap_t)))
+		goto err;
+	if (!(cache->hostsbase = evdns_base_new(evbase, 0)))
+		goto err;
+	// A missing hosts file is not an error
+	evdns_base_load_hosts(cache->hostsbase, NULL);
+	cache->dnsbase = dnsbase;
+	return cache;
+err:
+	if (cache->map)
+		kh_destroy(dnsmap_t, cache->map);
+	free(cache);
+	return NULL;
+}
+
+static void
+dnscache_entry_free(dnscache_entry_t *e)
+{
+	dnscache_waiter_t *w;
+
+	while ((w = e->waiters)) {
+		e->waiters = w->next;
+		free(w);
+	}
+	free(e->key);
+	free(e);
+}
+
+static void
+dnscache_entry_del(dnscache_t *cache, dnscache_entry_t *e)
+{
+	khiter_t it = kh_get(dnsmap_t, cache->map, e->key);
+
+	if (it != kh_end(cache->map))
+		kh_del(dnsmap_t, cache->map, it);
+	dnscache_entry_free(e);
+}
+
+/*
+ * Must be called after the evdns base has been freed without failing its
+ * requests, so that no callbacks run on the freed entries.
+ */
+void
+dnscache_free(dnscache_t *cache)
+{
+	khiter_t it;
+
+	for (it = kh_begin(cache->map); it != kh_end(cache->map); ++it) {
+		if (kh_exist(cache->map, it))
+			dnscache_entry_free(kh_val(cache->map, it));
+	}
+	kh_destroy(dnsmap_t, cache->map);
+	evdns_base_free(cache->hostsbase, 0);
+	free(cache);
+}
+
+/*
+ * Drop expired and failed entries.  If the cache is still full, drop entries
+ * in map order until there is room for one more.
+ */
+static void
+dnscache_evict(dnscache_t *cache, time_t now)
+{
+	dnscache_entry_t *e;
+	khiter_t it;
+	int pass;
+
+	for (pass = 0; pass < 2; pass++) {
+		for (it = kh_begin(cache->map); it != kh_end(cache->map); ++it) {
+			if (kh_size(cache->map) < DNSCACHE_MAX_ENTRIES && pass)
+				return;
+			if (!kh_exist(cache->map, it))
+				continue;
+			e = kh_val(cache->map, it);
+			if (e->querying)
+				continue;
+			if (pass || !e->valid || e->expires <= now) {
+				kh_del(dnsmap_t, cache->map, it);
+				dnscache_entry_free(e);
+			}
+		}
+		if (kh_size(cache->map) < DNSCACHE_MAX_ENTRIES)
+			return;
+	}
+}
+
+/*
+ * Send an A or AAAA query for the entry.
+ * Returns -1 on error.
+ */
+static int
+dnscache_query(dnscache_entry_t *e)
+{
+	struct evdns_request *req;
+
+	if (e->af == AF_INET) {
+		req = evdns_base_resolve_ipv4(e->cache->dnsbase, e->name, 0, dnscache_resolve_cb, e);
+	} else {
+		req = evdns_base_resolve_ipv6(e->cache->dnsbase, e->name, 0, dnscache_resolve_cb, e);
+	}
+	if (!req)
+		return -1;
+	e->querying = 1;
+	return 0;
+}
+
+/*
+ * Store the answer, if ttl is not 0, and pass it to the waiters.  A failed
+ * query does not replace an answer which has not expired yet.
+ */
+static void
+dnscache_done(dnscache_entry_t *e, int err, const struct sockaddr *addr, socklen_t addrlen, unsigned int ttl)
+{
+	struct sockaddr_storage ss;
+	dnscache_waiter_t *w, *waiters;
+
+	e->querying = 0;
+	if (ttl) {
+		if (ttl < DNSCACHE_MIN_TTL)
+			ttl = DNSCACHE_MIN_TTL;
+		else if (ttl > DNSCACHE_MAX_TTL)
+			ttl = DNSCACHE_MAX_TTL;
+		e->valid = 1;
+		e->err = err;
+		if (addr) {
+			memcpy(&e->addr, addr, addrlen);
+			e->addrlen = addrlen;
+		}
+		e->ttl = ttl;
+		e->expires = time(NULL) + ttl;
+		e->hits = 0;
+	}
+
+	// The waiters may look up names themselves, which may evict this entry
+	if (addr) {
+		memcpy(&ss, addr, addrlen);
+	}
+	waiters = e->waiters;
+	e->waiters = NULL;
+	if (!e->valid) {
+		dnscache_entry_del(e->cache, e);
+	}
+
+	while ((w = waiters)) {
+		waiters = w->next;
+		w->cb(err, addr ? (struct sockaddr *)&ss : NULL, addrlen, w->arg);
+		free(w);
+	}
+}
+
+static void
+dnscache_resolve_cb(int result, char type, int count, int ttl, void *addresses, void *arg)
+{
+	dnscache_entry_t *e = arg;
+	struct sockaddr_storage ss;
+
+	memset(&ss, 0, sizeof(ss));
+	if (result == DNS_ERR_NONE && count > 0 && type == DNS_IPv4_A && e->af == AF_INET) {
+		struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+		sin->sin_family = AF_INET;
+		memcpy(&sin->sin_addr, addresses, sizeof(struct in_addr));
+		dnscache_done(e, 0, (struct sockaddr *)sin, sizeof(struct sockaddr_in), ttl > 0 ? ttl : 1);
+	} else if (result == DNS_ERR_NONE && count > 0 && type == DNS_IPv6_AAAA && e->af == AF_INET6) {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&ss;
+		sin6->sin6_family = AF_INET6;
+		memcpy(&sin6->sin6_addr, addresses, sizeof(struct in6_addr));
+		dnscache_done(e, 0, (struct sockaddr *)sin6, sizeof(struct sockaddr_in6), ttl > 0 ? ttl : 1);
+	} else if (result == DNS_ERR_NONE) {
+		// The name has no address of the family
+		dnscache_done(e, EVUTIL_EAI_NODATA, NULL, 0, DNSCACHE_NEG_TTL);
+	} else if (result == DNS_ERR_NOTEXIST) {
+		dnscache_done(e, EVUTIL_EAI_NONAME, NULL, 0, DNSCACHE_NEG_TTL);
+	} else if (result == DNS_ERR_SHUTDOWN || result == DNS_ERR_CANCEL) {
+		dnscache_done(e, EVUTIL_EAI_CANCEL, NULL, 0, 0);
+	} else {
+		// Server failures and timeouts are transient, do not cache them
+		dnscache_done(e, EVUTIL_EAI_AGAIN, NULL, 0, 0);
+	}
+}
+
+typedef struct dnscache_hosts {
+	int found;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+} dnscache_hosts_t;
+
+/*
+ * Names in the hosts file are answered before evdns_getaddrinfo() returns.
+ * Otherwise the request is canceled right away, and this is called with
+ * EVUTIL_EAI_CANCEL later on, when arg is gone.
+ */
+static void
+dnscache_hosts_cb(int errcode, struct evutil_addrinfo *ai, void *arg)
+{
+	dnscache_hosts_t *hosts = arg;
+
+	if (!errcode && ai) {
+		memcpy(&hosts->addr, ai->ai_addr, ai->ai_addrlen);
+		hosts->addrlen = ai->ai_addrlen;
+		hosts->found = 1;
+	}
+	if (ai) {
+		evutil_freeaddrinfo(ai);
+	}
+}
+
+/*
+ * Look up name in the hosts file.  The hosts base has no nameservers, so its
+ * requests for other names wait without sending any queries until canceled.
+ * Returns 1 if found, 0 otherwise.
+ */
+static int
+dnscache_hosts_lookup(dnscache_t *cache, const char *name, int af, dnscache_hosts_t *hosts)
+{
+	struct evdns_getaddrinfo_request *req;
+	struct evutil_addrinfo hints;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = af;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+	hosts->found = 0;
+	req = evdns_getaddrinfo(cache->hostsbase, name, NULL, &hints, dnscache_hosts_cb, hosts);
+	if (req) {
+		evdns_getaddrinfo_cancel(req);
+	}
+	return hosts->found;
+}
+
+/*
+ * Resolve name to an address of family af, and pass it to cb.  If the answer
+ * is cached, or name is numeric or in the hosts file, cb is called before this
+ * function returns.
+ * Returns -1 on error, in which case cb is not called.
+ */
+int
+dnscache_resolve(dnscache_t *cache, const char *name, int af, dnscache_cb_t cb, void *arg)
+{
+	struct sockaddr_storage ss;
+	dnscache_hosts_t hosts;
+	dnscache_entry_t *e;
+	dnscache_waiter_t *w;
+	time_t now;
+	khiter_t it;
+	char *key;
+	size_t sz;
+	int ret;
+
+	if (af != AF_INET && af != AF_INET6)
+		return -1;
+
+	sz = strlen(name) + 3;
+	if (!(key = malloc(sz)))
+		return -1;
+	snprintf(key, sz, "%c:%s", af == AF_INET ? '4' : '6', name);
+
+	now = time(NULL);
+	it = kh_get(dnsmap_t, cache->map, key);
+	if (it != kh_end(cache->map)) {
+		free(key);
+		key = NULL;
+		e = kh_val(cache->map, it);
+
+		if (e->valid && e->expires > now) {
+			e->hits++;
+			if (e->err) {
+				cache->stats.neg_hits++;
+				cb(e->err, NULL, 0, arg);
+				return 0;
+			}
+			cache->stats.hits++;
+			if (!e->querying && e->hits >= DNSCACHE_PREFETCH_HITS &&
+			    (e->expires - now) * DNSCACHE_PREFETCH_DIV <= e->ttl &&
+			    dnscache_query(e) == 0) {
+				cache->stats.prefetches++;
+			}
+			// The callback may look up names itself, which may evict this entry
+			memcpy(&ss, &e->addr, e->addrlen);
+			cb(0, (struct sockaddr *)&ss, e->addrlen, arg);
+			return 0;
+		}
+		e->valid = 0;
+	} else {
+		e = NULL;
+	}
+
+	// Numeric names are answered from the hosts base too
+	if (!(e && e->querying) && dnscache_hosts_lookup(cache, name, af, &hosts)) {
+		free(key);
+		cb(0, (struct sockaddr *)&hosts.addr, hosts.addrlen, arg);
+		return 0;
+	}
+
+	if (!e) {
+		if (kh_size(cache->map) >= DNSCACHE_MAX_ENTRIES)
+			dnscache_evict(cache, now);
+
+		if (!(e = malloc(sizeof(dnscache_entry_t)))) {
+			free(key);
+			return -1;
+		}
+		memset(e, 0, sizeof(dnscache_entry_t));
+		e->cache = cache;
+		e->key = key;
+		e->name = key + 2;
+		e->af = af;
+		it = kh_put(dnsmap_t, cache->map, e->key, &ret);
+		if (ret == -1) {
+			dnscache_entry_free(e);
+			return -1;
+		}
+		kh_val(cache->map, it) = e;
+	}
+
+	if (!(w = malloc(sizeof(dnscache_waiter_t)))) {
+		if (!e->querying)
+			dnscache_entry_del(cache, e);
+		return -1;
+	}
+	w->cb = cb;
+	w->arg = arg;
+	w->next = e->waiters;
+	e->waiters = w;
+
+	if (e->querying) {
+		cache->stats.coalesced++;
+		return 0;
+	}
+	if (dnscache_query(e) == -1) {
+		dnscache_entry_del(cache, e);
+		return -1;
+	}
+	cache->stats.misses++;
+	return 0;
+}
+
+/*
+ * Get the stats of the cache, and reset its counters.
+ */
+void
+dnscache_get_stats(dnscache_t *cache, dnscache_stats_t *stats)
+{
+	memcpy(stats, &cache->stats, sizeof(dnscache_stats_t));
+	stats->entries = kh_size(cache->map);
+	memset(&cache->stats, 0, sizeof(dnscache_stats_t));
+}
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,81 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2017-2025, Soner Tari <sonertari@gmail.com>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef DNSCACHE_H
+#define DNSCACHE_H
+
+#include "attrib.h"
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <event2/event.h>
+#include <event2/dns.h>
+
+/*
+ * Limits of the TTL of cached answers, in seconds.  Names which do not exist
+ * or have no address of the family are cached for DNSCACHE_NEG_TTL.
+ */
+#define DNSCACHE_MIN_TTL 5
+#define DNSCACHE_MAX_TTL 3600
+#define DNSCACHE_NEG_TTL 10
+
+/*
+ * Names hit at least DNSCACHE_PREFETCH_HITS times since they have been
+ * resolved are resolved again in the background, once the remaining TTL
+ * drops below 1/DNSCACHE_PREFETCH_DIV of the TTL.
+ */
+#define DNSCACHE_PREFETCH_HITS 2
+#define DNSCACHE_PREFETCH_DIV 10
+
+#define DNSCACHE_MAX_ENTRIES 1024
+
+typedef struct dnscache dnscache_t;
+
+// errcode is an EVUTIL_EAI_* code, addr is NULL on error and has port 0
+typedef void (*dnscache_cb_t)(int errcode, const struct sockaddr *addr, socklen_t addrlen, void *arg);
+
+typedef struct dnscache_stats {
+	// Answers served from the cache, negative ones included
+	size_t hits;
+	size_t neg_hits;
+	// Lookups sent to the resolver, and those which waited for one in flight
+	size_t misses;
+	size_t coalesced;
+	size_t prefetches;
+	size_t entries;
+} dnscache_stats_t;
+
+dnscache_t * dnscache_new(struct event_base *, struct evdns_base *) NONNULL(1,2) MALLOC;
+void dnscache_free(dnscache_t *) NONNULL(1);
+int dnscache_resolve(dnscache_t *, const char *, int, dnscache_cb_t, void *) NONNULL(1,2,4) WUNRES;
+void dnscache_get_stats(dnscache_t *, dnscache_stats_t *) NONNULL(1,2);
+
+#endif /* !DNSCACHE_H */
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,239 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2017-2025, Soner Tari <sonertari@gmail.com>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "httphdr.h"
+
+#include <string.h>
+#include <strings.h>
+
+/*
+ * Streaming HTTP header parser working on the input evbuffer in place.
+ *
+ * Lines are located with memchr() on the evbuffer segments, which libc
+ * vectorizes, and the search resumes where it stopped on the previous read.
+ * Lines are passed to the callback without copying, unless a line spans
+ * segments.  Unmodified lines are moved to the output evbuffer in batches
+ * with evbuffer_remove_buffer(), which moves whole segments by reference.
+ */
+
+/*
+ * Perfect hash of the header field names in httphdr_names on their length,
+ * first and last characters, case insensitive.  None of the names collide,
+ * so a lookup compares against at most one name.
+ */
+#define HTTPHDR_HASH_SIZE 32
+#define HTTPHDR_HASH(n, len) \
+	(((len) + 2 * ((unsigned char)(n)[0] | 0x20) + 11 * ((unsigned char)(n)[(len) - 1] | 0x20)) & (HTTPHDR_HASH_SIZE - 1))
+
+typedef struct httphdr_name {
+	const char *name;
+	size_t len;
+	httphdr_id_t id;
+} httphdr_name_t;
+
+#define HTTPHDR_NAME(s, id) { s, sizeof(s) - 1, id }
+
+static const httphdr_name_t httphdr_names[HTTPHDR_HASH_SIZE] = {
+	[0] = HTTPHDR_NAME("Public-Key-Pins", HTTPHDR_PUBLIC_KEY_PINS),
+	[1] = HTTPHDR_NAME("SSLproxy", HTTPHDR_SSLPROXY),
+	[5] = HTTPHDR_NAME("X-Forwarded-For", HTTPHDR_X_FORWARDED_FOR),
+	[6] = HTTPHDR_NAME("Transfer-Encoding", HTTPHDR_TRANSFER_ENCODING),
+	[8] = HTTPHDR_NAME("Upgrade", HTTPHDR_UPGRADE),
+	[9] = HTTPHDR_NAME("Content-Type", HTTPHDR_CONTENT_TYPE),
+	[10] = HTTPHDR_NAME("Connection", HTTPHDR_CONNECTION),
+	[12] = HTTPHDR_NAME("Content-Length", HTTPHDR_CONTENT_LENGTH),
+	[14] = HTTPHDR_NAME("Public-Key-Pins-Report-Only", HTTPHDR_PUBLIC_KEY_PINS_REPORT_ONLY),
+	[15] = HTTPHDR_NAME("Expect-CT", HTTPHDR_EXPECT_CT),
+	[16] = HTTPHDR_NAME("Host", HTTPHDR_HOST),
+	[17] = HTTPHDR_NAME("Referer", HTTPHDR_REFERER),
+	[18] = HTTPHDR_NAME("Strict-Transport-Security", HTTPHDR_STRICT_TRANSPORT_SECURITY),
+	[23] = HTTPHDR_NAME("Keep-Alive", HTTPHDR_KEEP_ALIVE),
+	[24] = HTTPHDR_NAME("Alternate-Protocol", HTTPHDR_ALTERNATE_PROTOCOL),
+	[26] = HTTPHDR_NAME("Via", HTTPHDR_VIA),
+	[30] = HTTPHDR_NAME("Accept-Encoding", HTTPHDR_ACCEPT_ENCODING),
+};
+
+/*
+ * Look up the header field name of len bytes, which is not null-terminated.
+ */
+httphdr_id_t
+httphdr_lookup(const char *name, size_t len)
+{
+	const httphdr_name_t *n;
+
+	if (!len)
+		return HTTPHDR_UNKNOWN;
+	n = &httphdr_names[HTTPHDR_HASH(name, len)];
+	if (n->len == len && !strncasecmp(n->name, name, len))
+		return n->id;
+	return HTTPHDR_UNKNOWN;
+}
+
+/*
+ * Returns the offset of the first LF in buf at or after off, -1 if none.
+ */
+static ssize_t NONNULL(1)
+httphdr_find_lf(struct evbuffer *buf, size_t off)
+{
+	struct evbuffer_ptr ptr;
+	struct evbuffer_iovec v[8];
+	const char *lf;
+	int n, i;
+
+	do {
+		if (evbuffer_ptr_set(buf, &ptr, off, EVBUFFER_PTR_SET) == -1)
+			return -1;
+		n = evbuffer_peek(buf, -1, &ptr, v, 8);
+		for (i = 0; i < n && i < 8; i++) {
+			if ((lf = memchr(v[i].iov_base, '\n', v[i].iov_len)))
+				return off + (lf - (const char *)v[i].iov_base);
+			off += v[i].iov_len;
+		}
+	} while (n > 8);
+	return -1;
+}
+
+/*
+ * Move the kept lines at the start of inbuf to outbuf.
+ */
+static int NONNULL(1,2,3)
+httphdr_flush(struct evbuffer *inbuf, struct evbuffer *outbuf, size_t *keep)
+{
+	if (*keep) {
+		if (evbuffer_remove_buffer(inbuf, outbuf, *keep) != (int)*keep)
+			return -1;
+		*keep = 0;
+	}
+	return 0;
+}
+
+static int NONNULL(1,2)
+httphdr_add_line(struct evbuffer *outbuf, const char *s)
+{
+	if (evbuffer_add(outbuf, s, strlen(s)) == -1 ||
+	    evbuffer_add(outbuf, "\r\n", 2) == -1)
+		return -1;
+	return 0;
+}
+
+/*
+ * Parse the complete header lines in inbuf, pass them to cb one at a time,
+ * and write the resulting header lines to outbuf.  Stops after a line for
+ * which cb returns HTTPHDR_DONE, or at the first incomplete line, which is
+ * left in inbuf to be parsed when more data arrives.
+ *
+ * Returns 1 if cb returned HTTPHDR_DONE, 0 if the header is incomplete,
+ * and -1 if cb returned -1 or on memory allocation failure.
+ */
+int
+httphdr_filter(struct evbuffer *inbuf, struct evbuffer *outbuf, httphdr_parser_t *parser,
+               httphdr_linecb_t cb, void *arg)
+{
+	httphdr_line_t line;
+	struct evbuffer_ptr ptr;
+	struct evbuffer_iovec v;
+	const char *p, *colon;
+	// Size of the kept lines at the start of inbuf, not moved to outbuf yet
+	size_t keep = 0;
+	size_t sz;
+	ssize_t lf;
+	int rv;
+
+	for (;;) {
+		if ((lf = httphdr_find_lf(inbuf, keep + parser->scanned)) == -1) {
+			// Resume from here when more data arrives, after flushing the kept lines below
+			parser->scanned = evbuffer_get_length(inbuf) - keep;
+			rv = 0;
+			break;
+		}
+		parser->scanned = 0;
+		sz = lf - keep + 1;
+
+		if (evbuffer_ptr_set(inbuf, &ptr, keep, EVBUFFER_PTR_SET) == -1)
+			return -1;
+		if (evbuffer_peek(inbuf, sz, &ptr, &v, 1) == 1) {
+			p = v.iov_base;
+		} else {
+			// The line spans segments, make it contiguous
+			if (httphdr_flush(inbuf, outbuf, &keep) == -1)
+				return -1;
+			if (!(p = (const char *)evbuffer_pullup(inbuf, sz)))
+				return -1;
+		}
+
+		line.buf = p;
+		line.len = sz - 1;
+		if (line.len && p[line.len - 1] == '\r')
+			line.len--;
+		if ((colon = memchr(p, ':', line.len))) {
+			line.id = httphdr_lookup(p, colon - p);
+			line.value = colon + 1;
+			line.value += strspn(line.value, " \t");
+			if (line.value > p + line.len)
+				line.value = p + line.len;
+			line.value_len = p + line.len - line.value;
+		} else {
+			line.id = HTTPHDR_UNKNOWN;
+			line.value = NULL;
+			line.value_len = 0;
+		}
+		line.insert = NULL;
+		line.append = NULL;
+
+		if ((rv = cb(&line, arg)) == -1)
+			return -1;
+
+		if (!line.insert && !line.append && !(rv & HTTPHDR_DROP)) {
+			keep += sz;
+		} else {
+			if (httphdr_flush(inbuf, outbuf, &keep) == -1)
+				return -1;
+			if (line.insert && httphdr_add_line(outbuf, line.insert) == -1)
+				return -1;
+			if (rv & HTTPHDR_DROP) {
+				if (evbuffer_drain(inbuf, sz) == -1)
+					return -1;
+			} else if (evbuffer_remove_buffer(inbuf, outbuf, sz) != (int)sz) {
+				return -1;
+			}
+			if (line.append && httphdr_add_line(outbuf, line.append) == -1)
+				return -1;
+		}
+
+		if (rv & HTTPHDR_DONE) {
+			rv = 1;
+			break;
+		}
+	}
+
+	if (httphdr_flush(inbuf, outbuf, &keep) == -1)
+		return -1;
+	return rv;
+}
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,105 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2017-2025, Soner Tari <sonertari@gmail.com>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef HTTPHDR_H
+#define HTTPHDR_H
+
+#include "attrib.h"
+
+#include <stdlib.h>
+#include <event2/buffer.h>
+
+/*
+ * Header fields which the HTTP filters act on, looked up by name.
+ */
+typedef enum httphdr_id {
+	HTTPHDR_UNKNOWN = 0,
+	HTTPHDR_HOST,
+	HTTPHDR_CONTENT_TYPE,
+	HTTPHDR_CONTENT_LENGTH,
+	HTTPHDR_TRANSFER_ENCODING,
+	HTTPHDR_CONNECTION,
+	HTTPHDR_KEEP_ALIVE,
+	HTTPHDR_UPGRADE,
+	HTTPHDR_ACCEPT_ENCODING,
+	HTTPHDR_REFERER,
+	HTTPHDR_VIA,
+	HTTPHDR_X_FORWARDED_FOR,
+	HTTPHDR_PUBLIC_KEY_PINS,
+	HTTPHDR_PUBLIC_KEY_PINS_REPORT_ONLY,
+	HTTPHDR_STRICT_TRANSPORT_SECURITY,
+	HTTPHDR_EXPECT_CT,
+	HTTPHDR_ALTERNATE_PROTOCOL,
+	HTTPHDR_SSLPROXY,
+} httphdr_id_t;
+
+/*
+ * A header line passed to the line callback of httphdr_filter().
+ * The line points into the input evbuffer, is not null-terminated, and
+ * excludes the CRLF or LF line ending.  For header fields, value points to
+ * the field value after the colon and any leading whitespace.
+ *
+ * The callback may set insert and/or append to a null-terminated line, which
+ * is written before/after the line with a CRLF line ending.  The strings
+ * must be valid until the callback is called again.
+ */
+typedef struct httphdr_line {
+	const char *buf;
+	size_t len;
+	httphdr_id_t id;
+	const char *value;
+	size_t value_len;
+	const char *insert;
+	const char *append;
+} httphdr_line_t;
+
+/*
+ * Return flags of the line callback, or -1 to abort filtering.
+ * HTTPHDR_DROP removes the line, HTTPHDR_DONE stops parsing after the line,
+ * leaving the rest of the input evbuffer to the caller.
+ */
+#define HTTPHDR_KEEP 0
+#define HTTPHDR_DROP (1 << 0)
+#define HTTPHDR_DONE (1 << 1)
+
+typedef int (*httphdr_linecb_t)(httphdr_line_t *, void *);
+
+/*
+ * Parser state kept across reads: the number of bytes at the start of the
+ * input evbuffer already scanned for the end of the current partial line.
+ */
+typedef struct httphdr_parser {
+	size_t scanned;
+} httphdr_parser_t;
+
+httphdr_id_t httphdr_lookup(const char *, size_t) NONNULL(1) WUNRES;
+int httphdr_filter(struct evbuffer *, struct evbuffer *, httphdr_parser_t *, httphdr_linecb_t, void *) NONNULL(1,2,3,4) WUNRES;
+
+#endif /* !HTTPHDR_H */
+
+/* vim: set noet ft=c: */
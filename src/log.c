@@ -300,6 +300,16 @@ log_masterkey_writecb(UNUSED int level, UNUSED void *fh, UNUSED unsigned long ct
 	return sz;
 }
 
+/*
+ * All master key log writes go to the same file descriptor and are
+ * coalesced by the logger.
+ */
+static int
+log_masterkey_fdcb(UNUSED void *fh)
+{
+	return masterkey_fd;
+}
+
 static void
 log_masterkey_fini(void)
 {
@@ -354,33 +364,51 @@ log_connect_reopencb(void)
 }
 
 /*
- * Do the actual write to the open connection log file descriptor.
- * We prepend a timestamp here, which means that timestamps are slightly
- * delayed from the time of actual logging.  Since we only have second
- * resolution that should not make any difference.
+ * Prepend a timestamp to the connection log line.  This is done in the
+ * calling thread at submit time, so that the logger can write the timestamp
+ * and the line, and consecutive lines, in one go.
  */
-static ssize_t
-log_connect_writecb(UNUSED int level, UNUSED void *fh, UNUSED unsigned long ctl,
-                    const void *buf, size_t sz)
+static logbuf_t *
+log_connect_prepcb(UNUSED void *fh, UNUSED unsigned long prepflags,
+                   logbuf_t *lb)
 {
 	char timebuf[32];
 	time_t epoch;
-	struct tm *utc;
+	struct tm utc;
+	logbuf_t *head;
 	size_t n;
 
+	if (!lb)
+		return NULL;
 	time(&epoch);
-	if ((utc = gmtime(&epoch)) == NULL) {
+	if (gmtime_r(&epoch, &utc) == NULL) {
 		log_err_level_printf(LOG_CRIT, "Failed to convert time: %s (%i)\n",
 		               strerror(errno), errno);
-		return -1;
+		goto err;
 	}
-	n = strftime(timebuf, sizeof(timebuf), "%Y-%m-%d %H:%M:%S UTC ", utc);
+	n = strftime(timebuf, sizeof(timebuf), "%Y-%m-%d %H:%M:%S UTC ", &utc);
 	if (n == 0) {
 		log_err_level_printf(LOG_CRIT, "Error from strftime(): buffer too small\n");
-		return -1;
+		goto err;
 	}
-	if ((write(connect_fd, timebuf, n) == -1) ||
-	    (write(connect_fd, buf, sz) == -1)) {
+	if (!(head = logbuf_new_copy(timebuf, n, lb)))
+		goto err;
+	head->fh = lb->fh;
+	return head;
+err:
+	logbuf_free(lb);
+	return NULL;
+}
+
+/*
+ * Do the actual write to the open connection log file descriptor.
+ * Only used if the connection log fd is not open, see log_connect_fdcb().
+ */
+static ssize_t
+log_connect_writecb(UNUSED int level, UNUSED void *fh, UNUSED unsigned long ctl,
+                    const void *buf, size_t sz)
+{
+	if (write(connect_fd, buf, sz) == -1) {
 		log_err_level_printf(LOG_CRIT, "Failed to write to connect log: %s\n",
 		               strerror(errno));
 		return -1;
@@ -388,6 +416,12 @@ log_connect_writecb(UNUSED int level, UNUSED void *fh, UNUSED unsigned long ctl,
 	return sz;
 }
 
+static int
+log_connect_fdcb(UNUSED void *fh)
+{
+	return connect_fd;
+}
+
 static void
 log_connect_fini(void)
 {
@@ -450,6 +484,7 @@ typedef struct log_content_file_ctx {
 			char *filename;
 		} spec;
 	} u;
+	unsigned int shard;
 } log_content_file_ctx_t;
 
 typedef struct log_content_pcap_ctx {
@@ -464,6 +499,10 @@ typedef struct log_content_pcap_ctx {
 		} spec;
 	} u;
 	logpkt_ctx_t state;
+	unsigned int shard;
+	/* Link in the list of contexts with buffered records of the shard */
+	struct log_content_pcap_ctx *dirty_next;
+	struct log_content_pcap_ctx **dirty_prev;
 } log_content_pcap_ctx_t;
 
 #ifndef WITHOUT_MIRROR
@@ -476,6 +515,8 @@ static int content_file_clisock = -1;
 static logger_t *content_file_log = NULL;
 static int content_pcap_clisock = -1;
 static logger_t *content_pcap_log = NULL;
+static int content_pcap_format = LOGPKT_FORMAT_PCAP;
+static log_content_pcap_ctx_t *content_pcap_dirty[CONTENTLOG_MAX_THREADS];
 static uint8_t content_pcap_src_ether[ETHER_ADDR_LEN] = {
 	0x02, 0x00, 0x00, 0x11, 0x11, 0x11};
 static uint8_t content_pcap_dst_ether[ETHER_ADDR_LEN] = {
@@ -830,7 +871,7 @@ log_content_open(log_content_ctx_t *ctx, global_t *global,
 			goto errout;
 		memset(ctx->pcap, 0, sizeof(log_content_pcap_ctx_t));
 
-		logpkt_ctx_init(&ctx->pcap->state, NULL, 0,
+		logpkt_ctx_init(&ctx->pcap->state, NULL, 0, content_pcap_format,
 		                content_pcap_src_ether, content_pcap_dst_ether,
 		                srcaddr, srcaddrlen, dstaddr, dstaddrlen);
 
@@ -872,6 +913,7 @@ log_content_open(log_content_ctx_t *ctx, global_t *global,
 		logpkt_ctx_init(&ctx->mirror->state,
 		                content_mirror_libnet,
 		                content_mirror_mtu,
+		                LOGPKT_FORMAT_PCAP,
 		                content_mirror_src_ether,
 		                content_mirror_dst_ether,
 		                srcaddr, srcaddrlen, dstaddr, dstaddrlen);
@@ -921,6 +963,8 @@ errout:
 
 /*
  * On failure, lb is not freed.
+ * If more than one content logger is enabled, the others reference the
+ * shared buffers of lb, so that the content is not copied for each logger.
  */
 int
 log_content_submit(log_content_ctx_t *ctx, logbuf_t *lb, int is_request, int log_content, int log_pcap
@@ -942,18 +986,18 @@ log_content_submit(log_content_ctx_t *ctx, logbuf_t *lb, int is_request, int log
 	lbpcap = lbmirror = lb;
 	if (log_content && content_file_log) {
 		if (log_pcap && content_pcap_log) {
-			lbpcap = logbuf_new_deepcopy(lb, 1);
+			lbpcap = logbuf_new_ref(lb);
 			if (!lbpcap)
 				goto errout;
 		}
 #ifndef WITHOUT_MIRROR
 		if (log_mirror && content_mirror_log) {
-			lbmirror = logbuf_new_deepcopy(lb, 1);
+			lbmirror = logbuf_new_ref(lb);
 			if (!lbmirror)
 				goto errout;
 		}
 	} else if (log_pcap && content_pcap_log && log_mirror && content_mirror_log) {
-		lbmirror = logbuf_new_deepcopy(lb, 1);
+		lbmirror = logbuf_new_ref(lb);
 		if (!lbmirror)
 			goto errout;
 #endif /* !WITHOUT_MIRROR */
@@ -1063,6 +1107,7 @@ log_content_file_dir_opencb(void *fh)
 		               strerror(errno), errno);
 		return -1;
 	}
+	sys_fd_count_add(1);
 	return 0;
 }
 
@@ -1073,8 +1118,10 @@ log_content_file_dir_closecb(void *fh, UNUSED unsigned long ctl)
 
 	if (ctx->u.dir.filename)
 		free(ctx->u.dir.filename);
-	if (ctx->u.dir.fd != 1)
+	if (ctx->u.dir.fd != -1) {
 		close(ctx->u.dir.fd);
+		sys_fd_count_add(-1);
+	}
 	free(ctx);
 }
 
@@ -1092,6 +1139,22 @@ log_content_file_dir_writecb(UNUSED int level, void *fh, UNUSED unsigned long ct
 	return sz;
 }
 
+static unsigned int *
+log_content_file_shardcb(void *fh)
+{
+	log_content_file_ctx_t *ctx = fh;
+
+	return &ctx->shard;
+}
+
+static int
+log_content_file_dir_fdcb(void *fh)
+{
+	log_content_file_ctx_t *ctx = fh;
+
+	return ctx->u.dir.fd;
+}
+
 static int
 log_content_file_spec_opencb(void *fh)
 {
@@ -1104,6 +1167,7 @@ log_content_file_spec_opencb(void *fh)
 		               ctx->u.spec.filename, strerror(errno), errno);
 		return -1;
 	}
+	sys_fd_count_add(1);
 	return 0;
 }
 
@@ -1114,8 +1178,10 @@ log_content_file_spec_closecb(void *fh, UNUSED unsigned long ctl)
 
 	if (ctx->u.spec.filename)
 		free(ctx->u.spec.filename);
-	if (ctx->u.spec.fd != -1)
+	if (ctx->u.spec.fd != -1) {
 		close(ctx->u.spec.fd);
+		sys_fd_count_add(-1);
+	}
 	free(ctx);
 }
 
@@ -1133,6 +1199,14 @@ log_content_file_spec_writecb(UNUSED int level, void *fh, UNUSED unsigned long c
 	return sz;
 }
 
+static int
+log_content_file_spec_fdcb(void *fh)
+{
+	log_content_file_ctx_t *ctx = fh;
+
+	return ctx->u.spec.fd;
+}
+
 static int content_file_single_fd = -1;
 static char *content_file_single_fn = NULL;
 
@@ -1211,6 +1285,16 @@ log_content_file_single_writecb(UNUSED int level, void *fh, UNUSED unsigned long
 	return sz;
 }
 
+/*
+ * All connections share the single content log file, so writes for
+ * different connections are coalesced too.
+ */
+static int
+log_content_file_single_fdcb(UNUSED void *fh)
+{
+	return content_file_single_fd;
+}
+
 static logbuf_t *
 log_content_file_single_prepcb(void *fh, unsigned long prepflags,
                                logbuf_t *lb)
@@ -1293,7 +1377,7 @@ log_content_pcap_preinit(const char *pcapfile)
 		               pcapfile, strerror(errno), errno);
 		return -1;
 	}
-	if (logpkt_pcap_open_fd(content_pcap_fd) == -1) {
+	if (logpkt_pcap_open_fd(content_pcap_fd, content_pcap_format) == -1) {
 		log_err_level_printf(LOG_CRIT, "Failed to prepare '%s' for PCAP writing"
 		               ": %s (%i)\n",
 		               pcapfile, strerror(errno), errno);
@@ -1334,7 +1418,7 @@ log_content_pcap_reopencb(void) {
 		               content_pcap_fn, strerror(errno), errno);
 		return -1;
 	}
-	if (logpkt_pcap_open_fd(content_pcap_fd) == -1) {
+	if (logpkt_pcap_open_fd(content_pcap_fd, content_pcap_format) == -1) {
 		log_err_level_printf(LOG_CRIT, "Failed to prepare '%s' for PCAP writing"
 		               ": %s (%i)\n",
 		               content_pcap_fn, strerror(errno), errno);
@@ -1345,13 +1429,85 @@ log_content_pcap_reopencb(void) {
 	return 0;
 }
 
+/*
+ * In dir and spec modes, the records of a connection stay buffered across
+ * writes.  Contexts with buffered records are kept in a list per shard,
+ * which is flushed when the writer thread of the shard runs out of work,
+ * and walked every second while it is busy, to flush the contexts of
+ * connections which have not written for a while.
+ * Single file mode flushes after every write instead, so that the records of
+ * different connections are not reordered in the shared file.
+ */
+static void
+log_content_pcap_dirty_add(log_content_pcap_ctx_t *ctx)
+{
+	log_content_pcap_ctx_t **head = &content_pcap_dirty[ctx->shard];
+
+	if (ctx->dirty_prev || ctx->state.wlen == 0)
+		return;
+	ctx->dirty_next = *head;
+	if (*head)
+		(*head)->dirty_prev = &ctx->dirty_next;
+	ctx->dirty_prev = head;
+	*head = ctx;
+}
+
+static void
+log_content_pcap_dirty_remove(log_content_pcap_ctx_t *ctx)
+{
+	if (!ctx->dirty_prev)
+		return;
+	*ctx->dirty_prev = ctx->dirty_next;
+	if (ctx->dirty_next)
+		ctx->dirty_next->dirty_prev = ctx->dirty_prev;
+	ctx->dirty_next = NULL;
+	ctx->dirty_prev = NULL;
+}
+
+static void
+log_content_pcap_idlecb(unsigned int shard)
+{
+	log_content_pcap_ctx_t *ctx;
+
+	while ((ctx = content_pcap_dirty[shard])) {
+		log_content_pcap_dirty_remove(ctx);
+		/* u.dir.fd and u.spec.fd share their location */
+		if (logpkt_pcap_flush(&ctx->state, ctx->u.dir.fd) == -1) {
+			log_err_level_printf(LOG_CRIT, "Failed to write to pcap log: %s (%i)\n",
+			               strerror(errno), errno);
+		}
+	}
+}
+
+static void
+log_content_pcap_tickcb(unsigned int shard)
+{
+	log_content_pcap_ctx_t *ctx, *next;
+	time_t now = time(NULL);
+	int rv;
+
+	for (ctx = content_pcap_dirty[shard]; ctx; ctx = next) {
+		next = ctx->dirty_next;
+		/* u.dir.fd and u.spec.fd share their location */
+		rv = logpkt_pcap_flush_expired(&ctx->state, ctx->u.dir.fd, now);
+		if (rv == -1) {
+			log_err_level_printf(LOG_CRIT, "Failed to write to pcap log: %s (%i)\n",
+			               strerror(errno), errno);
+		}
+		if (rv != 0)
+			log_content_pcap_dirty_remove(ctx);
+	}
+}
+
 static void
 log_content_pcap_closecb_base(void *fh, unsigned long ctl, int fd) {
 	log_content_pcap_ctx_t *ctx = fh;
 	int direction = (ctl & LBFLAG_IS_REQ) ? LOGPKT_REQUEST
 	                                      : LOGPKT_RESPONSE;
 
+	log_content_pcap_dirty_remove(ctx);
 	logpkt_write_close(&ctx->state, fd, direction);
+	logpkt_ctx_fini(&ctx->state);
 }
 
 static void
@@ -1381,7 +1537,21 @@ errout:
 static ssize_t
 log_content_pcap_writecb(UNUSED int level, void *fh, unsigned long ctl,
                          const void *buf, size_t sz) {
-	return log_content_pcap_writecb_base(fh, ctl, buf, sz, content_pcap_fd);
+	log_content_pcap_ctx_t *ctx = fh;
+	ssize_t rv;
+
+	rv = log_content_pcap_writecb_base(fh, ctl, buf, sz, content_pcap_fd);
+	if (logpkt_pcap_flush(&ctx->state, content_pcap_fd) == -1)
+		return -1;
+	return rv;
+}
+
+static unsigned int *
+log_content_pcap_shardcb(void *fh)
+{
+	log_content_pcap_ctx_t *ctx = fh;
+
+	return &ctx->shard;
 }
 
 static int
@@ -1396,7 +1566,8 @@ log_content_pcap_dir_opencb(void *fh)
 		               ctx->u.dir.filename, strerror(errno), errno);
 		return -1;
 	}
-	return logpkt_pcap_open_fd(ctx->u.dir.fd);
+	sys_fd_count_add(1);
+	return logpkt_pcap_open_fd(ctx->u.dir.fd, content_pcap_format);
 }
 
 static void
@@ -1406,8 +1577,10 @@ log_content_pcap_dir_closecb(void *fh, unsigned long ctl)
 	log_content_pcap_closecb_base(fh, ctl, ctx->u.dir.fd);
 	if (ctx->u.dir.filename)
 		free(ctx->u.dir.filename);
-	if (ctx->u.dir.fd != -1)
+	if (ctx->u.dir.fd != -1) {
 		close(ctx->u.dir.fd);
+		sys_fd_count_add(-1);
+	}
 	free(ctx);
 }
 
@@ -1416,7 +1589,11 @@ log_content_pcap_dir_writecb(UNUSED int level, void *fh, unsigned long ctl,
                              const void *buf, size_t sz)
 {
 	log_content_pcap_ctx_t *ctx = fh;
-	return log_content_pcap_writecb_base(fh, ctl, buf, sz, ctx->u.dir.fd);
+	ssize_t rv;
+
+	rv = log_content_pcap_writecb_base(fh, ctl, buf, sz, ctx->u.dir.fd);
+	log_content_pcap_dirty_add(ctx);
+	return rv;
 }
 
 static int
@@ -1431,7 +1608,8 @@ log_content_pcap_spec_opencb(void *fh)
 		               ctx->u.spec.filename, strerror(errno), errno);
 		return -1;
 	}
-	return logpkt_pcap_open_fd(ctx->u.spec.fd);
+	sys_fd_count_add(1);
+	return logpkt_pcap_open_fd(ctx->u.spec.fd, content_pcap_format);
 }
 
 static void
@@ -1441,8 +1619,10 @@ log_content_pcap_spec_closecb(void *fh, unsigned long ctl)
 	log_content_pcap_closecb_base(fh, ctl, ctx->u.spec.fd);
 	if (ctx->u.spec.filename)
 		free(ctx->u.spec.filename);
-	if (ctx->u.spec.fd != -1)
+	if (ctx->u.spec.fd != -1) {
 		close(ctx->u.spec.fd);
+		sys_fd_count_add(-1);
+	}
 	free(ctx);
 }
 
@@ -1451,7 +1631,11 @@ log_content_pcap_spec_writecb(UNUSED int level, void *fh, unsigned long ctl,
                               const void *buf, size_t sz)
 {
 	log_content_pcap_ctx_t *ctx = fh;
-	return log_content_pcap_writecb_base(fh, ctl, buf, sz, ctx->u.spec.fd);
+	ssize_t rv;
+
+	rv = log_content_pcap_writecb_base(fh, ctl, buf, sz, ctx->u.spec.fd);
+	log_content_pcap_dirty_add(ctx);
+	return rv;
 }
 
 static logbuf_t *
@@ -1517,6 +1701,7 @@ log_content_mirror_closecb(void *fh, unsigned long ctl) {
 	                                      : LOGPKT_RESPONSE;
 
 	logpkt_write_close(&ctx->state, -1, direction);
+	logpkt_ctx_fini(&ctx->state);
 	free(ctx);
 }
 
@@ -1605,6 +1790,56 @@ log_cert_writecb(UNUSED int level, void *fh, UNUSED unsigned long ctl,
  * Initialization and destruction.
  */
 
+/*
+ * Print the queue and writer statistics of one logger and reset them.
+ * Sh is the number of writer threads, the other values are summed up or
+ * maxed over them.  Queue depth qd is a snapshot, mqd the maximum depth seen
+ * by the writer thread, rec/bat/mbat the records, batches and maximum batch
+ * size it drained, and wv the number of writev() calls coalesced writes took.
+ * Full is the number of submissions which found the queue full.
+ */
+static void
+log_stats_logger(const char *name, logger_t *logger, unsigned int stats_id)
+{
+	logger_stats_t ls;
+	char *smsg;
+
+	logger_get_stats(logger, &ls);
+	if (asprintf(&smsg, "STATS: logger: name=%s, sh=%u, qd=%zu, mqd=%zu, rec=%zu, bat=%zu, mbat=%zu, wv=%zu, wb=%zu, full=%zu, si=%u\n",
+			name, ls.shards, ls.queue.depth, ls.queue.max_depth, ls.queue.items, ls.queue.batches, ls.queue.max_batch,
+			ls.writevs, ls.bytes, ls.queue.full, stats_id) < 0) {
+		return;
+	}
+	if (log_stats(smsg) == -1) {
+		log_err_level_printf(LOG_WARNING, "Stats logging failed\n");
+	}
+	free(smsg);
+}
+
+/*
+ * Print the statistics of all active loggers.
+ */
+void
+log_stats_loggers(unsigned int stats_id)
+{
+	if (connect_log)
+		log_stats_logger("connect", connect_log, stats_id);
+	if (content_file_log)
+		log_stats_logger("content", content_file_log, stats_id);
+	if (content_pcap_log)
+		log_stats_logger("pcap", content_pcap_log, stats_id);
+#ifndef WITHOUT_MIRROR
+	if (content_mirror_log)
+		log_stats_logger("mirror", content_mirror_log, stats_id);
+#endif /* !WITHOUT_MIRROR */
+	if (masterkey_log)
+		log_stats_logger("masterkey", masterkey_log, stats_id);
+	if (cert_log)
+		log_stats_logger("cert", cert_log, stats_id);
+	if (err_log)
+		log_stats_logger("err", err_log, stats_id);
+}
+
 /*
  * Log pre-init: open all log files but don't start any threads, since we may
  * fork() after pre-initialization.
@@ -1618,6 +1853,7 @@ log_preinit(global_t *global)
 	logger_close_func_t closecb;
 	logger_write_func_t writecb;
 	logger_prep_func_t prepcb;
+	logger_fd_func_t fdcb;
 
 	if (global->contentlog) {
 		if (global->contentlog_isdir) {
@@ -1626,12 +1862,14 @@ log_preinit(global_t *global)
 			closecb = log_content_file_dir_closecb;
 			writecb = log_content_file_dir_writecb;
 			prepcb = NULL;
+			fdcb = log_content_file_dir_fdcb;
 		} else if (global->contentlog_isspec) {
 			reopencb = NULL;
 			opencb = log_content_file_spec_opencb;
 			closecb = log_content_file_spec_closecb;
 			writecb = log_content_file_spec_writecb;
 			prepcb = NULL;
+			fdcb = log_content_file_spec_fdcb;
 		} else {
 			if (log_content_file_single_preinit(global->contentlog) == -1)
 				goto out;
@@ -1640,6 +1878,7 @@ log_preinit(global_t *global)
 			closecb = log_content_file_single_closecb;
 			writecb = log_content_file_single_writecb;
 			prepcb = log_content_file_single_prepcb;
+			fdcb = log_content_file_single_fdcb;
 		}
 		if (!(content_file_log = logger_new(reopencb, opencb, closecb,
 		                                    writecb, prepcb,
@@ -1647,8 +1886,15 @@ log_preinit(global_t *global)
 			log_content_file_single_fini();
 			goto out;
 		}
+		logger_set_fd_func(content_file_log, fdcb, "content");
+		if (global->contentlog_isdir || global->contentlog_isspec)
+			logger_set_shards(content_file_log,
+			                  global->contentlog_threads,
+			                  log_content_file_shardcb);
 	}
 	if (global->pcaplog) {
+		content_pcap_format = global->pcaplog_format == PCAPLOG_FORMAT_PCAPNG
+		                      ? LOGPKT_FORMAT_PCAPNG : LOGPKT_FORMAT_PCAP;
 		if (log_content_pcap_preinit((global->pcaplog_isdir ||
 		                              global->pcaplog_isspec) ?
 		                              NULL :
@@ -1679,6 +1925,15 @@ log_preinit(global_t *global)
 			log_content_pcap_fini();
 			goto out;
 		}
+		if (global->pcaplog_isdir || global->pcaplog_isspec) {
+			logger_set_shards(content_pcap_log,
+			                  global->contentlog_threads,
+			                  log_content_pcap_shardcb);
+			logger_set_idle_func(content_pcap_log,
+			                     log_content_pcap_idlecb);
+			logger_set_tick_func(content_pcap_log,
+			                     log_content_pcap_tickcb, 1);
+		}
 	}
 #ifndef WITHOUT_MIRROR
 	if (global->mirrorif) {
@@ -1703,11 +1958,13 @@ log_preinit(global_t *global)
 			goto out;
 		if (!(connect_log = logger_new(log_connect_reopencb,
 		                               NULL, NULL,
-		                               log_connect_writecb, NULL,
+		                               log_connect_writecb,
+		                               log_connect_prepcb,
 		                               log_exceptcb))) {
 			log_connect_fini();
 			goto out;
 		}
+		logger_set_fd_func(connect_log, log_connect_fdcb, "connect");
 	}
 	if (global->masterkeylog) {
 		if (log_masterkey_preinit(global->masterkeylog) == -1)
@@ -1719,6 +1976,7 @@ log_preinit(global_t *global)
 			log_masterkey_fini();
 			goto out;
 		}
+		logger_set_fd_func(masterkey_log, log_masterkey_fdcb, "masterkey");
 	}
 	if (global->certgendir) {
 		if (!(cert_log = logger_new(NULL, NULL, NULL, log_cert_writecb,
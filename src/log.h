@@ -132,6 +132,7 @@ extern logger_t *connect_log;
 
 int log_stats(const char *);
 int log_conn(const char *);
+void log_stats_loggers(unsigned int);
 
 typedef struct log_content_ctx log_content_ctx_t;
 struct log_content_file_ctx;
@@ -36,9 +36,30 @@
 /*
  * Dynamic log buffer with zero-copy chaining, generic void * file handle
  * and ctl for status control flags.
- * Logbuf always owns the internal allocated buffer.
+ * Logbuf owns the internal allocated buffer, unless the buffer is shared,
+ * in which case the last logbuf referencing the buffer frees it.
  */
 
+/*
+ * Reference counted read-only buffer shared by logbufs queued to different
+ * loggers, e.g. the same content submitted to the file, pcap and mirror
+ * loggers.  The data follows the header in the same allocation.
+ */
+struct logbuf_shared {
+	size_t refs;
+};
+
+static void
+logbuf_buf_free(logbuf_t *lb)
+{
+	if (lb->shared) {
+		if (__atomic_sub_fetch(&lb->shared->refs, 1, __ATOMIC_ACQ_REL) == 0)
+			free(lb->shared);
+	} else if (lb->buf) {
+		free(lb->buf);
+	}
+}
+
 /*
  * Create new logbuf from provided, pre-allocated buffer, set fd and next.
  * The provided buffer will be freed by logbuf_free() if non-NULL, and by
@@ -57,6 +78,7 @@ logbuf_new(int level, void *buf, size_t sz, logbuf_t *next)
 	lb->prio = level;
 	lb->buf = buf;
 	lb->sz = sz;
+	lb->shared = NULL;
 	if (next) {
 		lb->fh = next->fh;
 		lb->ctl = next->ctl;
@@ -84,6 +106,7 @@ logbuf_new_alloc(size_t sz, logbuf_t *next)
 		return NULL;
 	}
 	lb->sz = sz;
+	lb->shared = NULL;
 	if (next) {
 		lb->fh = next->fh;
 		lb->ctl = next->ctl;
@@ -112,6 +135,38 @@ logbuf_new_copy(const void *buf, size_t sz, logbuf_t *next)
 	}
 	memcpy(lb->buf, buf, sz);
 	lb->sz = sz;
+	lb->shared = NULL;
+	if (next) {
+		lb->fh = next->fh;
+		lb->ctl = next->ctl;
+		lb->next = next;
+	} else {
+		lb->fh = NULL;
+		lb->ctl = 0;
+		lb->next = NULL;
+	}
+	return lb;
+}
+
+/*
+ * Create new logbuf, allocating sz bytes into a shared internal buffer,
+ * which can be referenced by other logbufs using logbuf_new_ref() instead of
+ * copying it.  The buffer must not be modified once it is referenced.
+ */
+logbuf_t *
+logbuf_new_shared(size_t sz, logbuf_t *next)
+{
+	logbuf_t *lb;
+
+	if (!(lb = malloc(sizeof(logbuf_t))))
+		return NULL;
+	if (!(lb->shared = malloc(sizeof(struct logbuf_shared) + sz))) {
+		free(lb);
+		return NULL;
+	}
+	lb->shared->refs = 1;
+	lb->buf = (unsigned char *)(lb->shared + 1);
+	lb->sz = sz;
 	if (next) {
 		lb->fh = next->fh;
 		lb->ctl = next->ctl;
@@ -124,6 +179,44 @@ logbuf_new_copy(const void *buf, size_t sz, logbuf_t *next)
 	return lb;
 }
 
+/*
+ * Create new logbuf from lb, referencing the shared buffers of lb without
+ * copying them, and copying the buffers which are not shared.
+ */
+logbuf_t *
+logbuf_new_ref(logbuf_t *lb)
+{
+	logbuf_t *lbnew;
+
+	if (!lb)
+		return NULL;
+
+	if (!lb->shared) {
+		lbnew = logbuf_new_copy(lb->buf, lb->sz, NULL);
+		if (!lbnew)
+			return NULL;
+	} else {
+		if (!(lbnew = malloc(sizeof(logbuf_t))))
+			return NULL;
+		__atomic_add_fetch(&lb->shared->refs, 1, __ATOMIC_RELAXED);
+		lbnew->shared = lb->shared;
+		lbnew->buf = lb->buf;
+		lbnew->sz = lb->sz;
+		lbnew->next = NULL;
+	}
+	lbnew->prio = lb->prio;
+	lbnew->fh = lb->fh;
+	lbnew->ctl = lb->ctl;
+	if (lb->next) {
+		lbnew->next = logbuf_new_ref(lb->next);
+		if (!lbnew->next) {
+			logbuf_free(lbnew);
+			return NULL;
+		}
+	}
+	return lbnew;
+}
+
 /*
  * Create new logbuf using printf.
  */
@@ -142,6 +235,7 @@ logbuf_new_printf(logbuf_t *next, const char *fmt, ...)
 		free(lb);
 		return NULL;
 	}
+	lb->shared = NULL;
 	if (next) {
 		lb->fh = next->fh;
 		lb->ctl = next->ctl;
@@ -199,9 +293,18 @@ logbuf_make_contiguous(logbuf_t *lb) {
 		return NULL;
 	if (!lb->next)
 		return lb;
-	p = realloc(lb->buf, logbuf_size(lb));
-	if (!p)
-		return NULL;
+	if (lb->shared) {
+		/* shared buffers are read-only, move the data to a private one */
+		if (!(p = malloc(logbuf_size(lb))))
+			return NULL;
+		memcpy(p, lb->buf, lb->sz);
+		logbuf_buf_free(lb);
+		lb->shared = NULL;
+	} else {
+		p = realloc(lb->buf, logbuf_size(lb));
+		if (!p)
+			return NULL;
+	}
 	lb->buf = p;
 	lbtmp = lb;
 	p += lbtmp->sz;
@@ -240,9 +343,7 @@ logbuf_write_free(logbuf_t *lb, writefunc_t writefunc)
 {
 	ssize_t rv1, rv2 = 0;
 	rv1 = writefunc(lb->prio, lb->fh, lb->ctl, lb->buf, lb->sz);
-	if (lb->buf) {
-		free(lb->buf);
-	}
+	logbuf_buf_free(lb);
 	if (lb->next) {
 		if (rv1 == -1) {
 			logbuf_free(lb->next);
@@ -264,9 +365,7 @@ logbuf_write_free(logbuf_t *lb, writefunc_t writefunc)
 void
 logbuf_free(logbuf_t *lb)
 {
-	if (lb->buf) {
-		free(lb->buf);
-	}
+	logbuf_buf_free(lb);
 	if (lb->next) {
 		logbuf_free(lb->next);
 	}
@@ -34,6 +34,8 @@
 #include <stdlib.h>
 #include <unistd.h>
 
+struct logbuf_shared;
+
 typedef struct logbuf {
 	int prio;
 	unsigned char *buf;
@@ -41,6 +43,8 @@ typedef struct logbuf {
 	void *fh;
 	unsigned long ctl;
 	struct logbuf *next;
+	// Reference counted owner of buf, if buf is shared between logbufs
+	struct logbuf_shared *shared;
 } logbuf_t;
 
 typedef ssize_t (*writefunc_t)(int, void *, unsigned long, const void *, size_t);
@@ -48,6 +52,8 @@ typedef ssize_t (*writefunc_t)(int, void *, unsigned long, const void *, size_t)
 logbuf_t * logbuf_new(int, void *, size_t, logbuf_t *) MALLOC;
 logbuf_t * logbuf_new_alloc(size_t, logbuf_t *) MALLOC;
 logbuf_t * logbuf_new_copy(const void *, size_t, logbuf_t *) MALLOC;
+logbuf_t * logbuf_new_shared(size_t, logbuf_t *) MALLOC;
+logbuf_t * logbuf_new_ref(logbuf_t *) MALLOC;
 logbuf_t * logbuf_new_printf(logbuf_t *, const char *, ...) MALLOC PRINTF(2,3);
 logbuf_t * logbuf_new_deepcopy(logbuf_t *, int) MALLOC;
 logbuf_t * logbuf_make_contiguous(logbuf_t *) WUNRES;
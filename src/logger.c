@@ -27,33 +27,84 @@
  */
 
 #include "logger.h"
+#include "log.h"
 
 #include "thrqueue.h"
 #include "logbuf.h"
 
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/uio.h>
 
 /*
  * Logger for multithreaded environments.  Disk writes are executed in a
  * writer thread.  Logging threads submit buffers to be logged by adding
- * them to the thrqueue.  Logging threads may block on the pthread mutex
- * of the thrqueue, but not on disk writes.
+ * them to the lock-free thrqueue.  Logging threads only block if the queue
+ * is full, never on disk writes.
+ *
+ * A logger can have several writer threads, called shards, each with its own
+ * queue.  Every file handle is pinned to one shard when it is opened, so all
+ * buffers and events for a file handle are still processed in submission
+ * order by the same thread.
+ *
+ * Writer threads drain their queue in batches.  For loggers with an fd
+ * callback, consecutive buffers going to the same file descriptor are
+ * coalesced into a single writev() instead of one write() per buffer.
  */
 
-struct logger {
+#define LOGGER_QUEUE_SIZE 8192
+#define LOGGER_BATCH_SIZE 256
+#if defined(IOV_MAX) && IOV_MAX < 512
+#define LOGGER_IOV_SIZE IOV_MAX
+#else /* !IOV_MAX || IOV_MAX >= 512 */
+#define LOGGER_IOV_SIZE 512
+#endif /* !IOV_MAX || IOV_MAX >= 512 */
+
+typedef struct logger_shard {
 	pthread_t thr;
+	thrqueue_t *queue;
+	logger_t *logger;
+
+	/* Written by the writer thread only */
+	size_t writevs;
+	size_t bytes;
+} logger_shard_t;
+
+struct logger {
 	logger_reopen_func_t reopen;
 	logger_open_func_t open;
 	logger_close_func_t close;
 	logger_prep_func_t prep;
 	logger_write_func_t write;
 	logger_except_func_t except;
-	thrqueue_t *queue;
+	logger_fd_func_t fd;
+	logger_idle_func_t idle;
+	logger_tick_func_t tick;
+	unsigned int tick_secs;
+	logger_shard_func_t shard;
+	const char *name;
+	unsigned int nshards;
+	logger_shard_t *shards;
 };
 
+/*
+ * Pending writev() of the writer thread: iovecs of all data buffers
+ * coalesced so far, all going to fd, and the buffers to free afterwards.
+ */
+typedef struct logger_iov {
+	int fd;
+	int cnt;
+	struct iovec iov[LOGGER_IOV_SIZE];
+	logbuf_t *pending;
+	logbuf_t **tail;
+} logger_iov_t;
+
 static void
 logger_clear(logger_t *logger)
 {
@@ -92,18 +143,123 @@ logger_new(logger_reopen_func_t reopenfunc, logger_open_func_t openfunc,
 	logger->write = writefunc;
 	logger->prep = prepfunc;
 	logger->except = exceptfunc;
-	logger->queue = NULL;
+	logger->nshards = 1;
 	return logger;
 }
 
+/*
+ * Set the fd callback returning the file descriptor a buffer for fh is to
+ * be written to, or -1 to fall back to the write callback for that buffer.
+ * Setting an fd callback enables coalescing of writes in the writer thread;
+ * the write callback is then only used for buffers without an fd.
+ * The fd callback is executed in the logger's writer thread, and the
+ * returned fd must stay open until the next open, close or reopen event.
+ * Name is the log name in error messages about failed coalesced writes,
+ * which the write callback reports itself otherwise.
+ * Must be called before logger_start().
+ */
+void
+logger_set_fd_func(logger_t *logger, logger_fd_func_t fdfunc, const char *name)
+{
+	logger->fd = fdfunc;
+	logger->name = name;
+}
+
+/*
+ * Set the idle callback, which is called by a writer thread with its shard
+ * number whenever it has drained its queue and is about to wait for more,
+ * and once more before it exits.  Loggers holding back writes can use it
+ * to write them out while there is nothing else to do.
+ * Must be called before logger_start().
+ */
+void
+logger_set_idle_func(logger_t *logger, logger_idle_func_t idlefunc)
+{
+	logger->idle = idlefunc;
+}
+
+/*
+ * Set the tick callback, which is called by a writer thread with its shard
+ * number about every secs seconds while its queue does not drain, so that the
+ * idle callback is not called.  Loggers holding back writes can use it to
+ * write out those which have waited too long on a busy shard.
+ * Must be called before logger_start().
+ */
+void
+logger_set_tick_func(logger_t *logger, logger_tick_func_t tickfunc,
+                     unsigned int secs)
+{
+	logger->tick = tickfunc;
+	logger->tick_secs = secs;
+}
+
+/*
+ * Use n writer threads instead of one.  Shardfunc returns a pointer to
+ * per file handle storage for the shard number, which the logger sets in
+ * logger_open() and reads on every later submission for the file handle.
+ * Buffers and events for a NULL file handle, including reopen events, are
+ * processed by the first shard.  All callbacks may thus be called from
+ * several writer threads concurrently, for different file handles.
+ * Must be called before logger_start().
+ */
+void
+logger_set_shards(logger_t *logger, unsigned int n,
+                  logger_shard_func_t shardfunc)
+{
+	logger->nshards = n > 0 ? n : 1;
+	logger->shard = shardfunc;
+}
+
+/*
+ * Return the queue of the shard fh is pinned to.
+ */
+static thrqueue_t *
+logger_queue(logger_t *logger, void *fh)
+{
+	if (logger->nshards == 1 || !fh)
+		return logger->shards[0].queue;
+	return logger->shards[*logger->shard(fh) % logger->nshards].queue;
+}
+
+/*
+ * Pin a newly opened fh to a shard.  Two candidate shards are derived from
+ * a hash of the file handle and the one with the shorter queue is chosen,
+ * which spreads connections evenly over the shards and steers new ones
+ * away from shards busy with a heavy writer.
+ */
+static void
+logger_pin(logger_t *logger, void *fh)
+{
+	uint32_t h;
+	unsigned int a, b;
+
+	if (logger->nshards == 1)
+		return;
+	h = (uint32_t)((uintptr_t)fh >> 4) * 2654435761U;
+	a = (h >> 16) % logger->nshards;
+	b = (h & 0xFFFF) % logger->nshards;
+	if (b == a)
+		b = (a + 1) % logger->nshards;
+	if (thrqueue_depth(logger->shards[b].queue) <
+	    thrqueue_depth(logger->shards[a].queue))
+		a = b;
+	*logger->shard(fh) = a;
+}
+
 /*
  * Free the logger data structures.  Caller must call logger_stop()
  * or logger_leave() and logger_join() prior to freeing.
  */
 void
 logger_free(logger_t *logger) {
-	if (logger->queue) {
-		thrqueue_free(logger->queue);
+	unsigned int i;
+
+	if (logger->shards) {
+		for (i = 0; i < logger->nshards; i++) {
+			if (logger->shards[i].queue)
+				thrqueue_free(logger->shards[i].queue);
+		}
+		free(logger->shards);
 	}
 	free(logger);
 }
@@ -129,7 +285,7 @@ logger_submit(logger_t *logger, void *fh, unsigned long prepflags,
 	 * with an actual log buffer, stop here. */
 	if (!lb)
 		return 0;
-	if (thrqueue_enqueue(logger->queue, lb)) {
+	if (thrqueue_enqueue(logger_queue(logger, lb->fh), lb)) {
 		return 0;
 	} else {
 		logbuf_free(lb);
@@ -151,7 +307,7 @@ logger_reopen(logger_t *logger)
 	if (!(lb = logbuf_new(0, NULL, 0, NULL)))
 		return -1;
 	logbuf_ctl_set(lb, LBFLAG_REOPEN);
-	return thrqueue_enqueue(logger->queue, lb) ? 0 : -1;
+	return thrqueue_enqueue(logger->shards[0].queue, lb) ? 0 : -1;
 }
 
 /*
@@ -165,6 +321,7 @@ logger_open(logger_t *logger, void *fh)
 {
 	logbuf_t *lb;
 
+	logger_pin(logger, fh);
 	if (!logger->open)
 		return 0;
 
@@ -172,7 +329,7 @@ logger_open(logger_t *logger, void *fh)
 		return -1;
 	lb->fh = fh;
 	logbuf_ctl_set(lb, LBFLAG_OPEN);
-	return thrqueue_enqueue(logger->queue, lb) ? 0 : -1;
+	return thrqueue_enqueue(logger_queue(logger, fh), lb) ? 0 : -1;
 }
 
 /*
@@ -193,7 +350,111 @@ logger_close(logger_t *logger, void *fh, unsigned long ctl)
 	lb->fh = fh;
 	lb->ctl = ctl;
 	logbuf_ctl_set(lb, LBFLAG_CLOSE);
-	return thrqueue_enqueue(logger->queue, lb) ? 0 : -1;
+	return thrqueue_enqueue(logger_queue(logger, fh), lb) ? 0 : -1;
+}
+
+/*
+ * Write all of iov to fd, retrying on short writes and EINTR.
+ * Modifies iov.  Returns 0 on success, -1 on error, with errno set for the
+ * except callback.
+ */
+static int
+logger_writev_all(logger_shard_t *shard, int fd, struct iovec *iov, int cnt)
+{
+	ssize_t n;
+	int e;
+
+	while (cnt > 0) {
+		n = writev(fd, iov, cnt);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			e = errno;
+			log_err_level_printf(LOG_CRIT, "Failed to write to %s log"
+			               " (fd=%d): %s (%i)\n",
+			               shard->logger->name, fd, strerror(e), e);
+			errno = e;
+			return -1;
+		}
+		__atomic_add_fetch(&shard->bytes, n, __ATOMIC_RELAXED);
+		while (cnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Write out and free all buffers coalesced in wv so far.
+ * Returns 0 on success, -1 on error.
+ */
+static int
+logger_flush(logger_shard_t *shard, logger_iov_t *wv)
+{
+	logbuf_t *lb, *next;
+	int rv = 0;
+
+	if (wv->cnt > 0) {
+		rv = logger_writev_all(shard, wv->fd, wv->iov, wv->cnt);
+		__atomic_add_fetch(&shard->writevs, 1, __ATOMIC_RELAXED);
+	}
+	for (lb = wv->pending; lb; lb = next) {
+		next = lb->next;
+		lb->next = NULL;
+		logbuf_free(lb);
+	}
+	wv->fd = -1;
+	wv->cnt = 0;
+	wv->pending = NULL;
+	wv->tail = &wv->pending;
+	return rv;
+}
+
+/*
+ * Add the buffer chain lb to the pending writev() to fd, flushing first if
+ * fd differs or if there is not enough room left.  Takes ownership of lb.
+ * Returns 0 on success, -1 on error.
+ */
+static int
+logger_coalesce(logger_shard_t *shard, logger_iov_t *wv, int fd, logbuf_t *lb)
+{
+	logbuf_t *p;
+	int n = 0, rv = 0;
+
+	for (p = lb; p; p = p->next) {
+		if (p->sz > 0)
+			n++;
+	}
+	if (wv->cnt > 0 && (fd != wv->fd || wv->cnt + n > LOGGER_IOV_SIZE))
+		rv = logger_flush(shard, wv);
+	wv->fd = fd;
+	for (p = lb; p; p = p->next) {
+		if (p->sz <= 0)
+			continue;
+		if (wv->cnt == LOGGER_IOV_SIZE) {
+			/* only possible for chains longer than the iov */
+			if (logger_writev_all(shard, wv->fd, wv->iov,
+			                      wv->cnt) == -1)
+				rv = -1;
+			__atomic_add_fetch(&shard->writevs, 1,
+			                   __ATOMIC_RELAXED);
+			wv->cnt = 0;
+		}
+		wv->iov[wv->cnt].iov_base = p->buf;
+		wv->iov[wv->cnt].iov_len = p->sz;
+		wv->cnt++;
+	}
+	/* append the whole chain to the pending list */
+	*wv->tail = lb;
+	for (p = lb; p->next; p = p->next);
+	wv->tail = &p->next;
+	return rv;
 }
 
 /*
@@ -202,61 +463,165 @@ logger_close(logger_t *logger, void *fh, unsigned long ctl)
 static void *
 logger_thread(void *arg)
 {
-	logger_t *logger = arg;
+	logger_shard_t *shard = arg;
+	logger_t *logger = shard->logger;
+	void *batch[LOGGER_BATCH_SIZE];
+	logger_iov_t *wv;
 	logbuf_t *lb;
-	int e = 0;
-
-	while ((lb = thrqueue_dequeue(logger->queue))) {
-		if (logbuf_ctl_isset(lb, LBFLAG_REOPEN)) {
-			if (logger->reopen() != 0)
-				e = 1;
-			logbuf_free(lb);
-		} else if (logbuf_ctl_isset(lb, LBFLAG_OPEN)) {
-			if (logger->open(lb->fh) != 0)
-				e = 1;
-			logbuf_free(lb);
-		} else if (logbuf_ctl_isset(lb, LBFLAG_CLOSE)) {
-			logger->close(lb->fh, lb->ctl);
-			logbuf_free(lb);
-		} else {
-			if (logbuf_write_free(lb, logger->write) < 0)
-				e = 1;
-		}
+	size_t i, n;
+	int fd, e = 0;
+	struct timespec now;
+	time_t tick = 0;
 
-		if (e && logger->except) {
+	if (!(wv = malloc(sizeof(logger_iov_t)))) {
+		if (logger->except)
 			logger->except();
+		return NULL;
+	}
+	wv->pending = NULL;
+	wv->tail = &wv->pending;
+	wv->cnt = 0;
+	wv->fd = -1;
+
+	while ((n = thrqueue_dequeue_batch(shard->queue, batch,
+	                                   LOGGER_BATCH_SIZE))) {
+		for (i = 0; i < n; i++) {
+			lb = batch[i];
+			if (logbuf_ctl_isset(lb, LBFLAG_REOPEN)) {
+				if (logger_flush(shard, wv) != 0)
+					e = 1;
+				if (logger->reopen() != 0)
+					e = 1;
+				logbuf_free(lb);
+			} else if (logbuf_ctl_isset(lb, LBFLAG_OPEN)) {
+				if (logger_flush(shard, wv) != 0)
+					e = 1;
+				if (logger->open(lb->fh) != 0)
+					e = 1;
+				logbuf_free(lb);
+			} else if (logbuf_ctl_isset(lb, LBFLAG_CLOSE)) {
+				if (logger_flush(shard, wv) != 0)
+					e = 1;
+				logger->close(lb->fh, lb->ctl);
+				logbuf_free(lb);
+			} else if (logger->fd &&
+			           (fd = logger->fd(lb->fh)) != -1) {
+				if (logger_coalesce(shard, wv, fd, lb) != 0)
+					e = 1;
+			} else {
+				if (logger_flush(shard, wv) != 0)
+					e = 1;
+				if (logbuf_write_free(lb, logger->write) < 0)
+					e = 1;
+			}
+
+			if (e && logger->except) {
+				logger->except();
+			}
+		}
+		if (logger_flush(shard, wv) != 0) {
+			e = 1;
+			if (logger->except)
+				logger->except();
+		}
+		if (logger->idle && thrqueue_depth(shard->queue) == 0) {
+			logger->idle(shard - logger->shards);
+		} else if (logger->tick &&
+		           clock_gettime(CLOCK_MONOTONIC, &now) == 0 &&
+		           now.tv_sec - tick >= logger->tick_secs) {
+			logger->tick(shard - logger->shards);
+			tick = now.tv_sec;
 		}
 	}
+	if (logger->idle)
+		logger->idle(shard - logger->shards);
 
+	free(wv);
 	return NULL;
 }
 
 /*
- * Start the logger's write thread.
+ * Start the logger's write threads.
  */
 int
 logger_start(logger_t *logger) {
+	logger_shard_t *shard;
+	unsigned int i;
 	int rv;
 
-	if (logger->queue) {
-		thrqueue_free(logger->queue);
+	if (!logger->shards) {
+		logger->shards = malloc(logger->nshards *
+		                        sizeof(logger_shard_t));
+		if (!logger->shards)
+			return -1;
+		memset(logger->shards, 0,
+		       logger->nshards * sizeof(logger_shard_t));
+	}
+	for (i = 0; i < logger->nshards; i++) {
+		shard = &logger->shards[i];
+		if (shard->queue) {
+			thrqueue_free(shard->queue);
+		}
+		shard->logger = logger;
+		shard->queue = thrqueue_new(LOGGER_QUEUE_SIZE);
+		if (!shard->queue)
+			return -1;
+
+		rv = pthread_create(&shard->thr, NULL, logger_thread, shard);
+		if (rv)
+			return -1;
 	}
-	logger->queue = thrqueue_new(1024);
-
-	rv = pthread_create(&logger->thr, NULL, logger_thread, logger);
-	if (rv)
-		return -1;
 	sched_yield();
 	return 0;
 }
 
 /*
- * Tell the logger's write thread to write all pending write requests
+ * Copy the logger statistics summed up over all shards into stats and reset
+ * the counters.  May be called from any thread while the logger is running.
+ */
+void
+logger_get_stats(logger_t *logger, logger_stats_t *stats)
+{
+	logger_shard_t *shard;
+	thrqueue_stats_t qs;
+	unsigned int i;
+
+	memset(stats, 0, sizeof(logger_stats_t));
+	if (!logger->shards)
+		return;
+	stats->shards = logger->nshards;
+	for (i = 0; i < logger->nshards; i++) {
+		shard = &logger->shards[i];
+		if (!shard->queue)
+			continue;
+		thrqueue_get_stats(shard->queue, &qs);
+		stats->queue.size += qs.size;
+		stats->queue.depth += qs.depth;
+		stats->queue.full += qs.full;
+		stats->queue.batches += qs.batches;
+		stats->queue.items += qs.items;
+		if (qs.max_depth > stats->queue.max_depth)
+			stats->queue.max_depth = qs.max_depth;
+		if (qs.max_batch > stats->queue.max_batch)
+			stats->queue.max_batch = qs.max_batch;
+		stats->writevs += __atomic_exchange_n(&shard->writevs, 0,
+		                                      __ATOMIC_RELAXED);
+		stats->bytes += __atomic_exchange_n(&shard->bytes, 0,
+		                                    __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Tell the logger's write threads to write all pending write requests
  * and then exit.  Don't wait for the logger to exit.
  */
 void
 logger_leave(logger_t *logger) {
-	thrqueue_unblock_dequeue(logger->queue);
+	unsigned int i;
+
+	for (i = 0; i < logger->nshards; i++) {
+		thrqueue_unblock_dequeue(logger->shards[i].queue);
+	}
 	sched_yield();
 }
 
@@ -265,16 +630,18 @@ logger_leave(logger_t *logger) {
  */
 int
 logger_join(logger_t *logger) {
-	int rv;
+	unsigned int i;
+	int rv = 0;
 
-	rv = pthread_join(logger->thr, NULL);
-	if (rv)
-		return -1;
-	return 0;
+	for (i = 0; i < logger->nshards; i++) {
+		if (pthread_join(logger->shards[i].thr, NULL))
+			rv = -1;
+	}
+	return rv;
 }
 
 /*
- * Tell the logger's write thread to write all pending write requests
+ * Tell the logger's write threads to write all pending write requests
  * and then exit; wait for the logger to exit.
  */
 int
@@ -30,6 +30,7 @@
 #define LOGGER_H
 
 #include "logbuf.h"
+#include "thrqueue.h"
 #include "attrib.h"
 
 #include <unistd.h>
@@ -42,17 +43,35 @@ typedef ssize_t (*logger_write_func_t)(int, void *, unsigned long,
                                        const void *, size_t);
 typedef logbuf_t * (*logger_prep_func_t)(void *, unsigned long, logbuf_t *);
 typedef void (*logger_except_func_t)(void);
+typedef int (*logger_fd_func_t)(void *);
+typedef unsigned int * (*logger_shard_func_t)(void *);
+typedef void (*logger_idle_func_t)(unsigned int);
+typedef void (*logger_tick_func_t)(unsigned int);
 typedef struct logger logger_t;
 
+typedef struct logger_stats {
+	thrqueue_stats_t queue;
+	unsigned int shards;
+	size_t writevs;
+	size_t bytes;
+} logger_stats_t;
+
 logger_t * logger_new(logger_reopen_func_t, logger_open_func_t,
                       logger_close_func_t, logger_write_func_t,
                       logger_prep_func_t, logger_except_func_t)
                       NONNULL(4,6) MALLOC;
+void logger_set_fd_func(logger_t *, logger_fd_func_t, const char *) NONNULL(1,2,3);
+void logger_set_idle_func(logger_t *, logger_idle_func_t) NONNULL(1,2);
+void logger_set_tick_func(logger_t *, logger_tick_func_t,
+                          unsigned int) NONNULL(1,2);
+void logger_set_shards(logger_t *, unsigned int,
+                       logger_shard_func_t) NONNULL(1,3);
 void logger_free(logger_t *) NONNULL(1);
 int logger_start(logger_t *) NONNULL(1) WUNRES;
 void logger_leave(logger_t *) NONNULL(1);
 int logger_join(logger_t *) NONNULL(1);
 int logger_stop(logger_t *) NONNULL(1) WUNRES;
+void logger_get_stats(logger_t *, logger_stats_t *) NONNULL(1,2);
 int logger_reopen(logger_t *) NONNULL(1) WUNRES;
 int logger_open(logger_t *, void *) NONNULL(1,2) WUNRES;
 int logger_close(logger_t *, void *, unsigned long) NONNULL(1,2) WUNRES;
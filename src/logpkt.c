@@ -34,6 +34,7 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <stdio.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
@@ -66,6 +67,40 @@ typedef struct __attribute__((packed)) {
 
 #define PCAP_MAGIC      0xa1b2c3d4
 
+typedef struct __attribute__((packed)) {
+	uint32_t block_type;    /* section header block */
+	uint32_t block_len;     /* total block length */
+	uint32_t byte_order;    /* byte order magic */
+	uint16_t version_major; /* major version number */
+	uint16_t version_minor; /* minor version number */
+	uint64_t section_len;   /* section length, -1 for unspecified */
+	uint32_t block_len2;    /* total block length */
+} pcapng_shb_t;
+
+typedef struct __attribute__((packed)) {
+	uint32_t block_type;    /* interface description block */
+	uint32_t block_len;     /* total block length */
+	uint16_t linktype;      /* data link type */
+	uint16_t reserved;
+	uint32_t snaplen;       /* max length of captured packets, 0 for none */
+	uint32_t block_len2;    /* total block length */
+} pcapng_idb_t;
+
+typedef struct __attribute__((packed)) {
+	uint32_t block_type;    /* enhanced packet block */
+	uint32_t block_len;     /* total block length */
+	uint32_t if_id;         /* interface id */
+	uint32_t ts_high;       /* timestamp microseconds, upper 32 bits */
+	uint32_t ts_low;        /* timestamp microseconds, lower 32 bits */
+	uint32_t cap_len;       /* number of octets of packet saved in file */
+	uint32_t orig_len;      /* actual length of packet */
+} pcapng_epb_hdr_t;
+
+#define PCAPNG_SHB_TYPE 0x0a0d0d0a
+#define PCAPNG_IDB_TYPE 0x00000001
+#define PCAPNG_EPB_TYPE 0x00000006
+#define PCAPNG_MAGIC    0x1a2b3c4d
+
 typedef struct __attribute__((packed)) {
 	uint8_t  dst_mac[ETHER_ADDR_LEN];
 	uint8_t  src_mac[ETHER_ADDR_LEN];
@@ -146,6 +181,22 @@ typedef struct __attribute__((packed)) {
 #define MSS_IP4         (MTU - sizeof(ip4_hdr_t) - sizeof(tcp_hdr_t))
 #define MSS_IP6         (MTU - sizeof(ip6_hdr_t) - sizeof(tcp_hdr_t))
 
+/*
+ * PCAPNG files have no snaplen, so frames use the largest packet size the
+ * IP length fields allow.  This cuts the number of synthesized packets by
+ * more than an order of magnitude for bulk transfers.
+ */
+#define MTU_PCAPNG      65535
+
+/*
+ * PCAP records are assembled in a per-file write buffer and written out once
+ * more than *WBUF_FLUSH* bytes are buffered, or on the first write more than
+ * *WBUF_SECS* seconds after the oldest buffered record.  Writers also call
+ * logpkt_pcap_flush_expired() periodically for connections gone quiet.
+ */
+#define WBUF_FLUSH      65536
+#define WBUF_SECS       1
+
 /*
  * IP/TCP checksumming operating on uint32_t intermediate state variable C.
  */
@@ -202,15 +253,37 @@ logpkt_write_all(int fd, const void *data, size_t sz)
 }
 
 /*
- * Write the PCAP file-level header to file descriptor *fd* open for writing,
+ * Write the PCAP file-level header, or for PCAPNG the section header and
+ * the interface description block, to file descriptor *fd* open for writing,
  * positioned at the beginning of an empty file.
  *
  * Returns 0 on success and -1 on failure.
  */
 static int
-logpkt_write_global_pcap_hdr(int fd)
+logpkt_write_global_pcap_hdr(int fd, int format)
 {
 	pcap_file_hdr_t hdr;
+	struct __attribute__((packed)) {
+		pcapng_shb_t shb;
+		pcapng_idb_t idb;
+	} nghdr;
+
+	if (format == LOGPKT_FORMAT_PCAPNG) {
+		memset(&nghdr, 0x0, sizeof(nghdr));
+		nghdr.shb.block_type = PCAPNG_SHB_TYPE;
+		nghdr.shb.block_len = sizeof(pcapng_shb_t);
+		nghdr.shb.byte_order = PCAPNG_MAGIC;
+		nghdr.shb.version_major = 1;
+		nghdr.shb.version_minor = 0;
+		nghdr.shb.section_len = (uint64_t)-1;
+		nghdr.shb.block_len2 = sizeof(pcapng_shb_t);
+		nghdr.idb.block_type = PCAPNG_IDB_TYPE;
+		nghdr.idb.block_len = sizeof(pcapng_idb_t);
+		nghdr.idb.linktype = 1;
+		nghdr.idb.snaplen = 0;
+		nghdr.idb.block_len2 = sizeof(pcapng_idb_t);
+		return logpkt_write_all(fd, &nghdr, sizeof(nghdr));
+	}
 
 	memset(&hdr, 0x0, sizeof(hdr));
 	hdr.magic_number = PCAP_MAGIC;
@@ -221,20 +294,39 @@ logpkt_write_global_pcap_hdr(int fd)
 	return logpkt_write_all(fd, &hdr, sizeof(hdr));
 }
 
+/*
+ * Return true if the file header in *hdr* matches *format*.  For PCAPNG,
+ * only files written by us in the same byte order are recognized.
+ */
+static int
+logpkt_pcap_hdr_matches(const uint8_t *hdr, int format)
+{
+	uint32_t magic, byte_order;
+
+	memcpy(&magic, hdr, sizeof(magic));
+	if (format == LOGPKT_FORMAT_PCAPNG) {
+		memcpy(&byte_order, hdr + offsetof(pcapng_shb_t, byte_order),
+		       sizeof(byte_order));
+		return magic == PCAPNG_SHB_TYPE && byte_order == PCAPNG_MAGIC;
+	}
+	return magic == PCAP_MAGIC;
+}
+
 /*
  * Called on a file descriptor open for reading and writing.
- * If the fd points to an empty file, a pcap header is added and 0 is returned.
- * If the fd points to a file with PCAP magic bytes, the file position is moved
- * to the end of the file and 0 is returned.
- * If the fd points to a file without PCAP magic bytes, the file is truncated
- * to zero bytes and a new PCAP header is written.
- * On a return value of 0, the caller can continue to write PCAP records to the
+ * If the fd points to an empty file, a file header for *format* is added and
+ * 0 is returned.
+ * If the fd points to a file with matching magic bytes, the file position is
+ * moved to the end of the file and 0 is returned.
+ * If the fd points to a file without matching magic bytes, the file is
+ * truncated to zero bytes and a new file header is written.
+ * On a return value of 0, the caller can continue to write records to the
  * file descriptor.  On error, -1 is returned and the file descriptor is in an
  * undefined but still open state.
  */
 int
-logpkt_pcap_open_fd(int fd) {
-	pcap_file_hdr_t hdr;
+logpkt_pcap_open_fd(int fd, int format) {
+	uint8_t hdr[sizeof(pcap_file_hdr_t)];
 	off_t sz;
 	ssize_t n;
 
@@ -245,10 +337,10 @@ logpkt_pcap_open_fd(int fd) {
 	if (sz > 0) {
 		if (lseek(fd, 0, SEEK_SET) == -1)
 			return -1;
-		n = read(fd, &hdr, sizeof(pcap_file_hdr_t));
-		if (n != sizeof(pcap_file_hdr_t))
+		n = read(fd, hdr, sizeof(hdr));
+		if (n != sizeof(hdr))
 			return -1;
-		if (hdr.magic_number == PCAP_MAGIC)
+		if (logpkt_pcap_hdr_matches(hdr, format))
 			return lseek(fd, 0, SEEK_END) == -1 ? -1 : 0;
 		if (lseek(fd, 0, SEEK_SET) == -1)
 			return -1;
@@ -256,20 +348,20 @@ logpkt_pcap_open_fd(int fd) {
 			return -1;
 	}
 
-	return logpkt_write_global_pcap_hdr(fd);
+	return logpkt_write_global_pcap_hdr(fd, format);
 }
 
 /*
  * Initialize the per-connection packet crafting context.  For mirroring,
  * *libnet* must be an initialized libnet instance and *mtu* must be the
  * target interface MTU greater than 0.  For PCAP writing, *libnet* must be
- * NULL and *mtu* must be 0.  The ether and sockaddr addresses are used as the
- * layer 2 and layer 3 addresses respectively.  For mirroring, the ethers must
- * match the actual link layer addresses to be used when sending traffic, not
- * some emulated addresses.
+ * NULL, *mtu* must be 0 and *format* selects PCAP or PCAPNG.  The ether and
+ * sockaddr addresses are used as the layer 2 and layer 3 addresses
+ * respectively.  For mirroring, the ethers must match the actual link layer
+ * addresses to be used when sending traffic, not some emulated addresses.
  */
 void
-logpkt_ctx_init(logpkt_ctx_t *ctx, libnet_t *libnet, size_t mtu,
+logpkt_ctx_init(logpkt_ctx_t *ctx, libnet_t *libnet, size_t mtu, int format,
                 const uint8_t *src_ether, const uint8_t *dst_ether,
                 const struct sockaddr *src_addr, socklen_t src_addr_len,
                 const struct sockaddr *dst_addr, socklen_t dst_addr_len)
@@ -281,6 +373,13 @@ logpkt_ctx_init(logpkt_ctx_t *ctx, libnet_t *libnet, size_t mtu,
 	memcpy(&ctx->dst_addr, dst_addr, dst_addr_len);
 	ctx->src_seq = 0;
 	ctx->dst_seq = 0;
+	ctx->format = format;
+	ctx->wbuf = NULL;
+	ctx->wlen = 0;
+	ctx->wsize = 0;
+	ctx->wtime = 0;
+	if (!mtu && format == LOGPKT_FORMAT_PCAPNG)
+		mtu = MTU_PCAPNG;
 	if (mtu) {
 		ctx->mss = mtu - sizeof(tcp_hdr_t)
 		               - (dst_addr->sa_family == AF_INET
@@ -292,45 +391,80 @@ logpkt_ctx_init(logpkt_ctx_t *ctx, libnet_t *libnet, size_t mtu,
 }
 
 /*
- * Write the layer 2 frame contained in *pkt* to file descriptor *fd* already
- * open for writing.  First writes a PCAP record header, then the actual frame.
+ * Release the PCAP write buffer of *ctx*.  Buffered records not written out
+ * by logpkt_pcap_flush() before are lost.
+ */
+void
+logpkt_ctx_fini(logpkt_ctx_t *ctx)
+{
+	if (ctx->wbuf) {
+		free(ctx->wbuf);
+		ctx->wbuf = NULL;
+	}
+	ctx->wlen = 0;
+	ctx->wsize = 0;
+}
+
+/*
+ * Write all PCAP records buffered in *ctx* to file descriptor *fd*, using a
+ * single write for all of them if possible, but keep the buffer for the next
+ * records.  The buffer is emptied even on failure, since the records cannot
+ * be written out partially later on.
  */
 static int
-logpkt_pcap_write(const uint8_t *pkt, size_t pktsz, int fd)
+logpkt_pcap_write(logpkt_ctx_t *ctx, int fd)
 {
-	pcap_rec_hdr_t rec_hdr;
-	struct timespec tv;
+	int rv = 0;
 
-	if (clock_gettime(CLOCK_REALTIME, &tv) == -1)
-	{
-		log_err_printf("Error getting current time: %s\n",
-		               strerror(errno));
-		return -1;
+	if (ctx->wlen > 0) {
+		rv = logpkt_write_all(fd, ctx->wbuf, ctx->wlen);
+		if (rv == -1) {
+			log_err_printf("Error writing pcap records: %s\n",
+			               strerror(errno));
+		}
+		ctx->wlen = 0;
 	}
-	rec_hdr.ts_sec = tv.tv_sec;
-	rec_hdr.ts_usec = tv.tv_nsec / 1000;
-	rec_hdr.orig_len = rec_hdr.incl_len = pktsz;
+	return rv;
+}
 
-	if (logpkt_write_all(fd, &rec_hdr, sizeof(rec_hdr)) == -1) {
-		log_err_printf("Error writing pcap record hdr: %s\n",
-		               strerror(errno));
-		return -1;
-	}
-	if (logpkt_write_all(fd, pkt, pktsz) == -1) {
-		log_err_printf("Error writing pcap record: %s\n",
-		               strerror(errno));
-		return -1;
-	}
-	return 0;
+/*
+ * Write all PCAP records buffered in *ctx* to file descriptor *fd* already
+ * open for writing, and release the buffer, so that idle connections do not
+ * hold on to it.  The next record allocates a new one.
+ */
+int
+logpkt_pcap_flush(logpkt_ctx_t *ctx, int fd)
+{
+	int rv;
+
+	rv = logpkt_pcap_write(ctx, fd);
+	logpkt_ctx_fini(ctx);
+	return rv;
+}
+
+/*
+ * Same as logpkt_pcap_flush(), but only if the oldest record buffered in
+ * *ctx* is more than WBUF_SECS seconds older than *now*, so that the records
+ * of a connection gone quiet do not wait for its next write.  *now* is the
+ * current wall clock time in seconds, e.g. from time().
+ * Returns 1 if the buffer was written out and released, 0 if not yet due,
+ * or -1 on error, in which case the buffer is released too.
+ */
+int
+logpkt_pcap_flush_expired(logpkt_ctx_t *ctx, int fd, time_t now)
+{
+	if (ctx->wlen > 0 && now - ctx->wtime < WBUF_SECS)
+		return 0;
+	return logpkt_pcap_flush(ctx, fd) == -1 ? -1 : 1;
 }
 
 /*
  * Build a frame from the given layer 2, layer 3 and layer 4 parameters plus
  * payload, write the resulting bytes into buffer pointed to by *pkt*, and fix
- * the checksums on all layers.  The receiving buffer must be at least
- * MAX_PKTSZ bytes large and payload must be a maximum of MSS_IP4 or MSS_IP6
- * respectively.  Layer 2 is Ethernet II, layer 3 is IPv4 or IPv6 depending on
- * the address family of *dst_addr*, and layer 4 is TCP.
+ * the checksums on all layers.  The receiving buffer must have room for the
+ * headers and the payload, which must fit into a single IP packet, see
+ * logpkt_ctx_init() for the MSS.  Layer 2 is Ethernet II, layer 3 is IPv4 or
+ * IPv6 depending on the address family of *dst_addr*, and layer 4 is TCP.
  *
  * This function is stateless.  For header fields that cannot be directly
  * derived from the arguments, default values will be used.
@@ -509,9 +643,102 @@ logpkt_mirror_build(libnet_t *libnet,
 }
 #endif /* !WITHOUT_MIRROR */
 
+/*
+ * Build the frame for a single packet and append it as a PCAP or PCAPNG
+ * record with timestamp *ts* to the write buffer of *ctx*, which is written
+ * out to *fd* if it is full.  Records are packed without alignment, so the
+ * frame is built in the buffer at the next aligned offset and then moved
+ * into place behind the record header.
+ * The buffer grows with the records pending in it, up to room for a maximum
+ * size record beyond the flush threshold.
+ */
+static int
+logpkt_pcap_append(logpkt_ctx_t *ctx, int fd, int direction, char flags,
+                   const uint8_t *payload, size_t payloadlen,
+                   const struct timespec *ts)
+{
+	pcap_rec_hdr_t rec_hdr;
+	pcapng_epb_hdr_t epb_hdr;
+	uint64_t usec;
+	uint32_t len;
+	uint8_t *rec, *frame, *wbuf;
+	size_t hdrsz, sz, pad, need, wsize;
+
+	/* frame alignment slack, and padding of the PCAPNG block body */
+	need = ctx->wlen + sizeof(pcapng_epb_hdr_t) + 3 + sizeof(ether_hdr_t) +
+	       sizeof(ip6_hdr_t) + sizeof(tcp_hdr_t) + payloadlen + 3 +
+	       sizeof(len);
+	if (need > ctx->wsize) {
+		/* payloadlen <= mss and wlen < WBUF_FLUSH, so need <= wsize */
+		wsize = WBUF_FLUSH + sizeof(pcapng_epb_hdr_t) + 3 +
+		        sizeof(ether_hdr_t) + sizeof(ip6_hdr_t) +
+		        sizeof(tcp_hdr_t) + ctx->mss + 3 + sizeof(len);
+		if (ctx->wsize * 2 < wsize)
+			wsize = ctx->wsize * 2 > need ? ctx->wsize * 2 : need;
+		if (!(wbuf = realloc(ctx->wbuf, wsize)))
+			return -1;
+		ctx->wbuf = wbuf;
+		ctx->wsize = wsize;
+	}
+	if (ctx->wlen == 0)
+		ctx->wtime = ts->tv_sec;
+
+	hdrsz = (ctx->format == LOGPKT_FORMAT_PCAPNG) ? sizeof(pcapng_epb_hdr_t)
+	                                              : sizeof(pcap_rec_hdr_t);
+	rec = ctx->wbuf + ctx->wlen;
+	frame = ctx->wbuf + ((ctx->wlen + hdrsz + 3) & ~(size_t)3);
+	if (direction == LOGPKT_REQUEST) {
+		sz = logpkt_pcap_build(frame,
+		                       ctx->src_ether, ctx->dst_ether,
+		                       CSA(&ctx->src_addr),
+		                       CSA(&ctx->dst_addr),
+		                       flags,
+		                       ctx->src_seq, ctx->dst_seq,
+		                       payload, payloadlen);
+	} else {
+		sz = logpkt_pcap_build(frame,
+		                       ctx->dst_ether, ctx->src_ether,
+		                       CSA(&ctx->dst_addr),
+		                       CSA(&ctx->src_addr),
+		                       flags,
+		                       ctx->dst_seq, ctx->src_seq,
+		                       payload, payloadlen);
+	}
+	if (frame != rec + hdrsz)
+		memmove(rec + hdrsz, frame, sz);
+
+	if (ctx->format == LOGPKT_FORMAT_PCAPNG) {
+		/* block body is padded to 32 bits, then repeats block length */
+		pad = (4 - (sz & 3)) & 3;
+		len = sizeof(epb_hdr) + sz + pad + sizeof(len);
+		usec = (uint64_t)ts->tv_sec * 1000000 + ts->tv_nsec / 1000;
+		epb_hdr.block_type = PCAPNG_EPB_TYPE;
+		epb_hdr.block_len = len;
+		epb_hdr.if_id = 0;
+		epb_hdr.ts_high = usec >> 32;
+		epb_hdr.ts_low = usec & 0xFFFFFFFF;
+		epb_hdr.cap_len = epb_hdr.orig_len = sz;
+		memcpy(rec, &epb_hdr, sizeof(epb_hdr));
+		memset(rec + sizeof(epb_hdr) + sz, 0, pad);
+		memcpy(rec + sizeof(epb_hdr) + sz + pad, &len, sizeof(len));
+		ctx->wlen += len;
+	} else {
+		rec_hdr.ts_sec = ts->tv_sec;
+		rec_hdr.ts_usec = ts->tv_nsec / 1000;
+		rec_hdr.orig_len = rec_hdr.incl_len = sz;
+		memcpy(rec, &rec_hdr, sizeof(rec_hdr));
+		ctx->wlen += sizeof(rec_hdr) + sz;
+	}
+
+	if (ctx->wlen >= WBUF_FLUSH)
+		return logpkt_pcap_write(ctx, fd);
+	return 0;
+}
+
 /*
  * Write a single packet to either PCAP (*fd* != -1) or a network interface
  * (*fd* == -1).  Caller must ensure that *ctx* was initialized accordingly.
+ * PCAP records are buffered, see logpkt_pcap_flush().
  * The packet will be in direction *direction*, use TCP flags *flags*, and
  * transmit a payload *payload*.  TCP sequence and acknowledgment numbers as
  * well as source and destination identifiers are taken from *ctx*.
@@ -521,31 +748,14 @@ logpkt_mirror_build(libnet_t *libnet,
  */
 static int
 logpkt_write_packet(logpkt_ctx_t *ctx, int fd, int direction, char flags,
-                    const uint8_t *payload, size_t payloadlen)
+                    const uint8_t *payload, size_t payloadlen,
+                    const struct timespec *ts)
 {
 	int rv;
 
 	if (fd != -1) {
-		uint8_t buf[MAX_PKTSZ];
-		size_t sz;
-		if (direction == LOGPKT_REQUEST) {
-			sz = logpkt_pcap_build(buf,
-			                       ctx->src_ether, ctx->dst_ether,
-			                       CSA(&ctx->src_addr),
-			                       CSA(&ctx->dst_addr),
-			                       flags,
-			                       ctx->src_seq, ctx->dst_seq,
-			                       payload, payloadlen);
-		} else {
-			sz = logpkt_pcap_build(buf,
-			                       ctx->dst_ether, ctx->src_ether,
-			                       CSA(&ctx->dst_addr),
-			                       CSA(&ctx->src_addr),
-			                       flags,
-			                       ctx->dst_seq, ctx->src_seq,
-			                       payload, payloadlen);
-		}
-		rv = logpkt_pcap_write(buf, sz, fd);
+		rv = logpkt_pcap_append(ctx, fd, direction, flags,
+		                        payload, payloadlen, ts);
 		if (rv == -1) {
 			log_err_printf("Error writing packet to PCAP file\n");
 			return -1;
@@ -589,24 +799,40 @@ logpkt_write_packet(logpkt_ctx_t *ctx, int fd, int direction, char flags,
 	return rv;
 }
 
+/*
+ * Get the timestamp for the packets of one payload segment or close
+ * handshake.  Synthesized packets share the timestamp of their segment.
+ */
+static int
+logpkt_gettime(struct timespec *ts)
+{
+	if (clock_gettime(CLOCK_REALTIME, ts) == -1) {
+		log_err_printf("Error getting current time: %s\n",
+		               strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
 /*
  * Emulate the initial SYN handshake.
  */
 static int
-logpkt_write_syn_handshake(logpkt_ctx_t *ctx, int fd)
+logpkt_write_syn_handshake(logpkt_ctx_t *ctx, int fd,
+                           const struct timespec *ts)
 {
 	ctx->src_seq = sys_rand32();
 	if (logpkt_write_packet(ctx, fd, LOGPKT_REQUEST,
-	                        TH_SYN, NULL, 0) == -1)
+	                        TH_SYN, NULL, 0, ts) == -1)
 		return -1;
 	ctx->src_seq += 1;
 	ctx->dst_seq = sys_rand32();
 	if (logpkt_write_packet(ctx, fd, LOGPKT_RESPONSE,
-	                        TH_SYN|TH_ACK, NULL, 0) == -1)
+	                        TH_SYN|TH_ACK, NULL, 0, ts) == -1)
 		return -1;
 	ctx->dst_seq += 1;
 	if (logpkt_write_packet(ctx, fd, LOGPKT_REQUEST,
-	                        TH_ACK, NULL, 0) == -1)
+	                        TH_ACK, NULL, 0, ts) == -1)
 		return -1;
 	return 0;
 }
@@ -615,6 +841,9 @@ logpkt_write_syn_handshake(logpkt_ctx_t *ctx, int fd)
  * Emulate the necessary packets to write a single payload segment.  If
  * necessary, a SYN handshake will automatically be generated before emitting
  * the packet carrying the payload plus a matching ACK.
+ * For PCAP writing, the records stay buffered in *ctx* until the buffer is
+ * full or on the first call more than WBUF_SECS after the oldest buffered
+ * record; use logpkt_pcap_flush() to write them out earlier.
  */
 int
 logpkt_write_payload(logpkt_ctx_t *ctx, int fd, int direction,
@@ -622,16 +851,20 @@ logpkt_write_payload(logpkt_ctx_t *ctx, int fd, int direction,
 {
 	int other_direction = (direction == LOGPKT_REQUEST) ? LOGPKT_RESPONSE
 	                                                    : LOGPKT_REQUEST;
+	struct timespec ts;
+
+	if (logpkt_gettime(&ts) == -1)
+		return -1;
 
 	if (ctx->src_seq == 0) {
-		if (logpkt_write_syn_handshake(ctx, fd) == -1)
+		if (logpkt_write_syn_handshake(ctx, fd, &ts) == -1)
 			return -1;
 	}
 
 	while (payloadlen > 0) {
 		size_t n = payloadlen > ctx->mss ? ctx->mss : payloadlen;
 		if (logpkt_write_packet(ctx, fd, direction,
-		                        TH_PUSH|TH_ACK, payload, n) == -1) {
+		                        TH_PUSH|TH_ACK, payload, n, &ts) == -1) {
 			log_err_printf("Warning: Failed to write to pcap log"
 			               ": %s\n", strerror(errno));
 			return -1;
@@ -646,32 +879,41 @@ logpkt_write_payload(logpkt_ctx_t *ctx, int fd, int direction,
 	}
 
 	if (logpkt_write_packet(ctx, fd, other_direction,
-	                        TH_ACK, NULL, 0) == -1) {
+	                        TH_ACK, NULL, 0, &ts) == -1) {
 		log_err_printf("Warning: Failed to write to pcap log: %s\n",
 		               strerror(errno));
 		return -1;
 	}
+
+	/* keep the buffer, the conn is active */
+	if (fd != -1 && ctx->wlen > 0 && ts.tv_sec - ctx->wtime >= WBUF_SECS)
+		return logpkt_pcap_write(ctx, fd);
 	return 0;
 }
 
 /*
  * Emulate a connection close, emitting a FIN handshake in the correct
- * direction.  Does not close the file descriptor.
+ * direction.  For PCAP writing, writes out all buffered records.
+ * Does not close the file descriptor.
  */
 int
 logpkt_write_close(logpkt_ctx_t *ctx, int fd, int direction) {
 	int other_direction = (direction == LOGPKT_REQUEST) ? LOGPKT_RESPONSE
 	                                                    : LOGPKT_REQUEST;
+	struct timespec ts;
+
+	if (logpkt_gettime(&ts) == -1)
+		goto out;
 
 	if (ctx->src_seq == 0) {
-		if (logpkt_write_syn_handshake(ctx, fd) == -1)
-			return -1;
+		if (logpkt_write_syn_handshake(ctx, fd, &ts) == -1)
+			goto out;
 	}
 
 	if (logpkt_write_packet(ctx, fd, direction,
-	                        TH_FIN|TH_ACK, NULL, 0) == -1) {
+	                        TH_FIN|TH_ACK, NULL, 0, &ts) == -1) {
 		log_err_printf("Warning: Failed to write packet\n");
-		return -1;
+		goto out;
 	}
 	if (direction == LOGPKT_REQUEST) {
 		ctx->src_seq += 1;
@@ -680,9 +922,9 @@ logpkt_write_close(logpkt_ctx_t *ctx, int fd, int direction) {
 	}
 
 	if (logpkt_write_packet(ctx, fd, other_direction,
-	                        TH_FIN|TH_ACK, NULL, 0) == -1) {
+	                        TH_FIN|TH_ACK, NULL, 0, &ts) == -1) {
 		log_err_printf("Warning: Failed to write packet\n");
-		return -1;
+		goto out;
 	}
 	if (other_direction == LOGPKT_REQUEST) {
 		ctx->src_seq += 1;
@@ -691,12 +933,19 @@ logpkt_write_close(logpkt_ctx_t *ctx, int fd, int direction) {
 	}
 
 	if (logpkt_write_packet(ctx, fd, direction,
-	                        TH_ACK, NULL, 0) == -1) {
+	                        TH_ACK, NULL, 0, &ts) == -1) {
 		log_err_printf("Warning: Failed to write packet\n");
-		return -1;
+		goto out;
 	}
 
+	if (fd != -1)
+		return logpkt_pcap_flush(ctx, fd);
 	return 0;
+out:
+	/* still write out what was buffered before */
+	if (fd != -1)
+		logpkt_pcap_flush(ctx, fd);
+	return -1;
 }
 
 #ifndef WITHOUT_MIRROR
@@ -51,19 +51,31 @@ typedef struct {
 	uint32_t src_seq;
 	uint32_t dst_seq;
 	size_t mss;
+	int format;
+	/* PCAP write buffer, records are assembled here and written at once */
+	uint8_t *wbuf;
+	size_t wlen;
+	size_t wsize;
+	time_t wtime;
 } logpkt_ctx_t;
 
 #define LOGPKT_REQUEST  0
 #define LOGPKT_RESPONSE 1
 
-int logpkt_pcap_open_fd(int fd) WUNRES;
-void logpkt_ctx_init(logpkt_ctx_t *, libnet_t *, size_t,
+#define LOGPKT_FORMAT_PCAP   0
+#define LOGPKT_FORMAT_PCAPNG 1
+
+int logpkt_pcap_open_fd(int, int) WUNRES;
+void logpkt_ctx_init(logpkt_ctx_t *, libnet_t *, size_t, int,
                      const uint8_t *, const uint8_t *,
                      const struct sockaddr *, socklen_t,
                      const struct sockaddr *, socklen_t);
 int logpkt_write_payload(logpkt_ctx_t *, int, int,
                          const unsigned char *, size_t) WUNRES;
 int logpkt_write_close(logpkt_ctx_t *, int, int);
+int logpkt_pcap_flush(logpkt_ctx_t *, int);
+int logpkt_pcap_flush_expired(logpkt_ctx_t *, int, time_t);
+void logpkt_ctx_fini(logpkt_ctx_t *);
 int logpkt_ether_lookup(libnet_t *, uint8_t *, uint8_t *,
                         const char *, const char *) WUNRES;
 
@@ -992,6 +992,9 @@ main(int argc, char *argv[])
 		fprintf(stderr, "%s: failed to preinit cachemgr.\n", argv0);
 		exit(EXIT_FAILURE);
 	}
+	cachemgr_set_limits(global->cache_max_entries,
+	                    (size_t)global->cache_max_mb * 1024 * 1024);
+	cachemgr_set_pass_limit(global->autopass_max_entries);
 	if (log_preinit(global) == -1) {
 		fprintf(stderr, "%s: failed to preinit logging.\n", argv0);
 		exit(EXIT_FAILURE);
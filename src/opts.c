@@ -146,6 +146,7 @@ conn_opts_new(void)
 	conn_opts->user_timeout = 300;
 #endif /* !WITHOUT_USERAUTH */
 	conn_opts->max_http_header_size = 8192;
+	conn_opts->outbuf_limit = OUTBUF_LIMIT;
 	return conn_opts;
 }
 
@@ -177,6 +178,11 @@ global_new(void)
 	global->conn_idle_timeout = 120;
 	global->expired_conn_check_period = 10;
 	global->stats_period = 1;
+	global->cache_max_mb = 256;
+	global->autopass_failures = 2;
+	global->autopass_max_entries = 10000;
+	global->outbuf_budget_mb = 256;
+	global->contentlog_threads = 1;
 
 	global->conn_opts = conn_opts_new();
 	if (!global->conn_opts)
@@ -365,6 +371,9 @@ global_free(global_t *global)
 	if (global->dropuser) {
 		free(global->dropuser);
 	}
+	if (global->worker_cpus) {
+		free(global->worker_cpus);
+	}
 	if (global->dropgroup) {
 		free(global->dropgroup);
 	}
@@ -604,6 +613,7 @@ conn_opts_copy(conn_opts_t *conn_opts, const char *argv0, tmp_opts_t *tmp_opts)
 #endif /* OPENSSL_VERSION_NUMBER >= 0x10100000L */
 	cops->remove_http_accept_encoding = conn_opts->remove_http_accept_encoding;
 	cops->remove_http_referer = conn_opts->remove_http_referer;
+	cops->http_keepalive = conn_opts->http_keepalive;
 	cops->verify_peer = conn_opts->verify_peer;
 	cops->allow_wrong_host = conn_opts->allow_wrong_host;
 #ifndef WITHOUT_USERAUTH
@@ -613,6 +623,8 @@ conn_opts_copy(conn_opts_t *conn_opts, const char *argv0, tmp_opts_t *tmp_opts)
 	cops->validate_proto = conn_opts->validate_proto;
 	cops->reconnect_ssl = conn_opts->reconnect_ssl;
 	cops->max_http_header_size = conn_opts->max_http_header_size;
+	cops->outbuf_limit = conn_opts->outbuf_limit;
+	cops->adaptive_outbuf = conn_opts->adaptive_outbuf;
 
 	// Pass NULL as tmp_opts param, so we don't reassign the var to itself
 	// That would be harmless but incorrect
@@ -1125,7 +1137,7 @@ conn_opts_str(conn_opts_t *conn_opts)
 #ifndef OPENSSL_NO_ECDH
 				 "|%s"
 #endif /* !OPENSSL_NO_ECDH */
-				 "|%s%s%s%s%s"
+				 "|%s%s%s%s%s%s%s"
 #ifndef WITHOUT_USERAUTH
 				 "%s|%s|%d"
 #endif /* !WITHOUT_USERAUTH */
@@ -1255,6 +1267,8 @@ conn_opts_str(conn_opts_t *conn_opts)
 	             (conn_opts->leafcrlurl ? conn_opts->leafcrlurl : "no leafcrlurl"),
 	             (conn_opts->remove_http_accept_encoding ? "|remove_http_accept_encoding" : ""),
 	             (conn_opts->remove_http_referer ? "|remove_http_referer" : ""),
+	             (conn_opts->http_keepalive ? "|http_keepalive" : ""),
+	             (conn_opts->adaptive_outbuf ? "|adaptive_outbuf" : ""),
 	             (conn_opts->verify_peer ? "|verify_peer" : ""),
 	             (conn_opts->allow_wrong_host ? "|allow_wrong_host" : ""),
 #ifndef WITHOUT_USERAUTH
@@ -2005,6 +2019,30 @@ opts_unset_remove_http_referer(conn_opts_t *conn_opts)
 	conn_opts->remove_http_referer = 0;
 }
 
+static void
+opts_set_http_keepalive(conn_opts_t *conn_opts)
+{
+	conn_opts->http_keepalive = 1;
+}
+
+static void
+opts_unset_http_keepalive(conn_opts_t *conn_opts)
+{
+	conn_opts->http_keepalive = 0;
+}
+
+static void
+opts_set_adaptive_outbuf(conn_opts_t *conn_opts)
+{
+	conn_opts->adaptive_outbuf = 1;
+}
+
+static void
+opts_unset_adaptive_outbuf(conn_opts_t *conn_opts)
+{
+	conn_opts->adaptive_outbuf = 0;
+}
+
 static void
 opts_set_verify_peer(conn_opts_t *conn_opts)
 {
@@ -2740,6 +2778,25 @@ set_conn_opts_option(conn_opts_t *conn_opts, const char *argv0,
 		}
 #ifdef DEBUG_OPTS
 		log_dbg_printf("MaxHTTPHeaderSize: %u\n", conn_opts->max_http_header_size);
+#endif /* DEBUG_OPTS */
+	} else if (equal(name, "OutbufLimit")) {
+		unsigned int i = atoi(value);
+		if (i >= 4096 && i <= 16777216) {
+			conn_opts->outbuf_limit = i;
+		} else {
+			fprintf(stderr, "Invalid OutbufLimit %s on line %d, use 4096-16777216\n", value, line_num);
+			return -1;
+		}
+#ifdef DEBUG_OPTS
+		log_dbg_printf("OutbufLimit: %u\n", conn_opts->outbuf_limit);
+#endif /* DEBUG_OPTS */
+	} else if (equal(name, "AdaptiveOutbuf")) {
+		yes = check_value_yesno(value, "AdaptiveOutbuf", line_num);
+		if (yes == -1)
+			return -1;
+		yes ? opts_set_adaptive_outbuf(conn_opts) : opts_unset_adaptive_outbuf(conn_opts);
+#ifdef DEBUG_OPTS
+		log_dbg_printf("AdaptiveOutbuf: %u\n", conn_opts->adaptive_outbuf);
 #endif /* DEBUG_OPTS */
 	} else if (equal(name, "VerifyPeer")) {
 		yes = check_value_yesno(value, "VerifyPeer", line_num);
@@ -2772,6 +2829,14 @@ set_conn_opts_option(conn_opts_t *conn_opts, const char *argv0,
 		yes ? opts_set_remove_http_referer(conn_opts) : opts_unset_remove_http_referer(conn_opts);
 #ifdef DEBUG_OPTS
 		log_dbg_printf("RemoveHTTPReferer: %u\n", conn_opts->remove_http_referer);
+#endif /* DEBUG_OPTS */
+	} else if (equal(name, "HTTPKeepAlive")) {
+		yes = check_value_yesno(value, "HTTPKeepAlive", line_num);
+		if (yes == -1)
+			return -1;
+		yes ? opts_set_http_keepalive(conn_opts) : opts_unset_http_keepalive(conn_opts);
+#ifdef DEBUG_OPTS
+		log_dbg_printf("HTTPKeepAlive: %u\n", conn_opts->http_keepalive);
 #endif /* DEBUG_OPTS */
 	}
 	else {
@@ -3272,6 +3337,207 @@ set_global_option(global_t *global, const char *argv0,
 #ifdef DEBUG_OPTS
 		log_dbg_printf("StatsPeriod: %u\n", global->stats_period);
 #endif /* DEBUG_OPTS */
+	} else if (equal(name, "ReusePortListeners")) {
+		yes = check_value_yesno(value, "ReusePortListeners", *line_num);
+		if (yes == -1)
+			return -1;
+#if !defined(SO_REUSEPORT_LB) && !defined(SO_REUSEPORT)
+		if (yes) {
+			fprintf(stderr, "ReusePortListeners not supported on this platform on line %d\n", *line_num);
+			return -1;
+		}
+#endif /* !SO_REUSEPORT_LB && !SO_REUSEPORT */
+		global->reuseport_listeners = yes;
+#ifdef DEBUG_OPTS
+		log_dbg_printf("ReusePortListeners: %u\n", global->reuseport_listeners);
+#endif /* DEBUG_OPTS */
+	} else if (equal(name, "SharedReturnListener")) {
+		yes = check_value_yesno(value, "SharedReturnListener", *line_num);
+		if (yes == -1)
+			return -1;
+		global->shared_return_listener = yes;
+#ifdef DEBUG_OPTS
+		log_dbg_printf("SharedReturnListener: %u\n", global->shared_return_listener);
+#endif /* DEBUG_OPTS */
+	} else if (equal(name, "KTLS")) {
+		yes = check_value_yesno(value, "KTLS", *line_num);
+		if (yes == -1)
+			return -1;
+#ifndef SSL_HAVE_KTLS
+		if (yes) {
+			fprintf(stderr, "KTLS not supported on this platform on line %d\n", *line_num);
+			return -1;
+		}
+#endif /* !SSL_HAVE_KTLS */
+		global->ktls = yes;
+#ifdef DEBUG_OPTS
+		log_dbg_printf("KTLS: %u\n", global->ktls);
+#endif /* DEBUG_OPTS */
+	} else if (equal(name, "SpeculativeHandshake")) {
+		yes = check_value_yesno(value, "SpeculativeHandshake", *line_num);
+		if (yes == -1)
+			return -1;
+		global->spec_handshake = yes;
+#ifdef DEBUG_OPTS
+		log_dbg_printf("SpeculativeHandshake: %u\n", global->spec_handshake);
+#endif /* DEBUG_OPTS */
+	} else if (equal(name, "AutoPassthroughTTL")) {
+		unsigned int i = atoi(value);
+		if (i <= 86400) {
+			global->autopass_ttl = i;
+		} else {
+			fprintf(stderr, "Invalid AutoPassthroughTTL %s on line %d, use 0-86400\n", value, *line_num);
+			return -1;
+		}
+#ifdef DEBUG_OPTS
+		log_dbg_printf("AutoPassthroughTTL: %u\n", global->autopass_ttl);
+#endif /* DEBUG_OPTS */
+	} else if (equal(name, "AutoPassthroughFailures")) {
+		unsigned int i = atoi(value);
+		if (i >= 1 && i <= 100) {
+			global->autopass_failures = i;
+		} else {
+			fprintf(stderr, "Invalid AutoPassthroughFailures %s on line %d, use 1-100\n", value, *line_num);
+			return -1;
+		}
+#ifdef DEBUG_OPTS
+		log_dbg_printf("AutoPassthroughFailures: %u\n", global->autopass_failures);
+#endif /* DEBUG_OPTS */
+	} else if (equal(name, "AutoPassthroughMaxEntries")) {
+		unsigned int i = atoi(value);
+		if (i >= 1 && i <= 100000000) {
+			global->autopass_max_entries = i;
+		} else {
+			fprintf(stderr, "Invalid AutoPassthroughMaxEntries %s on line %d, use 1-100000000\n", value, *line_num);
+			return -1;
+		}
+#ifdef DEBUG_OPTS
+		log_dbg_printf("AutoPassthroughMaxEntries: %u\n", global->autopass_max_entries);
+#endif /* DEBUG_OPTS */
+	} else if (equal(name, "OutbufBudget")) {
+		unsigned int i = atoi(value);
+		if (i >= 1 && i <= 65536) {
+			global->outbuf_budget_mb = i;
+		} else {
+			fprintf(stderr, "Invalid OutbufBudget %s on line %d, use 1-65536\n", value, *line_num);
+			return -1;
+		}
+#ifdef DEBUG_OPTS
+		log_dbg_printf("OutbufBudget: %u\n", global->outbuf_budget_mb);
+#endif /* DEBUG_OPTS */
+	} else if (equal(name, "ContentLogThreads")) {
+		unsigned int i = atoi(value);
+		if (i >= 1 && i <= CONTENTLOG_MAX_THREADS) {
+			global->contentlog_threads = i;
+		} else {
+			fprintf(stderr, "Invalid ContentLogThreads %s on line %d, use 1-64\n", value, *line_num);
+			return -1;
+		}
+#ifdef DEBUG_OPTS
+		log_dbg_printf("ContentLogThreads: %u\n", global->contentlog_threads);
+#endif /* DEBUG_OPTS */
+	} else if (equal(name, "PcapLogFormat")) {
+		if (equal(value, "pcap")) {
+			global->pcaplog_format = PCAPLOG_FORMAT_PCAP;
+		} else if (equal(value, "pcapng")) {
+			global->pcaplog_format = PCAPLOG_FORMAT_PCAPNG;
+		} else {
+			fprintf(stderr, "Invalid PcapLogFormat %s on line %d, use pcap|pcapng\n", value, *line_num);
+			return -1;
+		}
+#ifdef DEBUG_OPTS
+		log_dbg_printf("PcapLogFormat: %u\n", global->pcaplog_format);
+#endif /* DEBUG_OPTS */
+	} else if (equal(name, "Splice")) {
+		yes = check_value_yesno(value, "Splice", *line_num);
+		if (yes == -1)
+			return -1;
+#ifndef SYS_HAVE_SPLICE
+		if (yes) {
+			fprintf(stderr, "Splice not supported on this platform on line %d\n", *line_num);
+			return -1;
+		}
+#endif /* !SYS_HAVE_SPLICE */
+		global->splice = yes;
+#ifdef DEBUG_OPTS
+		log_dbg_printf("Splice: %u\n", global->splice);
+#endif /* DEBUG_OPTS */
+	} else if (equal(name, "ThreadBalance")) {
+		if (equal(value, "leastconn")) {
+			global->thr_balance = THR_BALANCE_LEASTCONN;
+		} else if (equal(value, "p2c")) {
+			global->thr_balance = THR_BALANCE_P2C;
+		} else {
+			fprintf(stderr, "Invalid ThreadBalance %s on line %d, use leastconn|p2c\n", value, *line_num);
+			return -1;
+		}
+#ifdef DEBUG_OPTS
+		log_dbg_printf("ThreadBalance: %u\n", global->thr_balance);
+#endif /* DEBUG_OPTS */
+	} else if (equal(name, "WorkerThreads")) {
+		unsigned int i = atoi(value);
+		if (i >= 1 && i <= 1024) {
+			global->worker_threads = i;
+		} else {
+			fprintf(stderr, "Invalid WorkerThreads %s on line %d, use 1-1024\n", value, *line_num);
+			return -1;
+		}
+#ifdef DEBUG_OPTS
+		log_dbg_printf("WorkerThreads: %u\n", global->worker_threads);
+#endif /* DEBUG_OPTS */
+	} else if (equal(name, "CryptoThreads")) {
+		unsigned int i = atoi(value);
+		if (i <= 64) {
+			global->crypto_threads = i;
+		} else {
+			fprintf(stderr, "Invalid CryptoThreads %s on line %d, use 0-64\n", value, *line_num);
+			return -1;
+		}
+#ifdef DEBUG_OPTS
+		log_dbg_printf("CryptoThreads: %u\n", global->crypto_threads);
+#endif /* DEBUG_OPTS */
+	} else if (equal(name, "CacheMaxEntries")) {
+		unsigned int i = atoi(value);
+		if (i <= 100000000) {
+			global->cache_max_entries = i;
+		} else {
+			fprintf(stderr, "Invalid CacheMaxEntries %s on line %d, use 0-100000000\n", value, *line_num);
+			return -1;
+		}
+#ifdef DEBUG_OPTS
+		log_dbg_printf("CacheMaxEntries: %u\n", global->cache_max_entries);
+#endif /* DEBUG_OPTS */
+	} else if (equal(name, "CacheMaxMB")) {
+		unsigned int i = atoi(value);
+		if (i <= 65536) {
+			global->cache_max_mb = i;
+		} else {
+			fprintf(stderr, "Invalid CacheMaxMB %s on line %d, use 0-65536\n", value, *line_num);
+			return -1;
+		}
+#ifdef DEBUG_OPTS
+		log_dbg_printf("CacheMaxMB: %u\n", global->cache_max_mb);
+#endif /* DEBUG_OPTS */
+	} else if (equal(name, "WorkerCPUs")) {
+#ifndef SYS_HAVE_AFFINITY
+		fprintf(stderr, "WorkerCPUs not supported on this platform on line %d\n", *line_num);
+		return -1;
+#else /* SYS_HAVE_AFFINITY */
+		int *cpus;
+		int n = sys_parse_cpulist(value, &cpus);
+		if (n == -1) {
+			fprintf(stderr, "Invalid WorkerCPUs %s on line %d, use a list of CPU ids and ranges, e.g. 0-3,8\n", value, *line_num);
+			return -1;
+		}
+		if (global->worker_cpus) {
+			free(global->worker_cpus);
+		}
+		global->worker_cpus = cpus;
+		global->worker_cpus_count = n;
+#ifdef DEBUG_OPTS
+		log_dbg_printf("WorkerCPUs: %s (%d)\n", value, global->worker_cpus_count);
+#endif /* DEBUG_OPTS */
+#endif /* SYS_HAVE_AFFINITY */
 	} else if (equal(name, "OpenFilesLimit")) {
 		return global_set_open_files_limit(value, *line_num);
 	} else if (equal(name, "LeafKey")) {
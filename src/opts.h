@@ -72,6 +72,20 @@
 
 #define FILTER_PRECEDENCE    0x000000FFU
 
+/*
+ * Default maximum size of data to buffer per connection direction before
+ * temporarily stopping to read data from the other end.
+ */
+#define OUTBUF_LIMIT	(128*1024)
+
+#define THR_BALANCE_LEASTCONN 0
+#define THR_BALANCE_P2C       1
+
+#define PCAPLOG_FORMAT_PCAP   0
+#define PCAPLOG_FORMAT_PCAPNG 1
+
+#define CONTENTLOG_MAX_THREADS 64
+
 #ifndef WITHOUT_USERAUTH
 typedef struct userlist {
 	char *user;
@@ -135,6 +149,8 @@ typedef struct conn_opts {
 	char *leafcrlurl;
 	unsigned int remove_http_accept_encoding: 1;
 	unsigned int remove_http_referer: 1;
+	// Keep HTTP conns alive, filtering and logging each request
+	unsigned int http_keepalive: 1;
 	unsigned int verify_peer: 1;
 	unsigned int allow_wrong_host: 1;
 #ifndef WITHOUT_USERAUTH
@@ -146,6 +162,10 @@ typedef struct conn_opts {
 	// Used with struct filtering rules only
 	unsigned int reconnect_ssl : 1;
 	unsigned int max_http_header_size;
+	// Max size of data to buffer per conn direction, the initial one in adaptive mode
+	unsigned int outbuf_limit;
+	// Size the buffer limit of each conn direction from the drain rate of its output
+	unsigned int adaptive_outbuf : 1;
 } conn_opts_t;
 
 typedef struct opts {
@@ -252,6 +272,36 @@ struct global {
 	unsigned int stats_period;
 	unsigned int statslog: 1;
 	unsigned int log_stats: 1;
+	unsigned int reuseport_listeners: 1;
+	unsigned int shared_return_listener: 1;
+	// Relay passthrough and split mode tcp conns with splice()
+	unsigned int splice: 1;
+	// Offload the crypto of SSL conns to the kernel if possible
+	unsigned int ktls: 1;
+	// Start the client handshake with the forged cert last used for the SNI, in parallel with the server connect
+	unsigned int spec_handshake: 1;
+	// Seconds to pass through conns to sites SSL interception has failed for, 0 to disable
+	unsigned int autopass_ttl;
+	// Number of failures before passing through, and max number of sites to remember
+	unsigned int autopass_failures;
+	unsigned int autopass_max_entries;
+	// Max total size in MB adaptive buffer limits can grow beyond OutbufLimit to
+	unsigned int outbuf_budget_mb;
+	// Number of writer threads of the content and pcap loggers in dir and spec modes
+	unsigned int contentlog_threads;
+	// File format of PcapLog/PcapLogDir/PcapLogPathSpec
+	unsigned int pcaplog_format;
+	unsigned int thr_balance;
+	// Number of conn handling threads, 0 for twice the number of CPU cores
+	unsigned int worker_threads;
+	// CPUs to pin conn handling threads to, thread i runs on worker_cpus[i % worker_cpus_count]
+	int *worker_cpus;
+	int worker_cpus_count;
+	// Number of crypto threads to forge certs on, 0 to forge on conn handling threads
+	unsigned int crypto_threads;
+	// Limits of each of the fake cert and session caches, 0 for no limit
+	unsigned int cache_max_entries;
+	unsigned int cache_max_mb;
 #ifndef WITHOUT_USERAUTH
 	char *userdb_path;
 	sqlite3 *userdb;
@@ -34,6 +34,7 @@
 #include "log.h"
 #include "attrib.h"
 #include "defaults.h"
+#include "thrqueue.h"
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -48,6 +49,10 @@
 #include <errno.h>
 #include <libgen.h>
 #include <fcntl.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include <event2/event.h>
 
 
 /*
@@ -55,16 +60,28 @@
  *
  * The server code has limitations on the internal functionality that can be
  * used, namely only those that are initialized before forking.
+ *
+ * Every request and answer starts with a header of the command or response
+ * byte followed by a request id.  The server hands requests off to a pool of
+ * worker threads and answers them in order of completion; the client matches
+ * the answers to its outstanding requests by id, so that any number of
+ * threads can have requests in flight on the same client socket.
  */
 
+/* message header: command or response byte, request id */
+#define PRIVSEP_HDR_SIZE	(1+sizeof(uint32_t))
 /* maximal message sizes */
 #define PRIVSEP_MAX_REQ_SIZE	512	/* arbitrary limit */
-#define PRIVSEP_MAX_ANS_SIZE	(1+sizeof(int))
+#define PRIVSEP_MAX_ANS_SIZE	(PRIVSEP_HDR_SIZE+sizeof(int))
+/* server worker threads and their request queue */
+#define PRIVSEP_SERVER_THREADS	4
+#define PRIVSEP_SERVER_QUEUE_SIZE	256
 /* command byte */
 #define PRIVSEP_REQ_CLOSE	0	/* closing command socket */
 #define PRIVSEP_REQ_OPENFILE	1	/* open content log file */
 #define PRIVSEP_REQ_OPENFILE_P	2	/* open content log file w/mkpath */
 #define PRIVSEP_REQ_OPENSOCK	3	/* open socket and pass fd */
+#define PRIVSEP_REQ_OPENSOCK_R	6	/* open socket w/SO_REUSEPORT and pass fd */
 #define PRIVSEP_REQ_CERTFILE	4	/* open cert file in certgendir */
 #ifndef WITHOUT_USERAUTH
 #define PRIVSEP_REQ_UPDATE_ATIME	5	/* update ip,user atime */
@@ -95,6 +112,20 @@ static volatile sig_atomic_t received_sigusr1;
 /* write end of pipe used for unblocking select */
 static volatile sig_atomic_t selfpipe_wrfd;
 
+/* request received by the server, queued for the server worker threads */
+typedef struct privsep_server_req {
+	int srvsock;
+	ssize_t n;
+	char buf[PRIVSEP_MAX_REQ_SIZE];
+} privsep_server_req_t;
+
+static thrqueue_t *privsep_server_queue;
+/* set by server worker threads on fatal errors */
+static int privsep_server_failed;
+#ifndef WITHOUT_USERAUTH
+static pthread_mutex_t privsep_server_userdb_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif /* !WITHOUT_USERAUTH */
+
 static void
 privsep_server_signal_handler(int sig)
 {
@@ -251,7 +282,7 @@ privsep_server_opensock_verify(global_t *global, void *arg)
 }
 
 static int WUNRES
-privsep_server_opensock(const proxyspec_t *spec)
+privsep_server_opensock(const proxyspec_t *spec, int reuseport)
 {
 	evutil_socket_t fd;
 	int on = 1;
@@ -289,6 +320,24 @@ privsep_server_opensock(const proxyspec_t *spec)
 		return -1;
 	}
 
+	if (reuseport) {
+#if defined(SO_REUSEPORT_LB)
+		/* FreeBSD: load-balance incoming connections across sockets */
+		rv = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT_LB, (void*)&on, sizeof(on));
+#elif defined(SO_REUSEPORT)
+		rv = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (void*)&on, sizeof(on));
+#else /* !SO_REUSEPORT */
+		errno = ENOTSUP;
+		rv = -1;
+#endif /* !SO_REUSEPORT */
+		if (rv == -1) {
+			log_err_level_printf(LOG_CRIT, "Error from setsockopt(SO_REUSEPORT): %s (%i)\n",
+			               strerror(errno), errno);
+			evutil_closesocket(fd);
+			return -1;
+		}
+	}
+
 	if (spec->natsocket && (spec->natsocket(fd) == -1)) {
 		log_err_level_printf(LOG_CRIT, "Error from spec->natsocket()\n");
 		evutil_closesocket(fd);
@@ -357,255 +406,229 @@ privsep_server_update_atime(global_t *global, const userdbkeys_t *keys)
 #endif /* !WITHOUT_USERAUTH */
 
 /*
- * Handle a single request on a readable server socket.
- * Returns 0 on success, 1 on EOF and -1 on error.
+ * Send the answer to request id on srvsock, passing fd unless -1.
+ * The errno err is only sent along with PRIVSEP_ANS_SYS_ERR.
+ * Returns 0 on success and -1 on error.
  */
 static int WUNRES
-privsep_server_handle_req(global_t *global, int srvsock)
+privsep_server_answer(int srvsock, uint32_t id, char status, int err, int fd)
 {
-	char req[PRIVSEP_MAX_REQ_SIZE];
 	char ans[PRIVSEP_MAX_ANS_SIZE];
-	ssize_t n;
-	int mkpath = 0;
+	size_t sz = PRIVSEP_HDR_SIZE;
 
-	if ((n = sys_recvmsgfd(srvsock, req, sizeof(req),
-	                       NULL)) == -1) {
-		if (errno == EPIPE || errno == ECONNRESET) {
-			/* unfriendly EOF, leave server */
-			return 1;
-		}
-		log_err_level_printf(LOG_CRIT, "Failed to receive msg: %s (%i)\n",
+	ans[0] = status;
+	memcpy(ans + 1, &id, sizeof(id));
+	if (status == PRIVSEP_ANS_SYS_ERR) {
+		memcpy(ans + PRIVSEP_HDR_SIZE, &err, sizeof(err));
+		sz += sizeof(err);
+	}
+	// @attention Pass -1 as fd if there is none, otherwise passing 0 opens an stdin (fd 0), causing fd leak
+	if (sys_sendmsgfd(srvsock, ans, sz, fd) == -1) {
+		log_err_level_printf(LOG_CRIT, "Sending message failed: %s (%i)\n",
 		               strerror(errno), errno);
 		return -1;
 	}
-	if (n == 0) {
-		/* EOF, leave server; will not happen for SOCK_DGRAM sockets */
-		return 1;
-	}
-	log_dbg_printf("Received privsep req type %02x sz %zd on srvsock %i\n",
-	               req[0], n, srvsock);
-	switch (req[0]) {
-	case PRIVSEP_REQ_CLOSE: {
-		/* client indicates EOF through close message */
-		return 1;
-	}
+	return 0;
+}
+
+/*
+ * Handle a single request received on srvsock, on a server worker thread.
+ * Answers are tagged with the id of the request, so the client can match
+ * them to its outstanding requests regardless of the order of completion.
+ * Returns 0 on success and -1 on error.
+ */
+static int WUNRES
+privsep_server_handle_req(global_t *global, privsep_server_req_t *req)
+{
+	const char *arg = req->buf + PRIVSEP_HDR_SIZE;
+	size_t argsz = req->n - PRIVSEP_HDR_SIZE;
+	int srvsock = req->srvsock;
+	int mkpath = 0;
+	int reuseport = 0;
+	uint32_t id;
+	int rv;
+
+	memcpy(&id, req->buf + 1, sizeof(id));
+
+	log_dbg_printf("Handling privsep req type %02x id %u sz %zd on srvsock %i\n",
+	               req->buf[0], id, req->n, srvsock);
+	switch (req->buf[0]) {
 	case PRIVSEP_REQ_OPENFILE_P:
 		mkpath = 1;
 		/* fall through */
 	case PRIVSEP_REQ_OPENFILE: {
-		char *fn;
+		char fn[PRIVSEP_MAX_REQ_SIZE];
 		int fd;
 
-		if (n < 2) {
-			ans[0] = PRIVSEP_ANS_INVALID;
-			if (sys_sendmsgfd(srvsock, ans, 1, -1) == -1) {
-				log_err_level_printf(LOG_CRIT, "Sending message failed: %s (%i"
-				               ")\n", strerror(errno), errno);
-				return -1;
-			}
-		}
-		if (!(fn = malloc(n))) {
-			ans[0] = PRIVSEP_ANS_SYS_ERR;
-			*((int*)&ans[1]) = errno;
-			if (sys_sendmsgfd(srvsock, ans, 1 + sizeof(int),
-			                  -1) == -1) {
-				log_err_level_printf(LOG_CRIT, "Sending message failed: %s (%i"
-				               ")\n", strerror(errno), errno);
-				return -1;
-			}
-			return 0;
+		if (argsz < 1) {
+			return privsep_server_answer(srvsock, id,
+			                             PRIVSEP_ANS_INVALID, 0, -1);
 		}
-		memcpy(fn, req + 1, n - 1);
-		fn[n - 1] = '\0';
+		memcpy(fn, arg, argsz);
+		fn[argsz] = '\0';
 		if (privsep_server_openfile_verify(global, fn, mkpath) == -1) {
-			free(fn);
-			ans[0] = PRIVSEP_ANS_DENIED;
-			if (sys_sendmsgfd(srvsock, ans, 1, -1) == -1) {
-				log_err_level_printf(LOG_CRIT, "Sending message failed: %s (%i"
-				               ")\n", strerror(errno), errno);
-				return -1;
-			}
-			return 0;
+			return privsep_server_answer(srvsock, id,
+			                             PRIVSEP_ANS_DENIED, 0, -1);
 		}
 		if ((fd = privsep_server_openfile(fn, mkpath)) == -1) {
-			free(fn);
-			ans[0] = PRIVSEP_ANS_SYS_ERR;
-			*((int*)&ans[1]) = errno;
-			if (sys_sendmsgfd(srvsock, ans, 1 + sizeof(int),
-			                  -1) == -1) {
-				log_err_level_printf(LOG_CRIT, "Sending message failed: %s (%i"
-				               ")\n", strerror(errno), errno);
-				return -1;
-			}
-			return 0;
-		} else {
-			free(fn);
-			ans[0] = PRIVSEP_ANS_SUCCESS;
-			if (sys_sendmsgfd(srvsock, ans, 1, fd) == -1) {
-				close(fd);
-				log_err_level_printf(LOG_CRIT, "Sending message failed: %s (%i"
-				               ")\n", strerror(errno), errno);
-				return -1;
-			}
-			close(fd);
-			return 0;
+			return privsep_server_answer(srvsock, id,
+			                             PRIVSEP_ANS_SYS_ERR, errno, -1);
 		}
-		/* not reached */
-		break;
+		rv = privsep_server_answer(srvsock, id, PRIVSEP_ANS_SUCCESS, 0, fd);
+		close(fd);
+		return rv;
 	}
+	case PRIVSEP_REQ_OPENSOCK_R:
+		reuseport = 1;
+		/* fall through */
 	case PRIVSEP_REQ_OPENSOCK: {
-		proxyspec_t *arg;
+		proxyspec_t *spec;
 		int s;
 
-		if (n != sizeof(char) + sizeof(arg)) {
-			ans[0] = PRIVSEP_ANS_INVALID;
-			if (sys_sendmsgfd(srvsock, ans, 1, -1) == -1) {
-				log_err_level_printf(LOG_CRIT, "Sending message failed: %s (%i"
-				               ")\n", strerror(errno), errno);
-				return -1;
-			}
-			return 0;
+		if (argsz != sizeof(spec)) {
+			return privsep_server_answer(srvsock, id,
+			                             PRIVSEP_ANS_INVALID, 0, -1);
 		}
-		arg = *(proxyspec_t**)(&req[1]);
-		if (privsep_server_opensock_verify(global, arg) == -1) {
-			ans[0] = PRIVSEP_ANS_DENIED;
-			if (sys_sendmsgfd(srvsock, ans, 1, -1) == -1) {
-				log_err_level_printf(LOG_CRIT, "Sending message failed: %s (%i"
-				               ")\n", strerror(errno), errno);
-				return -1;
-			}
-			return 0;
+		memcpy(&spec, arg, sizeof(spec));
+		if (privsep_server_opensock_verify(global, spec) == -1) {
+			return privsep_server_answer(srvsock, id,
+			                             PRIVSEP_ANS_DENIED, 0, -1);
 		}
-		if ((s = privsep_server_opensock(arg)) == -1) {
-			ans[0] = PRIVSEP_ANS_SYS_ERR;
-			*((int*)&ans[1]) = errno;
-			if (sys_sendmsgfd(srvsock, ans, 1 + sizeof(int),
-			                  -1) == -1) {
-				log_err_level_printf(LOG_CRIT, "Sending message failed: %s (%i"
-				               ")\n", strerror(errno), errno);
-				return -1;
-			}
-			return 0;
-		} else {
-			ans[0] = PRIVSEP_ANS_SUCCESS;
-			if (sys_sendmsgfd(srvsock, ans, 1, s) == -1) {
-				evutil_closesocket(s);
-				log_err_level_printf(LOG_CRIT, "Sending message failed: %s (%i"
-				               ")\n", strerror(errno), errno);
-				return -1;
-			}
-			evutil_closesocket(s);
-			return 0;
+		if ((s = privsep_server_opensock(spec, reuseport)) == -1) {
+			return privsep_server_answer(srvsock, id,
+			                             PRIVSEP_ANS_SYS_ERR, errno, -1);
 		}
-		/* not reached */
-		break;
+		rv = privsep_server_answer(srvsock, id, PRIVSEP_ANS_SUCCESS, 0, s);
+		evutil_closesocket(s);
+		return rv;
 	}
 #ifndef WITHOUT_USERAUTH
 	case PRIVSEP_REQ_UPDATE_ATIME: {
-		userdbkeys_t arg;
+		userdbkeys_t keys;
 
-		if (n != sizeof(char) + sizeof(userdbkeys_t)) {
-			ans[0] = PRIVSEP_ANS_INVALID;
-			if (sys_sendmsgfd(srvsock, ans, 1, -1) == -1) {
-				log_err_level_printf(LOG_CRIT, "Sending message failed: %s (%i"
-				               ")\n", strerror(errno), errno);
-				return -1;
-			}
-			return 0;
+		if (argsz != sizeof(userdbkeys_t)) {
+			return privsep_server_answer(srvsock, id,
+			                             PRIVSEP_ANS_INVALID, 0, -1);
 		}
-		arg = *(userdbkeys_t*)(&req[1]);
-		if (privsep_server_update_atime(global, &arg) == -1) {
-			ans[0] = PRIVSEP_ANS_SYS_ERR;
-			*((int*)&ans[1]) = errno;
-			if (sys_sendmsgfd(srvsock, ans, 1 + sizeof(int),
-			                  -1) == -1) {
-				log_err_level_printf(LOG_CRIT, "Sending message failed: %s (%i"
-				               ")\n", strerror(errno), errno);
-				return -1;
-			}
-			return 0;
-		} else {
-			ans[0] = PRIVSEP_ANS_SUCCESS;
-			// @attention Pass -1 as the 4th param, otherwise passing 0 opens an stdin (fd 0), causing fd leak
-			if (sys_sendmsgfd(srvsock, ans, 1, -1) == -1) {
-				log_err_level_printf(LOG_CRIT, "Sending message failed: %s (%i"
-				               ")\n", strerror(errno), errno);
-				return -1;
-			}
-			return 0;
+		// @attention Do not typecast, but memcpy
+		memcpy(&keys, arg, sizeof(userdbkeys_t));
+		// The prepared stmt is shared by all server worker threads
+		pthread_mutex_lock(&privsep_server_userdb_mutex);
+		rv = privsep_server_update_atime(global, &keys);
+		pthread_mutex_unlock(&privsep_server_userdb_mutex);
+		if (rv == -1) {
+			return privsep_server_answer(srvsock, id,
+			                             PRIVSEP_ANS_SYS_ERR, errno, -1);
 		}
-		/* not reached */
-		break;
+		return privsep_server_answer(srvsock, id, PRIVSEP_ANS_SUCCESS, 0, -1);
 	}
 #endif /* !WITHOUT_USERAUTH */
 	case PRIVSEP_REQ_CERTFILE: {
-		char *fn;
+		char fn[PRIVSEP_MAX_REQ_SIZE];
 		int fd;
 
-		if (n < 2) {
-			ans[0] = PRIVSEP_ANS_INVALID;
-			if (sys_sendmsgfd(srvsock, ans, 1, -1) == -1) {
-				log_err_level_printf(LOG_CRIT, "Sending message failed: %s (%i"
-				               ")\n", strerror(errno), errno);
-				return -1;
-			}
-		}
-		if (!(fn = malloc(n))) {
-			ans[0] = PRIVSEP_ANS_SYS_ERR;
-			*((int*)&ans[1]) = errno;
-			if (sys_sendmsgfd(srvsock, ans, 1 + sizeof(int),
-			                  -1) == -1) {
-				log_err_level_printf(LOG_CRIT, "Sending message failed: %s (%i"
-				               ")\n", strerror(errno), errno);
-				return -1;
-			}
-			return 0;
+		if (argsz < 1) {
+			return privsep_server_answer(srvsock, id,
+			                             PRIVSEP_ANS_INVALID, 0, -1);
 		}
-		memcpy(fn, req + 1, n - 1);
-		fn[n - 1] = '\0';
+		memcpy(fn, arg, argsz);
+		fn[argsz] = '\0';
 		if (privsep_server_certfile_verify(global, fn) == -1) {
-			free(fn);
-			ans[0] = PRIVSEP_ANS_DENIED;
-			if (sys_sendmsgfd(srvsock, ans, 1, -1) == -1) {
-				log_err_level_printf(LOG_CRIT, "Sending message failed: %s (%i"
-				               ")\n", strerror(errno), errno);
-				return -1;
-			}
-			return 0;
+			return privsep_server_answer(srvsock, id,
+			                             PRIVSEP_ANS_DENIED, 0, -1);
 		}
 		if ((fd = privsep_server_certfile(fn)) == -1) {
-			free(fn);
-			ans[0] = PRIVSEP_ANS_SYS_ERR;
-			*((int*)&ans[1]) = errno;
-			if (sys_sendmsgfd(srvsock, ans, 1 + sizeof(int),
-			                  -1) == -1) {
-				log_err_level_printf(LOG_CRIT, "Sending message failed: %s (%i"
-				               ")\n", strerror(errno), errno);
-				return -1;
-			}
-			return 0;
-		} else {
-			free(fn);
-			ans[0] = PRIVSEP_ANS_SUCCESS;
-			if (sys_sendmsgfd(srvsock, ans, 1, fd) == -1) {
-				close(fd);
-				log_err_level_printf(LOG_CRIT, "Sending message failed: %s (%i"
-				               ")\n", strerror(errno), errno);
-				return -1;
-			}
-			close(fd);
-			return 0;
+			return privsep_server_answer(srvsock, id,
+			                             PRIVSEP_ANS_SYS_ERR, errno, -1);
 		}
-		/* not reached */
-		break;
+		rv = privsep_server_answer(srvsock, id, PRIVSEP_ANS_SUCCESS, 0, fd);
+		close(fd);
+		return rv;
 	}
 	default:
-		ans[0] = PRIVSEP_ANS_UNK_CMD;
-		if (sys_sendmsgfd(srvsock, ans, 1, -1) == -1) {
-			log_err_level_printf(LOG_CRIT, "Sending message failed: %s (%i"
-			               ")\n", strerror(errno), errno);
-			return -1;
+		return privsep_server_answer(srvsock, id, PRIVSEP_ANS_UNK_CMD, 0, -1);
+	}
+	/* not reached */
+	return 0;
+}
+
+/*
+ * Server worker thread, handling the requests received by the monitor loop.
+ * Slow requests such as opening log files with mkpath only hold up the
+ * worker handling them, not the requests queued behind them.
+ * On error, the monitor loop is woken up through the self-pipe to exit.
+ */
+static void *
+privsep_server_thr(void *arg)
+{
+	global_t *global = arg;
+	privsep_server_req_t *req;
+
+	while ((req = thrqueue_dequeue(privsep_server_queue))) {
+		if (privsep_server_handle_req(global, req) == -1) {
+			log_err_level_printf(LOG_CRIT, "Failed to handle privsep req "
+			               "on srvsock %i\n", req->srvsock);
+			__atomic_store_n(&privsep_server_failed, 1, __ATOMIC_RELAXED);
+			if (selfpipe_wrfd != -1) {
+				int rv = write(selfpipe_wrfd, "!", 1);
+				(void) rv;
+			}
+		}
+		free(req);
+	}
+	return NULL;
+}
+
+/*
+ * Receive a single request on a readable server socket and queue it for
+ * the server worker threads.
+ * Returns 0 on success, 1 on EOF and -1 on error.
+ */
+static int WUNRES
+privsep_server_recv_req(int srvsock)
+{
+	privsep_server_req_t *req;
+	ssize_t n;
+
+	if (!(req = malloc(sizeof(privsep_server_req_t)))) {
+		log_err_level_printf(LOG_CRIT, "Failed to allocate privsep req\n");
+		return -1;
+	}
+	if ((n = sys_recvmsgfd(srvsock, req->buf, sizeof(req->buf),
+	                       NULL)) == -1) {
+		free(req);
+		if (errno == EPIPE || errno == ECONNRESET) {
+			/* unfriendly EOF, leave server */
+			return 1;
 		}
+		log_err_level_printf(LOG_CRIT, "Failed to receive msg: %s (%i)\n",
+		               strerror(errno), errno);
+		return -1;
+	}
+	if (n == 0) {
+		/* EOF, leave server; will not happen for SOCK_DGRAM sockets */
+		free(req);
+		return 1;
+	}
+	log_dbg_printf("Received privsep req type %02x sz %zd on srvsock %i\n",
+	               req->buf[0], n, srvsock);
+	if (req->buf[0] == PRIVSEP_REQ_CLOSE) {
+		/* client indicates EOF through close message */
+		free(req);
+		return 1;
+	}
+	if (n < (ssize_t)PRIVSEP_HDR_SIZE) {
+		/* cannot answer without a request id */
+		log_err_level_printf(LOG_WARNING, "Dropping truncated privsep req "
+		               "on srvsock %i\n", srvsock);
+		free(req);
+		return 0;
+	}
+	req->srvsock = srvsock;
+	req->n = n;
+	if (!thrqueue_enqueue(privsep_server_queue, req)) {
+		free(req);
+		return -1;
 	}
 	return 0;
 }
@@ -622,8 +645,8 @@ privsep_server_handle_req(global_t *global, int srvsock)
  * Returns 0 on a successful clean exit and -1 on errors.
  */
 static int
-privsep_server(global_t *global, int sigpipe, int srvsock[], size_t nsrvsock,
-               pid_t childpid)
+privsep_server_loop(global_t *global, int sigpipe, int srvsock[],
+                    size_t nsrvsock, pid_t childpid)
 {
 	int srveof[nsrvsock];
 	size_t i = 0;
@@ -675,6 +698,10 @@ privsep_server(global_t *global, int sigpipe, int srvsock[], size_t nsrvsock,
 				               strerror(errno), errno);
 				return -1;
 			}
+			if (__atomic_load_n(&privsep_server_failed,
+			                    __ATOMIC_RELAXED)) {
+				return -1;
+			}
 			if (received_sigquit) {
 				if (kill(childpid, SIGQUIT) == -1) {
 					log_err_level_printf(LOG_CRIT, "kill(%i,SIGQUIT) "
@@ -739,10 +766,9 @@ privsep_server(global_t *global, int sigpipe, int srvsock[], size_t nsrvsock,
 
 		for (i = 0; i < nsrvsock; i++) {
 			if (FD_ISSET(srvsock[i], &readfds)) {
-				int rv = privsep_server_handle_req(global,
-				                                   srvsock[i]);
+				int rv = privsep_server_recv_req(srvsock[i]);
 				if (rv == -1) {
-					log_err_level_printf(LOG_CRIT, "Failed to handle "
+					log_err_level_printf(LOG_CRIT, "Failed to receive "
 					               "privsep req "
 					               "on srvsock %i\n",
 					               srvsock[i]);
@@ -767,220 +793,499 @@ privsep_server(global_t *global, int sigpipe, int srvsock[], size_t nsrvsock,
 	return 0;
 }
 
-int
-privsep_client_openfile(int clisock, const char *fn, int mkpath)
+/*
+ * Run the privilege separation server with its pool of worker threads.
+ * Returns 0 on a successful clean exit and -1 on errors.
+ */
+static int
+privsep_server(global_t *global, int sigpipe, int srvsock[], size_t nsrvsock,
+               pid_t childpid)
 {
+	pthread_t thr[PRIVSEP_SERVER_THREADS];
+	int nthr, rv;
+
+	if (!(privsep_server_queue = thrqueue_new(PRIVSEP_SERVER_QUEUE_SIZE))) {
+		log_err_level_printf(LOG_CRIT, "Failed to create privsep queue\n");
+		return -1;
+	}
+	for (nthr = 0; nthr < PRIVSEP_SERVER_THREADS; nthr++) {
+		if (pthread_create(&thr[nthr], NULL, privsep_server_thr,
+		                   global)) {
+			log_err_level_printf(LOG_CRIT, "Failed to start privsep "
+			               "thread %i\n", nthr);
+			break;
+		}
+	}
+
+	rv = nthr ? privsep_server_loop(global, sigpipe, srvsock, nsrvsock,
+	                                childpid) : -1;
+
+	/* let the workers finish the queued requests, then leave */
+	thrqueue_unblock_dequeue(privsep_server_queue);
+	while (nthr > 0) {
+		pthread_join(thr[--nthr], NULL);
+	}
+	thrqueue_free(privsep_server_queue);
+	privsep_server_queue = NULL;
+	return rv;
+}
+
+/*
+ * Outstanding request of a privsep client.  Synchronous requests live on
+ * the stack of the waiting thread; asynchronous requests are allocated and
+ * completed on the event base given by the caller, if any.
+ */
+typedef struct privsep_client privsep_client_t;
+typedef struct privsep_client_req privsep_client_req_t;
+struct privsep_client_req {
+	uint32_t id;
+	int done;
+	int async;
+	ssize_t n;
+	int fd;
 	char ans[PRIVSEP_MAX_ANS_SIZE];
-	char req[1 + strlen(fn)];
-	int fd = -1;
+	struct event *ev;
+	privsep_client_cb_t cb;
+	void *arg;
+	privsep_client_t *client;
+	privsep_client_req_t *next;
+};
+
+/*
+ * Client side state of a privsep client socket.  The receiver thread is
+ * the only reader of the socket, started on the first request, and passes
+ * the answers to the outstanding requests with matching ids.  Completed
+ * async requests wait on the completed list until their event runs.
+ */
+struct privsep_client {
+	int sock;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_t thr;
+	int running;
+	int eof;
+	uint32_t next_id;
+	privsep_client_req_t *pending;
+	privsep_client_req_t *completed;
+};
+
+static privsep_client_t *privsep_clients;
+static size_t privsep_nclients;
+
+static privsep_client_t *
+privsep_client_find(int clisock)
+{
+	for (size_t i = 0; i < privsep_nclients; i++) {
+		if (privsep_clients[i].sock == clisock)
+			return &privsep_clients[i];
+	}
+	errno = EBADF;
+	return NULL;
+}
+
+/*
+ * Mark req as completed with the answer in ans of size n, or with n == 0
+ * if the socket was closed.  Must be called with the client mutex held.
+ */
+static void
+privsep_client_complete(privsep_client_t *client, privsep_client_req_t *req,
+                        const char *ans, ssize_t n, int fd)
+{
+	if (n > 0)
+		memcpy(req->ans, ans, n);
+	req->n = n;
+	req->fd = fd;
+	req->done = 1;
+	if (!req->async) {
+		pthread_cond_broadcast(&client->cond);
+	} else if (req->ev) {
+		req->next = client->completed;
+		client->completed = req;
+		// Event bases are created after evthread_use_pthreads(), so this is thread-safe
+		event_active(req->ev, 0, 0);
+	} else {
+		/* nobody is interested in the answer */
+		if (fd != -1)
+			close(fd);
+		free(req);
+	}
+}
+
+static void *
+privsep_client_thr(void *arg)
+{
+	privsep_client_t *client = arg;
+	privsep_client_req_t *req, **preq;
+	char ans[PRIVSEP_MAX_ANS_SIZE];
+	uint32_t id;
 	ssize_t n;
+	int fd;
 
-	if (privsep_fastpath)
-		return privsep_server_openfile(fn, mkpath);
+	for (;;) {
+		fd = -1;
+		if ((n = sys_recvmsgfd(client->sock, ans, sizeof(ans), &fd)) <= 0)
+			break;
+		if (n < (ssize_t)PRIVSEP_HDR_SIZE) {
+			if (fd != -1)
+				close(fd);
+			continue;
+		}
+		memcpy(&id, ans + 1, sizeof(id));
 
-	req[0] = mkpath ? PRIVSEP_REQ_OPENFILE_P : PRIVSEP_REQ_OPENFILE;
-	memcpy(req + 1, fn, sizeof(req) - 1);
+		pthread_mutex_lock(&client->mutex);
+		for (preq = &client->pending; *preq; preq = &(*preq)->next) {
+			if ((*preq)->id == id)
+				break;
+		}
+		if (!(req = *preq)) {
+			pthread_mutex_unlock(&client->mutex);
+			log_err_level_printf(LOG_WARNING, "Unexpected privsep answer "
+			               "id %u on clisock %i\n", id, client->sock);
+			if (fd != -1)
+				close(fd);
+			continue;
+		}
+		*preq = req->next;
+		privsep_client_complete(client, req, ans, n, fd);
+		pthread_mutex_unlock(&client->mutex);
+	}
 
-	if (sys_sendmsgfd(clisock, req, sizeof(req), -1) == -1) {
-		return -1;
+	/* socket closed, fail all outstanding requests */
+	pthread_mutex_lock(&client->mutex);
+	client->eof = 1;
+	while ((req = client->pending)) {
+		client->pending = req->next;
+		privsep_client_complete(client, req, NULL, 0, -1);
 	}
+	pthread_mutex_unlock(&client->mutex);
+	return NULL;
+}
+
+/*
+ * Send a request to the server, tagged with a new request id.
+ * The command byte is expected in buf[0], followed by room for the id.
+ * Returns 0 on success and -1 on error with errno set.
+ */
+static int
+privsep_client_send(privsep_client_t *client, privsep_client_req_t *req,
+                    char *buf, size_t bufsz)
+{
+	privsep_client_req_t **preq;
 
-	if ((n = sys_recvmsgfd(clisock, ans, sizeof(ans), &fd)) == -1) {
+	pthread_mutex_lock(&client->mutex);
+	if (client->eof) {
+		pthread_mutex_unlock(&client->mutex);
+		errno = EPIPE;
 		return -1;
 	}
-
-	if (n < 1) {
-		errno = EINVAL;
+	if (!client->running) {
+		if (pthread_create(&client->thr, NULL, privsep_client_thr,
+		                   client)) {
+			pthread_mutex_unlock(&client->mutex);
+			errno = EAGAIN;
+			return -1;
+		}
+		client->running = 1;
+	}
+	req->id = client->next_id++;
+	req->done = 0;
+	req->next = client->pending;
+	client->pending = req;
+	pthread_mutex_unlock(&client->mutex);
+
+	memcpy(buf + 1, &req->id, sizeof(req->id));
+	if (sys_sendmsgfd(client->sock, buf, bufsz, -1) == -1) {
+		int e = errno;
+		pthread_mutex_lock(&client->mutex);
+		for (preq = &client->pending; *preq; preq = &(*preq)->next) {
+			if (*preq == req) {
+				*preq = req->next;
+				break;
+			}
+		}
+		pthread_mutex_unlock(&client->mutex);
+		errno = e;
 		return -1;
 	}
+	return 0;
+}
+
+/*
+ * Decode the answer of a completed request.
+ * Returns the passed fd, or 0 if none, on success and -1 on error with
+ * errno set.
+ */
+static int
+privsep_client_result(privsep_client_req_t *req)
+{
+	int err;
 
-	switch (ans[0]) {
+	if (req->n == 0) {
+		errno = EPIPE;
+		return -1;
+	}
+	switch (req->ans[0]) {
 	case PRIVSEP_ANS_SUCCESS:
-		break;
+		return req->fd == -1 ? 0 : req->fd;
 	case PRIVSEP_ANS_DENIED:
 		errno = EACCES;
-		return -1;
+		break;
 	case PRIVSEP_ANS_SYS_ERR:
-		if (n < (ssize_t)(1 + sizeof(int))) {
+		if (req->n < (ssize_t)PRIVSEP_MAX_ANS_SIZE) {
 			errno = EINVAL;
-			return -1;
+			break;
 		}
-		errno = *((int*)&ans[1]);
-		return -1;
+		memcpy(&err, req->ans + PRIVSEP_HDR_SIZE, sizeof(err));
+		errno = err;
+		break;
 	case PRIVSEP_ANS_UNK_CMD:
 	case PRIVSEP_ANS_INVALID:
 	default:
 		errno = EINVAL;
-		return -1;
+		break;
 	}
-
-	return fd;
+	if (req->fd != -1)
+		close(req->fd);
+	return -1;
 }
 
-int
-privsep_client_opensock(int clisock, const proxyspec_t *spec)
+/*
+ * Synchronous request: send buf and block until the answer arrives, while
+ * other threads may have their own requests outstanding on the same socket.
+ * Returns the passed fd, or 0 if none, on success and -1 on error.
+ */
+static int
+privsep_client_request(int clisock, char *buf, size_t bufsz)
 {
-	char ans[PRIVSEP_MAX_ANS_SIZE];
-	char req[1 + sizeof(spec)];
-	int fd = -1;
-	ssize_t n;
-
-	if (privsep_fastpath)
-		return privsep_server_opensock(spec);
+	privsep_client_t *client;
+	privsep_client_req_t req;
 
-	req[0] = PRIVSEP_REQ_OPENSOCK;
-	*((const proxyspec_t **)&req[1]) = spec;
+	if (!(client = privsep_client_find(clisock)))
+		return -1;
 
-	if (sys_sendmsgfd(clisock, req, sizeof(req), -1) == -1) {
+	memset(&req, 0, sizeof(req));
+	req.fd = -1;
+	if (privsep_client_send(client, &req, buf, bufsz) == -1)
 		return -1;
+
+	pthread_mutex_lock(&client->mutex);
+	while (!req.done) {
+		pthread_cond_wait(&client->cond, &client->mutex);
 	}
+	pthread_mutex_unlock(&client->mutex);
+	return privsep_client_result(&req);
+}
 
-	if ((n = sys_recvmsgfd(clisock, ans, sizeof(ans), &fd)) == -1) {
-		return -1;
+#ifndef WITHOUT_USERAUTH
+/*
+ * Run the callback of a completed async request on its event base.
+ * The callback takes ownership of the passed fd, if any.
+ */
+static void
+privsep_client_async_cb(UNUSED evutil_socket_t fd, UNUSED short what,
+                        void *arg)
+{
+	privsep_client_req_t *req = arg;
+	privsep_client_t *client = req->client;
+	privsep_client_req_t **preq;
+	int found = 0;
+	int rv;
+
+	pthread_mutex_lock(&client->mutex);
+	for (preq = &client->completed; *preq; preq = &(*preq)->next) {
+		if (*preq == req) {
+			*preq = req->next;
+			found = 1;
+			break;
+		}
 	}
+	pthread_mutex_unlock(&client->mutex);
+	/* privsep_client_close() took the req and frees it */
+	if (!found)
+		return;
+
+	rv = privsep_client_result(req);
+	req->cb(rv, rv == -1 ? errno : 0, req->arg);
+	event_free(req->ev);
+	free(req);
+}
 
-	if (n < 1) {
-		errno = EINVAL;
+/*
+ * Asynchronous request: send buf and return without waiting for the answer.
+ * If evbase is given, cb is called with the result and arg on the thread of
+ * evbase once the answer arrives; otherwise the answer is discarded.
+ * Returns 0 if the request was sent and -1 on error.
+ */
+static int
+privsep_client_request_async(int clisock, char *buf, size_t bufsz,
+                             struct event_base *evbase,
+                             privsep_client_cb_t cb, void *arg)
+{
+	privsep_client_t *client;
+	privsep_client_req_t *req;
+
+	if (!(client = privsep_client_find(clisock)))
 		return -1;
-	}
 
-	switch (ans[0]) {
-	case PRIVSEP_ANS_SUCCESS:
-		break;
-	case PRIVSEP_ANS_DENIED:
-		errno = EACCES;
+	if (!(req = malloc(sizeof(privsep_client_req_t))))
 		return -1;
-	case PRIVSEP_ANS_SYS_ERR:
-		if (n < (ssize_t)(1 + sizeof(int))) {
-			errno = EINVAL;
+	memset(req, 0, sizeof(privsep_client_req_t));
+	req->fd = -1;
+	req->async = 1;
+	req->client = client;
+	if (evbase && cb) {
+		if (!(req->ev = event_new(evbase, -1, 0,
+		                          privsep_client_async_cb, req))) {
+			free(req);
 			return -1;
 		}
-		errno = *((int*)&ans[1]);
+		req->cb = cb;
+		req->arg = arg;
+	}
+
+	if (privsep_client_send(client, req, buf, bufsz) == -1) {
+		int e = errno;
+		if (req->ev)
+			event_free(req->ev);
+		free(req);
+		errno = e;
 		return -1;
-	case PRIVSEP_ANS_UNK_CMD:
-	case PRIVSEP_ANS_INVALID:
-	default:
-		errno = EINVAL;
+	}
+	return 0;
+}
+#endif /* !WITHOUT_USERAUTH */
+
+int
+privsep_client_openfile(int clisock, const char *fn, int mkpath)
+{
+	size_t fnsz = strlen(fn);
+	char req[PRIVSEP_HDR_SIZE + fnsz];
+
+	if (privsep_fastpath)
+		return privsep_server_openfile(fn, mkpath);
+
+	if (sizeof(req) > PRIVSEP_MAX_REQ_SIZE) {
+		errno = ENAMETOOLONG;
 		return -1;
 	}
+	req[0] = mkpath ? PRIVSEP_REQ_OPENFILE_P : PRIVSEP_REQ_OPENFILE;
+	memcpy(req + PRIVSEP_HDR_SIZE, fn, fnsz);
 
-	return fd;
+	return privsep_client_request(clisock, req, sizeof(req));
 }
 
 int
-privsep_client_certfile(int clisock, const char *fn)
+privsep_client_opensock(int clisock, const proxyspec_t *spec, int reuseport)
 {
-	char ans[PRIVSEP_MAX_ANS_SIZE];
-	char req[1 + strlen(fn)];
-	int fd = -1;
-	ssize_t n;
+	char req[PRIVSEP_HDR_SIZE + sizeof(spec)];
 
 	if (privsep_fastpath)
-		return privsep_server_certfile(fn);
+		return privsep_server_opensock(spec, reuseport);
 
-	req[0] = PRIVSEP_REQ_CERTFILE;
-	memcpy(req + 1, fn, sizeof(req) - 1);
+	req[0] = reuseport ? PRIVSEP_REQ_OPENSOCK_R : PRIVSEP_REQ_OPENSOCK;
+	memcpy(req + PRIVSEP_HDR_SIZE, &spec, sizeof(spec));
 
-	if (sys_sendmsgfd(clisock, req, sizeof(req), -1) == -1) {
-		return -1;
-	}
+	return privsep_client_request(clisock, req, sizeof(req));
+}
 
-	if ((n = sys_recvmsgfd(clisock, ans, sizeof(ans), &fd)) == -1) {
-		return -1;
-	}
+int
+privsep_client_certfile(int clisock, const char *fn)
+{
+	size_t fnsz = strlen(fn);
+	char req[PRIVSEP_HDR_SIZE + fnsz];
 
-	if (n < 1) {
-		errno = EINVAL;
-		return -1;
-	}
+	if (privsep_fastpath)
+		return privsep_server_certfile(fn);
 
-	switch (ans[0]) {
-	case PRIVSEP_ANS_SUCCESS:
-		break;
-	case PRIVSEP_ANS_DENIED:
-		errno = EACCES;
-		return -1;
-	case PRIVSEP_ANS_SYS_ERR:
-		if (n < (ssize_t)(1 + sizeof(int))) {
-			errno = EINVAL;
-			return -1;
-		}
-		errno = *((int*)&ans[1]);
-		return -1;
-	case PRIVSEP_ANS_UNK_CMD:
-	case PRIVSEP_ANS_INVALID:
-	default:
-		errno = EINVAL;
+	if (sizeof(req) > PRIVSEP_MAX_REQ_SIZE) {
+		errno = ENAMETOOLONG;
 		return -1;
 	}
+	req[0] = PRIVSEP_REQ_CERTFILE;
+	memcpy(req + PRIVSEP_HDR_SIZE, fn, fnsz);
 
-	return fd;
+	return privsep_client_request(clisock, req, sizeof(req));
 }
 
 int
 privsep_client_close(int clisock)
 {
-	char req[1];
+	privsep_client_t *client;
+	privsep_client_req_t *areq, *completed;
+	char req[PRIVSEP_HDR_SIZE];
+	int rv = 0;
 
+	memset(req, 0, sizeof(req));
 	req[0] = PRIVSEP_REQ_CLOSE;
 
 	if (sys_sendmsgfd(clisock, req, sizeof(req), -1) == -1) {
-		close(clisock);
-		return -1;
+		rv = -1;
+	}
+
+	/* wake up and join the receiver thread, failing outstanding reqs */
+	if ((client = privsep_client_find(clisock))) {
+		pthread_mutex_lock(&client->mutex);
+		int running = client->running;
+		client->running = 0;
+		client->eof = 1;
+		pthread_mutex_unlock(&client->mutex);
+		if (running) {
+			shutdown(clisock, SHUT_RDWR);
+			pthread_join(client->thr, NULL);
+		}
+		/* the event loops may still be running their callbacks, which
+		 * lock the mutex, so detach the completed async reqs under the
+		 * lock and free them after unlocking, while their event bases
+		 * still exist; event_free() waits for a running callback */
+		pthread_mutex_lock(&client->mutex);
+		completed = client->completed;
+		client->completed = NULL;
+		pthread_mutex_unlock(&client->mutex);
+		while ((areq = completed)) {
+			completed = areq->next;
+			if (areq->fd != -1)
+				close(areq->fd);
+			event_free(areq->ev);
+			free(areq);
+		}
+		client->sock = -1;
 	}
 
 	close(clisock);
-	return 0;
+	return rv;
 }
 
 #ifndef WITHOUT_USERAUTH
 int
 privsep_client_update_atime(int clisock, const userdbkeys_t *keys)
 {
-	char ans[PRIVSEP_MAX_ANS_SIZE];
-	char req[1 + sizeof(userdbkeys_t)];
-	ssize_t n;
+	char req[PRIVSEP_HDR_SIZE + sizeof(userdbkeys_t)];
 
 	req[0] = PRIVSEP_REQ_UPDATE_ATIME;
 	// @attention Do not typecast, but memcpy
-	//*((const userdbkeys_t **)&req[1]) = keys;
-	memcpy(req + 1, keys, sizeof(req) - 1);
+	memcpy(req + PRIVSEP_HDR_SIZE, keys, sizeof(userdbkeys_t));
 
-	if (sys_sendmsgfd(clisock, req, sizeof(req), -1) == -1) {
-		return -1;
-	}
+	// Does not return an fd
+	return privsep_client_request(clisock, req, sizeof(req));
+}
 
-	// @attention Pass NULL as the 4th param, otherwise other privsep calls cannot get the fds they request
-	if ((n = sys_recvmsgfd(clisock, ans, sizeof(ans), NULL)) == -1) {
-		return -1;
-	}
+/*
+ * Update the atime of the user without blocking the calling event loop.
+ * If evbase and cb are given, cb is called on the thread of evbase with the
+ * result of the update; otherwise the result is discarded.
+ */
+int
+privsep_client_update_atime_async(int clisock, const userdbkeys_t *keys,
+                                  struct event_base *evbase,
+                                  privsep_client_cb_t cb, void *arg)
+{
+	char req[PRIVSEP_HDR_SIZE + sizeof(userdbkeys_t)];
 
-	if (n < 1) {
-		errno = EINVAL;
-		return -1;
-	}
+	req[0] = PRIVSEP_REQ_UPDATE_ATIME;
+	memcpy(req + PRIVSEP_HDR_SIZE, keys, sizeof(userdbkeys_t));
 
-	switch (ans[0]) {
-	case PRIVSEP_ANS_SUCCESS:
-		break;
-	case PRIVSEP_ANS_DENIED:
-		errno = EACCES;
-		return -1;
-	case PRIVSEP_ANS_SYS_ERR:
-		if (n < (ssize_t)(1 + sizeof(int))) {
-			errno = EINVAL;
-			return -1;
-		}
-		errno = *((int*)&ans[1]);
-		return -1;
-	case PRIVSEP_ANS_UNK_CMD:
-	case PRIVSEP_ANS_INVALID:
-	default:
-		errno = EINVAL;
-		return -1;
-	}
-	// Does not return an fd
-	return 0;
+	return privsep_client_request_async(clisock, req, sizeof(req),
+	                                    evbase, cb, arg);
 }
 #endif /* !WITHOUT_USERAUTH */
 
@@ -1013,6 +1318,12 @@ privsep_fork(global_t *global, int clisock[], size_t nclisock, int *parent_rv)
 	received_sigchld = 0;
 	received_sigusr1 = 0;
 
+	if (!(privsep_clients = malloc(nclisock * sizeof(privsep_client_t)))) {
+		log_err_level_printf(LOG_CRIT, "Failed to allocate privsep clients\n");
+		return -1;
+	}
+	memset(privsep_clients, 0, nclisock * sizeof(privsep_client_t));
+
 	if (pipe(selfpipev) == -1) {
 		log_err_level_printf(LOG_CRIT, "Failed to create self-pipe: %s (%i)\n",
 		               strerror(errno), errno);
@@ -1069,12 +1380,19 @@ privsep_fork(global_t *global, int clisock[], size_t nclisock, int *parent_rv)
 		} while (n == -1 && errno == EINTR);
 		close(chldpipev[0]);
 		log_dbg_printf("Privsep child pid %i\n", getpid());
+		privsep_nclients = nclisock;
 		/* return the privsep client sockets */
-		for (size_t i = 0; i < nclisock; i++)
+		for (size_t i = 0; i < nclisock; i++) {
 			clisock[i] = sockcliv[i][1];
+			privsep_clients[i].sock = clisock[i];
+			pthread_mutex_init(&privsep_clients[i].mutex, NULL);
+			pthread_cond_init(&privsep_clients[i].cond, NULL);
+		}
 		return 0;
 	}
 	/* parent */
+	free(privsep_clients);
+	privsep_clients = NULL;
 	for (size_t i = 0; i < nclisock; i++)
 		close(sockcliv[i][1]);
 	selfpipe_wrfd = selfpipev[1];
@@ -32,14 +32,22 @@
 #include "attrib.h"
 #include "opts.h"
 
+#include <event2/event.h>
+
+/* completion callback of async requests: result, errno, arg */
+typedef void (*privsep_client_cb_t)(int, int, void *);
+
 int privsep_fork(global_t *, int[], size_t, int *);
 
 int privsep_client_openfile(int, const char *, int);
-int privsep_client_opensock(int, const proxyspec_t *spec);
+int privsep_client_opensock(int, const proxyspec_t *spec, int);
 int privsep_client_certfile(int, const char *);
 int privsep_client_close(int);
 #ifndef WITHOUT_USERAUTH
 int privsep_client_update_atime(int, const userdbkeys_t *);
+int privsep_client_update_atime_async(int, const userdbkeys_t *,
+                                      struct event_base *,
+                                      privsep_client_cb_t, void *);
 #endif /* !WITHOUT_USERAUTH */
 #endif /* !PRIVSEP_H */
 
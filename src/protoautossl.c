@@ -30,6 +30,7 @@
 #include "protoautossl.h"
 #include "prototcp.h"
 #include "protossl.h"
+#include "util.h"
 
 #include <string.h>
 #include <sys/param.h>
@@ -277,12 +278,20 @@ protoautossl_peek_and_upgrade(pxy_conn_ctx_t *ctx)
 
 				// Change p in sslproxy_header to s
 				if (ctx->sslproxy_header) {
+					// Conns using the shared return listener are registered by their SSLproxy line
+					int retconn = ctx->retconn;
+					pxy_thr_retconn_del(ctx);
+
 					free(ctx->sslproxy_header);
 					ctx->sslproxy_header = NULL;
 					ctx->sslproxy_header_len = 0;
 					if (pxy_set_sslproxy_header(ctx, 1) == -1) {
 						return -1;
 					}
+					if (retconn && pxy_thr_retconn_add(ctx) == -1) {
+						log_err_level(LOG_CRIT, "Cannot register conn with shared return listener in autossl");
+						return -1;
+					}
 				} else {
 					log_err_level(LOG_CRIT, "No sslproxy_header set up in divert mode in autossl");
 					return -1;
@@ -321,23 +330,29 @@ protoautossl_conn_connect(pxy_conn_ctx_t *ctx)
 }
 
 static void
-protoautossl_try_set_watermark(struct bufferevent *bev, pxy_conn_ctx_t *ctx, struct bufferevent *other)
+protoautossl_try_set_watermark(pxy_conn_desc_t *desc, pxy_conn_ctx_t *ctx, struct bufferevent *other)
 {
 	struct bufferevent *ubev_other = bufferevent_get_underlying(other);
-	if (evbuffer_get_length(bufferevent_get_output(other)) >= OUTBUF_LIMIT ||
-			(ubev_other && evbuffer_get_length(bufferevent_get_output(ubev_other)) >= OUTBUF_LIMIT)) {
-		log_fine_va("%s", prototcp_get_event_name(bev, ctx));
+	size_t limit = prototcp_outbuf_limit(ctx, desc);
+	size_t len = evbuffer_get_length(bufferevent_get_output(other));
+
+	if (ubev_other)
+		len = util_max(len, evbuffer_get_length(bufferevent_get_output(ubev_other)));
+
+	if (len >= limit) {
+		log_fine_va("%s", prototcp_get_event_name(desc->bev, ctx));
 
 		/* temporarily disable data source;
 		 * set an appropriate watermark. */
-		bufferevent_setwatermark(other, EV_WRITE, OUTBUF_LIMIT/2, OUTBUF_LIMIT);
-		bufferevent_disable(bev, EV_READ);
+		bufferevent_setwatermark(other, EV_WRITE, limit/2, limit);
+		bufferevent_disable(desc->bev, EV_READ);
 
 		/* The watermark for ubev_other may be already set, see pxy_try_unset_watermark,
 		 * but getting is equally expensive as setting */
 		if (ubev_other)
-			bufferevent_setwatermark(ubev_other, EV_WRITE, OUTBUF_LIMIT/2, OUTBUF_LIMIT);
+			bufferevent_setwatermark(ubev_other, EV_WRITE, limit/2, limit);
 
+		prototcp_outbuf_throttled(ctx, desc, len);
 		ctx->thr->set_watermarks++;
 	}
 }
@@ -348,16 +363,22 @@ protoautossl_try_unset_watermark(struct bufferevent *bev, pxy_conn_ctx_t *ctx, p
 	if (other->bev && !(bufferevent_get_enabled(other->bev) & EV_READ)) {
 		log_fine_va("%s", prototcp_get_event_name(bev, ctx));
 
+		/* Do not reset the watermark for ubev without checking its buf len,
+		 * because the current write event may be due to the buf len of bev
+		 * falling below the low watermark, not that of ubev */
+		struct bufferevent *ubev = bufferevent_get_underlying(bev);
+		size_t limit = prototcp_outbuf_limit(ctx, other);
+		size_t len = evbuffer_get_length(bufferevent_get_output(bev));
+		size_t ulen = ubev ? evbuffer_get_length(bufferevent_get_output(ubev)) : 0;
+
+		prototcp_outbuf_adapt(ctx, other, util_max(len, ulen));
+
 		/* data source temporarily disabled;
 		 * re-enable and reset watermark to 0. */
 		bufferevent_setwatermark(bev, EV_WRITE, 0, 0);
 		bufferevent_enable(other->bev, EV_READ);
 
-		/* Do not reset the watermark for ubev without checking its buf len,
-		 * because the current write event may be due to the buf len of bev
-		 * falling below OUTBUF_LIMIT/2, not that of ubev */
-		struct bufferevent *ubev = bufferevent_get_underlying(bev);
-		if (ubev && evbuffer_get_length(bufferevent_get_output(ubev)) < OUTBUF_LIMIT/2)
+		if (ubev && ulen < limit/2)
 			bufferevent_setwatermark(ubev, EV_WRITE, 0, 0);
 
 		ctx->thr->unset_watermarks++;
@@ -433,7 +454,7 @@ protoautossl_bev_readcb_src(struct bufferevent *bev, pxy_conn_ctx_t *ctx)
 		return;
 	}
 
-	ctx->protoctx->set_watermarkcb(bev, ctx, ctx->dst.bev);
+	ctx->protoctx->set_watermarkcb(&ctx->src, ctx, ctx->dst.bev);
 }
 
 static void NONNULL(1)
@@ -456,7 +477,7 @@ protoautossl_bev_readcb_srvdst(struct bufferevent *bev, pxy_conn_ctx_t *ctx)
 	}
 
 	evbuffer_add_buffer(bufferevent_get_output(ctx->src.bev), bufferevent_get_input(bev));
-	ctx->protoctx->set_watermarkcb(bev, ctx, ctx->src.bev);
+	ctx->protoctx->set_watermarkcb(&ctx->srvdst, ctx, ctx->src.bev);
 }
 
 static int NONNULL(1) WUNRES
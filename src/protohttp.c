@@ -37,15 +37,24 @@
 #include "url.h"
 
 #include <string.h>
+#include <stdlib.h>
+#include <limits.h>
 #include <event2/bufferevent.h>
 
+/*
+ * Log the conn with the current response and the request req, or the request
+ * in the HTTP ctx if req is NULL.
+ */
 static void NONNULL(1)
-protohttp_log_connect(pxy_conn_ctx_t *ctx)
+protohttp_log_connect(pxy_conn_ctx_t *ctx, protohttp_req_t *req)
 {
-	if (!ctx->log_connect)
+	if (req ? !req->log_connect : !ctx->log_connect)
 		return;
 
 	protohttp_ctx_t *http_ctx = ctx->protoctx->arg;
+	const char *method = req ? req->method : http_ctx->http_method;
+	const char *uri = req ? req->uri : http_ctx->http_uri;
+	const char *host = req ? req->host : http_ctx->http_host;
 
 	char *msg;
 #ifdef HAVE_LOCAL_PROCINFO
@@ -87,9 +96,9 @@ protohttp_log_connect(pxy_conn_ctx_t *ctx)
 		              STRORDASH(ctx->srcport_str),
 		              STRORDASH(ctx->dsthost_str),
 		              STRORDASH(ctx->dstport_str),
-		              STRORDASH(http_ctx->http_host),
-		              STRORDASH(http_ctx->http_method),
-		              STRORDASH(http_ctx->http_uri),
+		              STRORDASH(host),
+		              STRORDASH(method),
+		              STRORDASH(uri),
 		              STRORDASH(http_ctx->http_status_code),
 		              STRORDASH(http_ctx->http_content_length),
 #ifdef HAVE_LOCAL_PROCINFO
@@ -117,9 +126,9 @@ protohttp_log_connect(pxy_conn_ctx_t *ctx)
 		              STRORDASH(ctx->srcport_str),
 		              STRORDASH(ctx->dsthost_str),
 		              STRORDASH(ctx->dstport_str),
-		              STRORDASH(http_ctx->http_host),
-		              STRORDASH(http_ctx->http_method),
-		              STRORDASH(http_ctx->http_uri),
+		              STRORDASH(host),
+		              STRORDASH(method),
+		              STRORDASH(uri),
 		              STRORDASH(http_ctx->http_status_code),
 		              STRORDASH(http_ctx->http_content_length),
 		              STRORDASH(ctx->sslctx->sni),
@@ -265,115 +274,527 @@ deny:
 	http_ctx->ocsp_denied = 1;
 }
 
+/*
+ * Argument of the header line callbacks.
+ * @attention Always use conn ctx for opts, child ctx does not have opts, see the comments in pxy_conn_child_ctx
+ */
+typedef struct protohttp_filter_arg {
+	protohttp_ctx_t *http_ctx;
+	enum conn_type type;
+	pxy_conn_ctx_t *ctx;
+} protohttp_filter_arg_t;
+
+static void NONNULL(1)
+protohttp_free_req(protohttp_req_t *req)
+{
+	if (req->method)
+		free(req->method);
+	if (req->uri)
+		free(req->uri);
+	if (req->host)
+		free(req->host);
+	free(req);
+}
+
+static char * NONNULL(1) MALLOC
+protohttp_strndup(const char *s, size_t n)
+{
+	char *d = malloc(n + 1);
+	if (d) {
+		memcpy(d, s, n);
+		d[n] = '\0';
+	}
+	return d;
+}
+
+/*
+ * Free the log strings of the previous request on a keep-alive conn.
+ */
+static void NONNULL(1)
+protohttp_free_request(protohttp_ctx_t *http_ctx)
+{
+	if (http_ctx->http_method) {
+		free(http_ctx->http_method);
+		http_ctx->http_method = NULL;
+	}
+	if (http_ctx->http_uri) {
+		free(http_ctx->http_uri);
+		http_ctx->http_uri = NULL;
+	}
+	if (http_ctx->http_host) {
+		free(http_ctx->http_host);
+		http_ctx->http_host = NULL;
+	}
+	if (http_ctx->http_content_type) {
+		free(http_ctx->http_content_type);
+		http_ctx->http_content_type = NULL;
+	}
+}
+
+/*
+ * Free the log strings of the previous response on a keep-alive conn.
+ */
+static void NONNULL(1)
+protohttp_free_response(protohttp_ctx_t *http_ctx)
+{
+	if (http_ctx->http_status_code) {
+		free(http_ctx->http_status_code);
+		http_ctx->http_status_code = NULL;
+	}
+	if (http_ctx->http_status_text) {
+		free(http_ctx->http_status_text);
+		http_ctx->http_status_text = NULL;
+	}
+	if (http_ctx->http_content_length) {
+		free(http_ctx->http_content_length);
+		http_ctx->http_content_length = NULL;
+	}
+}
+
+/*
+ * Save the conn state which protohttp_apply_filter() may change, before the
+ * first request of the conn is filtered.
+ */
+static void NONNULL(1,2)
+protohttp_save_filter_state(protohttp_ctx_t *http_ctx, pxy_conn_ctx_t *ctx)
+{
+	http_ctx->filter_precedence = ctx->filter_precedence;
+	http_ctx->conn_opts = ctx->conn_opts;
+	http_ctx->log_connect = ctx->log_connect;
+	http_ctx->log_master = ctx->log_master;
+	http_ctx->log_cert = ctx->log_cert;
+	http_ctx->log_content = ctx->log_content;
+	http_ctx->log_pcap = ctx->log_pcap;
+#ifndef WITHOUT_MIRROR
+	http_ctx->log_mirror = ctx->log_mirror;
+#endif /* !WITHOUT_MIRROR */
+}
+
+/*
+ * Undo the changes made by filtering the previous requests on the conn, so
+ * that a filter match on one request does not apply to the next ones.
+ */
+static void NONNULL(1,2)
+protohttp_restore_filter_state(protohttp_ctx_t *http_ctx, pxy_conn_ctx_t *ctx)
+{
+	ctx->filter_precedence = http_ctx->filter_precedence;
+	ctx->conn_opts = http_ctx->conn_opts;
+	ctx->log_connect = http_ctx->log_connect;
+	ctx->log_master = http_ctx->log_master;
+	ctx->log_cert = http_ctx->log_cert;
+	ctx->log_content = http_ctx->log_content;
+	ctx->log_pcap = http_ctx->log_pcap;
+#ifndef WITHOUT_MIRROR
+	ctx->log_mirror = http_ctx->log_mirror;
+#endif /* !WITHOUT_MIRROR */
+}
+
+/*
+ * Record the body framing given by a Content-Length or Transfer-Encoding
+ * header line.
+ */
+void
+protohttp_body_header(protohttp_body_t *body, httphdr_line_t *line)
+{
+	const char *v = line->value;
+	size_t len = line->value_len;
+
+	while (len && (v[len - 1] == ' ' || v[len - 1] == '\t'))
+		len--;
+
+	if (line->id == HTTPHDR_CONTENT_LENGTH) {
+		long long unsigned int n = 0;
+		size_t i;
+
+		if (!len)
+			body->bad_length = 1;
+		for (i = 0; i < len; i++) {
+			if (v[i] < '0' || v[i] > '9' || n > (ULLONG_MAX - 9) / 10) {
+				body->bad_length = 1;
+				return;
+			}
+			n = n * 10 + (v[i] - '0');
+		}
+		/* duplicate Content-Length lines must agree */
+		if (body->has_length && body->remaining != n)
+			body->bad_length = 1;
+		body->has_length = 1;
+		body->remaining = n;
+	} else {
+		/* the final transfer coding decides, and may be on a later line */
+		body->has_te = 1;
+		body->chunked = len >= 7 && !strncasecmp(v + len - 7, "chunked", 7) &&
+		                (len == 7 || v[len - 8] == ',' || v[len - 8] == ' ' || v[len - 8] == '\t');
+	}
+}
+
+/*
+ * Set up the framing of the request body after the request header.
+ * Ambiguous framing is rejected instead of forwarded, so that the proxy
+ * and the server cannot disagree on where the next request begins.
+ * Returns -1 on invalid or ambiguous framing.
+ */
+int
+protohttp_body_request(protohttp_ctx_t *http_ctx)
+{
+	protohttp_body_t *body = &http_ctx->req_body;
+
+	/* not HTTP or HTTP/0.9, already set while parsing the request line */
+	if (body->state == PROTOHTTP_BODY_EOF)
+		return 0;
+
+	if (body->bad_length || (body->has_te && (!body->chunked || body->has_length)))
+		return -1;
+
+	if (http_ctx->http_method && !strcasecmp(http_ctx->http_method, "CONNECT"))
+		body->state = PROTOHTTP_BODY_EOF;
+	else if (body->chunked)
+		body->state = PROTOHTTP_BODY_CHUNK_SIZE;
+	else if (body->has_length && body->remaining)
+		body->state = PROTOHTTP_BODY_LENGTH;
+	else
+		body->state = PROTOHTTP_BODY_NONE;
+	return 0;
+}
+
+/*
+ * Set up the framing of the response body after the response header,
+ * given the method of the request, see RFC 7230 section 3.3.3.
+ * Invalid framing falls back to reading until the conn is closed.
+ */
+static void NONNULL(1)
+protohttp_body_response(protohttp_ctx_t *http_ctx, const char *method)
+{
+	protohttp_body_t *body = &http_ctx->resp_body;
+	int code = http_ctx->http_status_code ? atoi(http_ctx->http_status_code) : 0;
+
+	if (!http_ctx->http_status_code)
+		body->state = PROTOHTTP_BODY_EOF;
+	else if ((code >= 100 && code < 200 && code != 101) || code == 204 || code == 304 ||
+	         (method && !strcasecmp(method, "HEAD")))
+		body->state = PROTOHTTP_BODY_NONE;
+	else if (code == 101 || (code >= 200 && code < 300 && method && !strcasecmp(method, "CONNECT")))
+		body->state = PROTOHTTP_BODY_EOF;
+	else if (body->has_te)
+		body->state = body->chunked ? PROTOHTTP_BODY_CHUNK_SIZE : PROTOHTTP_BODY_EOF;
+	else if (body->has_length && !body->bad_length)
+		body->state = body->remaining ? PROTOHTTP_BODY_LENGTH : PROTOHTTP_BODY_NONE;
+	else
+		body->state = PROTOHTTP_BODY_EOF;
+}
+
+/*
+ * Parse the chunk size at the start of a chunk size line of len bytes,
+ * excluding the line ending.  Only hex digits are accepted, without any
+ * sign or 0x prefix, and only chunk extensions or whitespace may follow.
+ * Returns -1 on invalid chunk size or overflow.
+ */
+int
+protohttp_parse_chunk_size(const char *line, size_t len, long long unsigned int *size)
+{
+	long long unsigned int n = 0;
+	size_t i;
+	int d;
+
+	for (i = 0; i < len; i++) {
+		if (line[i] >= '0' && line[i] <= '9')
+			d = line[i] - '0';
+		else if (line[i] >= 'a' && line[i] <= 'f')
+			d = line[i] - 'a' + 10;
+		else if (line[i] >= 'A' && line[i] <= 'F')
+			d = line[i] - 'A' + 10;
+		else
+			break;
+		if (n > (ULLONG_MAX >> 4))
+			return -1;
+		n = (n << 4) | d;
+	}
+	if (!i || (i < len && line[i] != ';' && line[i] != ' ' && line[i] != '\t'))
+		return -1;
+	*size = n;
+	return 0;
+}
+
+#define PROTOHTTP_CHUNK_LINE_MAX 4096
+
+/*
+ * Forward the body of the current message from inbuf to outbuf verbatim,
+ * including any chunk framing, up to the end of the message.
+ * Data of the next message is left in inbuf.
+ * Returns 1 if the body is complete, 0 if more data is needed, and -1 on
+ * invalid chunk framing or memory allocation failure.
+ */
+int
+protohttp_forward_body(struct evbuffer *inbuf, struct evbuffer *outbuf, protohttp_body_t *body)
+{
+	struct evbuffer_ptr eol;
+	size_t eol_len;
+	size_t n;
+	unsigned char *line;
+
+	for (;;) {
+		switch (body->state) {
+		case PROTOHTTP_BODY_NONE:
+			return 1;
+		case PROTOHTTP_BODY_EOF:
+			if (evbuffer_add_buffer(outbuf, inbuf) == -1)
+				return -1;
+			return 0;
+		case PROTOHTTP_BODY_LENGTH:
+		case PROTOHTTP_BODY_CHUNK_DATA:
+			n = evbuffer_get_length(inbuf);
+			if (n > body->remaining)
+				n = body->remaining;
+			if (n && evbuffer_remove_buffer(inbuf, outbuf, n) != (int)n)
+				return -1;
+			body->remaining -= n;
+			if (body->remaining)
+				return 0;
+			body->state = body->state == PROTOHTTP_BODY_LENGTH ?
+			              PROTOHTTP_BODY_NONE : PROTOHTTP_BODY_CHUNK_END;
+			break;
+		case PROTOHTTP_BODY_CHUNK_SIZE:
+		case PROTOHTTP_BODY_CHUNK_END:
+		case PROTOHTTP_BODY_TRAILER:
+			eol = evbuffer_search_eol(inbuf, NULL, &eol_len, EVBUFFER_EOL_CRLF);
+			if (eol.pos == -1) {
+				if (evbuffer_get_length(inbuf) > PROTOHTTP_CHUNK_LINE_MAX)
+					return -1;
+				return 0;
+			}
+			if (eol.pos > PROTOHTTP_CHUNK_LINE_MAX)
+				return -1;
+			if (body->state == PROTOHTTP_BODY_CHUNK_SIZE) {
+				/* chunk extensions after the size are ignored */
+				if (!eol.pos || !(line = evbuffer_pullup(inbuf, eol.pos)))
+					return -1;
+				if (protohttp_parse_chunk_size((char *)line, eol.pos, &body->remaining) == -1)
+					return -1;
+				body->state = body->remaining ?
+				              PROTOHTTP_BODY_CHUNK_DATA : PROTOHTTP_BODY_TRAILER;
+			} else if (body->state == PROTOHTTP_BODY_CHUNK_END) {
+				if (eol.pos != 0)
+					return -1;
+				body->state = PROTOHTTP_BODY_CHUNK_SIZE;
+			} else if (eol.pos == 0) {
+				/* empty line ends the trailer */
+				body->state = PROTOHTTP_BODY_NONE;
+			}
+			n = eol.pos + eol_len;
+			if (evbuffer_remove_buffer(inbuf, outbuf, n) != (int)n)
+				return -1;
+			break;
+		}
+	}
+}
+
+/*
+ * Queue the current request until its response arrives.
+ */
+static int NONNULL(1,2)
+protohttp_push_request(protohttp_ctx_t *http_ctx, pxy_conn_ctx_t *ctx)
+{
+	protohttp_req_t *req = malloc(sizeof(protohttp_req_t));
+	if (!req)
+		goto memout;
+	memset(req, 0, sizeof(protohttp_req_t));
+
+	if ((http_ctx->http_method && !(req->method = strdup(http_ctx->http_method))) ||
+	    (http_ctx->http_uri && !(req->uri = strdup(http_ctx->http_uri))) ||
+	    (http_ctx->http_host && !(req->host = strdup(http_ctx->http_host)))) {
+		protohttp_free_req(req);
+		goto memout;
+	}
+	req->log_connect = ctx->log_connect;
+
+	if (http_ctx->reqs_last)
+		http_ctx->reqs_last->next = req;
+	else
+		http_ctx->reqs = req;
+	http_ctx->reqs_last = req;
+	return 0;
+memout:
+	ctx->enomem = 1;
+	return -1;
+}
+
+/*
+ * Remove the oldest request from the queue, the caller owns it.
+ */
+static protohttp_req_t * NONNULL(1)
+protohttp_pop_request(protohttp_ctx_t *http_ctx)
+{
+	protohttp_req_t *req = http_ctx->reqs;
+	if (req) {
+		http_ctx->reqs = req->next;
+		if (!http_ctx->reqs)
+			http_ctx->reqs_last = NULL;
+	}
+	return req;
+}
+
 /*
  * Filter a single line of HTTP request headers.
  * Also fills in some context fields for logging.
  *
- * Returns NULL if the current line should be deleted from the request.
- * Returns a newly allocated string if the current line should be replaced.
- * Returns 'line' if the line should be kept.
+ * Returns HTTPHDR_DROP if the current line should be deleted from the request,
+ * with line->insert set if the line should be replaced.
+ * Returns HTTPHDR_DONE after the last line of the header.
+ * Returns -1 on memory allocation failure.
  */
-static char * NONNULL(1,2,4)
-protohttp_filter_request_header_line(const char *line, protohttp_ctx_t *http_ctx, enum conn_type type, pxy_conn_ctx_t *ctx)
+static int NONNULL(1,2)
+protohttp_filter_request_header_line(httphdr_line_t *line, void *arg)
 {
+	protohttp_filter_arg_t *a = arg;
+	protohttp_ctx_t *http_ctx = a->http_ctx;
+	pxy_conn_ctx_t *ctx = a->ctx;
+	int rv = HTTPHDR_KEEP;
+
+	log_finest_va("%.*s", (int)line->len, line->buf);
+
 	/* parse information for connect log */
-	if (!http_ctx->http_method) {
+	if (!http_ctx->seen_req_line) {
 		/* first line */
-		char *space1, *space2;
+		const char *end = line->buf + line->len;
+		const char *space1, *space2;
+
+		http_ctx->seen_req_line = 1;
+		if (!http_ctx->http_method) {
+			/* first request on this conn */
+			http_ctx->keepalive = ctx->conn_opts->http_keepalive;
+			protohttp_save_filter_state(http_ctx, ctx);
+		} else {
+			/* next request on a keep-alive conn, filter it as if it
+			 * was the first one, header lines included */
+			protohttp_free_request(http_ctx);
+			protohttp_restore_filter_state(http_ctx, ctx);
+		}
 
-		space1 = strchr(line, ' ');
-		space2 = space1 ? strchr(space1 + 1, ' ') : NULL;
+		space1 = memchr(line->buf, ' ', line->len);
+		space2 = space1 ? memchr(space1 + 1, ' ', end - space1 - 1) : NULL;
 		if (!space1) {
 			/* not HTTP */
 			http_ctx->seen_req_header = 1;
 			http_ctx->not_valid = 1;
+			http_ctx->req_body.state = PROTOHTTP_BODY_EOF;
+			rv = HTTPHDR_DONE;
 		} else {
-			http_ctx->http_method = malloc(space1 - line + 1);
-			if (http_ctx->http_method) {
-				memcpy(http_ctx->http_method, line, space1 - line);
-				http_ctx->http_method[space1 - line] = '\0';
-			} else {
-				ctx->enomem = 1;
-				return NULL;
-			}
+			http_ctx->http_method = protohttp_strndup(line->buf, space1 - line->buf);
+			if (!http_ctx->http_method)
+				goto memout;
 			space1++;
 			if (!space2) {
 				/* HTTP/0.9 */
 				http_ctx->seen_req_header = 1;
-				space2 = space1 + strlen(space1);
-			}
-			http_ctx->http_uri = malloc(space2 - space1 + 1);
-			if (http_ctx->http_uri) {
-				memcpy(http_ctx->http_uri, space1, space2 - space1);
-				http_ctx->http_uri[space2 - space1] = '\0';
-			} else {
-				ctx->enomem = 1;
-				return NULL;
+				http_ctx->req_body.state = PROTOHTTP_BODY_EOF;
+				space2 = end;
+				rv = HTTPHDR_DONE;
 			}
+			http_ctx->http_uri = protohttp_strndup(space1, space2 - space1);
+			if (!http_ctx->http_uri)
+				goto memout;
+		}
+
+		if ((a->type == CONN_TYPE_PARENT) && ctx->divert && !ctx->sent_sslproxy_header) {
+			ctx->sent_sslproxy_header = 1;
+			line->append = ctx->sslproxy_header;
 		}
 	} else {
 		/* not first line */
-		char *newhdr;
-
-		if (!http_ctx->http_host && !strncasecmp(line, "Host:", 5)) {
-			http_ctx->http_host = strdup(util_skipws(line + 5));
+		switch (line->id) {
+		case HTTPHDR_HOST:
 			if (!http_ctx->http_host) {
-				ctx->enomem = 1;
-				return NULL;
+				http_ctx->http_host = protohttp_strndup(line->value, line->value_len);
+				if (!http_ctx->http_host)
+					goto memout;
+				http_ctx->seen_keyword_count++;
 			}
+			break;
+		case HTTPHDR_CONTENT_TYPE:
+			if (http_ctx->http_content_type)
+				free(http_ctx->http_content_type);
+			http_ctx->http_content_type = protohttp_strndup(line->value, line->value_len);
+			if (!http_ctx->http_content_type)
+				goto memout;
 			http_ctx->seen_keyword_count++;
-		} else if (!strncasecmp(line, "Content-Type:", 13)) {
-			http_ctx->http_content_type = strdup(util_skipws(line + 13));
-			if (!http_ctx->http_content_type) {
-				ctx->enomem = 1;
-				return NULL;
+			break;
+		case HTTPHDR_CONTENT_LENGTH:
+		case HTTPHDR_TRANSFER_ENCODING:
+			if (http_ctx->keepalive) {
+				protohttp_body_header(&http_ctx->req_body, line);
 			}
-			http_ctx->seen_keyword_count++;
+			break;
 		/* Override Connection: keepalive and Connection: upgrade */
-		} else if (!strncasecmp(line, "Connection:", 11)) {
-			http_ctx->sent_http_conn_close = 1;
-			if (!(newhdr = strdup("Connection: close"))) {
-				ctx->enomem = 1;
-				return NULL;
-			}
-			http_ctx->seen_keyword_count++;
-			return newhdr;
-		// @attention Always use conn ctx for opts, child ctx does not have opts, see the comments in pxy_conn_child_ctx
-		} else if (ctx->conn_opts->remove_http_accept_encoding && !strncasecmp(line, "Accept-Encoding:", 16)) {
+		case HTTPHDR_CONNECTION:
 			http_ctx->seen_keyword_count++;
-			return NULL;
-		} else if (ctx->conn_opts->remove_http_referer && !strncasecmp(line, "Referer:", 8)) {
-			http_ctx->seen_keyword_count++;
-			return NULL;
+			if (!http_ctx->keepalive) {
+				http_ctx->sent_http_conn_close = 1;
+				line->insert = "Connection: close";
+				rv = HTTPHDR_DROP;
+			}
+			break;
+		case HTTPHDR_ACCEPT_ENCODING:
+			if (ctx->conn_opts->remove_http_accept_encoding) {
+				http_ctx->seen_keyword_count++;
+				rv = HTTPHDR_DROP;
+			}
+			break;
+		case HTTPHDR_REFERER:
+			if (ctx->conn_opts->remove_http_referer) {
+				http_ctx->seen_keyword_count++;
+				rv = HTTPHDR_DROP;
+			}
+			break;
 		/* Suppress upgrading to SSL/TLS, WebSockets or HTTP/2 and keep-alive */
-		} else if (!strncasecmp(line, "Upgrade:", 8) || !strncasecmp(line, "Keep-Alive:", 11)) {
+		case HTTPHDR_UPGRADE:
 			http_ctx->seen_keyword_count++;
-			return NULL;
-		} else if ((type == CONN_TYPE_CHILD) && (
-				   // @attention flickr keeps redirecting to https with 301 unless we remove the Via line of squid
-				   // Apparently flickr assumes the existence of Via header field or squid keyword a sign of plain http, even if we are using https
-		           !strncasecmp(line, "Via:", 4) ||
-				   // Also do not send the loopback address to the Internet
-		           !strncasecmp(line, "X-Forwarded-For:", 16))) {
+			rv = HTTPHDR_DROP;
+			break;
+		case HTTPHDR_KEEP_ALIVE:
 			http_ctx->seen_keyword_count++;
-			return NULL;
-		} else if (!strncasecmp(line, SSLPROXY_KEY, SSLPROXY_KEY_LEN)) {
+			if (!http_ctx->keepalive) {
+				rv = HTTPHDR_DROP;
+			}
+			break;
+		// @attention flickr keeps redirecting to https with 301 unless we remove the Via line of squid
+		// Apparently flickr assumes the existence of Via header field or squid keyword a sign of plain http, even if we are using https
+		// Also do not send the loopback address to the Internet
+		case HTTPHDR_VIA:
+		case HTTPHDR_X_FORWARDED_FOR:
+			if (a->type == CONN_TYPE_CHILD) {
+				http_ctx->seen_keyword_count++;
+				rv = HTTPHDR_DROP;
+			}
+			break;
+		case HTTPHDR_SSLPROXY:
 			// Remove any SSLproxy line, parent or child
-			return NULL;
-		} else if (line[0] == '\0') {
-			http_ctx->seen_req_header = 1;
-			if (!http_ctx->sent_http_conn_close) {
-				newhdr = strdup("Connection: close\r\n");
-				if (!newhdr) {
-					ctx->enomem = 1;
-					return NULL;
+			rv = HTTPHDR_DROP;
+			break;
+		default:
+			if (line->len == 0) {
+				http_ctx->seen_req_header = 1;
+				if (!http_ctx->keepalive && !http_ctx->sent_http_conn_close) {
+					line->insert = "Connection: close";
 				}
-				return newhdr;
+				rv = HTTPHDR_DONE;
 			}
+			break;
 		}
 	}
 
-	return (char*)line;
+	if (rv & HTTPHDR_DROP) {
+		log_finer_va("REMOVE= %.*s", (int)line->len, line->buf);
+	}
+	if (line->insert) {
+		log_finer_va("INSERT= %s", line->insert);
+	}
+	if (line->append) {
+		log_finer_va("INSERT= %s", line->append);
+	}
+	return rv;
+memout:
+	ctx->enomem = 1;
+	return -1;
 }
 
 static filter_action_t * NONNULL(1,2)
@@ -591,31 +1012,11 @@ protohttp_apply_filter(pxy_conn_ctx_t *ctx)
 static int WUNRES NONNULL(1,2,3,5)
 protohttp_filter_request_header(struct evbuffer *inbuf, struct evbuffer *outbuf, protohttp_ctx_t *http_ctx, enum conn_type type, pxy_conn_ctx_t *ctx)
 {
-	char *line;
+	protohttp_filter_arg_t arg = { http_ctx, type, ctx };
 
-	while (!http_ctx->seen_req_header && (line = evbuffer_readln(inbuf, NULL, EVBUFFER_EOL_CRLF))) {
-		log_finest_va("%s", line);
-
-		char *replace = protohttp_filter_request_header_line(line, http_ctx, type, ctx);
-		if (replace == line) {
-			evbuffer_add_printf(outbuf, "%s\r\n", line);
-		} else if (replace) {
-			log_finer_va("REPLACE= %s", replace);
-			evbuffer_add_printf(outbuf, "%s\r\n", replace);
-			free(replace);
-		} else {
-			log_finer_va("REMOVE= %s", line);
-			if (ctx->enomem) {
-				return -1;
-			}
-		}
-		free(line);
-
-		if ((type == CONN_TYPE_PARENT) && ctx->divert && !ctx->sent_sslproxy_header) {
-			ctx->sent_sslproxy_header = 1;
-			log_finer_va("INSERT= %s", ctx->sslproxy_header);
-			evbuffer_add_printf(outbuf, "%s\r\n", ctx->sslproxy_header);
-		}
+	if (httphdr_filter(inbuf, outbuf, &http_ctx->req_parser, protohttp_filter_request_header_line, &arg) == -1) {
+		ctx->enomem = 1;
+		return -1;
 	}
 
 	if (http_ctx->seen_req_header) {
@@ -634,6 +1035,18 @@ protohttp_filter_request_header(struct evbuffer *inbuf, struct evbuffer *outbuf,
 			return -1;
 		}
 
+		if (http_ctx->keepalive) {
+			if (protohttp_push_request(http_ctx, ctx) == -1) {
+				return -1;
+			}
+			if (protohttp_body_request(http_ctx) == -1) {
+				log_err_level_printf(LOG_WARNING, "Invalid HTTP request body framing, terminating conn\n");
+				pxy_conn_term(ctx, 1);
+				return -1;
+			}
+			return 0;
+		}
+
 		/* no data left after parsing headers? */
 		if (evbuffer_get_length(inbuf) == 0) {
 			return 0;
@@ -643,6 +1056,49 @@ protohttp_filter_request_header(struct evbuffer *inbuf, struct evbuffer *outbuf,
 	return 0;
 }
 
+/*
+ * Filter and forward the requests in inbuf, one message at a time in
+ * keep-alive mode, or the first header and everything after it otherwise.
+ * Returns -1 if the conn should not be handled any further.
+ */
+int
+protohttp_filter_requests(struct evbuffer *inbuf, struct evbuffer *outbuf, protohttp_ctx_t *http_ctx, enum conn_type type, pxy_conn_ctx_t *ctx)
+{
+	int rv;
+
+	do {
+		if (!http_ctx->seen_req_header) {
+			log_finest_va("HTTP Request Header, size=%zu", evbuffer_get_length(inbuf));
+			if (protohttp_filter_request_header(inbuf, outbuf, http_ctx, type, ctx) == -1) {
+				return -1;
+			}
+			if (!http_ctx->seen_req_header || !http_ctx->keepalive || http_ctx->ocsp_denied) {
+				return 0;
+			}
+		} else if (!http_ctx->keepalive) {
+			log_finest_va("HTTP Request Body, size=%zu", evbuffer_get_length(inbuf));
+			evbuffer_add_buffer(outbuf, inbuf);
+			return 0;
+		}
+
+		log_finest_va("HTTP Request Body, size=%zu", evbuffer_get_length(inbuf));
+		if ((rv = protohttp_forward_body(inbuf, outbuf, &http_ctx->req_body)) == -1) {
+			log_err_level_printf(LOG_WARNING, "Invalid HTTP request body framing, terminating conn\n");
+			pxy_conn_term(ctx, 1);
+			return -1;
+		}
+		if (rv == 0) {
+			return 0;
+		}
+
+		/* request complete, the next one may follow */
+		http_ctx->seen_req_header = 0;
+		http_ctx->seen_req_line = 0;
+		memset(&http_ctx->req_body, 0, sizeof(protohttp_body_t));
+	} while (evbuffer_get_length(inbuf) > 0);
+	return 0;
+}
+
 #ifndef WITHOUT_USERAUTH
 static char * NONNULL(1,2)
 protohttp_get_url(struct evbuffer *inbuf, pxy_conn_ctx_t *ctx)
@@ -828,14 +1284,8 @@ protohttp_bev_readcb_src(struct bufferevent *bev, pxy_conn_ctx_t *ctx)
 	// And we are dealing with pop3 and smtp also, not just http.
 
 	/* request header munging */
-	if (!http_ctx->seen_req_header) {
-		log_finest_va("HTTP Request Header, size=%zu", evbuffer_get_length(inbuf));
-		if (protohttp_filter_request_header(inbuf, outbuf, http_ctx, ctx->type, ctx) == -1) {
-			return;
-		}
-	} else {
-		log_finest_va("HTTP Request Body, size=%zu", evbuffer_get_length(inbuf));
-		evbuffer_add_buffer(outbuf, inbuf);
+	if (protohttp_filter_requests(inbuf, outbuf, http_ctx, ctx->type, ctx) == -1) {
+		return;
 	}
 
 	if (ctx->conn_opts->validate_proto && !ctx->protoctx->is_valid) {
@@ -848,117 +1298,121 @@ protohttp_bev_readcb_src(struct bufferevent *bev, pxy_conn_ctx_t *ctx)
 		}
 	}
 
-	ctx->protoctx->set_watermarkcb(bev, ctx, ctx->dst.bev);
+	ctx->protoctx->set_watermarkcb(&ctx->src, ctx, ctx->dst.bev);
 }
 
 /*
  * Filter a single line of HTTP response headers.
  *
- * Returns NULL if the current line should be deleted from the response.
- * Returns a newly allocated string if the current line should be replaced.
- * Returns `line' if the line should be kept.
+ * Returns HTTPHDR_DROP if the current line should be deleted from the response.
+ * Returns HTTPHDR_DONE after the last line of the header.
+ * Returns -1 on memory allocation failure.
  */
-static char * NONNULL(1,2,3)
-protohttp_filter_response_header_line(const char *line, protohttp_ctx_t *http_ctx, pxy_conn_ctx_t *ctx)
+static int NONNULL(1,2)
+protohttp_filter_response_header_line(httphdr_line_t *line, void *arg)
 {
+	protohttp_filter_arg_t *a = arg;
+	protohttp_ctx_t *http_ctx = a->http_ctx;
+	pxy_conn_ctx_t *ctx = a->ctx;
+	int rv = HTTPHDR_KEEP;
+
+	log_finest_va("%.*s", (int)line->len, line->buf);
+
 	/* parse information for connect log */
-	if (!http_ctx->http_status_code) {
+	if (!http_ctx->seen_resp_line) {
 		/* first line */
-		char *space1, *space2;
+		const char *end = line->buf + line->len;
+		const char *space1, *space2;
 
-		space1 = strchr(line, ' ');
-		space2 = space1 ? strchr(space1 + 1, ' ') : NULL;
-		if (!space1 || !!strncmp(line, "HTTP", 4)) {
+		http_ctx->seen_resp_line = 1;
+		/* next response on a keep-alive conn */
+		protohttp_free_response(http_ctx);
+
+		space1 = memchr(line->buf, ' ', line->len);
+		space2 = space1 ? memchr(space1 + 1, ' ', end - space1 - 1) : NULL;
+		if (!space1 || line->len < 4 || memcmp(line->buf, "HTTP", 4)) {
 			/* not HTTP or HTTP/0.9 */
 			http_ctx->seen_resp_header = 1;
+			rv = HTTPHDR_DONE;
 		} else {
 			size_t len_code, len_text;
 
 			if (space2) {
 				len_code = space2 - space1 - 1;
-				len_text = strlen(space2 + 1);
+				len_text = end - space2 - 1;
 			} else {
-				len_code = strlen(space1 + 1);
+				len_code = end - space1 - 1;
 				len_text = 0;
 			}
-			http_ctx->http_status_code = malloc(len_code + 1);
-			http_ctx->http_status_text = malloc(len_text + 1);
+			http_ctx->http_status_code = protohttp_strndup(space1 + 1, len_code);
+			http_ctx->http_status_text = protohttp_strndup(space2 ? space2 + 1 : end, len_text);
 			if (!http_ctx->http_status_code || !http_ctx->http_status_text) {
 				ctx->enomem = 1;
-				return NULL;
-			}
-			memcpy(http_ctx->http_status_code, space1 + 1, len_code);
-			http_ctx->http_status_code[len_code] = '\0';
-			if (space2) {
-				memcpy(http_ctx->http_status_text,
-				       space2 + 1, len_text);
+				return -1;
 			}
-			http_ctx->http_status_text[len_text] = '\0';
 		}
 	} else {
 		/* not first line */
-		if (!http_ctx->http_content_length &&
-		    !strncasecmp(line, "Content-Length:", 15)) {
-			http_ctx->http_content_length =
-				strdup(util_skipws(line + 15));
+		switch (line->id) {
+		case HTTPHDR_CONTENT_LENGTH:
 			if (!http_ctx->http_content_length) {
-				ctx->enomem = 1;
-				return NULL;
+				http_ctx->http_content_length = protohttp_strndup(line->value, line->value_len);
+				if (!http_ctx->http_content_length) {
+					ctx->enomem = 1;
+					return -1;
+				}
 			}
-		} else if (
-		    /* HPKP: Public Key Pinning Extension for HTTP
-		     * (draft-ietf-websec-key-pinning)
-		     * remove to prevent public key pinning */
-		    !strncasecmp(line, "Public-Key-Pins:", 16) ||
-		    !strncasecmp(line, "Public-Key-Pins-Report-Only:", 28) ||
-		    /* HSTS: HTTP Strict Transport Security (RFC 6797)
-		     * remove to allow users to accept bad certs */
-		    !strncasecmp(line, "Strict-Transport-Security:", 26) ||
-		    /* Expect-CT: Expect Certificate Transparency
-		     * (draft-ietf-httpbis-expect-ct-latest)
-		     * remove to prevent failed CT log lookups */
-		    !strncasecmp(line, "Expect-CT:", 10) ||
-		    /* Alternate Protocol
-		     * remove to prevent switching to QUIC, SPDY et al */
-		    !strncasecmp(line, "Alternate-Protocol:", 19) ||
-		    /* Upgrade header
-		     * remove to prevent upgrading to HTTPS in unhandled ways,
-		     * and more importantly, WebSockets and HTTP/2 */
-		    !strncasecmp(line, "Upgrade:", 8)) {
-			return NULL;
-		} else if (line[0] == '\0') {
-			http_ctx->seen_resp_header = 1;
+			/* FALLTHROUGH */
+		case HTTPHDR_TRANSFER_ENCODING:
+			if (http_ctx->keepalive) {
+				protohttp_body_header(&http_ctx->resp_body, line);
+			}
+			break;
+		/* HPKP: Public Key Pinning Extension for HTTP
+		 * (draft-ietf-websec-key-pinning)
+		 * remove to prevent public key pinning */
+		case HTTPHDR_PUBLIC_KEY_PINS:
+		case HTTPHDR_PUBLIC_KEY_PINS_REPORT_ONLY:
+		/* HSTS: HTTP Strict Transport Security (RFC 6797)
+		 * remove to allow users to accept bad certs */
+		case HTTPHDR_STRICT_TRANSPORT_SECURITY:
+		/* Expect-CT: Expect Certificate Transparency
+		 * (draft-ietf-httpbis-expect-ct-latest)
+		 * remove to prevent failed CT log lookups */
+		case HTTPHDR_EXPECT_CT:
+		/* Alternate Protocol
+		 * remove to prevent switching to QUIC, SPDY et al */
+		case HTTPHDR_ALTERNATE_PROTOCOL:
+		/* Upgrade header
+		 * remove to prevent upgrading to HTTPS in unhandled ways,
+		 * and more importantly, WebSockets and HTTP/2 */
+		case HTTPHDR_UPGRADE:
+			log_finer_va("REMOVE= %.*s", (int)line->len, line->buf);
+			rv = HTTPHDR_DROP;
+			break;
+		default:
+			if (line->len == 0) {
+				http_ctx->seen_resp_header = 1;
+				rv = HTTPHDR_DONE;
+			}
+			break;
 		}
 	}
 
-	return (char*)line;
+	return rv;
 }
 
 static void NONNULL(1,2,3,4)
 protohttp_filter_response_header(struct evbuffer *inbuf, struct evbuffer *outbuf, protohttp_ctx_t *http_ctx, pxy_conn_ctx_t *ctx)
 {
-	char *line;
-
-	while (!http_ctx->seen_resp_header && (line = evbuffer_readln(inbuf, NULL, EVBUFFER_EOL_CRLF))) {
-		log_finest_va("%s", line);
+	protohttp_filter_arg_t arg = { http_ctx, CONN_TYPE_PARENT, ctx };
 
-		char *replace = protohttp_filter_response_header_line(line, http_ctx, ctx);
-		if (replace == line) {
-			evbuffer_add_printf(outbuf, "%s\r\n", line);
-		} else if (replace) {
-			log_finer_va("REPLACE= %s", replace);
-			evbuffer_add_printf(outbuf, "%s\r\n", replace);
-			free(replace);
-		} else {
-			log_finer_va("REMOVE= %s", line);
-			if (ctx->enomem) {
-				return;
-			}
-		}
-		free(line);
+	if (httphdr_filter(inbuf, outbuf, &http_ctx->resp_parser, protohttp_filter_response_header_line, &arg) == -1) {
+		ctx->enomem = 1;
+		return;
 	}
 
-	if (http_ctx->seen_resp_header) {
+	if (http_ctx->seen_resp_header && !http_ctx->keepalive) {
 		/* no data left after parsing headers? */
 		if (evbuffer_get_length(inbuf) == 0) {
 			return;
@@ -967,6 +1421,64 @@ protohttp_filter_response_header(struct evbuffer *inbuf, struct evbuffer *outbuf
 	}
 }
 
+/*
+ * Filter and forward the responses in inbuf, one message at a time in
+ * keep-alive mode, or the first header and everything after it otherwise.
+ * In keep-alive mode, the parent conn logs each final response along with
+ * its request.
+ */
+static void NONNULL(1,2,3,5)
+protohttp_filter_responses(struct evbuffer *inbuf, struct evbuffer *outbuf, protohttp_ctx_t *http_ctx, enum conn_type type, pxy_conn_ctx_t *ctx)
+{
+	protohttp_req_t *req;
+	int rv;
+
+	do {
+		if (!http_ctx->seen_resp_header) {
+			log_finest_va("HTTP Response Header, size=%zu", evbuffer_get_length(inbuf));
+			protohttp_filter_response_header(inbuf, outbuf, http_ctx, ctx);
+			if (ctx->enomem || !http_ctx->seen_resp_header || !http_ctx->keepalive) {
+				return;
+			}
+
+			/* interim 1xx responses precede the final response to the same request */
+			req = http_ctx->reqs;
+			protohttp_body_response(http_ctx, req ? req->method : NULL);
+			if (!http_ctx->http_status_code || http_ctx->http_status_code[0] != '1' ||
+			    !strcmp(http_ctx->http_status_code, "101")) {
+				req = protohttp_pop_request(http_ctx);
+				if (req) {
+					if (type == CONN_TYPE_PARENT && WANT_CONNECT_LOG(ctx)) {
+						protohttp_log_connect(ctx, req);
+					}
+					protohttp_free_req(req);
+				}
+			}
+		} else if (!http_ctx->keepalive) {
+			log_finest_va("HTTP Response Body, size=%zu", evbuffer_get_length(inbuf));
+			evbuffer_add_buffer(outbuf, inbuf);
+			return;
+		}
+
+		log_finest_va("HTTP Response Body, size=%zu", evbuffer_get_length(inbuf));
+		if ((rv = protohttp_forward_body(inbuf, outbuf, &http_ctx->resp_body)) == -1) {
+			// Cannot find the end of the response, the server will close the conn
+			log_err_level_printf(LOG_WARNING, "Invalid HTTP response body framing\n");
+			http_ctx->resp_body.state = PROTOHTTP_BODY_EOF;
+			evbuffer_add_buffer(outbuf, inbuf);
+			return;
+		}
+		if (rv == 0) {
+			return;
+		}
+
+		/* response complete, the next one may follow */
+		http_ctx->seen_resp_header = 0;
+		http_ctx->seen_resp_line = 0;
+		memset(&http_ctx->resp_body, 0, sizeof(protohttp_body_t));
+	} while (evbuffer_get_length(inbuf) > 0);
+}
+
 static void NONNULL(1)
 protohttp_bev_readcb_dst(struct bufferevent *bev, pxy_conn_ctx_t *ctx)
 {
@@ -981,17 +1493,11 @@ protohttp_bev_readcb_dst(struct bufferevent *bev, pxy_conn_ctx_t *ctx)
 	struct evbuffer *inbuf = bufferevent_get_input(bev);
 	struct evbuffer *outbuf = bufferevent_get_output(ctx->src.bev);
 
-	if (!http_ctx->seen_resp_header) {
-		log_finest_va("HTTP Response Header, size=%zu", evbuffer_get_length(inbuf));
-		protohttp_filter_response_header(inbuf, outbuf, http_ctx, ctx);
-		if (ctx->enomem) {
-			return;
-		}
-	} else {
-		log_finest_va("HTTP Response Body, size=%zu", evbuffer_get_length(inbuf));
-		evbuffer_add_buffer(outbuf, inbuf);
+	protohttp_filter_responses(inbuf, outbuf, http_ctx, ctx->type, ctx);
+	if (ctx->enomem) {
+		return;
 	}
-	ctx->protoctx->set_watermarkcb(bev, ctx, ctx->src.bev);
+	ctx->protoctx->set_watermarkcb(&ctx->dst, ctx, ctx->src.bev);
 }
 
 static void NONNULL(1)
@@ -1014,17 +1520,11 @@ protohttp_bev_readcb_src_child(struct bufferevent *bev, pxy_conn_child_ctx_t *ct
 	struct evbuffer *inbuf = bufferevent_get_input(bev);
 	struct evbuffer *outbuf = bufferevent_get_output(ctx->dst.bev);
 
-	if (!http_ctx->seen_req_header) {
-		log_finest_va("HTTP Request Header, size=%zu", evbuffer_get_length(inbuf));
-		// @todo Just remove SSLproxy line, do not filter request on the server side?
-		if (protohttp_filter_request_header(inbuf, outbuf, http_ctx, ctx->type, ctx->conn) == -1) {
-			return;
-		}
-	} else {
-		log_finest_va("HTTP Request Body, size=%zu", evbuffer_get_length(inbuf));
-		evbuffer_add_buffer(outbuf, inbuf);
+	// @todo Just remove SSLproxy line, do not filter request on the server side?
+	if (protohttp_filter_requests(inbuf, outbuf, http_ctx, ctx->type, ctx->conn) == -1) {
+		return;
 	}
-	ctx->conn->protoctx->set_watermarkcb(bev, ctx->conn, ctx->dst.bev);
+	ctx->conn->protoctx->set_watermarkcb(&ctx->src, ctx->conn, ctx->dst.bev);
 }
 
 static void NONNULL(1)
@@ -1041,18 +1541,12 @@ protohttp_bev_readcb_dst_child(struct bufferevent *bev, pxy_conn_child_ctx_t *ct
 	struct evbuffer *inbuf = bufferevent_get_input(bev);
 	struct evbuffer *outbuf = bufferevent_get_output(ctx->src.bev);
 
-	if (!http_ctx->seen_resp_header) {
-		log_finest_va("HTTP Response Header, size=%zu", evbuffer_get_length(inbuf));
-		// @todo Do not filter response on the server side?
-		protohttp_filter_response_header(inbuf, outbuf, http_ctx, ctx->conn);
-		if (ctx->conn->enomem) {
-			return;
-		}
-	} else {
-		log_finest_va("HTTP Response Body, size=%zu", evbuffer_get_length(inbuf));
-		evbuffer_add_buffer(outbuf, inbuf);
+	// @todo Do not filter response on the server side?
+	protohttp_filter_responses(inbuf, outbuf, http_ctx, ctx->type, ctx->conn);
+	if (ctx->conn->enomem) {
+		return;
 	}
-	ctx->conn->protoctx->set_watermarkcb(bev, ctx->conn, ctx->src.bev);
+	ctx->conn->protoctx->set_watermarkcb(&ctx->dst, ctx->conn, ctx->src.bev);
 }
 
 static void NONNULL(1)
@@ -1078,10 +1572,10 @@ protohttp_bev_readcb(struct bufferevent *bev, void *arg)
 		return;
 	}
 
-	if (!seen_resp_header_on_entry && http_ctx->seen_resp_header) {
+	if (!http_ctx->keepalive && !seen_resp_header_on_entry && http_ctx->seen_resp_header) {
 		/* response header complete: log connection */
 		if (WANT_CONNECT_LOG(ctx->conn)) {
-			protohttp_log_connect(ctx);
+			protohttp_log_connect(ctx, NULL);
 		}
 	}
 }
@@ -1164,6 +1658,9 @@ protohttp_free_ctx(protohttp_ctx_t *http_ctx)
 	if (http_ctx->http_content_length) {
 		free(http_ctx->http_content_length);
 	}
+	while (http_ctx->reqs) {
+		protohttp_free_req(protohttp_pop_request(http_ctx));
+	}
 	free(http_ctx);
 }
 
@@ -31,10 +31,48 @@
 #define PROTOHTTP_H
 
 #include "pxyconn.h"
+#include "httphdr.h"
+
+/*
+ * Framing of the body of the current message in keep-alive mode.
+ */
+typedef enum protohttp_body_state {
+	PROTOHTTP_BODY_NONE = 0,        /* no body, or body complete */
+	PROTOHTTP_BODY_LENGTH,          /* Content-Length bytes */
+	PROTOHTTP_BODY_CHUNK_SIZE,      /* chunk size line */
+	PROTOHTTP_BODY_CHUNK_DATA,      /* chunk data */
+	PROTOHTTP_BODY_CHUNK_END,       /* CRLF after chunk data */
+	PROTOHTTP_BODY_TRAILER,         /* trailer lines after the last chunk */
+	PROTOHTTP_BODY_EOF,             /* everything until the conn is closed */
+} protohttp_body_state_t;
+
+typedef struct protohttp_body {
+	protohttp_body_state_t state;
+	/* Content-Length, then bytes left of body or current chunk */
+	long long unsigned int remaining;
+	unsigned int has_length : 1;        /* 1 if Content-Length seen */
+	unsigned int has_te : 1;          /* 1 if Transfer-Encoding seen */
+	unsigned int chunked : 1;       /* 1 if final transfer coding chunked */
+	unsigned int bad_length : 1;  /* 1 if invalid Content-Length seen */
+} protohttp_body_t;
+
+/*
+ * Request waiting for its response in keep-alive mode.
+ */
+typedef struct protohttp_req {
+	char *method;
+	char *uri;
+	char *host;
+	unsigned int log_connect : 1;  /* log_connect after filtering request */
+	struct protohttp_req *next;
+} protohttp_req_t;
 
 typedef struct protohttp_ctx {
 	unsigned int seen_req_header : 1; /* 0 until request header complete */
 	unsigned int seen_resp_header : 1;  /* 0 until response hdr complete */
+	unsigned int seen_req_line : 1;      /* 0 until request line parsed */
+	unsigned int seen_resp_line : 1;      /* 0 until status line parsed */
+	unsigned int keepalive : 1;   /* 1 if HTTPKeepAlive on first request */
 	unsigned int sent_http_conn_close : 1;   /* 0 until Conn: close sent */
 	unsigned int ocsp_denied : 1;                /* 1 if OCSP was denied */
 
@@ -52,10 +90,37 @@ typedef struct protohttp_ctx {
 	unsigned int not_valid : 1;    /* 1 if cannot find HTTP on first line */
 	unsigned int seen_keyword_count;
 	long long unsigned int seen_bytes;
+
+	/* header parser state across reads */
+	httphdr_parser_t req_parser;
+	httphdr_parser_t resp_parser;
+
+	/* keep-alive mode */
+	protohttp_body_t req_body;
+	protohttp_body_t resp_body;
+	protohttp_req_t *reqs;     /* requests waiting for response, FIFO */
+	protohttp_req_t *reqs_last;
+	/* conn state before HTTP filtering, restored for each request */
+	unsigned int filter_precedence;  /* conn filter precedence */
+	conn_opts_t *conn_opts;
+	unsigned int log_connect : 1;
+	unsigned int log_master : 1;
+	unsigned int log_cert : 1;
+	unsigned int log_content : 1;
+	unsigned int log_pcap : 1;
+#ifndef WITHOUT_MIRROR
+	unsigned int log_mirror : 1;
+#endif /* !WITHOUT_MIRROR */
 } protohttp_ctx_t;
 
 int protohttp_validate(pxy_conn_ctx_t *) NONNULL(1);
 
+void protohttp_body_header(protohttp_body_t *, httphdr_line_t *) NONNULL(1,2);
+int protohttp_body_request(protohttp_ctx_t *) NONNULL(1);
+int protohttp_parse_chunk_size(const char *, size_t, long long unsigned int *) NONNULL(1,3) WUNRES;
+int protohttp_forward_body(struct evbuffer *, struct evbuffer *, protohttp_body_t *) NONNULL(1,2,3);
+int protohttp_filter_requests(struct evbuffer *, struct evbuffer *, protohttp_ctx_t *, enum conn_type, pxy_conn_ctx_t *) NONNULL(1,2,3,5) WUNRES;
+
 protocol_t protohttp_setup(pxy_conn_ctx_t *) NONNULL(1);
 protocol_t protohttps_setup(pxy_conn_ctx_t *) NONNULL(1);
 
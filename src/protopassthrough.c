@@ -31,6 +31,14 @@
 #include "prototcp.h"
 
 #include <sys/param.h>
+#ifdef SYS_HAVE_SPLICE
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <event2/bufferevent_ssl.h>
+#endif /* SYS_HAVE_SPLICE */
 
 #ifdef HAVE_LOCAL_PROCINFO
 static int NONNULL(1)
@@ -77,6 +85,17 @@ protopassthrough_engage(pxy_conn_ctx_t *ctx)
 {
 	log_fine("ENTER");
 
+	protopassthrough_switch(ctx);
+	pxy_conn_connect(ctx);
+}
+
+/*
+ * Free everything the previous proto has set up, and switch the conn to
+ * passthrough mode, without connecting it.
+ */
+void
+protopassthrough_switch(pxy_conn_ctx_t *ctx)
+{
 	// Free any children of the previous proto
 	pxy_conn_free_children(ctx);
 
@@ -105,7 +124,6 @@ protopassthrough_engage(pxy_conn_ctx_t *ctx)
 	}
 
 	ctx->proto = protopassthrough_setup(ctx);
-	pxy_conn_connect(ctx);
 }
 
 static int NONNULL(1) WUNRES
@@ -121,6 +139,275 @@ protopassthrough_conn_connect(pxy_conn_ctx_t *ctx)
 	return 0;
 }
 
+#ifdef SYS_HAVE_SPLICE
+/*
+ * Splice relay.
+ *
+ * Once a conn does not need any inspection anymore, it is relayed with
+ * splice() through a pipe per direction, instead of reading into and writing
+ * from bufferevents, so the payload is never copied to user space.  The
+ * relay runs between src and srvdst of passthrough conns, and between src
+ * and dst of split mode tcp conns, see prototcp_try_splice().  The
+ * bufferevents are disabled but kept, so that the conn is freed as usual,
+ * and their fds are used by the relay events on the thread event base.
+ */
+static void NONNULL(1)
+protopassthrough_splice_close(protopassthrough_splice_t *sp)
+{
+	pxy_conn_ctx_t *ctx = sp->ctx;
+	protopassthrough_ctx_t *pctx = ctx->protoctx->arg;
+
+	log_finest("ENTER");
+
+	// The conn is closed in both directions on error, or once both directions are done
+	ctx->src.closed = 1;
+	pctx->dst->closed = 1;
+	pxy_log_dbg_disconnect(ctx);
+	pxy_conn_free(ctx, sp->from_src);
+}
+
+/*
+ * Finish a direction once its in socket has reached eof and its pipe has been
+ * flushed, by passing the eof on to the out socket.  The other direction keeps
+ * relaying until it is done too, so no bytes in flight are dropped, and only
+ * then is the conn freed.
+ */
+static void NONNULL(1)
+protopassthrough_splice_done(protopassthrough_splice_t *sp)
+{
+	protopassthrough_ctx_t *pctx = sp->ctx->protoctx->arg;
+	protopassthrough_splice_t *other = sp->from_src ? &pctx->down : &pctx->up;
+
+	log_finest_va("%s done", sp->from_src ? "src" : "dst");
+
+	sp->done = 1;
+	event_del(sp->rev);
+	event_del(sp->wev);
+	if (shutdown(sp->out, SHUT_WR) == -1 && errno != ENOTCONN) {
+		log_fine_va("shutdown of %s failed: %s", sp->from_src ? "dst" : "src", strerror(errno));
+		protopassthrough_splice_close(sp);
+		return;
+	}
+
+	if (other->done)
+		protopassthrough_splice_close(sp);
+}
+
+/*
+ * Write the pipe contents to the out socket, stop reading while the out
+ * socket cannot take more.
+ * Returns 1 if this direction is done, 0 if not, and -1 on error.
+ */
+int
+protopassthrough_splice_flush(protopassthrough_splice_t *sp)
+{
+	while (sp->pending) {
+		ssize_t n = splice(sp->pipe[0], NULL, sp->out, NULL, sp->pending,
+		                   SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			return -1;
+		}
+		sp->pending -= n;
+	}
+
+	if (sp->pending) {
+		event_del(sp->rev);
+		event_add(sp->wev, NULL);
+		return 0;
+	}
+	event_del(sp->wev);
+	if (sp->eof)
+		return 1;
+	event_add(sp->rev, NULL);
+	return 0;
+}
+
+void
+protopassthrough_splice_readcb(UNUSED evutil_socket_t fd, UNUSED short what, void *arg)
+{
+	protopassthrough_splice_t *sp = arg;
+	pxy_conn_ctx_t *ctx = sp->ctx;
+
+	ssize_t n = splice(sp->in, NULL, sp->pipe[1], NULL, PROTOPASSTHROUGH_SPLICE_SIZE,
+	                   SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+	if (n == -1) {
+		if (errno == EAGAIN || errno == EINTR)
+			return;
+		log_fine_va("splice from %s failed: %s", sp->from_src ? "src" : "dst", strerror(errno));
+		protopassthrough_splice_close(sp);
+		return;
+	}
+	if (n == 0) {
+		log_finest_va("EOF on %s", sp->from_src ? "src" : "dst");
+		sp->eof = 1;
+		event_del(sp->rev);
+		if (!sp->pending)
+			protopassthrough_splice_done(sp);
+		return;
+	}
+
+	sp->pending += n;
+	if (sp->from_src) {
+		ctx->thr->intif_in_bytes += n;
+		ctx->thr->extif_out_bytes += n;
+	} else {
+		ctx->thr->extif_in_bytes += n;
+		ctx->thr->intif_out_bytes += n;
+	}
+	pxy_thr_touch(ctx);
+
+	if (protopassthrough_splice_flush(sp) == -1) {
+		log_fine_va("splice to %s failed: %s", sp->from_src ? "dst" : "src", strerror(errno));
+		protopassthrough_splice_close(sp);
+	}
+}
+
+void
+protopassthrough_splice_writecb(UNUSED evutil_socket_t fd, UNUSED short what, void *arg)
+{
+	protopassthrough_splice_t *sp = arg;
+#ifdef DEBUG_PROXY
+	pxy_conn_ctx_t *ctx = sp->ctx;
+#endif /* DEBUG_PROXY */
+
+	int rv = protopassthrough_splice_flush(sp);
+	if (rv == -1) {
+		log_fine_va("splice to %s failed: %s", sp->from_src ? "dst" : "src", strerror(errno));
+		protopassthrough_splice_close(sp);
+	} else if (rv) {
+		protopassthrough_splice_done(sp);
+	}
+}
+
+int
+protopassthrough_splice_init(protopassthrough_splice_t *sp, pxy_conn_ctx_t *ctx,
+		evutil_socket_t in, evutil_socket_t out, int from_src)
+{
+	sp->ctx = ctx;
+	sp->in = in;
+	sp->out = out;
+	sp->from_src = from_src;
+
+	if (pipe2(sp->pipe, O_NONBLOCK|O_CLOEXEC) == -1) {
+		return -1;
+	}
+	sp->rev = event_new(ctx->thr->evbase, in, EV_READ|EV_PERSIST, protopassthrough_splice_readcb, sp);
+	sp->wev = event_new(ctx->thr->evbase, out, EV_WRITE|EV_PERSIST, protopassthrough_splice_writecb, sp);
+	if (!sp->rev || !sp->wev) {
+		return -1;
+	}
+	return 0;
+}
+
+void
+protopassthrough_splice_free(protopassthrough_splice_t *sp)
+{
+	if (sp->rev) {
+		event_free(sp->rev);
+	}
+	if (sp->wev) {
+		event_free(sp->wev);
+	}
+	if (sp->pipe[0] != -1) {
+		close(sp->pipe[0]);
+		close(sp->pipe[1]);
+	}
+}
+
+static void NONNULL(1)
+protopassthrough_free(pxy_conn_ctx_t *ctx)
+{
+	protopassthrough_ctx_t *pctx = ctx->protoctx->arg;
+
+	protopassthrough_splice_free(&pctx->up);
+	protopassthrough_splice_free(&pctx->down);
+	free(pctx);
+	ctx->protoctx->arg = NULL;
+}
+
+/*
+ * Whether bev reads from and writes to its socket directly, i.e. it is not
+ * an SSL or filtering bufferevent, e.g. after autossl upgraded src.
+ */
+static int
+protopassthrough_is_socket_bev(struct bufferevent *bev)
+{
+	return !bufferevent_get_underlying(bev) && !bufferevent_openssl_get_ssl(bev);
+}
+
+/*
+ * Switch the conn to the splice relay between src and dst, if enabled and
+ * if the conn does not need to pass through the bufferevents anymore: both
+ * ends connected and open, no data left in the bufferevents, and no pending
+ * userauth or deferred filter action.  Otherwise, or if setting up the relay
+ * fails, the conn keeps using the bufferevents.
+ */
+void
+protopassthrough_try_splice(pxy_conn_ctx_t *ctx, pxy_conn_desc_t *dst)
+{
+	protopassthrough_ctx_t *pctx;
+
+	if (!ctx->global->splice || ctx->protoctx->proto_free == protopassthrough_free)
+		return;
+	if (!ctx->connected || ctx->term || ctx->enomem || ctx->deferred_action ||
+			!ctx->src.bev || !dst->bev || ctx->src.closed || dst->closed)
+		return;
+#ifndef WITHOUT_USERAUTH
+	if (ctx->conn_opts->user_auth && !ctx->user)
+		return;
+#endif /* !WITHOUT_USERAUTH */
+	if (!protopassthrough_is_socket_bev(ctx->src.bev) || !protopassthrough_is_socket_bev(dst->bev))
+		return;
+	if (evbuffer_get_length(bufferevent_get_input(ctx->src.bev)) ||
+			evbuffer_get_length(bufferevent_get_output(ctx->src.bev)) ||
+			evbuffer_get_length(bufferevent_get_input(dst->bev)) ||
+			evbuffer_get_length(bufferevent_get_output(dst->bev)))
+		return;
+
+	pctx = calloc(1, sizeof(protopassthrough_ctx_t));
+	if (!pctx) {
+		return;
+	}
+	pctx->dst = dst;
+	pctx->up.pipe[0] = pctx->up.pipe[1] = -1;
+	pctx->down.pipe[0] = pctx->down.pipe[1] = -1;
+
+	// The pipes of both directions
+	if (pxy_thrmgr_fd_acquire(ctx->thr, 4, 0) == -1) {
+		free(pctx);
+		return;
+	}
+
+	evutil_socket_t srcfd = bufferevent_getfd(ctx->src.bev);
+	evutil_socket_t dstfd = bufferevent_getfd(dst->bev);
+	if (protopassthrough_splice_init(&pctx->up, ctx, srcfd, dstfd, 1) == -1 ||
+			protopassthrough_splice_init(&pctx->down, ctx, dstfd, srcfd, 0) == -1) {
+		log_err_level_printf(LOG_WARNING, "Cannot set up splice relay: %s\n", strerror(errno));
+		protopassthrough_splice_free(&pctx->up);
+		protopassthrough_splice_free(&pctx->down);
+		free(pctx);
+		pxy_thrmgr_fd_release(ctx->thr, 4, 0);
+		return;
+	}
+	ctx->fd_count += 4;
+
+	log_fine("Relaying with splice");
+
+	bufferevent_disable(ctx->src.bev, EV_READ|EV_WRITE);
+	bufferevent_disable(dst->bev, EV_READ|EV_WRITE);
+
+	ctx->protoctx->arg = pctx;
+	ctx->protoctx->proto_free = protopassthrough_free;
+
+	event_add(pctx->up.rev, NULL);
+	event_add(pctx->down.rev, NULL);
+}
+#endif /* SYS_HAVE_SPLICE */
+
 static void NONNULL(1)
 protopassthrough_bev_readcb_src(struct bufferevent *bev, pxy_conn_ctx_t *ctx)
 {
@@ -143,7 +430,7 @@ protopassthrough_bev_readcb_src(struct bufferevent *bev, pxy_conn_ctx_t *ctx)
 	}
 
 	evbuffer_add_buffer(bufferevent_get_output(ctx->srvdst.bev), bufferevent_get_input(bev));
-	ctx->protoctx->set_watermarkcb(bev, ctx, ctx->srvdst.bev);
+	ctx->protoctx->set_watermarkcb(&ctx->src, ctx, ctx->srvdst.bev);
 }
 
 static void NONNULL(1)
@@ -158,7 +445,7 @@ protopassthrough_bev_readcb_srvdst(struct bufferevent *bev, pxy_conn_ctx_t *ctx)
 	}
 
 	evbuffer_add_buffer(bufferevent_get_output(ctx->src.bev), bufferevent_get_input(bev));
-	ctx->protoctx->set_watermarkcb(bev, ctx, ctx->src.bev);
+	ctx->protoctx->set_watermarkcb(&ctx->srvdst, ctx, ctx->src.bev);
 }
 
 static void NONNULL(1)
@@ -181,6 +468,9 @@ protopassthrough_bev_writecb_src(struct bufferevent *bev, pxy_conn_ctx_t *ctx)
 		return;
 	}
 	ctx->protoctx->unset_watermarkcb(bev, ctx, &ctx->srvdst);
+#ifdef SYS_HAVE_SPLICE
+	protopassthrough_try_splice(ctx, &ctx->srvdst);
+#endif /* SYS_HAVE_SPLICE */
 }
 
 static void NONNULL(1)
@@ -196,6 +486,9 @@ protopassthrough_bev_writecb_srvdst(struct bufferevent *bev, pxy_conn_ctx_t *ctx
 		return;
 	}
 	ctx->protoctx->unset_watermarkcb(bev, ctx, &ctx->src);
+#ifdef SYS_HAVE_SPLICE
+	protopassthrough_try_splice(ctx, &ctx->srvdst);
+#endif /* SYS_HAVE_SPLICE */
 }
 
 static void NONNULL(1,2)
@@ -257,10 +550,21 @@ protopassthrough_bev_eventcb_connected_srvdst(struct bufferevent *bev, pxy_conn_
 	ctx->connected = 1;
 	bufferevent_enable(bev, EV_READ|EV_WRITE);
 
+	if (ctx->src_prefix) {
+		// Relay the bytes read from src before falling back to passthrough mode, i.e. the ClientHello
+		log_finer_va("Relaying src prefix, size=%zu", evbuffer_get_length(ctx->src_prefix));
+		evbuffer_add_buffer(bufferevent_get_output(bev), ctx->src_prefix);
+		evbuffer_free(ctx->src_prefix);
+		ctx->src_prefix = NULL;
+	}
+
 	// Do not re-enable src if it is already enabled, e.g. in autossl
 	if (!ctx->src.bev && protopassthrough_enable_src(ctx) == -1) {
 		return;
 	}
+#ifdef SYS_HAVE_SPLICE
+	protopassthrough_try_splice(ctx, &ctx->srvdst);
+#endif /* SYS_HAVE_SPLICE */
 }
 
 static void NONNULL(1,2)
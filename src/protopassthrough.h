@@ -31,8 +31,49 @@
 #define PROTOPASSTHROUGH_H
 
 #include "pxyconn.h"
+#include "sys.h"
+
+#ifdef SYS_HAVE_SPLICE
+// Max number of bytes moved by a single splice() call, the default pipe size
+#define PROTOPASSTHROUGH_SPLICE_SIZE 65536
+
+/*
+ * One direction of the splice relay, moving bytes from the in socket to the
+ * out socket through a pipe, without copying them to user space.
+ */
+typedef struct protopassthrough_splice {
+	pxy_conn_ctx_t *ctx;
+	evutil_socket_t in;
+	evutil_socket_t out;
+	int pipe[2];
+	// Bytes in the pipe not written to out yet
+	size_t pending;
+	struct event *rev;
+	struct event *wev;
+	// 1 if this direction moves bytes from src to dst
+	unsigned int from_src : 1;
+	unsigned int eof : 1;
+	// 1 once eof has been passed on to out, see protopassthrough_splice_done()
+	unsigned int done : 1;
+} protopassthrough_splice_t;
+
+typedef struct protopassthrough_ctx {
+	protopassthrough_splice_t up;
+	protopassthrough_splice_t down;
+	// The other end of src, srvdst of passthrough or dst of tcp conns
+	pxy_conn_desc_t *dst;
+} protopassthrough_ctx_t;
+
+int protopassthrough_splice_init(protopassthrough_splice_t *, pxy_conn_ctx_t *, evutil_socket_t, evutil_socket_t, int) NONNULL(1,2) WUNRES;
+void protopassthrough_splice_free(protopassthrough_splice_t *) NONNULL(1);
+int protopassthrough_splice_flush(protopassthrough_splice_t *) NONNULL(1);
+void protopassthrough_splice_readcb(evutil_socket_t, short, void *);
+void protopassthrough_splice_writecb(evutil_socket_t, short, void *);
+void protopassthrough_try_splice(pxy_conn_ctx_t *, pxy_conn_desc_t *) NONNULL(1,2);
+#endif /* SYS_HAVE_SPLICE */
 
 void protopassthrough_engage(pxy_conn_ctx_t *) NONNULL(1);
+void protopassthrough_switch(pxy_conn_ctx_t *) NONNULL(1);
 protocol_t protopassthrough_setup(pxy_conn_ctx_t *) NONNULL(1);
 
 #endif /* PROTOPASSTHROUGH_H */
@@ -32,8 +32,11 @@
 #include "protopassthrough.h"
 
 #include "cachemgr.h"
+#include "cryptopool.h"
 
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
 #include <sys/param.h>
 #include <event2/bufferevent_ssl.h>
 
@@ -289,6 +292,11 @@ protossl_sslctx_setoptions(SSL_CTX *sslctx, pxy_conn_ctx_t *ctx)
 #ifdef SSL_OP_NO_TICKET
 	SSL_CTX_set_options(sslctx, SSL_OP_NO_TICKET);
 #endif /* SSL_OP_NO_TICKET */
+#ifdef SSL_HAVE_KTLS
+	if (ctx->global->ktls) {
+		SSL_CTX_set_options(sslctx, SSL_OP_ENABLE_KTLS);
+	}
+#endif /* SSL_HAVE_KTLS */
 
 #ifdef SSL_OP_NO_SSLv2
 #ifdef HAVE_SSLV2
@@ -392,8 +400,8 @@ protossl_srcsslctx_create(pxy_conn_ctx_t *ctx, X509 *crt, STACK_OF(X509) *chain,
 	                                       sizeof(ssl_session_context));
 #endif /* USE_SSL_SESSION_ID_CONTEXT */
 #ifndef OPENSSL_NO_TLSEXT
+	// The SSL_CTX is shared by conns, the callback gets the conn from the SSL app data
 	SSL_CTX_set_tlsext_servername_callback(sslctx, protossl_ossl_servername_cb);
-	SSL_CTX_set_tlsext_servername_arg(sslctx, ctx);
 #endif /* !OPENSSL_NO_TLSEXT */
 #ifndef OPENSSL_NO_DH
 	if (ctx->conn_opts->dh) {
@@ -472,6 +480,34 @@ protossl_srcsslctx_create(pxy_conn_ctx_t *ctx, X509 *crt, STACK_OF(X509) *chain,
 	return sslctx;
 }
 
+/*
+ * Get an SSL_CTX for terminating SSL with crt from the SSL_CTX cache, or
+ * create one and cache it.  The SSL_CTX does not refer to the conn, so it
+ * is shared by all conns using the same cert with the same conn options.
+ * Returns a new reference, or NULL on error.
+ */
+static SSL_CTX *
+protossl_srcsslctx_get(pxy_conn_ctx_t *ctx, X509 *crt, STACK_OF(X509) *chain,
+                     EVP_PKEY *key)
+{
+	SSL_CTX *sslctx = cachemgr_sslctx_get(crt, ctx->conn_opts);
+	if (sslctx) {
+		if (OPTS_DEBUG(ctx->global)) {
+			log_dbg_printf("SSL_CTX cache: HIT\n");
+		}
+		return sslctx;
+	}
+
+	if (OPTS_DEBUG(ctx->global)) {
+		log_dbg_printf("SSL_CTX cache: MISS\n");
+	}
+	sslctx = protossl_srcsslctx_create(ctx, crt, chain, key);
+	if (sslctx) {
+		cachemgr_sslctx_set(crt, ctx->conn_opts, sslctx);
+	}
+	return sslctx;
+}
+
 static int
 protossl_srccert_write_to_gendir(pxy_conn_ctx_t *ctx, X509 *crt, int is_orig)
 {
@@ -514,8 +550,174 @@ protossl_srccert_write(pxy_conn_ctx_t *ctx)
 	}
 }
 
+/*
+ * Cert forging job on the crypto pool.  The job holds its own references to
+ * the keys and certs, so that the conn can be freed while forging.
+ */
+typedef struct protossl_forge_job {
+	cryptopool_job_t job;
+	// The conn waiting for the forged cert, NULL if the conn has been freed
+	pxy_conn_ctx_t *ctx;
+	X509 *cacrt;
+	EVP_PKEY *cakey;
+	X509 *origcrt;
+	EVP_PKEY *key;
+	const char *crlurl;
+	X509 *crt;
+} protossl_forge_job_t;
+
+static void NONNULL(1)
+protossl_forge_job_free(protossl_forge_job_t *fj)
+{
+	X509_free(fj->cacrt);
+	EVP_PKEY_free(fj->cakey);
+	X509_free(fj->origcrt);
+	EVP_PKEY_free(fj->key);
+	if (fj->crt) {
+		X509_free(fj->crt);
+	}
+	free(fj);
+}
+
+/*
+ * Runs on a crypto thread.
+ */
+static void
+protossl_forge_work(cryptopool_job_t *job)
+{
+	protossl_forge_job_t *fj = (protossl_forge_job_t *)job;
+
+	fj->crt = ssl_x509_forge(fj->cacrt, fj->cakey, fj->origcrt, fj->key, NULL, fj->crlurl);
+	if (fj->crt) {
+		// The cache is thread-safe, so make the cert available to other conns asap
+		cachemgr_fkcrt_set(fj->origcrt, fj->crt);
+	}
+}
+
+static int NONNULL(1)
+protossl_setup_src_ssl_and_dst(pxy_conn_ctx_t *);
+
+/*
+ * Runs on the conn handling thread of the conn, resumes the setup of the conn
+ * where protossl_bev_eventcb_connected_srvdst() has left off.
+ */
+static void
+protossl_forge_done(cryptopool_job_t *job, int canceled)
+{
+	protossl_forge_job_t *fj = (protossl_forge_job_t *)job;
+	pxy_conn_ctx_t *ctx = fj->ctx;
+
+	if (canceled || !ctx) {
+		protossl_forge_job_free(fj);
+		return;
+	}
+
+	log_finest("ENTER");
+
+	ctx->sslctx->forge_job = NULL;
+	ctx->sslctx->forge_pending = 0;
+	ctx->sslctx->forge_done = 1;
+	// Pass the forged cert to protossl_srccert_create(), even if forging failed
+	ctx->sslctx->forgedcrt = fj->crt;
+	fj->crt = NULL;
+	protossl_forge_job_free(fj);
+
+	pxy_thr_touch(ctx);
+	// srvdst.bev may be NULLed during setup in split mode
+	struct bufferevent *bev = ctx->srvdst.bev;
+	bufferevent_enable(bev, ctx->sslctx->srvdst_enabled);
+
+	if (protossl_setup_src_ssl_and_dst(ctx) == 0) {
+		pxy_bev_eventcb_postexec_logging_and_stats(bev, BEV_EVENT_CONNECTED, ctx);
+	}
+
+	if (ctx->term || ctx->enomem) {
+		pxy_conn_free(ctx, ctx->term ? ctx->term_requestor : 0);
+	}
+}
+
+/*
+ * Forge the src cert on the crypto pool, and suspend the conn until done.
+ * Reads on srvdst are disabled while forging, because the conn is not ready
+ * to handle any data or events yet.
+ * Returns -1 if the crypto pool is disabled or full, 0 on success.
+ */
+static int NONNULL(1)
+protossl_forge_async(pxy_conn_ctx_t *ctx)
+{
+	if (!ctx->thrmgr->cryptopool) {
+		return -1;
+	}
+
+	protossl_forge_job_t *fj = malloc(sizeof(protossl_forge_job_t));
+	if (!fj) {
+		return -1;
+	}
+	memset(fj, 0, sizeof(protossl_forge_job_t));
+
+	fj->job.work = protossl_forge_work;
+	fj->job.done = protossl_forge_done;
+	fj->ctx = ctx;
+	fj->cacrt = ctx->conn_opts->cacrt;
+	ssl_x509_refcount_inc(fj->cacrt);
+	fj->cakey = ctx->conn_opts->cakey;
+	ssl_key_refcount_inc(fj->cakey);
+	fj->origcrt = ctx->sslctx->origcrt;
+	ssl_x509_refcount_inc(fj->origcrt);
+	fj->key = ctx->global->leafkey;
+	ssl_key_refcount_inc(fj->key);
+	fj->crlurl = ctx->conn_opts->leafcrlurl;
+
+	if (cryptopool_submit(ctx->thrmgr->cryptopool, &fj->job, ctx->thr->compq) == -1) {
+		log_fine("Crypto pool full, forging on conn thread");
+		protossl_forge_job_free(fj);
+		return -1;
+	}
+
+	ctx->sslctx->forge_job = fj;
+	ctx->sslctx->forge_pending = 1;
+	ctx->sslctx->srvdst_enabled = bufferevent_get_enabled(ctx->srvdst.bev) & EV_READ;
+	bufferevent_disable(ctx->srvdst.bev, EV_READ);
+	return 0;
+}
+
+static void NONNULL(1)
+protossl_srccert_fpr(pxy_conn_ctx_t *ctx, cert_t *cert)
+{
+	if ((WANT_CONNECT_LOG(ctx) || ctx->global->certgendir) && ctx->sslctx->origcrt) {
+		ctx->sslctx->origcrtfpr = ssl_x509_fingerprint(ctx->sslctx->origcrt, 0);
+		if (!ctx->sslctx->origcrtfpr)
+			ctx->enomem = 1;
+	}
+	if ((WANT_CONNECT_LOG(ctx) || ctx->global->certgen_writeall) &&
+	    cert && cert->crt) {
+		ctx->sslctx->usedcrtfpr = ssl_x509_fingerprint(cert->crt, 0);
+		if (!ctx->sslctx->usedcrtfpr)
+			ctx->enomem = 1;
+	}
+}
+
+/*
+ * The server cert does not match the cert the speculative src handshake was
+ * started on, so forget that cert for the SNI and terminate the conn.
+ */
+static void NONNULL(1,2)
+protossl_spec_mismatch(pxy_conn_ctx_t *ctx, const char *reason)
+{
+	log_err_level_printf(LOG_WARNING, "Speculative handshake for %s failed: %s, terminating conn\n",
+	                     ctx->sslctx->sni, reason);
+	ctx->thr->spec_mismatches++;
+	cachemgr_snicrt_del(ctx->sslctx->sni);
+	pxy_conn_term(ctx, 1);
+}
+
+/*
+ * Create the src cert.  If async is set and the cert should be forged,
+ * forging may be deferred to the crypto pool, in which case NULL is returned
+ * with forge_pending set, and the conn is resumed by protossl_forge_done().
+ */
 static cert_t *
-protossl_srccert_create(pxy_conn_ctx_t *ctx)
+protossl_srccert_create(pxy_conn_ctx_t *ctx, int async)
 {
 	cert_t *cert = NULL;
 
@@ -579,40 +781,76 @@ protossl_srccert_create(pxy_conn_ctx_t *ctx)
 	}
 
 	if (!cert && ctx->sslctx->origcrt && ctx->global->leafkey) {
-		cert = cert_new();
+		X509 *crt;
 
-		cert->crt = cachemgr_fkcrt_get(ctx->sslctx->origcrt);
-		if (cert->crt) {
+		if (ctx->sslctx->forge_done) {
+			// Forged on the crypto pool, or failed to
+			crt = ctx->sslctx->forgedcrt;
+			ctx->sslctx->forgedcrt = NULL;
+		} else if ((crt = cachemgr_fkcrt_get(ctx->sslctx->origcrt))) {
 			if (OPTS_DEBUG(ctx->global))
 				log_dbg_printf("Certificate cache: HIT\n");
 		} else {
 			if (OPTS_DEBUG(ctx->global))
 				log_dbg_printf("Certificate cache: MISS\n");
-			cert->crt = ssl_x509_forge(ctx->conn_opts->cacrt,
-			                           ctx->conn_opts->cakey,
-			                           ctx->sslctx->origcrt,
-			                           ctx->global->leafkey,
-			                           NULL,
-			                           ctx->conn_opts->leafcrlurl);
-			cachemgr_fkcrt_set(ctx->sslctx->origcrt, cert->crt);
+			if (async && protossl_forge_async(ctx) == 0) {
+				return NULL;
+			}
+			crt = ssl_x509_forge(ctx->conn_opts->cacrt,
+			                     ctx->conn_opts->cakey,
+			                     ctx->sslctx->origcrt,
+			                     ctx->global->leafkey,
+			                     NULL,
+			                     ctx->conn_opts->leafcrlurl);
+			cachemgr_fkcrt_set(ctx->sslctx->origcrt, crt);
 		}
+		cert = cert_new();
+		cert->crt = crt;
 		cert_set_key(cert, ctx->global->leafkey);
 		cert_set_chain(cert, ctx->conn_opts->chain);
 		ctx->sslctx->generated_cert = 1;
 	}
 
-	if ((WANT_CONNECT_LOG(ctx) || ctx->global->certgendir) && ctx->sslctx->origcrt) {
-		ctx->sslctx->origcrtfpr = ssl_x509_fingerprint(ctx->sslctx->origcrt, 0);
-		if (!ctx->sslctx->origcrtfpr)
-			ctx->enomem = 1;
+	protossl_srccert_fpr(ctx, cert);
+	return cert;
+}
+
+/*
+ * Use the cert the speculative src handshake was started on, if it was forged
+ * from the original server cert.  Otherwise it is dropped from the SNI cache,
+ * and the conn is terminated, since the client may have accepted it already.
+ */
+static cert_t * NONNULL(1)
+protossl_srccert_spec(pxy_conn_ctx_t *ctx)
+{
+	snicrt_t *spec = ctx->sslctx->spec;
+	unsigned char fpr[SSL_X509_FPRSZ];
+	cert_t *cert;
+
+	ctx->sslctx->spec = NULL;
+	if (!ctx->sslctx->origcrt ||
+	    ssl_x509_fingerprint_sha1(ctx->sslctx->origcrt, fpr) == -1 ||
+	    memcmp(fpr, spec->origfpr, SSL_X509_FPRSZ) != 0) {
+		snicrt_free(spec);
+		protossl_spec_mismatch(ctx, "server cert changed");
+		return NULL;
 	}
-	if ((WANT_CONNECT_LOG(ctx) || ctx->global->certgen_writeall) &&
-	    cert && cert->crt) {
-		ctx->sslctx->usedcrtfpr = ssl_x509_fingerprint(cert->crt, 0);
-		if (!ctx->sslctx->usedcrtfpr)
-			ctx->enomem = 1;
+	if (OPTS_DEBUG(ctx->global))
+		log_dbg_printf("SNI certificate cache: MATCH\n");
+
+	if (!(cert = cert_new())) {
+		snicrt_free(spec);
+		ctx->enomem = 1;
+		return NULL;
 	}
+	cert->crt = spec->crt;
+	spec->crt = NULL;
+	snicrt_free(spec);
+	cert_set_key(cert, ctx->global->leafkey);
+	cert_set_chain(cert, ctx->conn_opts->chain);
+	ctx->sslctx->generated_cert = 1;
 
+	protossl_srccert_fpr(ctx, cert);
 	return cert;
 }
 
@@ -798,69 +1036,84 @@ protossl_reconnect_srvdst(pxy_conn_ctx_t *ctx)
 	}
 }
 
-static int
-protossl_apply_filter(pxy_conn_ctx_t *ctx)
+/*
+ * Set the action, log settings, and conn options of the matching SSL filtering
+ * rule a on the conn, deferring any block action.
+ * Returns 1 if the rule passes the conn through, 0 otherwise.
+ */
+static int NONNULL(1,2)
+protossl_set_filter_action(pxy_conn_ctx_t *ctx, filter_action_t *a)
 {
 	int rv = 0;
-	filter_action_t *a;
-	if ((a = pxy_conn_filter(ctx, protossl_filter))) {
-		unsigned int action = pxy_conn_translate_filter_action(ctx, a);
+	unsigned int action = pxy_conn_translate_filter_action(ctx, a);
 
-		ctx->filter_precedence = action & FILTER_PRECEDENCE;
+	ctx->filter_precedence = action & FILTER_PRECEDENCE;
 
-		if (action & FILTER_ACTION_DIVERT) {
-			ctx->deferred_action = FILTER_ACTION_NONE;
-			ctx->divert = 1;
-		}
-		else if (action & FILTER_ACTION_SPLIT) {
-			ctx->deferred_action = FILTER_ACTION_NONE;
-			ctx->divert = 0;
-		}
-		else if (action & FILTER_ACTION_PASS) {
-			ctx->deferred_action = FILTER_ACTION_NONE;
-			ctx->pass = 1;
-			rv = 1;
-		}
-		else if (action & FILTER_ACTION_BLOCK) {
-			// Always defer block action, the only action we can defer from this point on
-			// This block action should override any deferred pass action,
-			// because the current rule must have a higher precedence
-			log_fine("Deferring block action");
-			ctx->deferred_action = FILTER_ACTION_BLOCK;
-		}
-		//else { /* FILTER_ACTION_MATCH */ }
-
-		// Filtering rules at higher precedence can enable/disable logging
-		if (action & FILTER_LOG_CONNECT)
-			ctx->log_connect = 1;
-		else if (action & FILTER_LOG_NOCONNECT)
-			ctx->log_connect = 0;
-		if (action & FILTER_LOG_MASTER)
-			ctx->log_master = 1;
-		else if (action & FILTER_LOG_NOMASTER)
-			ctx->log_master = 0;
-		if (action & FILTER_LOG_CERT)
-			ctx->log_cert = 1;
-		else if (action & FILTER_LOG_NOCERT)
-			ctx->log_cert = 0;
-		if (action & FILTER_LOG_CONTENT)
-			ctx->log_content = 1;
-		else if (action & FILTER_LOG_NOCONTENT)
-			ctx->log_content = 0;
-		if (action & FILTER_LOG_PCAP)
-			ctx->log_pcap = 1;
-		else if (action & FILTER_LOG_NOPCAP)
-			ctx->log_pcap = 0;
+	if (action & FILTER_ACTION_DIVERT) {
+		ctx->deferred_action = FILTER_ACTION_NONE;
+		ctx->divert = 1;
+	}
+	else if (action & FILTER_ACTION_SPLIT) {
+		ctx->deferred_action = FILTER_ACTION_NONE;
+		ctx->divert = 0;
+	}
+	else if (action & FILTER_ACTION_PASS) {
+		ctx->deferred_action = FILTER_ACTION_NONE;
+		ctx->pass = 1;
+		rv = 1;
+	}
+	else if (action & FILTER_ACTION_BLOCK) {
+		// Always defer block action, the only action we can defer from this point on
+		// This block action should override any deferred pass action,
+		// because the current rule must have a higher precedence
+		log_fine("Deferring block action");
+		ctx->deferred_action = FILTER_ACTION_BLOCK;
+	}
+	//else { /* FILTER_ACTION_MATCH */ }
+
+	// Filtering rules at higher precedence can enable/disable logging
+	if (action & FILTER_LOG_CONNECT)
+		ctx->log_connect = 1;
+	else if (action & FILTER_LOG_NOCONNECT)
+		ctx->log_connect = 0;
+	if (action & FILTER_LOG_MASTER)
+		ctx->log_master = 1;
+	else if (action & FILTER_LOG_NOMASTER)
+		ctx->log_master = 0;
+	if (action & FILTER_LOG_CERT)
+		ctx->log_cert = 1;
+	else if (action & FILTER_LOG_NOCERT)
+		ctx->log_cert = 0;
+	if (action & FILTER_LOG_CONTENT)
+		ctx->log_content = 1;
+	else if (action & FILTER_LOG_NOCONTENT)
+		ctx->log_content = 0;
+	if (action & FILTER_LOG_PCAP)
+		ctx->log_pcap = 1;
+	else if (action & FILTER_LOG_NOPCAP)
+		ctx->log_pcap = 0;
 #ifndef WITHOUT_MIRROR
-		if (action & FILTER_LOG_MIRROR)
-			ctx->log_mirror = 1;
-		else if (action & FILTER_LOG_NOMIRROR)
-			ctx->log_mirror = 0;
+	if (action & FILTER_LOG_MIRROR)
+		ctx->log_mirror = 1;
+	else if (action & FILTER_LOG_NOMIRROR)
+		ctx->log_mirror = 0;
 #endif /* !WITHOUT_MIRROR */
 
-		if (a->conn_opts) {
-			ctx->conn_opts = a->conn_opts;
+	if (a->conn_opts) {
+		ctx->conn_opts = a->conn_opts;
+	}
+	return rv;
+}
+
+static int
+protossl_apply_filter(pxy_conn_ctx_t *ctx)
+{
+	int rv = 0;
+	filter_action_t *a;
+	if ((a = pxy_conn_filter(ctx, protossl_filter))) {
+		rv = protossl_set_filter_action(ctx, a);
 
+		if (a->conn_opts) {
 			if (ctx->conn_opts->reconnect_ssl) {
 				// Reconnect srvdst only once, if ReconnectSSL set in the rule
 				if (!ctx->sslctx->reconnected) {
@@ -886,33 +1139,68 @@ protossl_apply_filter(pxy_conn_ctx_t *ctx)
 	return rv;
 }
 
+/*
+ * Create an SSL object for terminating SSL on src with crt.
+ */
+static SSL * NONNULL(1,2)
+protossl_srcssl_new(pxy_conn_ctx_t *ctx, X509 *crt, STACK_OF(X509) *chain,
+                    EVP_PKEY *key)
+{
+	SSL_CTX *sslctx = protossl_srcsslctx_get(ctx, crt, chain, key);
+	if (!sslctx)
+		return NULL;
+	SSL *ssl = SSL_new(sslctx);
+	SSL_CTX_free(sslctx); /* SSL_new() increments refcount */
+	if (!ssl) {
+		ctx->enomem = 1;
+		return NULL;
+	}
+	SSL_set_app_data(ssl, ctx);
+#ifdef SSL_MODE_RELEASE_BUFFERS
+	/* lower memory footprint for idle connections */
+	SSL_set_mode(ssl, SSL_get_mode(ssl) | SSL_MODE_RELEASE_BUFFERS);
+#endif /* SSL_MODE_RELEASE_BUFFERS */
+	return ssl;
+}
+
 /*
  * Create new SSL context for the incoming connection, based on the original
  * destination SSL certificate.
  * Returns NULL if no suitable certificate could be found or the site should 
- * be passed through.
+ * be passed through, or if async is set and the certificate is being forged
+ * on the crypto pool (forge_pending).  In the latter case, this function is
+ * called again once forging is done.
+ * If the src handshake has been started speculatively, validates its cert and
+ * returns the existing src SSL object.
  */
 static SSL *
-protossl_srcssl_create(pxy_conn_ctx_t *ctx, SSL *origssl)
+protossl_srcssl_create(pxy_conn_ctx_t *ctx, SSL *origssl, int async)
 {
 	cert_t *cert;
 
-	cachemgr_dsess_set((struct sockaddr*)&ctx->dstaddr,
-	                   ctx->dstaddrlen, ctx->sslctx->sni,
-	                   SSL_get0_session(origssl));
+	// Skip if resumed after forging on the crypto pool, we have done this already
+	if (!ctx->sslctx->forge_done) {
+		cachemgr_dsess_set((struct sockaddr*)&ctx->dstaddr,
+		                   ctx->dstaddrlen, ctx->sslctx->sni,
+		                   SSL_get0_session(origssl));
 
-	ctx->sslctx->origcrt = SSL_get_peer_certificate(origssl);
+		ctx->sslctx->origcrt = SSL_get_peer_certificate(origssl);
 
-	if (OPTS_DEBUG(ctx->global)) {
-		if (ctx->sslctx->origcrt) {
-			log_dbg_printf("===> Original server certificate:\n");
-			protossl_debug_crt(ctx->sslctx->origcrt);
-		} else {
-			log_dbg_printf("===> Original server has no cert!\n");
+		if (OPTS_DEBUG(ctx->global)) {
+			if (ctx->sslctx->origcrt) {
+				log_dbg_printf("===> Original server certificate:\n");
+				protossl_debug_crt(ctx->sslctx->origcrt);
+			} else {
+				log_dbg_printf("===> Original server has no cert!\n");
+			}
 		}
 	}
 
-	cert = protossl_srccert_create(ctx);
+	if (ctx->sslctx->spec) {
+		cert = protossl_srccert_spec(ctx);
+	} else {
+		cert = protossl_srccert_create(ctx, async);
+	}
 	if (!cert)
 		return NULL;
 
@@ -936,21 +1224,21 @@ protossl_srcssl_create(pxy_conn_ctx_t *ctx, SSL *origssl)
 		return NULL;
 	}
 
-	SSL_CTX *sslctx = protossl_srcsslctx_create(ctx, cert->crt, cert->chain,
-	                                       cert->key);
-	cert_free(cert);
-	if (!sslctx)
-		return NULL;
-	SSL *ssl = SSL_new(sslctx);
-	SSL_CTX_free(sslctx); /* SSL_new() increments refcount */
-	if (!ssl) {
-		ctx->enomem = 1;
-		return NULL;
+	if (ctx->src.ssl) {
+		// The filter may have switched to conn options with another CA
+		if (!ctx->conn_opts->cacrt ||
+		    X509_check_issued(ctx->conn_opts->cacrt, cert->crt) != X509_V_OK) {
+			cert_free(cert);
+			protossl_spec_mismatch(ctx, "CA changed by filter");
+			return NULL;
+		}
+		ctx->thr->spec_hits++;
+		cert_free(cert);
+		return ctx->src.ssl;
 	}
-#ifdef SSL_MODE_RELEASE_BUFFERS
-	/* lower memory footprint for idle connections */
-	SSL_set_mode(ssl, SSL_get_mode(ssl) | SSL_MODE_RELEASE_BUFFERS);
-#endif /* SSL_MODE_RELEASE_BUFFERS */
+
+	SSL *ssl = protossl_srcssl_new(ctx, cert->crt, cert->chain, cert->key);
+	cert_free(cert);
 	return ssl;
 }
 
@@ -965,9 +1253,9 @@ protossl_srcssl_create(pxy_conn_ctx_t *ctx, SSL *origssl)
  * indicate to it.
  */
 static int
-protossl_ossl_servername_cb(SSL *ssl, UNUSED int *al, void *arg)
+protossl_ossl_servername_cb(SSL *ssl, UNUSED int *al, UNUSED void *arg)
 {
-	pxy_conn_ctx_t *ctx = arg;
+	pxy_conn_ctx_t *ctx = SSL_get_app_data(ssl);
 	const char *sn;
 	X509 *sslcrt;
 
@@ -1006,7 +1294,9 @@ protossl_ossl_servername_cb(SSL *ssl, UNUSED int *al, void *arg)
 
 	/* generate a new certificate with sn as additional altSubjectName
 	 * and replace it both in the current SSL ctx and in the cert cache */
+	// The SNI cache is keyed by the servername, so the speculative cert matches it
 	if (ctx->conn_opts->allow_wrong_host && !ctx->sslctx->immutable_cert &&
+	    !ctx->sslctx->spec &&
 	    !ssl_x509_names_match((sslcrt = SSL_get_certificate(ssl)), sn)) {
 		X509 *newcrt;
 		SSL_CTX *newsslctx;
@@ -1048,7 +1338,7 @@ protossl_ossl_servername_cb(SSL *ssl, UNUSED int *al, void *arg)
 			}
 		}
 
-		newsslctx = protossl_srcsslctx_create(ctx, newcrt, ctx->conn_opts->chain,
+		newsslctx = protossl_srcsslctx_get(ctx, newcrt, ctx->conn_opts->chain,
 		                                 ctx->global->leafkey);
 		if (!newsslctx) {
 			X509_free(newcrt);
@@ -1066,6 +1356,20 @@ protossl_ossl_servername_cb(SSL *ssl, UNUSED int *al, void *arg)
 }
 #endif /* !OPENSSL_NO_TLSEXT */
 
+/*
+ * Called by OpenSSL if the server requests a client cert and we have none to
+ * send.  Note the demand, so that if the handshake fails because of it, the
+ * site counts toward auto-passing.
+ */
+static int
+protossl_clientcrt_cb(SSL *ssl, UNUSED X509 **x509, UNUSED EVP_PKEY **pkey)
+{
+	pxy_conn_ctx_t *ctx = SSL_get_app_data(ssl);
+
+	ctx->sslctx->clientcrt_demand = 1;
+	return 0;
+}
+
 /*
  * Create new SSL context for outgoing connections to the original destination.
  * If hostname sni is provided, use it for Server Name Indication.
@@ -1127,6 +1431,9 @@ protossl_dstssl_create(pxy_conn_ctx_t *ctx)
 		SSL_CTX_free(sslctx);
 		return NULL;
 	}
+	if (!ctx->conn_opts->clientcrt) {
+		SSL_CTX_set_client_cert_cb(sslctx, protossl_clientcrt_cb);
+	}
 
 	ssl = SSL_new(sslctx);
 	SSL_CTX_free(sslctx); /* SSL_new() increments refcount */
@@ -1145,6 +1452,8 @@ protossl_dstssl_create(pxy_conn_ctx_t *ctx)
 	SSL_set_mode(ssl, SSL_get_mode(ssl) | SSL_MODE_RELEASE_BUFFERS);
 #endif /* SSL_MODE_RELEASE_BUFFERS */
 
+	SSL_set_app_data(ssl, ctx);
+
 	/* session resuming based on remote endpoint address and port */
 	sess = cachemgr_dsess_get((struct sockaddr *)&ctx->dstaddr,
 	                          ctx->dstaddrlen, ctx->sslctx->sni); /* new sess inst */
@@ -1159,6 +1468,168 @@ protossl_dstssl_create(pxy_conn_ctx_t *ctx)
 	return ssl;
 }
 
+#if (OPENSSL_VERSION_NUMBER < 0x10100000L) || (defined(LIBRESSL_VERSION_NUMBER) && LIBRESSL_VERSION_NUMBER < 0x20700000L)
+#define BIO_get_data(b) ((b)->ptr)
+#define BIO_set_data(b, d) ((b)->ptr = (d))
+#define BIO_set_init(b, i) ((b)->init = (i))
+#define BIO_next(b) ((b)->next_bio)
+#define BIO_up_ref(b) CRYPTO_add(&(b)->references, 1, CRYPTO_LOCK_BIO)
+#endif /* OpenSSL < 1.1.0 */
+
+/*
+ * Prefix BIO.
+ *
+ * Filter BIO which returns the bytes in an evbuffer on read before reading
+ * from the next BIO in the chain.  It hands the ClientHello read from the
+ * src socket before setting up the src SSL object to that SSL object.
+ * Everything else is passed through to the next BIO.
+ */
+static int
+protossl_bio_prefix_read(BIO *b, char *out, int outl)
+{
+	struct evbuffer *prefix = BIO_get_data(b);
+	BIO *next = BIO_next(b);
+	int n;
+
+	if (prefix) {
+		n = evbuffer_remove(prefix, out, outl);
+		if (evbuffer_get_length(prefix) == 0) {
+			evbuffer_free(prefix);
+			BIO_set_data(b, NULL);
+		}
+		return n;
+	}
+	if (!next)
+		return 0;
+	BIO_clear_retry_flags(b);
+	n = BIO_read(next, out, outl);
+	BIO_copy_next_retry(b);
+	return n;
+}
+
+static int
+protossl_bio_prefix_write(BIO *b, const char *in, int inl)
+{
+	BIO *next = BIO_next(b);
+	int n;
+
+	if (!next)
+		return 0;
+	BIO_clear_retry_flags(b);
+	n = BIO_write(next, in, inl);
+	BIO_copy_next_retry(b);
+	return n;
+}
+
+static long
+protossl_bio_prefix_ctrl(BIO *b, int cmd, long num, void *ptr)
+{
+	struct evbuffer *prefix = BIO_get_data(b);
+	BIO *next = BIO_next(b);
+	long rv;
+
+	if (!next)
+		return 0;
+	rv = BIO_ctrl(next, cmd, num, ptr);
+	if (cmd == BIO_CTRL_PENDING && prefix)
+		rv += evbuffer_get_length(prefix);
+	return rv;
+}
+
+static int
+protossl_bio_prefix_create(BIO *b)
+{
+	BIO_set_data(b, NULL);
+	BIO_set_init(b, 1);
+	return 1;
+}
+
+static int
+protossl_bio_prefix_destroy(BIO *b)
+{
+	struct evbuffer *prefix = BIO_get_data(b);
+
+	if (prefix)
+		evbuffer_free(prefix);
+	BIO_set_data(b, NULL);
+	return 1;
+}
+
+#if (OPENSSL_VERSION_NUMBER < 0x10100000L) || (defined(LIBRESSL_VERSION_NUMBER) && LIBRESSL_VERSION_NUMBER < 0x20700000L)
+static BIO_METHOD protossl_bio_prefix_method_st = {
+	BIO_TYPE_FILTER,
+	"sslproxy prefix",
+	protossl_bio_prefix_write,
+	protossl_bio_prefix_read,
+	NULL,
+	NULL,
+	protossl_bio_prefix_ctrl,
+	protossl_bio_prefix_create,
+	protossl_bio_prefix_destroy,
+	NULL,
+};
+
+static BIO_METHOD *
+protossl_bio_prefix_method(void)
+{
+	return &protossl_bio_prefix_method_st;
+}
+#else /* OpenSSL >= 1.1.0 */
+static BIO_METHOD *protossl_bio_prefix_method_st = NULL;
+static pthread_once_t protossl_bio_prefix_once = PTHREAD_ONCE_INIT;
+
+static void
+protossl_bio_prefix_method_init(void)
+{
+	BIO_METHOD *m = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_FILTER, "sslproxy prefix");
+	if (!m)
+		return;
+	BIO_meth_set_write(m, protossl_bio_prefix_write);
+	BIO_meth_set_read(m, protossl_bio_prefix_read);
+	BIO_meth_set_ctrl(m, protossl_bio_prefix_ctrl);
+	BIO_meth_set_create(m, protossl_bio_prefix_create);
+	BIO_meth_set_destroy(m, protossl_bio_prefix_destroy);
+	protossl_bio_prefix_method_st = m;
+}
+
+static BIO_METHOD *
+protossl_bio_prefix_method(void)
+{
+	pthread_once(&protossl_bio_prefix_once, protossl_bio_prefix_method_init);
+	return protossl_bio_prefix_method_st;
+}
+#endif /* OpenSSL >= 1.1.0 */
+
+/*
+ * Make the src SSL object read the bytes in ctx->src_prefix before reading
+ * from the src socket.  Writes go to the socket BIO directly.
+ * Takes ownership of ctx->src_prefix.
+ * Returns -1 on error.
+ */
+static int NONNULL(1)
+protossl_set_src_prefix(pxy_conn_ctx_t *ctx)
+{
+	BIO_METHOD *method;
+	BIO *prefix, *sock;
+
+	if (!(method = protossl_bio_prefix_method()))
+		return -1;
+	if (!(prefix = BIO_new(method)))
+		return -1;
+	if (!(sock = BIO_new_socket(ctx->fd, BIO_NOCLOSE))) {
+		BIO_free(prefix);
+		return -1;
+	}
+	BIO_set_data(prefix, ctx->src_prefix);
+	ctx->src_prefix = NULL;
+
+	// The socket BIO is both the end of the read chain and the write BIO
+	BIO_up_ref(sock);
+	BIO_push(prefix, sock);
+	SSL_set_bio(ctx->src.ssl, prefix, sock);
+	return 0;
+}
+
 /*
  * Set up a bufferevent structure for either a dst or src connection,
  * optionally with or without SSL.  Sets all callbacks, enables read
@@ -1303,6 +1774,16 @@ protossl_free(pxy_conn_ctx_t *ctx)
 	if (ctx->sslctx->srvdst_ssl_cipher) {
 		free(ctx->sslctx->srvdst_ssl_cipher);
 	}
+	if (ctx->sslctx->forge_job) {
+		// The crypto pool frees the job when done
+		ctx->sslctx->forge_job->ctx = NULL;
+	}
+	if (ctx->sslctx->forgedcrt) {
+		X509_free(ctx->sslctx->forgedcrt);
+	}
+	if (ctx->sslctx->spec) {
+		snicrt_free(ctx->sslctx->spec);
+	}
 	free(ctx->sslctx);
 	// It is necessary to NULL the sslctx to prevent passthrough mode trying to access it (signal 11 crash)
 	ctx->sslctx = NULL;
@@ -1310,11 +1791,12 @@ protossl_free(pxy_conn_ctx_t *ctx)
 
 #ifndef OPENSSL_NO_TLSEXT
 /*
- * The SNI hostname has been resolved.  Fill the first resolved address into
- * the context and continue connecting.
+ * The SNI hostname has been resolved, possibly from the DNS cache of the
+ * thread.  Fill the address and the SNI port into the context and continue
+ * connecting.
  */
 static void
-protossl_sni_resolve_cb(int errcode, struct evutil_addrinfo *ai, void *arg)
+protossl_sni_resolve_cb(int errcode, const struct sockaddr *addr, socklen_t addrlen, void *arg)
 {
 	pxy_conn_ctx_t *ctx = arg;
 
@@ -1327,18 +1809,24 @@ protossl_sni_resolve_cb(int errcode, struct evutil_addrinfo *ai, void *arg)
 		return;
 	}
 
-	memcpy(&ctx->dstaddr, ai->ai_addr, ai->ai_addrlen);
-	ctx->dstaddrlen = ai->ai_addrlen;
-	evutil_freeaddrinfo(ai);
+	memcpy(&ctx->dstaddr, addr, addrlen);
+	ctx->dstaddrlen = addrlen;
+	if (addr->sa_family == AF_INET) {
+		((struct sockaddr_in *)&ctx->dstaddr)->sin_port = htons(ctx->spec->sni_port);
+	} else {
+		((struct sockaddr_in6 *)&ctx->dstaddr)->sin6_port = htons(ctx->spec->sni_port);
+	}
 	pxy_conn_connect(ctx);
 }
 #endif /* !OPENSSL_NO_TLSEXT */
 
 /*
- * The src fd is readable.  This is used to sneak-preview the SNI on SSL
- * connections.  If ctx->ev is NULL, it was called manually for a non-SSL
- * connection.  If ctx->opts->passthrough is set, it was called a second time
- * after the first ssl callout failed because of client cert auth.
+ * The src fd is readable.  This is used to read the ClientHello on SSL
+ * connections and parse the SNI from it, before connecting to dst.
+ * The first record of the ClientHello is read into ctx->src_prefix as bytes
+ * arrive, and parsed once complete.  The bytes read are fed to the src SSL
+ * object before the rest of the stream, or relayed to the server if we fall
+ * back to passthrough mode.
  */
 static void
 protossl_fd_readcb(evutil_socket_t fd, UNUSED short what, void *arg)
@@ -1347,21 +1835,30 @@ protossl_fd_readcb(evutil_socket_t fd, UNUSED short what, void *arg)
 
 	log_finest("ENTER");
 
-	event_free(ctx->ev);
-	ctx->ev = NULL;
-
 	// Child connections will use the sni info obtained by the parent conn
-	/* for SSL, peek ClientHello and parse SNI from it */
+	/* for SSL, read ClientHello and parse SNI from it */
 
-	unsigned char buf[2048];
-	ssize_t n;
 	const unsigned char *chello;
+	unsigned char *buf;
+	size_t len, sz;
+	ssize_t recordsz;
+	int n;
 	int rv;
 
-	n = recv(fd, buf, sizeof(buf), MSG_PEEK);
+	if (!ctx->src_prefix && !(ctx->src_prefix = evbuffer_new())) {
+		log_err_level(LOG_CRIT, "Error creating ClientHello buffer, aborting connection");
+		goto out;
+	}
+	len = evbuffer_get_length(ctx->src_prefix);
+	sz = ctx->sslctx->clienthello_sz ? ctx->sslctx->clienthello_sz : SSL_TLS_RECORD_HDR_SZ;
+
+	// Do not read beyond the ClientHello record, the SSL object reads the rest
+	n = evbuffer_read(ctx->src_prefix, fd, sz - len);
 	if (n == -1) {
-		log_err_printf("Error peeking on fd, aborting connection\n");
-		log_fine("Error peeking on fd, aborting connection");
+		if (errno == EAGAIN || errno == EINTR)
+			return;
+		log_err_printf("Error reading on fd, aborting connection\n");
+		log_fine("Error reading on fd, aborting connection");
 		goto out;
 	}
 	if (n == 0) {
@@ -1370,50 +1867,45 @@ protossl_fd_readcb(evutil_socket_t fd, UNUSED short what, void *arg)
 		log_fine("Socket got closed while waiting");
 		goto out;
 	}
+	len += n;
+	if (len < sz)
+		return;
+
+	if (!ctx->sslctx->clienthello_sz) {
+		/* record header complete, wait for the rest of the record */
+		buf = evbuffer_pullup(ctx->src_prefix, len);
+		recordsz = ssl_tls_clienthello_recordsz(buf, len);
+		if (recordsz > (ssize_t)len) {
+			ctx->sslctx->clienthello_sz = recordsz;
+			return;
+		}
+	}
+
+	event_free(ctx->ev);
+	ctx->ev = NULL;
 
-	rv = ssl_tls_clienthello_parse(buf, n, 0, &chello, &ctx->sslctx->sni);
+	buf = evbuffer_pullup(ctx->src_prefix, len);
+	if (!buf) {
+		log_err_level(LOG_CRIT, "Error pulling up ClientHello, aborting connection");
+		goto out;
+	}
+	rv = ssl_tls_clienthello_parse(buf, len, 0, &chello, &ctx->sslctx->sni);
 	if ((rv == 1) && !chello) {
-		log_err_printf("Peeking did not yield a (truncated) ClientHello message, aborting connection\n");
-		log_fine("Peeking did not yield a (truncated) ClientHello message, aborting connection");
+		log_err_printf("Reading did not yield a (truncated) ClientHello message, aborting connection\n");
+		log_fine("Reading did not yield a (truncated) ClientHello message, aborting connection");
 		goto out;
 	}
 	if (OPTS_DEBUG(ctx->global)) {
-		log_dbg_printf("SNI peek: [%s] [%s], fd=%d\n", ctx->sslctx->sni ? ctx->sslctx->sni : "n/a",
-					   ((rv == 1) && chello) ? "incomplete" : "complete", ctx->fd);
-	}
-	if ((rv == 1) && chello && (ctx->sslctx->sni_peek_retries++ < 50)) {
-		/* ssl_tls_clienthello_parse indicates that we
-		 * should retry later when we have more data, and we
-		 * haven't reached the maximum retry count yet.
-		 * Reschedule this event as timeout-only event in
-		 * order to prevent busy looping over the read event.
-		 * Because we only peeked at the pending bytes and
-		 * never actually read them, fd is still ready for
-		 * reading now.  We use 25 * 0.2 s = 5 s timeout. */
-		struct timeval retry_delay = {0, 100};
-
-		ctx->ev = event_new(ctx->thr->evbase, fd, 0, protossl_fd_readcb, ctx);
-		if (!ctx->ev) {
-			log_err_level(LOG_CRIT, "Error creating retry event, aborting connection");
-			goto out;
-		}
-		if (event_add(ctx->ev, &retry_delay) == -1)
-			goto out;
-		return;
+		/* a ClientHello spanning records is incomplete, but its first record is all we parse */
+		log_dbg_printf("SNI read: [%s] [%s], size=%zu, fd=%d\n", ctx->sslctx->sni ? ctx->sslctx->sni : "n/a",
+					   ((rv == 1) && chello) ? "incomplete" : "complete", len, ctx->fd);
 	}
 
 	if (ctx->sslctx->sni && !ctx->dstaddrlen && ctx->spec->sni_port) {
-		char sniport[6];
-		struct evutil_addrinfo hints;
-
-		memset(&hints, 0, sizeof(hints));
-		hints.ai_family = ctx->af;
-		hints.ai_flags = EVUTIL_AI_ADDRCONFIG;
-		hints.ai_socktype = SOCK_STREAM;
-		hints.ai_protocol = IPPROTO_TCP;
-
-		snprintf(sniport, sizeof(sniport), "%i", ctx->spec->sni_port);
-		evdns_getaddrinfo(ctx->thr->dnsbase, ctx->sslctx->sni, sniport, &hints, protossl_sni_resolve_cb, ctx);
+		if (dnscache_resolve(ctx->thr->dnscache, ctx->sslctx->sni, ctx->af, protossl_sni_resolve_cb, ctx) == -1) {
+			log_err_level(LOG_CRIT, "Error resolving SNI hostname, aborting connection");
+			goto out;
+		}
 		return;
 	}
 
@@ -1431,8 +1923,11 @@ protossl_init_conn(evutil_socket_t fd, UNUSED short what, void *arg)
 
 	log_finest("ENTER");
 
-	event_free(ctx->ev);
-	ctx->ev = NULL;
+	// ctx->ev is NULL if the conn was accepted on a per-thread listener
+	if (ctx->ev) {
+		event_free(ctx->ev);
+		ctx->ev = NULL;
+	}
 
 	if (pxy_conn_init(ctx) == -1)
 		return;
@@ -1443,7 +1938,7 @@ protossl_init_conn(evutil_socket_t fd, UNUSED short what, void *arg)
 #endif /* !OPENSSL_NO_TLSEXT */
 
 	/* for SSL, defer dst connection setup to initial_readcb */
-	ctx->ev = event_new(ctx->thr->evbase, ctx->fd, EV_READ, protossl_fd_readcb, ctx);
+	ctx->ev = event_new(ctx->thr->evbase, ctx->fd, EV_READ|EV_PERSIST, protossl_fd_readcb, ctx);
 	if (!ctx->ev)
 		goto out;
 
@@ -1501,11 +1996,203 @@ protossl_setup_srvdst(pxy_conn_ctx_t *ctx)
 	return 0;
 }
 
+/*
+ * Record an SSL interception failure for the site in the pass cache, so that
+ * conns to it are passed through once failures reach the threshold.
+ */
+static void NONNULL(1,2)
+protossl_autopass_record(pxy_conn_ctx_t *ctx, const char *reason)
+{
+	unsigned int failures;
+	pass_t *pass;
+
+	if (!ctx->global->autopass_ttl || !ctx->dstaddrlen) {
+		return;
+	}
+
+	ctx->thr->autopass_fails++;
+
+	/* add the failure atomically, so that concurrent ones are not lost */
+	if (!(pass = cachemgr_pass_add((struct sockaddr *)&ctx->dstaddr, ctx->dstaddrlen, ctx->sslctx->sni,
+	                               1, ctx->global->autopass_ttl))) {
+		return;
+	}
+	failures = pass->failures;
+	free(pass);
+
+	if (failures == ctx->global->autopass_failures) {
+		log_err_level_printf(LOG_WARNING, "Passing through %s:%s sni:%s for %us, %s\n",
+		                     STRORDASH(ctx->dsthost_str), STRORDASH(ctx->dstport_str),
+		                     STRORDASH(ctx->sslctx->sni), ctx->global->autopass_ttl, reason);
+	} else {
+		log_fine_va("Interception failure %u: %s", failures, reason);
+	}
+}
+
+/*
+ * Returns 1 if interception has failed for the site often enough to pass
+ * it through, 0 otherwise.
+ */
+static int NONNULL(1)
+protossl_autopass_match(pxy_conn_ctx_t *ctx)
+{
+	pass_t *pass;
+	int rv;
+
+	if (!ctx->global->autopass_ttl || !ctx->conn_opts->passthrough) {
+		return 0;
+	}
+
+	if (!(pass = cachemgr_pass_get((struct sockaddr *)&ctx->dstaddr, ctx->dstaddrlen, ctx->sslctx->sni))) {
+		return 0;
+	}
+	rv = pass->failures >= ctx->global->autopass_failures;
+	free(pass);
+	return rv;
+}
+
+/*
+ * Apply user auth and the filtering rules before auto-passing the conn, as
+ * protossl_bev_eventcb_connected_srvdst() would, except that the SSL rules can
+ * only match the SNI, since there is no server cert.  Terminates blocked conns.
+ * Returns 1 if the conn may still be passed through, 0 otherwise.
+ */
+static int NONNULL(1)
+protossl_autopass_filter(pxy_conn_ctx_t *ctx)
+{
+	filter_action_t *a;
+
+#ifndef WITHOUT_USERAUTH
+	pxy_userauth(ctx);
+	if (ctx->term || ctx->enomem) {
+		return 0;
+	}
+#endif /* !WITHOUT_USERAUTH */
+
+	if (pxy_conn_apply_filter(ctx, FILTER_ACTION_PASS | FILTER_ACTION_BLOCK)) {
+		// We never reach here, since we defer pass and block actions
+		return 0;
+	}
+	if ((a = pxy_conn_filter(ctx, protossl_filter))) {
+		protossl_set_filter_action(ctx, a);
+	}
+
+	// The ClientHello is relayed as soon as srvdst connects, so do not wait for src readcb to block
+	if (pxy_conn_apply_deferred_block_action(ctx)) {
+		return 0;
+	}
+
+	// Passthrough disables content logging, so do not pass the conns it would log
+	return ctx->conn_opts->passthrough &&
+		!(ctx->log_content && ctx->global->contentlog) &&
+		!(ctx->log_pcap && ctx->global->pcaplog)
+#ifndef WITHOUT_MIRROR
+		&& !(ctx->log_mirror && ctx->global->mirrorif)
+#endif /* !WITHOUT_MIRROR */
+		;
+}
+
+/*
+ * Event callback of src while the speculative src handshake runs, before the
+ * conn is set up.  The normal callbacks are set in protossl_enable_src().
+ */
+static void
+protossl_bev_eventcb_spec_src(struct bufferevent *bev, short events, void *arg)
+{
+	pxy_conn_ctx_t *ctx = arg;
+
+	pxy_thr_touch(ctx);
+
+	if (events & BEV_EVENT_CONNECTED) {
+		log_fine("Speculative src handshake done");
+		ctx->sslctx->spec_connected = 1;
+		return;
+	}
+
+	if (events & BEV_EVENT_ERROR) {
+		log_err_printf("Client-side BEV_EVENT_ERROR\n");
+		ctx->thr->errors++;
+		protossl_log_ssl_error(bev, ctx);
+		// The client may have rejected the cert, do not offer it again
+		if (ctx->sslctx->sni) {
+			cachemgr_snicrt_del(ctx->sslctx->sni);
+		}
+		if (ctx->sslctx->have_sslerr) {
+			protossl_autopass_record(ctx, "client rejected forged cert");
+		}
+	}
+	pxy_conn_term(ctx, 1);
+	pxy_conn_free(ctx, 1);
+}
+
+/*
+ * Start the src handshake with the forged cert last used for the SNI, in
+ * parallel with the srvdst connect.  The cert is validated against the
+ * original server cert in protossl_srcssl_create() once srvdst is connected.
+ * Returns -1 on error, 0 otherwise, also if there is no cert to speculate on.
+ */
+static int NONNULL(1)
+protossl_setup_src_spec(pxy_conn_ctx_t *ctx)
+{
+	snicrt_t *spec;
+
+	if (!ctx->sslctx->sni || !ctx->global->leafkey)
+		return 0;
+	if (!(spec = cachemgr_snicrt_get(ctx->sslctx->sni))) {
+		if (OPTS_DEBUG(ctx->global))
+			log_dbg_printf("SNI certificate cache: MISS\n");
+		return 0;
+	}
+	if (OPTS_DEBUG(ctx->global))
+		log_dbg_printf("SNI certificate cache: HIT\n");
+
+	ctx->src.ssl = protossl_srcssl_new(ctx, spec->crt, ctx->conn_opts->chain,
+	                                   ctx->global->leafkey);
+	if (!ctx->src.ssl) {
+		snicrt_free(spec);
+		return ctx->enomem ? -1 : 0;
+	}
+
+	if (ctx->src_prefix && protossl_set_src_prefix(ctx) == -1) {
+		log_err_level_printf(LOG_CRIT, "Error setting up src ClientHello BIO\n");
+		goto err;
+	}
+	ctx->src.bev = protossl_bufferevent_setup(ctx, ctx->fd, ctx->src.ssl);
+	if (!ctx->src.bev) {
+		log_err_level_printf(LOG_CRIT, "Error creating src bufferevent\n");
+		goto err;
+	}
+	ctx->src.free = protossl_bufferevent_free_and_close_fd;
+	bufferevent_setcb(ctx->src.bev, NULL, NULL, protossl_bev_eventcb_spec_src, ctx);
+
+	ctx->sslctx->spec = spec;
+	ctx->sslctx->speculative = 1;
+	return 0;
+err:
+	SSL_free(ctx->src.ssl);
+	ctx->src.ssl = NULL;
+	snicrt_free(spec);
+	return -1;
+}
+
 int
 protossl_conn_connect(pxy_conn_ctx_t *ctx)
 {
 	log_finest("ENTER");
 
+	// pxy_conn_connect() connects srvdst of passthrough on return
+	if (protossl_autopass_match(ctx)) {
+		if (protossl_autopass_filter(ctx)) {
+			log_fine("Passing through site interception has failed for");
+			ctx->thr->autopass_conns++;
+			protopassthrough_switch(ctx);
+			return ctx->protoctx->connectcb(ctx);
+		}
+		if (ctx->term || ctx->enomem) {
+			return 0;
+		}
+	}
+
 	/* create server-side socket and eventbuffer */
 	if (protossl_setup_srvdst(ctx) == -1) {
 		return -1;
@@ -1513,6 +2200,11 @@ protossl_conn_connect(pxy_conn_ctx_t *ctx)
 
 	// Disable and NULL r/w cbs, we do nothing for srvdst in r/w cbs
 	bufferevent_setcb(ctx->srvdst.bev, NULL, NULL, pxy_bev_eventcb, ctx);
+
+	// Not on reconnect, src is set up already
+	if (ctx->global->spec_handshake && !ctx->src.ssl) {
+		return protossl_setup_src_spec(ctx);
+	}
 	return 0;
 }
 
@@ -1567,13 +2259,32 @@ protossl_connect_child(pxy_conn_child_ctx_t *ctx)
 	return 0;
 }
 
+/*
+ * Returns 0 on success, 1 if switched to passthrough mode, 2 if waiting for
+ * the crypto pool to forge the cert (only if async is set), -1 on error.
+ */
 static int NONNULL(1)
-protossl_setup_src_ssl(pxy_conn_ctx_t *ctx)
+protossl_setup_src_ssl(pxy_conn_ctx_t *ctx, int async)
 {
+	if (ctx->sslctx->spec) {
+		// The src handshake has started, it is too late to fall back to passthrough
+		if (protossl_srcssl_create(ctx, ctx->srvdst.ssl, async)) {
+			return 0;
+		}
+		if (!ctx->term) {
+			log_err_level_printf(LOG_WARNING, "Cannot pass speculative conn through, terminating conn\n");
+			pxy_conn_term(ctx, 1);
+		}
+		return -1;
+	}
+
 	// @todo Make srvdst.ssl the origssl param
-	if (ctx->src.ssl || (ctx->src.ssl = protossl_srcssl_create(ctx, ctx->srvdst.ssl))) {
+	if (ctx->src.ssl || (ctx->src.ssl = protossl_srcssl_create(ctx, ctx->srvdst.ssl, async))) {
 		return 0;
 	}
+	else if (ctx->sslctx->forge_pending) {
+		return 2;
+	}
 	else if (ctx->term) {
 		return -1;
 	}
@@ -1597,7 +2308,7 @@ protossl_setup_src_ssl_from_dst(pxy_conn_ctx_t *ctx)
 	// This function is used by protoautossl only
 	// srvdst may or may not have been xfered to child, or it may be divert or split mode
 	// so make sure dst.ssl is not NULL
-	if (ctx->src.ssl || (ctx->src.ssl = protossl_srcssl_create(ctx, ctx->srvdst.ssl ? ctx->srvdst.ssl : ctx->dst.ssl))) {
+	if (ctx->src.ssl || (ctx->src.ssl = protossl_srcssl_create(ctx, ctx->srvdst.ssl ? ctx->srvdst.ssl : ctx->dst.ssl, 0))) {
 		return 0;
 	}
 	else if (ctx->term) {
@@ -1612,7 +2323,7 @@ protossl_setup_src_ssl_from_child_dst(pxy_conn_child_ctx_t *ctx)
 {
 	// @attention We cannot engage passthrough mode upon ssl errors on already enabled src
 	// This function is used by protoautossl only
-	if (ctx->conn->src.ssl || (ctx->conn->src.ssl = protossl_srcssl_create(ctx->conn, ctx->dst.ssl))) {
+	if (ctx->conn->src.ssl || (ctx->conn->src.ssl = protossl_srcssl_create(ctx->conn, ctx->dst.ssl, 0))) {
 		return 0;
 	}
 	else if (ctx->conn->term) {
@@ -1626,10 +2337,23 @@ static int NONNULL(1)
 protossl_setup_src(pxy_conn_ctx_t *ctx)
 {
 	int rv;
-	if ((rv = protossl_setup_src_ssl(ctx)) != 0) {
+	if ((rv = protossl_setup_src_ssl(ctx, 0)) != 0) {
 		return rv;
 	}
 
+	// Set up by the speculative src handshake
+	if (ctx->src.bev) {
+		return 0;
+	}
+
+	if (ctx->src_prefix && protossl_set_src_prefix(ctx) == -1) {
+		log_err_level_printf(LOG_CRIT, "Error setting up src ClientHello BIO\n");
+		SSL_free(ctx->src.ssl);
+		ctx->src.ssl = NULL;
+		pxy_conn_term(ctx, 1);
+		return -1;
+	}
+
 	ctx->src.bev = protossl_bufferevent_setup(ctx, ctx->fd, ctx->src.ssl);
 	if (!ctx->src.bev) {
 		log_err_level_printf(LOG_CRIT, "Error creating src bufferevent\n");
@@ -1664,9 +2388,62 @@ protossl_enable_src(pxy_conn_ctx_t *ctx)
 	log_finer("Enabling src");
 	// Now open the gates
 	bufferevent_enable(ctx->src.bev, EV_READ|EV_WRITE);
+
+	// Deliver the event the speculative eventcb has swallowed, for logging and stats
+	if (ctx->sslctx->spec_connected) {
+		bufferevent_trigger_event(ctx->src.bev, BEV_EVENT_CONNECTED, BEV_OPT_DEFER_CALLBACKS);
+	}
 	return 0;
 }
 
+/*
+ * Remember the forged cert used for the SNI, so that the next conn to the
+ * same SNI can start its src handshake before srvdst is connected.
+ */
+static void NONNULL(1)
+protossl_spec_record(pxy_conn_ctx_t *ctx)
+{
+	X509 *crt;
+
+	// Reconnected conns may use different SSL options than the next one
+	if (!ctx->global->spec_handshake || ctx->sslctx->speculative ||
+	    !ctx->sslctx->generated_cert || ctx->sslctx->reconnected ||
+	    !ctx->sslctx->sni || !ctx->sslctx->origcrt) {
+		return;
+	}
+	// This is the cert after any update by the servername callback
+	if ((crt = SSL_get_certificate(ctx->src.ssl))) {
+		cachemgr_snicrt_set(ctx->sslctx->sni, crt, ctx->sslctx->origcrt);
+	}
+}
+
+/*
+ * Account for the kTLS state of an SSL conn leg once its handshake is done.
+ * OpenSSL switches the leg to kTLS while changing the cipher state if the
+ * kernel supports the negotiated cipher, so there is nothing else to do here.
+ * Reused srvdst carries its flag over to the child dst, hence is counted once.
+ */
+static void NONNULL(1,2)
+protossl_ktls_check(pxy_conn_ctx_t *ctx, pxy_conn_desc_t *desc)
+{
+	if (!desc->ssl || desc->ktls_checked) {
+		return;
+	}
+	desc->ktls_checked = 1;
+	ctx->thr->ssl_legs++;
+
+#ifdef SSL_HAVE_KTLS
+	if (ctx->global->ktls) {
+		int tx = BIO_get_ktls_send(SSL_get_wbio(desc->ssl));
+		int rx = BIO_get_ktls_recv(SSL_get_rbio(desc->ssl));
+
+		ctx->thr->ktls_tx += tx;
+		ctx->thr->ktls_rx += rx;
+		log_fine_va("kTLS tx=%d, rx=%d, %s", tx, rx, SSL_get_cipher(desc->ssl));
+	}
+#endif /* SSL_HAVE_KTLS */
+}
+
 static void NONNULL(1,2)
 protossl_bev_eventcb_connected_dst(struct bufferevent *bev, pxy_conn_ctx_t *ctx)
 {
@@ -1678,6 +2455,36 @@ protossl_bev_eventcb_connected_dst(struct bufferevent *bev, pxy_conn_ctx_t *ctx)
 	protossl_enable_src(ctx);
 }
 
+/*
+ * Returns 0 if the src ssl and dst have been set up, non-zero otherwise,
+ * including if the conn is waiting for the crypto pool.
+ */
+static int NONNULL(1)
+protossl_setup_src_ssl_and_dst(pxy_conn_ctx_t *ctx)
+{
+	int rv;
+
+	// Set src ssl up early to apply SSL filter,
+	// this is the last moment we can take divert or split action
+	if ((rv = protossl_setup_src_ssl(ctx, 1)) != 0) {
+		return rv;
+	}
+
+	if (prototcp_setup_dst(ctx) == -1) {
+		return -1;
+	}
+
+	if (ctx->divert) {
+		bufferevent_setcb(ctx->dst.bev, pxy_bev_readcb, pxy_bev_writecb, pxy_bev_eventcb, ctx);
+		if (bufferevent_socket_connect(ctx->dst.bev, (struct sockaddr *)&ctx->spec->divert_addr, ctx->spec->divert_addrlen) == -1) {
+			log_fine("FAILED bufferevent_socket_connect for divert addr");
+			pxy_conn_term(ctx, 1);
+			return -1;
+		}
+	}
+	return 0;
+}
+
 static void
 protossl_bev_eventcb_connected_srvdst(UNUSED struct bufferevent *bev, pxy_conn_ctx_t *ctx)
 {
@@ -1696,24 +2503,7 @@ protossl_bev_eventcb_connected_srvdst(UNUSED struct bufferevent *bev, pxy_conn_c
 		return;
 	}
 
-	// Set src ssl up early to apply SSL filter,
-	// this is the last moment we can take divert or split action
-	if (protossl_setup_src_ssl(ctx) != 0) {
-		return;
-	}
-
-	if (prototcp_setup_dst(ctx) == -1) {
-		return;
-	}
-
-	if (ctx->divert) {
-		bufferevent_setcb(ctx->dst.bev, pxy_bev_readcb, pxy_bev_writecb, pxy_bev_eventcb, ctx);
-		if (bufferevent_socket_connect(ctx->dst.bev, (struct sockaddr *)&ctx->spec->divert_addr, ctx->spec->divert_addrlen) == -1) {
-			log_fine("FAILED bufferevent_socket_connect for divert addr");
-			pxy_conn_term(ctx, 1);
-			return;
-		}
-	}
+	protossl_setup_src_ssl_and_dst(ctx);
 }
 
 static void NONNULL(1,2)
@@ -1727,7 +2517,9 @@ protossl_bev_eventcb_error_srvdst(UNUSED struct bufferevent *bev, pxy_conn_ctx_t
 		/* the callout to the original destination failed,
 		 * e.g. because it asked for client cert auth, so
 		 * close the accepted socket and clean up */
-		if (((ctx->conn_opts->passthrough && ctx->sslctx->have_sslerr) || (ctx->pass && !ctx->sslctx->have_sslerr))) {
+		// Speculative conns cannot fall back to passthrough, the src handshake has started
+		if (!ctx->sslctx->speculative &&
+		    ((ctx->conn_opts->passthrough && ctx->sslctx->have_sslerr) || (ctx->pass && !ctx->sslctx->have_sslerr))) {
 			/* ssl callout failed, fall back to plain TCP passthrough of SSL connection */
 			log_err_level_printf(LOG_WARNING, "SSL srvdst connection failed; falling back to passthrough\n");
 			ctx->sslctx->have_sslerr = 0;
@@ -1769,13 +2561,34 @@ protossl_bev_eventcb(struct bufferevent *bev, short events, void *arg)
 
 	if (events & BEV_EVENT_ERROR) {
 		protossl_log_ssl_error(bev, ctx);
+
+		// Of the server-side failures, only a client cert demand is one that
+		// interception cannot get past, upstream verify failures are not counted
+		// With TLS 1.3, the server rejects the missing cert after the handshake
+		if (bev != ctx->src.bev && ctx->sslctx->have_sslerr && ctx->sslctx->clientcrt_demand) {
+			ctx->sslctx->clientcrt_demand = 0;
+			protossl_autopass_record(ctx, "server demanded client cert");
+		}
 	}
 
 	if (bev == ctx->src.bev) {
+		if (events & BEV_EVENT_CONNECTED) {
+			protossl_ktls_check(ctx, &ctx->src);
+			protossl_spec_record(ctx);
+		} else if ((events & BEV_EVENT_ERROR) && ctx->sslctx->have_sslerr &&
+		           !SSL_is_init_finished(ctx->src.ssl)) {
+			protossl_autopass_record(ctx, "client rejected forged cert");
+		}
 		prototcp_bev_eventcb_src(bev, events, ctx);
 	} else if (bev == ctx->dst.bev) {
+		if (events & BEV_EVENT_CONNECTED) {
+			protossl_ktls_check(ctx, &ctx->dst);
+		}
 		protossl_bev_eventcb_dst(bev, events, ctx);
 	} else if (bev == ctx->srvdst.bev) {
+		if (events & BEV_EVENT_CONNECTED) {
+			protossl_ktls_check(ctx, &ctx->srvdst);
+		}
 		protossl_bev_eventcb_srvdst(bev, events, ctx);
 	} else {
 		log_err_printf("protossl_bev_eventcb: UNKWN conn end\n");
@@ -1794,6 +2607,9 @@ protossl_bev_eventcb_child(struct bufferevent *bev, short events, void *arg)
 	if (bev == ctx->src.bev) {
 		prototcp_bev_eventcb_src_child(bev, events, ctx);
 	} else if (bev == ctx->dst.bev) {
+		if (events & BEV_EVENT_CONNECTED) {
+			protossl_ktls_check(ctx->conn, &ctx->dst);
+		}
 		prototcp_bev_eventcb_dst_child(bev, events, ctx);
 	} else {
 		log_err_printf("protossl_bev_eventcb_child: UNKWN conn end\n");
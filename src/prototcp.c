@@ -254,8 +254,11 @@ prototcp_init_conn(UNUSED evutil_socket_t fd, UNUSED short what, void *arg)
 
 	log_finest("ENTER");
 
-	event_free(ctx->ev);
-	ctx->ev = NULL;
+	// ctx->ev is NULL if the conn was accepted on a per-thread listener
+	if (ctx->ev) {
+		event_free(ctx->ev);
+		ctx->ev = NULL;
+	}
 
 	if (pxy_conn_init(ctx) == -1)
 		return;
@@ -290,16 +293,113 @@ prototcp_get_event_name(struct bufferevent *bev, pxy_conn_ctx_t *ctx)
 }
 #endif /* DEBUG_PROXY */
 
+/*
+ * Limit of the data buffered for the peer of desc before reading from desc
+ * is stopped.
+ */
+size_t
+prototcp_outbuf_limit(pxy_conn_ctx_t *ctx, pxy_conn_desc_t *desc)
+{
+	return desc->outbuf_limit ? desc->outbuf_limit : ctx->conn_opts->outbuf_limit;
+}
+
+static long long NONNULL(1)
+prototcp_now_ms(pxy_conn_ctx_t *ctx)
+{
+	struct timeval tv;
+
+	event_base_gettimeofday_cached(ctx->thr->evbase, &tv);
+	return (long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/*
+ * Reading from desc has been stopped with len bytes buffered for its peer.
+ */
 void
-prototcp_try_set_watermark(struct bufferevent *bev, pxy_conn_ctx_t *ctx, struct bufferevent *other)
+prototcp_outbuf_throttled(pxy_conn_ctx_t *ctx, pxy_conn_desc_t *desc, size_t len)
 {
-	if (evbuffer_get_length(bufferevent_get_output(other)) >= OUTBUF_LIMIT) {
-		log_fine_va("%s", prototcp_get_event_name(bev, ctx));
+	if (ctx->conn_opts->adaptive_outbuf) {
+		desc->wm_len = len;
+		desc->wm_time = prototcp_now_ms(ctx);
+	}
+}
+
+/*
+ * The output of the peer of desc has drained to len bytes since reading from
+ * desc was stopped.  In adaptive mode, resize the limit to the data drained
+ * in OUTBUF_ADAPTIVE_MS at the drain rate observed, averaged with the current
+ * limit.  Growth beyond OutbufLimit is taken from the global OutbufBudget, and
+ * limited to the current one if the budget is exhausted.
+ */
+void
+prototcp_outbuf_adapt(pxy_conn_ctx_t *ctx, pxy_conn_desc_t *desc, size_t len)
+{
+	pxy_thrmgr_ctx_t *thrmgr = ctx->thr->thrmgr;
+	size_t base = ctx->conn_opts->outbuf_limit;
+	size_t prev, limit, target, extra;
+	long long ms;
+
+	if (!ctx->conn_opts->adaptive_outbuf || desc->wm_len <= len)
+		return;
+
+	prev = limit = prototcp_outbuf_limit(ctx, desc);
+	ms = prototcp_now_ms(ctx) - desc->wm_time;
+	// Drained within the same event loop iteration, faster than we can measure
+	target = ms > 0 ? (desc->wm_len - len) * OUTBUF_ADAPTIVE_MS / ms : limit * 2;
+	limit = (limit + target) / 2;
+	if (limit < OUTBUF_ADAPTIVE_MIN)
+		limit = OUTBUF_ADAPTIVE_MIN;
+	else if (limit > OUTBUF_ADAPTIVE_MAX)
+		limit = OUTBUF_ADAPTIVE_MAX;
+
+	extra = limit > base ? limit - base : 0;
+	if (extra > desc->outbuf_reserved) {
+		size_t delta = extra - desc->outbuf_reserved;
+		if (__atomic_add_fetch(&thrmgr->outbuf_reserved, delta, __ATOMIC_RELAXED) > thrmgr->outbuf_budget) {
+			__atomic_sub_fetch(&thrmgr->outbuf_reserved, delta, __ATOMIC_RELAXED);
+			extra = desc->outbuf_reserved;
+			limit = base + extra;
+		}
+	} else if (extra < desc->outbuf_reserved) {
+		__atomic_sub_fetch(&thrmgr->outbuf_reserved, desc->outbuf_reserved - extra, __ATOMIC_RELAXED);
+	}
+	if (limit > prev)
+		ctx->thr->outbuf_grown++;
+	else if (limit < prev)
+		ctx->thr->outbuf_shrunk++;
+	log_finest_va("limit=%zu, extra=%zu, drained=%zu, ms=%lld", limit, extra, desc->wm_len - len, ms);
+
+	desc->outbuf_reserved = extra;
+	desc->outbuf_limit = limit;
+	desc->wm_len = 0;
+}
+
+/*
+ * Return the part of the adaptive limit of desc taken from the OutbufBudget.
+ */
+void
+prototcp_outbuf_release(pxy_conn_ctx_t *ctx, pxy_conn_desc_t *desc)
+{
+	if (desc->outbuf_reserved) {
+		__atomic_sub_fetch(&ctx->thr->thrmgr->outbuf_reserved, desc->outbuf_reserved, __ATOMIC_RELAXED);
+		desc->outbuf_reserved = 0;
+	}
+}
+
+void
+prototcp_try_set_watermark(pxy_conn_desc_t *desc, pxy_conn_ctx_t *ctx, struct bufferevent *other)
+{
+	size_t limit = prototcp_outbuf_limit(ctx, desc);
+	size_t len = evbuffer_get_length(bufferevent_get_output(other));
+
+	if (len >= limit) {
+		log_fine_va("%s", prototcp_get_event_name(desc->bev, ctx));
 
 		/* temporarily disable data source;
 		 * set an appropriate watermark. */
-		bufferevent_setwatermark(other, EV_WRITE, OUTBUF_LIMIT/2, OUTBUF_LIMIT);
-		bufferevent_disable(bev, EV_READ);
+		bufferevent_setwatermark(other, EV_WRITE, limit/2, limit);
+		bufferevent_disable(desc->bev, EV_READ);
+		prototcp_outbuf_throttled(ctx, desc, len);
 		ctx->thr->set_watermarks++;
 	}
 }
@@ -310,6 +410,8 @@ prototcp_try_unset_watermark(struct bufferevent *bev, pxy_conn_ctx_t *ctx, pxy_c
 	if (other->bev && !(bufferevent_get_enabled(other->bev) & EV_READ)) {
 		log_fine_va("%s", prototcp_get_event_name(bev, ctx));
 
+		prototcp_outbuf_adapt(ctx, other, evbuffer_get_length(bufferevent_get_output(bev)));
+
 		/* data source temporarily disabled;
 		 * re-enable and reset watermark to 0. */
 		bufferevent_setwatermark(bev, EV_WRITE, 0, 0);
@@ -417,7 +519,7 @@ prototcp_bev_readcb_src(struct bufferevent *bev, pxy_conn_ctx_t *ctx)
 		return;
 	}
 
-	ctx->protoctx->set_watermarkcb(bev, ctx, ctx->dst.bev);
+	ctx->protoctx->set_watermarkcb(&ctx->src, ctx, ctx->dst.bev);
 }
 
 void
@@ -431,7 +533,7 @@ prototcp_bev_readcb_dst(struct bufferevent *bev, pxy_conn_ctx_t *ctx)
 	}
 
 	evbuffer_add_buffer(bufferevent_get_output(ctx->src.bev), bufferevent_get_input(bev));
-	ctx->protoctx->set_watermarkcb(bev, ctx, ctx->src.bev);
+	ctx->protoctx->set_watermarkcb(&ctx->dst, ctx, ctx->src.bev);
 }
 
 static void NONNULL(1)
@@ -470,7 +572,7 @@ prototcp_bev_readcb_src_child(struct bufferevent *bev, pxy_conn_child_ctx_t *ctx
 	} else {
 		evbuffer_add_buffer(outbuf, inbuf);
 	}
-	ctx->conn->protoctx->set_watermarkcb(bev, ctx->conn, ctx->dst.bev);
+	ctx->conn->protoctx->set_watermarkcb(&ctx->src, ctx->conn, ctx->dst.bev);
 }
 
 static void NONNULL(1)
@@ -484,7 +586,7 @@ prototcp_bev_readcb_dst_child(struct bufferevent *bev, pxy_conn_child_ctx_t *ctx
 	}
 
 	evbuffer_add_buffer(bufferevent_get_output(ctx->src.bev), bufferevent_get_input(bev));
-	ctx->conn->protoctx->set_watermarkcb(bev, ctx->conn, ctx->src.bev);
+	ctx->conn->protoctx->set_watermarkcb(&ctx->dst, ctx->conn, ctx->src.bev);
 }
 
 static int NONNULL(1) WUNRES
@@ -638,6 +740,31 @@ prototcp_bev_eventcb_connected_src(UNUSED struct bufferevent *bev, UNUSED pxy_co
 	log_finest("ENTER");
 }
 
+#ifdef SYS_HAVE_SPLICE
+/*
+ * Relay split mode tcp conns with splice() if nothing needs to see their
+ * payload: content, pcap, and mirror logging are off, and their filters have
+ * been applied on srvdst connect already, except for any deferred block
+ * action, which the relay waits for.  Divert mode conns are not spliced,
+ * because the SSLproxy line is inserted into their first packet.
+ */
+static void NONNULL(1)
+prototcp_try_splice(pxy_conn_ctx_t *ctx)
+{
+	if (ctx->divert || ctx->proto != PROTO_TCP)
+		return;
+	if ((ctx->log_content && ctx->global->contentlog) ||
+			(ctx->log_pcap && ctx->global->pcaplog)
+#ifndef WITHOUT_MIRROR
+			|| (ctx->log_mirror && ctx->global->mirrorif)
+#endif /* !WITHOUT_MIRROR */
+			)
+		return;
+
+	protopassthrough_try_splice(ctx, &ctx->dst);
+}
+#endif /* SYS_HAVE_SPLICE */
+
 static void NONNULL(1,2)
 prototcp_bev_eventcb_connected_dst(struct bufferevent *bev, pxy_conn_ctx_t *ctx)
 {
@@ -646,7 +773,12 @@ prototcp_bev_eventcb_connected_dst(struct bufferevent *bev, pxy_conn_ctx_t *ctx)
 	ctx->connected = 1;
 	bufferevent_enable(bev, EV_READ|EV_WRITE);
 
-	prototcp_enable_src(ctx);
+	if (prototcp_enable_src(ctx) == -1) {
+		return;
+	}
+#ifdef SYS_HAVE_SPLICE
+	prototcp_try_splice(ctx);
+#endif /* SYS_HAVE_SPLICE */
 }
 
 static void NONNULL(1,2)
@@ -33,10 +33,12 @@
 #include "pxyconn.h"
 
 /*
- * Maximum size of data to buffer per connection direction before
- * temporarily stopping to read data from the other end.
+ * Bounds of adaptive buffer limits, which are sized to hold the data drained
+ * in OUTBUF_ADAPTIVE_MS at the observed drain rate.
  */
-#define OUTBUF_LIMIT	(128*1024)
+#define OUTBUF_ADAPTIVE_MIN	(16*1024)
+#define OUTBUF_ADAPTIVE_MAX	(16*1024*1024)
+#define OUTBUF_ADAPTIVE_MS	200
 
 #ifdef DEBUG_PROXY
 void prototcp_log_dbg_evbuf_info(pxy_conn_ctx_t *, pxy_conn_desc_t *, pxy_conn_desc_t *) NONNULL(1,2,3);
@@ -47,7 +49,11 @@ void prototcp_init_conn(evutil_socket_t, short, void *);
 #ifdef DEBUG_PROXY
 char *prototcp_get_event_name(struct bufferevent *, pxy_conn_ctx_t *) NONNULL(2);
 #endif /* DEBUG_PROXY */
-void prototcp_try_set_watermark(struct bufferevent *, pxy_conn_ctx_t *, struct bufferevent *) NONNULL(1,2,3);
+size_t prototcp_outbuf_limit(pxy_conn_ctx_t *, pxy_conn_desc_t *) NONNULL(1,2) WUNRES;
+void prototcp_outbuf_throttled(pxy_conn_ctx_t *, pxy_conn_desc_t *, size_t) NONNULL(1,2);
+void prototcp_outbuf_adapt(pxy_conn_ctx_t *, pxy_conn_desc_t *, size_t) NONNULL(1,2);
+void prototcp_outbuf_release(pxy_conn_ctx_t *, pxy_conn_desc_t *) NONNULL(1,2);
+void prototcp_try_set_watermark(pxy_conn_desc_t *, pxy_conn_ctx_t *, struct bufferevent *) NONNULL(1,2,3);
 void prototcp_try_unset_watermark(struct bufferevent *, pxy_conn_ctx_t *, pxy_conn_desc_t *) NONNULL(1,2,3);
 
 void prototcp_try_discard_inbuf(struct bufferevent *) NONNULL(1);
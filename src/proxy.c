@@ -85,14 +85,21 @@ proxy_listener_ctx_new(pxy_thrmgr_ctx_t *thrmgr, proxyspec_t *spec,
 	ctx->thrmgr = thrmgr;
 	ctx->spec = spec;
 	ctx->global = global;
+	ctx->thridx = -1;
+	ctx->fd = -1;
 	return ctx;
 }
 
 static void NONNULL(1)
 proxy_listener_ctx_free(proxy_listener_ctx_t *ctx)
 {
+	if (ctx->backoff_ev) {
+		event_free(ctx->backoff_ev);
+	}
 	if (ctx->evcl) {
 		evconnlistener_free(ctx->evcl);
+	} else if (ctx->fd != -1) {
+		evutil_closesocket(ctx->fd);
 	}
 	if (ctx->next) {
 		proxy_listener_ctx_free(ctx->next);
@@ -164,7 +171,8 @@ proxy_conn_ctx_new(evutil_socket_t fd,
 
 	ctx->type = CONN_TYPE_PARENT;
 #ifdef DEBUG_PROXY
-	ctx->id = thrmgr->conn_count++;
+	// Per-thread listeners create conns on multiple threads concurrently
+	ctx->id = __atomic_fetch_add(&thrmgr->conn_count, 1, __ATOMIC_RELAXED);
 #endif /* DEBUG_PROXY */
 	ctx->conn = ctx;
 	ctx->fd = fd;
@@ -205,16 +213,21 @@ proxy_conn_ctx_new(evutil_socket_t fd,
 }
 
 /*
- * Does minimal clean-up, called on error by proxy_listener_acceptcb() only.
+ * Does minimal clean-up, called on error by the listener accept callbacks only.
  * We call this function instead of pxy_conn_ctx_free(), because
  * proxy_listener_acceptcb() runs on thrmgr, whereas pxy_conn_ctx_free()
  * runs on conn handling thr. This is necessary to prevent multithreading issues.
+ * In proxy_listener_thr_acceptcb(), the conn has not been set up yet either.
  */
 static void NONNULL(1)
 proxy_conn_ctx_free(pxy_conn_ctx_t *ctx)
 {
 	log_finest("ENTER");
 
+	pxy_thr_handshake_done(ctx);
+	if (ctx->fd_count) {
+		pxy_thrmgr_fd_release(ctx->thr, ctx->fd_count, 0);
+	}
 	if (ctx->ev) {
 		event_free(ctx->ev);
 	}
@@ -262,6 +275,10 @@ proxy_listener_acceptcb(UNUSED struct evconnlistener *listener,
 	// Choose the conn handling thr
 	pxy_thrmgr_assign_thr(ctx);
 
+	// Take the fds of the conn from the budget before handing it over to the thr
+	if (pxy_conn_fd_acquire(ctx) == -1)
+		goto out;
+
 	/* prepare logging part 1 and user auth */
 	ctx->srcaddrlen = peeraddrlen;
 	memcpy(&ctx->srcaddr, peeraddr, ctx->srcaddrlen);
@@ -283,6 +300,52 @@ out:
 	proxy_conn_ctx_free(ctx);
 }
 
+/*
+ * Callback for accept events on the per-thread SO_REUSEPORT listeners.
+ * The listener runs on the evbase of the conn handling thread it belongs to,
+ * so there is no need to assign a thread or to switch event bases, we can
+ * initialize the conn right away.
+ */
+static void
+proxy_listener_thr_acceptcb(struct evconnlistener *listener,
+                            evutil_socket_t fd,
+                            struct sockaddr *peeraddr, int peeraddrlen,
+                            void *arg)
+{
+	proxy_listener_ctx_t *lctx = arg;
+
+	log_finest_main_va("ENTER, fd=%d", fd);
+
+	pxy_conn_ctx_t *ctx = proxy_conn_ctx_new(fd, lctx->thrmgr, lctx->spec, lctx->global
+#ifndef WITHOUT_USERAUTH
+			, lctx->clisock
+#endif /* !WITHOUT_USERAUTH */
+			);
+	if (!ctx) {
+		log_err_level_printf(LOG_CRIT, "Error allocating ctx memory\n");
+		evutil_closesocket(fd);
+		return;
+	}
+
+	ctx->thr = lctx->thrmgr->thr[lctx->thridx];
+
+	// Take the fds of the conn from the budget before setting it up, and
+	// stop accepting for a while if we are out of fds, as on EMFILE
+	if (pxy_conn_fd_acquire(ctx) == -1) {
+		pxy_thr_listener_backoff(listener, lctx->backoff_ev);
+		evutil_closesocket(fd);
+		proxy_conn_ctx_free(ctx);
+		return;
+	}
+
+	pxy_thr_handshake_start(ctx);
+
+	ctx->srcaddrlen = peeraddrlen;
+	memcpy(&ctx->srcaddr, peeraddr, ctx->srcaddrlen);
+
+	ctx->protoctx->init_conn(fd, 0, ctx);
+}
+
 /*
  * Callback for error events on the socket listener bufferevent.
  */
@@ -301,6 +364,19 @@ proxy_listener_errorcb(struct evconnlistener *listener, UNUSED void *arg)
 	event_base_loopbreak(evbase);
 }
 
+/*
+ * Callback for error events on the per-thread SO_REUSEPORT listeners.
+ * The other listeners keep accepting the conns for the same proxyspec while
+ * the listener is backing off.
+ */
+static void
+proxy_listener_thr_errorcb(struct evconnlistener *listener, void *arg)
+{
+	proxy_listener_ctx_t *lctx = arg;
+
+	pxy_thr_listener_backoff(listener, lctx->backoff_ev);
+}
+
 /*
  * Dump a description of an evbase to debugging code.
  */
@@ -329,7 +405,7 @@ proxy_listener_setup(struct event_base *evbase, pxy_thrmgr_ctx_t *thrmgr,
 	log_finest_main("ENTER");
 
 	int fd;
-	if ((fd = privsep_client_opensock(clisock, spec)) == -1) {
+	if ((fd = privsep_client_opensock(clisock, spec, 0)) == -1) {
 		log_err_level_printf(LOG_CRIT, "Error opening socket: %s (%i)\n",
 		               strerror(errno), errno);
 		return NULL;
@@ -360,6 +436,99 @@ proxy_listener_setup(struct event_base *evbase, pxy_thrmgr_ctx_t *thrmgr,
 	return lctx;
 }
 
+/*
+ * Open one SO_REUSEPORT socket per conn handling thread for a single
+ * proxyspec, and prepend the listener contexts to the list in *head.
+ * The evconnlisteners are created later by proxy_listener_thr_run(),
+ * because the thread event bases do not exist before pxy_thrmgr_run().
+ * If the threads are pinned to CPUs, the sockets are bound to the CPUs of
+ * their threads with SO_INCOMING_CPU, so that the kernel prefers the listener
+ * of the thread running on the CPU which has received the connection.
+ * Returns 0 on success, -1 on error.
+ */
+static int
+proxy_listener_thr_setup(proxy_listener_ctx_t **head, pxy_thrmgr_ctx_t *thrmgr,
+                         proxyspec_t *spec, global_t *global, evutil_socket_t clisock)
+{
+	log_finest_main("ENTER");
+
+	for (int i = 0; i < thrmgr->num_thr; i++) {
+		int fd;
+		if ((fd = privsep_client_opensock(clisock, spec, 1)) == -1) {
+			log_err_level_printf(LOG_CRIT, "Error opening socket: %s (%i)\n",
+			               strerror(errno), errno);
+			return -1;
+		}
+
+		proxy_listener_ctx_t *lctx = proxy_listener_ctx_new(thrmgr, spec, global);
+		if (!lctx) {
+			log_err_level_printf(LOG_CRIT, "Error creating listener context\n");
+			evutil_closesocket(fd);
+			return -1;
+		}
+
+#ifndef WITHOUT_USERAUTH
+		lctx->clisock = clisock;
+#endif /* !WITHOUT_USERAUTH */
+		lctx->thridx = i;
+		lctx->fd = fd;
+
+#ifdef SO_INCOMING_CPU
+		if (global->worker_cpus) {
+			int cpu = global->worker_cpus[i % global->worker_cpus_count];
+			if (setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) == -1) {
+				log_err_level_printf(LOG_WARNING, "Error setting SO_INCOMING_CPU: %s (%i)\n",
+				               strerror(errno), errno);
+			}
+		}
+#endif /* SO_INCOMING_CPU */
+
+		lctx->next = *head;
+		*head = lctx;
+	}
+	return 0;
+}
+
+/*
+ * Start listening on the per-thread SO_REUSEPORT sockets, each on the evbase
+ * of its own conn handling thread.  Must be called after pxy_thrmgr_run().
+ * Returns 0 on success, -1 on error.
+ */
+static int
+proxy_listener_thr_run(proxy_ctx_t *ctx)
+{
+	for (proxy_listener_ctx_t *lctx = ctx->lctx; lctx; lctx = lctx->next) {
+		if (lctx->thridx == -1)
+			continue;
+
+		// The thread is already running its event loop, hence the listener must be enabled only after its error
+		// callback is set. Otherwise, the listener is used by its own thread only, so it does not need to be
+		// thread-safe: the event base is locked while enabling it, and freeing it waits for a running callback
+		// @attention Do not pass NULL as user-supplied pointer
+		lctx->evcl = evconnlistener_new(ctx->thrmgr->thr[lctx->thridx]->evbase,
+		                               proxy_listener_thr_acceptcb, lctx,
+		                               LEV_OPT_CLOSE_ON_FREE | LEV_OPT_DISABLED,
+		                               1024, lctx->fd);
+		if (!lctx->evcl) {
+			log_err_level_printf(LOG_CRIT, "Error creating evconnlistener: %s\n",
+			               strerror(errno));
+			return -1;
+		}
+		lctx->fd = -1;
+		lctx->backoff_ev = pxy_thr_listener_backoff_new(ctx->thrmgr->thr[lctx->thridx]->evbase, lctx->evcl);
+		if (!lctx->backoff_ev) {
+			log_err_level_printf(LOG_CRIT, "Error creating listener back-off timer\n");
+			return -1;
+		}
+		evconnlistener_set_error_cb(lctx->evcl, proxy_listener_thr_errorcb);
+		if (evconnlistener_enable(lctx->evcl) == -1) {
+			log_err_level_printf(LOG_CRIT, "Error enabling evconnlistener\n");
+			return -1;
+		}
+	}
+	return 0;
+}
+
 /*
  * Signal handler for SIGTERM, SIGQUIT, SIGINT, SIGHUP, SIGPIPE and SIGUSR1.
  */
@@ -402,14 +571,12 @@ static void
 proxy_gc_cb(UNUSED evutil_socket_t fd, UNUSED short what, void *arg)
 {
 	proxy_ctx_t *ctx = arg;
+	size_t n;
 
-	if (OPTS_DEBUG(ctx->global))
-		log_dbg_printf("Garbage collecting caches started.\n");
+	n = cachemgr_gc();
 
-	cachemgr_gc();
-
-	if (OPTS_DEBUG(ctx->global))
-		log_dbg_printf("Garbage collecting caches done.\n");
+	if (n && OPTS_DEBUG(ctx->global))
+		log_dbg_printf("Garbage collected %zu cache entries.\n", n);
 }
 
 /*
@@ -485,6 +652,12 @@ proxy_new(global_t *global, int clisock)
 
 	head = ctx->lctx = NULL;
 	for (proxyspec_t *spec = global->spec; spec; spec = spec->next) {
+		if (global->reuseport_listeners) {
+			if (proxy_listener_thr_setup(&ctx->lctx, ctx->thrmgr,
+			                             spec, global, clisock) == -1)
+				goto leave2;
+			continue;
+		}
 		head = proxy_listener_setup(ctx->evbase, ctx->thrmgr,
 		                            spec, global, clisock);
 		if (!head)
@@ -501,7 +674,8 @@ proxy_new(global_t *global, int clisock)
 		evsignal_add(ctx->sev[i], NULL);
 	}
 
-	struct timeval gc_delay = {60, 0};
+	// The caches are garbage collected incrementally, a slice on each tick
+	struct timeval gc_delay = {1, 0};
 	ctx->gcev = event_new(ctx->evbase, -1, EV_PERSIST, proxy_gc_cb, ctx);
 	if (!ctx->gcev)
 		goto leave4;
@@ -557,6 +731,10 @@ proxy_run(proxy_ctx_t *ctx)
 		log_err_level_printf(LOG_CRIT, "Failed to start thread manager\n");
 		return -1;
 	}
+	if (proxy_listener_thr_run(ctx) == -1) {
+		log_err_level_printf(LOG_CRIT, "Failed to start per-thread listeners\n");
+		return -1;
+	}
 	if (OPTS_DEBUG(ctx->global)) {
 		log_dbg_printf("Starting main event loop.\n");
 	}
@@ -48,6 +48,12 @@ typedef struct proxy_listener_ctx {
 	evutil_socket_t clisock;
 #endif /* !WITHOUT_USERAUTH */
 	struct evconnlistener *evcl;
+	// Per-thread SO_REUSEPORT listeners only: the socket is opened before
+	// privdrop, but the evconnlistener is created on the thread evbase
+	// once the conn handling threads are running
+	int thridx;
+	evutil_socket_t fd;
+	struct event *backoff_ev;  /* re-enables the listener after an error */
 	struct proxy_listener_ctx *next;
 } proxy_listener_ctx_t;
 
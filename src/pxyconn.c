@@ -51,10 +51,6 @@
 
 #include <event2/listener.h>
 
-#ifdef __linux__
-#include <glob.h>
-#endif /* __linux__ */
-
 #include <net/if_arp.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
@@ -67,7 +63,7 @@
 #include <net/if_dl.h>
 #endif /* __OpenBSD__ */
 
-// getdtablecount() returns int, hence we don't use size_t here
+// getdtablesize() returns int, hence we don't use size_t here
 int descriptor_table_size = 0;
 
 // @attention The order of names should match the order in protocol enum
@@ -162,6 +158,10 @@ pxy_conn_ctx_free_child(pxy_conn_child_ctx_t *ctx)
 {
 	log_finest("ENTER");
 
+	pxy_thrmgr_fd_release(ctx->conn->thr, ctx->fd_count, ctx->fd_reserved);
+	prototcp_outbuf_release(ctx->conn, &ctx->src);
+	prototcp_outbuf_release(ctx->conn, &ctx->dst);
+
 	// If the proto doesn't have special args, proto_free() callback is NULL
 	if (ctx->protoctx->proto_free) {
 		ctx->protoctx->proto_free(ctx);
@@ -179,6 +179,7 @@ pxy_conn_attach_child(pxy_conn_child_ctx_t *ctx)
 	// @attention Child connections use the parent's event bases, otherwise we would get multithreading issues
 	// Always keep thr load and conns list in sync
 	ctx->conn->thr->load++;
+	pxy_thr_publish_load(ctx->conn->thr);
 	ctx->conn->thr->max_load = max(ctx->conn->thr->max_load, ctx->conn->thr->load);
 
 	// Prepend child to the children list of parent
@@ -198,6 +199,7 @@ pxy_conn_detach_child(pxy_conn_child_ctx_t *ctx)
 	log_finest("Removing child conn");
 
 	ctx->conn->thr->load--;
+	pxy_thr_publish_load(ctx->conn->thr);
 
 	if (ctx->prev) {
 		ctx->prev->next = ctx->next;
@@ -294,6 +296,18 @@ pxy_conn_free_children(pxy_conn_ctx_t *ctx)
 	}
 }
 
+#ifndef WITHOUT_USERAUTH
+static void
+pxy_conn_update_atime_cb(int rv, UNUSED int err, UNUSED void *arg)
+{
+	if (rv == -1) {
+		log_finest_main_va("Error updating user atime: %s", strerror(err));
+	} else {
+		log_finest_main_va("Successfully updated user atime%s", "");
+	}
+}
+#endif /* !WITHOUT_USERAUTH */
+
 /*
  * Does full clean-up of conn ctx.
  * This is the conn handling thr version of a similar function
@@ -317,7 +331,7 @@ pxy_conn_ctx_free(pxy_conn_ctx_t *ctx, int by_requestor)
 #ifndef WITHOUT_USERAUTH
 	if (ctx->conn_opts->user_auth && ctx->srchost_str && ctx->user && ctx->ether) {
 		// Update userdb atime if idle time is more than 50% of user timeout, which is expected to reduce update frequency
-		unsigned int idletime = ctx->idletime + (time(NULL) - ctx->ctime);
+		unsigned int idletime = ctx->idletime + (pxy_thr_time() - ctx->ctime);
 		if (idletime > (ctx->conn_opts->user_timeout / 2)) {
 			userdbkeys_t keys;
 			// Zero out for NULL termination
@@ -327,10 +341,10 @@ pxy_conn_ctx_free(pxy_conn_ctx_t *ctx, int by_requestor)
 			strncpy(keys.user, ctx->user, sizeof(keys.user) - 1);
 			strncpy(keys.ether, ctx->ether, sizeof(keys.ether) - 1);
 
-			if (privsep_client_update_atime(ctx->clisock, &keys) == -1) {
-				log_finest_va("Error updating user atime: %s", sqlite3_errmsg(ctx->global->userdb));
-			} else {
-				log_finest("Successfully updated user atime");
+			// Do not block the event loop of the thread waiting for the privsep server
+			if (privsep_client_update_atime_async(ctx->clisock, &keys, ctx->thr->evbase,
+					pxy_conn_update_atime_cb, NULL) == -1) {
+				log_finest_va("Error updating user atime: %s", strerror(errno));
 			}
 		} else {
 			log_finest_va("Will not update user atime, idletime=%u", idletime);
@@ -338,7 +352,9 @@ pxy_conn_ctx_free(pxy_conn_ctx_t *ctx, int by_requestor)
 	}
 #endif /* !WITHOUT_USERAUTH */
 
+	pxy_thr_handshake_done(ctx);
 	pxy_thr_detach(ctx);
+	pxy_thrmgr_fd_release(ctx->thr, ctx->fd_count, 0);
 
 	if (ctx->srchost_str) {
 		free(ctx->srchost_str);
@@ -366,7 +382,14 @@ pxy_conn_ctx_free(pxy_conn_ctx_t *ctx, int by_requestor)
 	if (ctx->ev) {
 		event_free(ctx->ev);
 	}
+	if (ctx->src_prefix) {
+		evbuffer_free(ctx->src_prefix);
+	}
+	prototcp_outbuf_release(ctx, &ctx->src);
+	prototcp_outbuf_release(ctx, &ctx->dst);
+	prototcp_outbuf_release(ctx, &ctx->srvdst);
 	if (ctx->sslproxy_header) {
+		pxy_thr_retconn_del(ctx);
 		free(ctx->sslproxy_header);
 	}
 	// If the proto doesn't have special args, proto_free() callback is NULL
@@ -554,24 +577,17 @@ pxy_log_content_inbuf(pxy_conn_ctx_t *ctx, struct evbuffer *inbuf, int req)
 		return 0;
 	}
 
+	// Copy the content once into a shared logbuf, which the content loggers reference instead of copying
 	size_t sz = evbuffer_get_length(inbuf);
-	unsigned char *buf = malloc(sz);
-	if (!buf) {
+	logbuf_t *lb = logbuf_new_shared(sz, NULL);
+	if (!lb) {
 		ctx->enomem = 1;
 		return -1;
 	}
-	if (evbuffer_copyout(inbuf, buf, sz) == -1) {
-		free(buf);
-		return -1;
-	}
-	logbuf_t *lb = logbuf_new_alloc(sz, NULL);
-	if (!lb) {
-		free(buf);
-		ctx->enomem = 1;
+	if (evbuffer_copyout(inbuf, lb->buf, sz) == -1) {
+		logbuf_free(lb);
 		return -1;
 	}
-	memcpy(lb->buf, buf, lb->sz);
-	free(buf);
 	if (log_content_submit(&ctx->logctx, lb, req, ctx->log_content, ctx->log_pcap
 #ifndef WITHOUT_MIRROR
 		, ctx->log_mirror
@@ -724,7 +740,7 @@ pxy_log_connect_srvdst(pxy_conn_ctx_t *ctx)
 	}
 }
 
-static void
+void
 pxy_log_dbg_disconnect(pxy_conn_ctx_t *ctx)
 {
 	/* we only get a single disconnect event here for both connections */
@@ -828,141 +844,31 @@ pxy_try_remove_sslproxy_header(pxy_conn_child_ctx_t *ctx, unsigned char *packet,
 	}
 }
 
-#if defined(__APPLE__) || defined(__FreeBSD__)
-#define getdtablecount() 0
-
-/*
- * Copied from:
- * opensmtpd-201801101641p1/openbsd-compat/imsg.c
- * 
- * Copyright (c) 2003, 2004 Henning Brauer <henning@openbsd.org>
- *
- * Permission to use, copy, modify, and distribute this software for any
- * purpose with or without fee is hereby granted, provided that the above
- * copyright notice and this permission notice appear in all copies.
- *
- * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
- * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
- * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
- * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
- * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
- * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
- * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
- */
-static int
-available_fds(unsigned int n)
-{
-	unsigned int i;
-	int ret, fds[256];
-
-	if (n > (sizeof(fds)/sizeof(fds[0])))
-		return -1;
-
-	ret = 0;
-	for (i = 0; i < n; i++) {
-		fds[i] = -1;
-		if ((fds[i] = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
-			ret = -1;
-			break;
-		}
-	}
-
-	for (i = 0; i < n && fds[i] >= 0; i++)
-		close(fds[i]);
-
-	return ret;
-}
-#endif /* __APPLE__ || __FreeBSD__ */
-
-#ifdef __linux__
 /*
- * Copied from:
- * https://github.com/tmux/tmux/blob/master/compat/getdtablecount.c
- * 
- * Copyright (c) 2017 Nicholas Marriott <nicholas.marriott@gmail.com>
- *
- * Permission to use, copy, modify, and distribute this software for any
- * purpose with or without fee is hereby granted, provided that the above
- * copyright notice and this permission notice appear in all copies.
- *
- * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
- * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
- * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
- * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
- * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
- * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
- * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ * Make the child conn read the bytes already in the input buffer of its src,
+ * i.e. the bytes read ahead on the shared return listener, once its dst is
+ * connected.  Otherwise they would wait for more data to arrive on src.
  */
-int
-getdtablecount()
+static void NONNULL(1)
+pxy_conn_child_read_prefix(pxy_conn_child_ctx_t *ctx)
 {
-	char path[PATH_MAX];
-	glob_t g;
-	int n = 0;
-
-	if (snprintf(path, sizeof path, "/proc/%ld/fd/*", (long)getpid()) < 0) {
-		log_err_level_printf(LOG_CRIT, "snprintf overflow\n");
-		return 0;
+	if (ctx->connected && ctx->src.bev && evbuffer_get_length(bufferevent_get_input(ctx->src.bev))) {
+		bufferevent_trigger(ctx->src.bev, EV_READ, BEV_TRIG_DEFER_CALLBACKS);
 	}
-	if (glob(path, 0, NULL, &g) == 0)
-		n = g.gl_pathc;
-	globfree(&g);
-	return n;
 }
-#endif /* __linux__ */
 
 /*
- * Check if we are out of file descriptors to close the conn, or else libevent will crash us
- * @attention We cannot guess the number of children in a connection at conn setup time. So, FD_RESERVE is just a ball park figure.
- * But what if a connection passes the check below, but eventually tries to create more children than FD_RESERVE allows for? This will crash us the same.
- * Beware, this applies to all current conns, not just the last connection setup.
- * For example, 20x conns pass the check below before creating any children, at which point we reach the last FD_RESERVE fds,
- * then they all start creating children, which crashes us again.
- * So, no matter how large an FD_RESERVE we choose, there will always be a risk of running out of fds, if we check the number of fds during parent conn setup only.
- * If we are left with less than FD_RESERVE fds, we should not create more children than FD_RESERVE allows for either.
- * Therefore, we check if we are out of fds in pxy_listener_acceptcb_child() and close the conn there too.
- * @attention These checks are expected to slow us further down, but it is critical to avoid a crash in case we run out of fds.
- */
-static int
-check_fd_usage(
-#ifdef DEBUG_PROXY
-	pxy_conn_ctx_t *ctx
-#else
-	void
-#endif /* DEBUG_PROXY */
-	)
-{
-	int dtable_count = getdtablecount();
-
-	log_finer_va("descriptor_table_size=%d, dtablecount=%d, reserve=%d", descriptor_table_size, dtable_count, FD_RESERVE);
-
-	if (dtable_count + FD_RESERVE >= descriptor_table_size) {
-		goto out;
-	}
-
-#if defined(__APPLE__) || defined(__FreeBSD__)
-	if (available_fds(FD_RESERVE) == -1) {
-		goto out;
-	}
-#endif /* __APPLE__ || __FreeBSD__ */
-
-	return 0;
-out:
-	errno = EMFILE;
-	log_err_level_printf(LOG_CRIT, "Out of file descriptors\n");
-	return -1;
-}
-
-/*
- * Callback for accept events on the socket listener bufferevent.
+ * Set up a new child conn accepted for the parent conn ctx, either on the
+ * child listener of the conn or on the shared return listener of the thread.
+ * The prefix, if any, holds the bytes read from the fd to find the parent
+ * conn, which the child conn reads before the rest of the stream.
  */
 static void
-pxy_listener_acceptcb_child(UNUSED struct evconnlistener *listener, evutil_socket_t fd,
-							UNUSED struct sockaddr *peeraddr, UNUSED int peeraddrlen, void *arg)
+pxy_conn_accept_child(pxy_conn_ctx_t *ctx, evutil_socket_t fd,
+                      UNUSED struct sockaddr *peeraddr, UNUSED int peeraddrlen,
+                      struct evbuffer *prefix)
 {
-	pxy_conn_ctx_t *ctx = arg;
-
-	ctx->atime = time(NULL);
+	pxy_thr_touch(ctx);
 
 #ifdef DEBUG_PROXY
 	log_finest_va("ENTER, fd=%d, ctx->child_fd=%d", fd, ctx->child_fd);
@@ -982,11 +888,9 @@ pxy_listener_acceptcb_child(UNUSED struct evconnlistener *listener, evutil_socke
 		goto out;
 	}
 
-	if (check_fd_usage(
-#ifdef DEBUG_PROXY
-			ctx
-#endif /* DEBUG_PROXY */
-			) == -1) {
+	// Account for the src fd of the child, children of existing conns can use the fd reserve of the thread
+	int fd_reserved = pxy_thrmgr_fd_acquire(ctx->thr, 1, 1);
+	if (fd_reserved == -1) {
 		evutil_closesocket(fd);
 		pxy_conn_term(ctx, 1);
 		goto out;
@@ -995,10 +899,13 @@ pxy_listener_acceptcb_child(UNUSED struct evconnlistener *listener, evutil_socke
 	pxy_conn_child_ctx_t *child_ctx = pxy_conn_ctx_new_child(fd, ctx);
 	if (!child_ctx) {
 		log_err_level_printf(LOG_CRIT, "Error allocating memory\n");
+		pxy_thrmgr_fd_release(ctx->thr, 1, fd_reserved);
 		evutil_closesocket(fd);
 		pxy_conn_term(ctx, 1);
 		goto out;
 	}
+	child_ctx->fd_count = 1;
+	child_ctx->fd_reserved = fd_reserved;
 
 	pxy_conn_attach_child(child_ctx);
 
@@ -1007,6 +914,19 @@ pxy_listener_acceptcb_child(UNUSED struct evconnlistener *listener, evutil_socke
 		goto out;
 	}
 
+	if (prefix) {
+		// The end of the input buffer of socket bufferevents is frozen, except while reading from the socket
+		struct evbuffer *inbuf = bufferevent_get_input(child_ctx->src.bev);
+		evbuffer_unfreeze(inbuf, 0);
+		int rv = evbuffer_add_buffer(inbuf, prefix);
+		evbuffer_freeze(inbuf, 0);
+		if (rv == -1) {
+			log_err_level_printf(LOG_CRIT, "Error adding prefix to child src\n");
+			pxy_conn_term(ctx, 1);
+			goto out;
+		}
+	}
+
 	// @attention fd (child_ctx->fd) is different from child event listener fd (ctx->child_fd)
 	ctx->thr->max_fd = max(ctx->thr->max_fd, child_ctx->fd);
 	ctx->child_src_fd = child_ctx->fd;
@@ -1026,6 +946,15 @@ pxy_listener_acceptcb_child(UNUSED struct evconnlistener *listener, evutil_socke
 	// initiate connection, except for the first child conn which uses the parent's srvdst as dst
 	// connectcb returns 1 if we have reused srvdst as the dst of the first child conn, and 0 for the other child conns
 	if (connect_retval == 0) {
+		// Account for the dst fd of the child
+		fd_reserved = pxy_thrmgr_fd_acquire(ctx->thr, 1, 1);
+		if (fd_reserved == -1) {
+			pxy_conn_term(ctx, 1);
+			goto out;
+		}
+		child_ctx->fd_count++;
+		child_ctx->fd_reserved += fd_reserved;
+
 		if (bufferevent_socket_connect(child_ctx->dst.bev, (struct sockaddr *)&ctx->dstaddr, ctx->dstaddrlen) == -1) {
 			pxy_conn_term(ctx, 1);
 			goto out;
@@ -1035,6 +964,9 @@ pxy_listener_acceptcb_child(UNUSED struct evconnlistener *listener, evutil_socke
 	child_ctx->dst_fd = bufferevent_getfd(child_ctx->dst.bev);
 	ctx->child_dst_fd = child_ctx->dst_fd;
 	ctx->thr->max_fd = max(ctx->thr->max_fd, child_ctx->dst_fd);
+
+	// The first child conn is connected already, if it has reused srvdst as dst
+	pxy_conn_child_read_prefix(child_ctx);
 	// Do not return here, but continue and check term/enomem flags below
 out:
 	// @attention Do not use child_ctx->conn here, child_ctx may be uninitialized
@@ -1045,6 +977,203 @@ out:
 	}
 }
 
+/*
+ * Callback for accept events on the socket listener bufferevent.
+ */
+static void
+pxy_listener_acceptcb_child(UNUSED struct evconnlistener *listener, evutil_socket_t fd,
+							struct sockaddr *peeraddr, int peeraddrlen, void *arg)
+{
+	pxy_conn_ctx_t *ctx = arg;
+
+	pxy_conn_accept_child(ctx, fd, peeraddr, peeraddrlen, NULL);
+}
+
+/*
+ * Max bytes to read from a child conn accepted on a shared return listener
+ * while looking for the SSLproxy line.
+ */
+#define PXY_RETCONN_PREFIX_MAX 8192
+
+/*
+ * Child conn accepted on a shared return listener, waiting for the SSLproxy line
+ * to find its parent conn.
+ */
+typedef struct pxy_retconn_pending {
+	pxy_thr_ctx_t *thr;
+	evutil_socket_t fd;
+	struct sockaddr_storage peeraddr;
+	int peeraddrlen;
+	struct event *ev;
+	struct evbuffer *prefix;  /* bytes read so far */
+	// On the list of the thread, so that it is freed if still pending at exit
+	struct pxy_retconn_pending *prev;
+	struct pxy_retconn_pending *next;
+} pxy_retconn_pending_t;
+
+static void
+pxy_retconn_pending_free(pxy_retconn_pending_t *pending, int close_fd)
+{
+	if (pending->prev) {
+		pending->prev->next = pending->next;
+	} else {
+		pending->thr->retconns_pending = pending->next;
+	}
+	if (pending->next) {
+		pending->next->prev = pending->prev;
+	}
+	if (pending->ev) {
+		event_free(pending->ev);
+	}
+	if (pending->prefix) {
+		evbuffer_free(pending->prefix);
+	}
+	if (close_fd) {
+		evutil_closesocket(pending->fd);
+	}
+	// The child conn accounts for its fd itself
+	sys_fd_count_add(-1);
+	free(pending);
+}
+
+/*
+ * Free the child conns of the thread still waiting for their SSLproxy lines.
+ * Must be called after the thread has exited, but before freeing its evbase.
+ */
+void
+pxy_retconns_pending_free(pxy_thr_ctx_t *tctx)
+{
+	while (tctx->retconns_pending) {
+		pxy_retconn_pending_free(tctx->retconns_pending, 1);
+	}
+}
+
+/*
+ * The fd of a child conn accepted on a shared return listener is readable.
+ * Read the bytes as they arrive until we have the SSLproxy line sent by the
+ * listening program, and pass the child conn to the parent conn registered with
+ * that line, along with the bytes read.
+ */
+static void
+pxy_retconn_fd_readcb(evutil_socket_t fd, short what, void *arg)
+{
+	pxy_retconn_pending_t *pending = arg;
+	struct evbuffer_ptr key, eol;
+	size_t eol_len;
+	char *line;
+	int n;
+
+	log_finest_main_va("ENTER, fd=%d", fd);
+
+	if (what & EV_TIMEOUT) {
+		log_err_printf("Timed out waiting for SSLproxy line, closing child conn\n");
+		goto out;
+	}
+
+	n = evbuffer_read(pending->prefix, fd, PXY_RETCONN_PREFIX_MAX - evbuffer_get_length(pending->prefix));
+	if (n == -1) {
+		if (errno == EAGAIN || errno == EINTR)
+			return;
+		log_err_printf("Error reading on child fd, closing child conn\n");
+		goto out;
+	}
+	if (n == 0) {
+		log_err_printf("Child conn closed while waiting for SSLproxy line\n");
+		goto out;
+	}
+
+	// The SSLproxy line may not be the first line, e.g. it is inserted among the headers of http requests
+	key = evbuffer_search(pending->prefix, SSLPROXY_KEY, SSLPROXY_KEY_LEN, NULL);
+	eol = key.pos != -1 ? evbuffer_search_eol(pending->prefix, &key, &eol_len, EVBUFFER_EOL_CRLF_STRICT) : key;
+	if (eol.pos == -1) {
+		if (evbuffer_get_length(pending->prefix) >= PXY_RETCONN_PREFIX_MAX) {
+			log_err_printf("No SSLproxy line in child conn, closing child conn\n");
+			goto out;
+		}
+		return;
+	}
+
+	n = eol.pos - key.pos;
+	if (!(line = malloc(n + 1))) {
+		log_err_level_printf(LOG_CRIT, "Error allocating memory\n");
+		goto out;
+	}
+	evbuffer_copyout_from(pending->prefix, &key, line, n);
+	line[n] = '\0';
+
+	pxy_conn_ctx_t *ctx = pxy_thr_retconn_get(pending->thr, line);
+	free(line);
+	if (!ctx) {
+		log_err_printf("No parent conn for SSLproxy line in child conn, closing child conn\n");
+		goto out;
+	}
+
+	log_finer_va("Found parent conn of child, fd=%d", fd);
+
+	event_free(pending->ev);
+	pending->ev = NULL;
+	pxy_conn_accept_child(ctx, fd, (struct sockaddr *)&pending->peeraddr, pending->peeraddrlen, pending->prefix);
+	pxy_retconn_pending_free(pending, 0);
+	return;
+out:
+	pxy_retconn_pending_free(pending, 1);
+}
+
+/*
+ * Callback for accept events on the shared return listener of a thread.
+ * We cannot know the parent conn before the listening program sends the
+ * SSLproxy line, so wait for the child conn to become readable.
+ */
+static void
+pxy_listener_acceptcb_retconn(UNUSED struct evconnlistener *listener, evutil_socket_t fd,
+							struct sockaddr *peeraddr, int peeraddrlen, void *arg)
+{
+	pxy_thr_retlistener_t *rl = arg;
+	pxy_thr_ctx_t *tctx = rl->thr;
+
+	log_finest_main_va("ENTER, fd=%d", fd);
+
+	pxy_retconn_pending_t *pending = malloc(sizeof(pxy_retconn_pending_t));
+	if (!pending) {
+		log_err_level_printf(LOG_CRIT, "Error allocating memory\n");
+		evutil_closesocket(fd);
+		return;
+	}
+	sys_fd_count_add(1);
+	memset(pending, 0, sizeof(pxy_retconn_pending_t));
+	pending->thr = tctx;
+	pending->fd = fd;
+	pending->peeraddrlen = peeraddrlen;
+	memcpy(&pending->peeraddr, peeraddr, peeraddrlen);
+
+	pending->next = tctx->retconns_pending;
+	if (pending->next)
+		pending->next->prev = pending;
+	tctx->retconns_pending = pending;
+
+	// Do not wait for the SSLproxy line forever, the timeout restarts whenever bytes arrive
+	struct timeval timeout = {tctx->thrmgr->global->conn_idle_timeout, 0};
+
+	pending->prefix = evbuffer_new();
+	pending->ev = event_new(tctx->evbase, fd, EV_READ|EV_PERSIST, pxy_retconn_fd_readcb, pending);
+	if (!pending->prefix || !pending->ev || event_add(pending->ev, &timeout) == -1) {
+		log_err_level_printf(LOG_CRIT, "Error creating child conn event, closing child conn\n");
+		pxy_retconn_pending_free(pending, 1);
+	}
+}
+
+/*
+ * Callback for error events on a shared return listener, which runs on the
+ * evbase of the thread.
+ */
+static void
+pxy_retlistener_errorcb(struct evconnlistener *listener, void *arg)
+{
+	pxy_thr_retlistener_t *rl = arg;
+
+	pxy_thr_listener_backoff(listener, rl->backoff_ev);
+}
+
 static int WUNRES NONNULL(1)
 pxy_opensock_child(pxy_conn_ctx_t *ctx)
 {
@@ -1157,6 +1286,98 @@ pxy_set_sslproxy_header(pxy_conn_ctx_t *ctx, int upgraded)
 	return 0;
 }
 
+/*
+ * Find or create the shared return listener of the thread for the return address of the conn.
+ */
+static pxy_thr_retlistener_t *
+pxy_get_retlistener(pxy_conn_ctx_t *ctx)
+{
+	pxy_thr_retlistener_t *rl = ctx->thr->retlisteners;
+	while (rl) {
+		if (rl->addrlen == ctx->spec->return_addrlen && !memcmp(&rl->addr, &ctx->spec->return_addr, rl->addrlen))
+			return rl;
+		rl = rl->next;
+	}
+
+	rl = malloc(sizeof(pxy_thr_retlistener_t));
+	if (!rl)
+		return NULL;
+	memset(rl, 0, sizeof(pxy_thr_retlistener_t));
+
+	rl->fd = pxy_opensock_child(ctx);
+	if (rl->fd < 0) {
+		free(rl);
+		return NULL;
+	}
+
+	rl->thr = ctx->thr;
+
+	// @attention Do not pass NULL as user-supplied pointer
+	rl->evcl = evconnlistener_new(ctx->thr->evbase, pxy_listener_acceptcb_retconn, rl, LEV_OPT_CLOSE_ON_FREE, 1024, rl->fd);
+	if (!rl->evcl) {
+		evutil_closesocket(rl->fd);
+		free(rl);
+		return NULL;
+	}
+	rl->backoff_ev = pxy_thr_listener_backoff_new(ctx->thr->evbase, rl->evcl);
+	if (!rl->backoff_ev) {
+		// evcl was created with LEV_OPT_CLOSE_ON_FREE
+		evconnlistener_free(rl->evcl);
+		free(rl);
+		return NULL;
+	}
+	evconnlistener_set_error_cb(rl->evcl, pxy_retlistener_errorcb);
+
+	memcpy(&rl->addr, &ctx->spec->return_addr, ctx->spec->return_addrlen);
+	rl->addrlen = ctx->spec->return_addrlen;
+	ctx->thr->max_fd = max(ctx->thr->max_fd, rl->fd);
+	sys_fd_count_add(1);
+
+	rl->next = ctx->thr->retlisteners;
+	ctx->thr->retlisteners = rl;
+
+	log_finer_va("Created shared return listener, fd=%d", rl->fd);
+	return rl;
+}
+
+/*
+ * Set up the conn to receive its child conns on the shared return listener of the thread.
+ * Returns 1 if the conn should use its own child listener instead, 0 on success, and -1 on error.
+ */
+static int
+pxy_setup_child_retlistener(pxy_conn_ctx_t *ctx)
+{
+	pxy_thr_retlistener_t *rl = pxy_get_retlistener(ctx);
+	if (!rl) {
+		log_err_level_printf(LOG_CRIT, "Error creating shared return listener: %s (%i)\n", strerror(errno), errno);
+		pxy_conn_term(ctx, 1);
+		return -1;
+	}
+
+	// @attention The shared listener fd is closed by pxy_thr_retlisteners_free() only, and child_evcl remains NULL
+	ctx->child_fd = rl->fd;
+
+	if (pxy_set_sslproxy_header(ctx, 0) == -1)
+		return -1;
+
+	if (pxy_thr_retconn_add(ctx) == -1) {
+		// Another conn on this thread has the same SSLproxy line, this should be very rare
+		log_fine("Cannot register conn with shared return listener, falling back to child listener");
+		free(ctx->sslproxy_header);
+		ctx->sslproxy_header = NULL;
+		ctx->sslproxy_header_len = 0;
+
+		// Account for the fd of the child listener, see pxy_conn_fd_acquire()
+		if (pxy_thrmgr_fd_acquire(ctx->thr, 1, 0) == -1) {
+			pxy_conn_term(ctx, 1);
+			return -1;
+		}
+		ctx->fd_count++;
+		return 1;
+	}
+	return 0;
+}
+
 int
 pxy_setup_child_listener(pxy_conn_ctx_t *ctx)
 {
@@ -1165,6 +1386,12 @@ pxy_setup_child_listener(pxy_conn_ctx_t *ctx)
 		return 0;
 	}
 
+	if (ctx->global->shared_return_listener) {
+		int rv = pxy_setup_child_retlistener(ctx);
+		if (rv != 1)
+			return rv;
+	}
+
 	// @attention Defer child setup and evcl creation until after parent init is complete, otherwise (1) causes multithreading issues (proxy_listener_acceptcb is
 	// running on a different thread from the conn, and we only have thrmgr mutex), and (2) we need to clean up less upon errors.
 	// Child evcls use the evbase of the parent thread, otherwise we would get multithreading issues.
@@ -1331,7 +1558,8 @@ pxy_bev_readcb(struct bufferevent *bev, void *arg)
 		return;
 	}
 
-	ctx->atime = time(NULL);
+	pxy_thr_touch(ctx);
+	pxy_thr_handshake_done(ctx);
 	ctx->protoctx->bev_readcb(bev, ctx);
 
 out:
@@ -1373,7 +1601,7 @@ pxy_bev_readcb_child(struct bufferevent *bev, void *arg)
 		return;
 	}
 
-	ctx->conn->atime = time(NULL);
+	pxy_thr_touch(ctx->conn);
 	ctx->protoctx->bev_readcb(bev, ctx);
 
 out:
@@ -1397,7 +1625,7 @@ pxy_bev_writecb(struct bufferevent *bev, void *arg)
 {
 	pxy_conn_ctx_t *ctx = arg;
 
-	ctx->atime = time(NULL);
+	pxy_thr_touch(ctx);
 	ctx->protoctx->bev_writecb(bev, ctx);
 
 	if (ctx->term || ctx->enomem) {
@@ -1410,7 +1638,7 @@ pxy_bev_writecb_child(struct bufferevent *bev, void *arg)
 {
 	pxy_conn_child_ctx_t *ctx = arg;
 
-	ctx->conn->atime = time(NULL);
+	pxy_thr_touch(ctx->conn);
 	ctx->protoctx->bev_writecb(bev, ctx);
 
 	if (ctx->conn->term || ctx->conn->enomem) {
@@ -1423,7 +1651,7 @@ pxy_bev_writecb_child(struct bufferevent *bev, void *arg)
 	}
 }
 
-static int NONNULL(1,3)
+int
 pxy_bev_eventcb_postexec_logging_and_stats(struct bufferevent *bev, short events, pxy_conn_ctx_t *ctx)
 {
 	if (ctx->term || ctx->enomem) {
@@ -1431,6 +1659,11 @@ pxy_bev_eventcb_postexec_logging_and_stats(struct bufferevent *bev, short events
 	}
 
 	if (events & BEV_EVENT_CONNECTED) {
+		if (bev == ctx->src.bev) {
+			// The SSL handshake with the client is complete
+			pxy_thr_handshake_done(ctx);
+		}
+
 		// Passthrough proto does its own connect logging
 		if (ctx->proto != PROTO_PASSTHROUGH) {
 			if (bev == ctx->src.bev) {
@@ -1472,7 +1705,7 @@ pxy_bev_eventcb(struct bufferevent *bev, short events, void *arg)
 {
 	pxy_conn_ctx_t *ctx = arg;
 
-	ctx->atime = time(NULL);
+	pxy_thr_touch(ctx);
 
 	if (events & BEV_EVENT_ERROR) {
 		log_err_printf("Client-side BEV_EVENT_ERROR\n");
@@ -1503,7 +1736,7 @@ pxy_bev_eventcb_child(struct bufferevent *bev, short events, void *arg)
 {
 	pxy_conn_child_ctx_t *ctx = arg;
 
-	ctx->conn->atime = time(NULL);
+	pxy_thr_touch(ctx->conn);
 
 	if (events & BEV_EVENT_ERROR) {
 		log_err_printf("Server-side BEV_EVENT_ERROR\n");
@@ -1530,6 +1763,10 @@ pxy_bev_eventcb_child(struct bufferevent *bev, short events, void *arg)
 		}
 
 		pxy_bev_eventcb_postexec_stats_child(events, ctx);
+
+		if ((events & BEV_EVENT_CONNECTED) && bev == ctx->dst.bev) {
+			pxy_conn_child_read_prefix(ctx);
+		}
 	}
 }
 
@@ -1754,83 +1991,55 @@ pxy_classify_user(pxy_conn_ctx_t *ctx)
 	}
 }
 
+/*
+ * Identify the user of the conn by looking up its src ip in the users table,
+ * which the users table of the user db is loaded into, without blocking on db.
+ */
 static void
-identify_user(UNUSED evutil_socket_t fd, UNUSED short what, void *arg)
+identify_user(pxy_conn_ctx_t *ctx)
 {
-	pxy_conn_ctx_t *ctx = arg;
+	usertbl_user_t u;
+	int rv;
 
 	log_finest("ENTER");
 
-	if (ctx->ev) {
-		event_free(ctx->ev);
-		ctx->ev = NULL;
+	memset(&u, 0, sizeof(usertbl_user_t));
+	rv = usertbl_lookup(ctx->thr->thrmgr->usertbl, ctx->thr->id, ctx->srchost_str, &u);
+	if (rv == -1) {
+		goto memout;
+	} else if (rv == 0) {
+		log_finest("Conn has no user");
+		return;
 	}
 
-	if (ctx->identify_user_count++ >= 50) {
-		log_finest("Cannot get conn user");
-		goto redirect;
-	} else {
-		int rc;
-
-		// @todo Do we really need to reset the stmt, as we always reset while returning?
-		sqlite3_reset(ctx->thr->get_user);
-		sqlite3_bind_text(ctx->thr->get_user, 1, ctx->srchost_str, -1, NULL);
-		rc = sqlite3_step(ctx->thr->get_user);
-
-		// Retry in case we cannot acquire db file or database: SQLITE_BUSY or SQLITE_LOCKED respectively
-		if (rc == SQLITE_BUSY || rc == SQLITE_LOCKED) {
-			log_finest_va("User db busy or locked, retrying, count=%d", ctx->identify_user_count);
-
-			// Do not forget to reset sqlite stmt, or else the userdb may remain busy/locked
-			sqlite3_reset(ctx->thr->get_user);
-
-			ctx->ev = event_new(ctx->thr->evbase, -1, 0, identify_user, ctx);
-			if (!ctx->ev)
-				goto memout;
-			struct timeval retry_delay = {0, 100};
-			if (event_add(ctx->ev, &retry_delay) == -1)
-				goto memout;
-			return;
-		} else if (rc == SQLITE_DONE) {
-			log_finest("Conn has no user");
-			goto redirect;
-		} else if (rc == SQLITE_ROW) {
-			char *ether = (char *)sqlite3_column_text(ctx->thr->get_user, 1);
-			if (strncasecmp(ether, ctx->ether, 17)) {
-				log_finest_va("Ethernet addresses do not match, db=%s, arp cache=%s", ether, ctx->ether);
-				goto redirect;
-			}
+	if (strncasecmp(u.ether, ctx->ether, 17)) {
+		log_finest_va("Ethernet addresses do not match, db=%s, arp cache=%s", u.ether, ctx->ether);
+		goto out;
+	}
 
-			log_finest_va("Passed ethernet address test, %s", ether);
+	log_finest_va("Passed ethernet address test, %s", u.ether);
 
-			ctx->idletime = time(NULL) - sqlite3_column_int(ctx->thr->get_user, 2);
-			if (ctx->idletime > ctx->conn_opts->user_timeout) {
-				log_finest_va("User entry timed out, idletime=%u", ctx->idletime);
-				goto redirect;
-			}
+	ctx->idletime = time(NULL) - u.atime;
+	if (ctx->idletime > ctx->conn_opts->user_timeout) {
+		log_finest_va("User entry timed out, idletime=%u", ctx->idletime);
+		goto out;
+	}
 
-			log_finest_va("Passed timeout test, idletime=%u", ctx->idletime);
+	log_finest_va("Passed timeout test, idletime=%u", ctx->idletime);
 
-			ctx->user = strdup((char *)sqlite3_column_text(ctx->thr->get_user, 0));
-			// Desc is needed for filtering
-			ctx->desc = strdup((char *)sqlite3_column_text(ctx->thr->get_user, 3));
-			if (!ctx->user || !ctx->desc) {
-				goto memout;
-			}
+	// Desc is needed for filtering
+	ctx->user = u.user;
+	ctx->desc = u.desc;
 
-			log_finest_va("Conn user=%s, desc=%s", ctx->user, ctx->desc);
+	log_finest_va("Conn user=%s, desc=%s", ctx->user, ctx->desc);
 
-			ctx->protoctx->classify_usercb(ctx);
-		}
-	}
-	log_finest("Passed user identification");
-redirect:
-	sqlite3_reset(ctx->thr->get_user);
+	ctx->protoctx->classify_usercb(ctx);
 
-	if (ctx->ev) {
-		event_free(ctx->ev);
-		ctx->ev = NULL;
-	}
+	log_finest("Passed user identification");
+	return;
+out:
+	free(u.user);
+	free(u.desc);
 	return;
 
 memout:
@@ -2008,7 +2217,7 @@ pxy_userauth(pxy_conn_ctx_t *ctx)
 #endif /* __OpenBSD__ */
 			ctx);
 		if (ec == 1) {
-			identify_user(-1, 0, ctx);
+			identify_user(ctx);
 			return;
 		} else if (ec == 0) {
 			log_err_level_printf(LOG_CRIT, "Cannot find ethernet address of client IP address\n");
@@ -2287,23 +2496,37 @@ pxy_conn_filter(pxy_conn_ctx_t *ctx, proto_filter_func_t filtercb)
 	return action;
 }
 
+/*
+ * Account for the fds of a new conn: src and srvdst, plus dst and child
+ * listener in divert mode.  Called by the listeners right after accepting
+ * the conn, before it is handed over to its thread, so that the fd budget
+ * is taken before the conn opens any more fds.  New conns cannot use the fd
+ * reserve of the thread, which is for the children of existing conns.
+ * Returns 0 on success, -1 if we are out of fds.
+ */
+int
+pxy_conn_fd_acquire(pxy_conn_ctx_t *ctx)
+{
+	int fd_count = 2;
+	if (ctx->divert) {
+		fd_count += ctx->global->shared_return_listener ? 1 : 2;
+	}
+	if (pxy_thrmgr_fd_acquire(ctx->thr, fd_count, 0) == -1) {
+		return -1;
+	}
+	ctx->fd_count = fd_count;
+	return 0;
+}
+
 int
 pxy_conn_init(pxy_conn_ctx_t *ctx)
 {
 	log_finest("ENTER");
 
-	pxy_thr_attach(ctx);
-
-	ctx->ctime = time(NULL);
+	ctx->ctime = pxy_thr_time();
 	ctx->atime = ctx->ctime;
 
-	if (check_fd_usage(
-#ifdef DEBUG_PROXY
-			ctx
-#endif /* DEBUG_PROXY */
-			) == -1) {
-			goto out;
-	}
+	pxy_thr_attach(ctx);
 
 	ctx->af = ctx->srcaddr.ss_family;
 
@@ -84,7 +84,7 @@ typedef void (*proto_classify_user_func_t)(pxy_conn_ctx_t *);
 typedef int (*child_connect_func_t)(pxy_conn_child_ctx_t *) NONNULL(1) WUNRES;
 typedef void (*child_proto_free_func_t)(pxy_conn_child_ctx_t *);
 
-typedef void (*set_watermark_func_t)(struct bufferevent *, pxy_conn_ctx_t *, struct bufferevent *);
+typedef void (*set_watermark_func_t)(pxy_conn_desc_t *, pxy_conn_ctx_t *, struct bufferevent *);
 typedef void (*unset_watermark_func_t)(struct bufferevent *, pxy_conn_ctx_t *, pxy_conn_desc_t *);
 typedef void (*discard_inbuf_func_t)(struct bufferevent *) NONNULL(1);
 typedef void (*discard_outbuf_func_t)(struct bufferevent *) NONNULL(1);
@@ -111,7 +111,16 @@ struct pxy_conn_desc {
 	struct bufferevent *bev;
 	SSL *ssl;
 	unsigned int closed : 1;
+	// Set once the kTLS state of the ssl has been accounted for
+	unsigned int ktls_checked : 1;
 	bev_free_func_t free;
+	// Adaptive limit of the data buffered for the peer of this end, 0 until adapted
+	size_t outbuf_limit;
+	// Part of outbuf_limit above OutbufLimit, taken from the OutbufBudget
+	size_t outbuf_reserved;
+	// Length of the output of the peer and time in ms when reading from this end was stopped
+	size_t wm_len;
+	long long wm_time;
 };
 
 enum conn_type {
@@ -145,18 +154,33 @@ struct ssl_ctx {
 	char *usedcrtfpr;
 
 	/* ssl */
-	unsigned int sni_peek_retries : 6;       /* max 64 SNI parse retries */
 	unsigned int immutable_cert : 1;  /* 1 if the cert cannot be changed */
 	unsigned int generated_cert : 1;     /* 1 if we generated a new cert */
 	unsigned int have_sslerr : 1;           /* 1 if we have an ssl error */
 	// Set after reconnecting srvdst to enforce the SSL options in matching struct filtering rule
 	unsigned int reconnected : 1;     /* 1 if we have reconnected srvdst */
+	unsigned int forge_pending : 1;   /* 1 while forging on crypto pool */
+	unsigned int forge_done : 1;      /* 1 after forging on crypto pool */
+	unsigned int speculative : 1;     /* 1 if src handshake started early */
+	unsigned int spec_connected : 1;  /* 1 after speculative handshake */
+	unsigned int clientcrt_demand : 1;  /* 1 if srvdst asked for a client cert */
 
 	/* server name indicated by client in SNI TLS extension */
 	char *sni;
+	/* size of the ClientHello record being read into src_prefix, 0 if unknown */
+	size_t clienthello_sz;
 
 	X509 *origcrt;
 
+	/* cert forging job on the crypto pool, and its result */
+	struct protossl_forge_job *forge_job;
+	X509 *forgedcrt;
+	/* events enabled on srvdst before disabling it while forging */
+	short srvdst_enabled;
+
+	/* SNI cache entry the src handshake was started on, until validated */
+	struct snicrt *spec;
+
 	char *srvdst_ssl_version;
 	char *srvdst_ssl_cipher;
 };
@@ -268,11 +292,15 @@ struct pxy_conn_ctx {
 	unsigned int enomem : 1;                       /* 1 if out of memory */
 	unsigned int term : 1;                     /* 0 until term requested */
 	unsigned int term_requestor : 1;          /* 1 client, 0 server side */
+	unsigned int handshaking : 1;  /* 1 until the first data after connect */
 
 	struct pxy_conn_desc srvdst;
 
 	struct event *ev;
 
+	/* bytes read from src before its bufferevent is set up, i.e. ClientHello */
+	struct evbuffer *src_prefix;
+
 	/* original source and destination address, and family */
 	struct sockaddr_storage srcaddr;
 	socklen_t srcaddrlen;
@@ -298,6 +326,9 @@ struct pxy_conn_ctx {
 	evutil_socket_t clisock;
 #endif /* !WITHOUT_USERAUTH */
 
+	// Number of fds accounted for by the conn, see pxy_thrmgr_fd_acquire()
+	int fd_count;
+
 	// fd of event listener for children, explicitly closed on error (not for stats only)
 	evutil_socket_t child_fd;
 	struct evconnlistener *child_evcl;
@@ -307,6 +338,7 @@ struct pxy_conn_ctx {
 	char *sslproxy_header;
 	size_t sslproxy_header_len;
 	unsigned int sent_sslproxy_header : 1; /* 1 to prevent inserting SSLproxy header twice */
+	unsigned int retconn : 1; /* 1 if registered with the shared return listener of the thread */
 
 #ifdef DEBUG_PROXY
 	// Listening programs may create multiple child connections, such as Squid http proxy
@@ -321,13 +353,19 @@ struct pxy_conn_ctx {
 	evutil_socket_t child_dst_fd;
 
 	// Conn create time
+	// Monotonic clock time, see pxy_thr_time()
 	time_t ctime;
 
 	// Conn last access time, used to determine expired conns
-	// Updated on entry to callback functions, parent or child
+	// Updated on entry to callback functions, parent or child, using pxy_thr_touch()
+	// Monotonic clock time, see pxy_thr_time()
 	time_t atime;
-	
-	// Per-thread conn list, used to determine idle and expired conns, and to close them
+
+	// Per-thread timer wheel slot list, see pxy_thr_touch()
+	pxy_conn_ctx_t *wheel_next;
+	pxy_conn_ctx_t *wheel_prev;
+
+	// Per-thread conn list, used to track active conns and to close them
 	pxy_conn_ctx_t *next;
 	pxy_conn_ctx_t *prev;
 
@@ -335,8 +373,6 @@ struct pxy_conn_ctx {
 	pxy_conn_ctx_t *next_expired;
 
 #ifndef WITHOUT_USERAUTH
-	// Number of times we try to acquire user db before giving up
-	unsigned int identify_user_count;
 	// User owner of conn
 	char *user;
 	// Ethernet address of client
@@ -408,6 +444,10 @@ struct pxy_conn_child_ctx {
 	// For statistics only
 	evutil_socket_t dst_fd;
 
+	// Number of fds accounted for by the child, and those taken from the thread reserve
+	int fd_count;
+	int fd_reserved;
+
 	// Child conns remove the SSLproxy header inserted by parent
 	int removed_sslproxy_header;   /* 1 after SSLproxy header is removed */
 
@@ -431,12 +471,14 @@ void pxy_try_remove_sslproxy_header(pxy_conn_child_ctx_t *, unsigned char *, siz
 
 int pxy_try_close_conn_end(pxy_conn_desc_t *, pxy_conn_ctx_t *) NONNULL(1,2);
 
+void pxy_log_dbg_disconnect(pxy_conn_ctx_t *) NONNULL(1);
 void pxy_try_disconnect(pxy_conn_ctx_t *, pxy_conn_desc_t *, pxy_conn_desc_t *, int) NONNULL(1,2,3);
 void pxy_try_disconnect_child(pxy_conn_child_ctx_t *, pxy_conn_desc_t *, pxy_conn_desc_t *) NONNULL(1,2,3);
 
 int pxy_try_consume_last_input(struct bufferevent *, pxy_conn_ctx_t *) NONNULL(1,2);
 int pxy_try_consume_last_input_child(struct bufferevent *, pxy_conn_child_ctx_t *) NONNULL(1,2);
 
+int pxy_conn_fd_acquire(pxy_conn_ctx_t *) NONNULL(1) WUNRES;
 int pxy_conn_init(pxy_conn_ctx_t *) NONNULL(1);
 void pxy_conn_ctx_free(pxy_conn_ctx_t *, int) NONNULL(1);
 void pxy_conn_free(pxy_conn_ctx_t *, int) NONNULL(1);
@@ -446,12 +488,14 @@ void pxy_conn_free_children(pxy_conn_ctx_t *) NONNULL(1);
 
 int pxy_set_sslproxy_header(pxy_conn_ctx_t *, int) NONNULL(1);
 int pxy_setup_child_listener(pxy_conn_ctx_t *) NONNULL(1);
+void pxy_retconns_pending_free(pxy_thr_ctx_t *) NONNULL(1);
 
 int pxy_bev_readcb_preexec_logging_and_stats(struct bufferevent *, pxy_conn_ctx_t *) NONNULL(1,2);
 
 void pxy_bev_readcb(struct bufferevent *, void *);
 void pxy_bev_writecb(struct bufferevent *, void *);
 void pxy_bev_eventcb(struct bufferevent *, short, void *);
+int pxy_bev_eventcb_postexec_logging_and_stats(struct bufferevent *, short, pxy_conn_ctx_t *) NONNULL(1,3);
 
 int pxy_bev_readcb_preexec_logging_and_stats_child(struct bufferevent *, pxy_conn_child_ctx_t *) NONNULL(1,2);
 void pxy_bev_eventcb_postexec_stats_child(short, pxy_conn_child_ctx_t *) NONNULL(2);
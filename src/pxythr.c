@@ -29,13 +29,120 @@
 #include "pxythr.h"
 
 #include "log.h"
+#include "cachemgr.h"
 #include "pxyconn.h"
 #include "util.h"
+#include "sys.h"
+#include "khash.h"
 
 #include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <event2/listener.h>
+
+KHASH_MAP_INIT_STR(retconnmap_t, pxy_conn_ctx_t *)
+
+/*
+ * Insert a conn into the timer wheel slot of its atime.
+ */
+static void
+pxy_thr_wheel_link(pxy_conn_ctx_t *ctx)
+{
+	pxy_conn_ctx_t **slot = &ctx->thr->wheel[(size_t)ctx->atime & PXY_THR_WHEEL_MASK];
+
+	ctx->wheel_prev = NULL;
+	ctx->wheel_next = *slot;
+	if (*slot)
+		(*slot)->wheel_prev = ctx;
+	*slot = ctx;
+}
+
+/*
+ * Returns 1 if the conn is in the timer wheel, i.e. attached to its thread.
+ */
+static int
+pxy_thr_wheel_linked(pxy_conn_ctx_t *ctx)
+{
+	return ctx->wheel_prev || ctx->thr->wheel[(size_t)ctx->atime & PXY_THR_WHEEL_MASK] == ctx;
+}
+
+/*
+ * Remove a conn from the timer wheel slot of its atime.
+ * A no-op for conns not in the wheel.
+ */
+static void
+pxy_thr_wheel_unlink(pxy_conn_ctx_t *ctx)
+{
+	pxy_conn_ctx_t **slot = &ctx->thr->wheel[(size_t)ctx->atime & PXY_THR_WHEEL_MASK];
+
+	if (ctx->wheel_prev) {
+		ctx->wheel_prev->wheel_next = ctx->wheel_next;
+	} else if (*slot == ctx) {
+		*slot = ctx->wheel_next;
+	} else {
+		return;
+	}
+	if (ctx->wheel_next)
+		ctx->wheel_next->wheel_prev = ctx->wheel_prev;
+
+	ctx->wheel_next = NULL;
+	ctx->wheel_prev = NULL;
+}
+
+/*
+ * Publish the number of active conns of the thread for the thread manager.
+ * Only the thread itself updates its conn count, so a plain store is enough.
+ */
+void
+pxy_thr_publish_load(pxy_thr_ctx_t *tctx)
+{
+	__atomic_store_n(&tctx->ld->conns, tctx->load, __ATOMIC_RELAXED);
+}
+
+/*
+ * Count the conn as a handshake in flight on its thread, until the conn
+ * receives its first data or is freed.  Called by the thread manager on
+ * thread assignment, hence the atomic increment.
+ */
+void
+pxy_thr_handshake_start(pxy_conn_ctx_t *ctx)
+{
+	ctx->handshaking = 1;
+	__atomic_add_fetch(&ctx->thr->ld->handshakes, 1, __ATOMIC_RELAXED);
+}
+
+void
+pxy_thr_handshake_done(pxy_conn_ctx_t *ctx)
+{
+	if (ctx->handshaking) {
+		ctx->handshaking = 0;
+		__atomic_sub_fetch(&ctx->thr->ld->handshakes, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Update the decaying byte rate of the thread using the bytes transferred
+ * since the last update, halving the weight of the past on each update.
+ */
+static void
+pxy_thr_update_byte_rate(pxy_thr_ctx_t *tctx)
+{
+	long long unsigned int bytes = tctx->intif_in_bytes + tctx->intif_out_bytes + tctx->extif_in_bytes + tctx->extif_out_bytes;
+	unsigned int period = tctx->thrmgr->global->expired_conn_check_period;
+	unsigned long long rate = (bytes - tctx->rate_bytes) / (period ? period : 1);
+
+	tctx->rate_bytes = bytes;
+	rate = (__atomic_load_n(&tctx->ld->byte_rate, __ATOMIC_RELAXED) + rate) / 2;
+	__atomic_store_n(&tctx->ld->byte_rate, rate, __ATOMIC_RELAXED);
+}
 
 /*
  * Attach a connection to its thread.
+ * The atime and ctime of the conn should have already been set.
+ * The conns list is kept in ctime order, newest first, so that the tail is
+ * the oldest conn.  Conns are attached right after they are created, so this
+ * is normally an insert at the head.
  * This function cannot fail.
  */
 void
@@ -49,11 +156,27 @@ pxy_thr_attach(pxy_conn_ctx_t *ctx)
 
 	// Always keep thr load and conns list in sync
 	ctx->thr->load++;
+	pxy_thr_publish_load(ctx->thr);
 
-	ctx->next = ctx->thr->conns;
-	ctx->thr->conns = ctx;
-	if (ctx->next)
-		ctx->next->prev = ctx;
+	pxy_conn_ctx_t *prev = NULL;
+	pxy_conn_ctx_t *next = ctx->thr->conns;
+	while (next && next->ctime > ctx->ctime) {
+		prev = next;
+		next = next->next;
+	}
+
+	ctx->prev = prev;
+	ctx->next = next;
+	if (prev)
+		prev->next = ctx;
+	else
+		ctx->thr->conns = ctx;
+	if (next)
+		next->prev = ctx;
+	else
+		ctx->thr->conns_tail = ctx;
+
+	pxy_thr_wheel_link(ctx);
 }
 
 /*
@@ -72,6 +195,7 @@ pxy_thr_detach(pxy_conn_ctx_t *ctx)
 
 	// We increment thr load in pxy_conn_init() only (for parent conns)
 	ctx->thr->load--;
+	pxy_thr_publish_load(ctx->thr);
 
 	if (ctx->prev) {
 		ctx->prev->next = ctx->next;
@@ -80,6 +204,10 @@ pxy_thr_detach(pxy_conn_ctx_t *ctx)
 	}
 	if (ctx->next)
 		ctx->next->prev = ctx->prev;
+	else
+		ctx->thr->conns_tail = ctx->prev;
+
+	pxy_thr_wheel_unlink(ctx);
 
 #ifdef DEBUG_PROXY
 	// We may get multiple conns with the same fd combinations, so fds cannot uniquely identify a conn; hence the need for unique ids.
@@ -108,23 +236,224 @@ pxy_thr_detach(pxy_conn_ctx_t *ctx)
 #endif /* DEBUG_PROXY */
 }
 
+/*
+ * Current time in seconds for the atime of conns and the timer wheel.
+ * The clock is monotonic, so that setting the system time back or forward
+ * does not make the conns look as if they were accessed in the future or
+ * had been idle for long.
+ */
+time_t
+pxy_thr_time(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec;
+}
+
+static evutil_socket_t
+pxy_thr_get_children_max_fd(pxy_conn_child_ctx_t *ctx)
+{
+	evutil_socket_t max_fd = 0;
+	while (ctx) {
+		max_fd = max(max_fd, max(ctx->fd, ctx->dst_fd));
+		ctx = ctx->next;
+	}
+	return max_fd;
+}
+
+/*
+ * Update the atime of a parent conn, moving it to the timer wheel slot of the
+ * current second.  This is O(1), and a no-op if the conn has already been
+ * accessed in the current second.
+ */
+void
+pxy_thr_touch(pxy_conn_ctx_t *ctx)
+{
+	time_t now = pxy_thr_time();
+
+	if (now == ctx->atime)
+		return;
+
+	// Conns are touched before being attached to and after being detached from their thread too
+	if (pxy_thr_wheel_linked(ctx)) {
+		pxy_thr_wheel_unlink(ctx);
+		ctx->atime = now;
+		pxy_thr_wheel_link(ctx);
+	} else {
+		ctx->atime = now;
+	}
+
+	// Idle conns are visited while printing stats, but active conns are not, so update max fd here, including the fds of children
+	ctx->thr->max_fd = max(ctx->thr->max_fd, max(ctx->fd, max(ctx->dst_fd, max(ctx->srvdst_fd, max(ctx->child_fd, max(ctx->child_src_fd, ctx->child_dst_fd))))));
+	if (ctx->children) {
+		// @attention Do not pass pxy_thr_get_children_max_fd() to MAX() or util_max() macro functions as param, or else it is called twice
+		ctx->thr->max_fd = max(ctx->thr->max_fd, pxy_thr_get_children_max_fd(ctx->children));
+	}
+}
+
+/*
+ * Register a parent conn using a shared return listener by its SSLproxy line,
+ * so that its child conns can be routed to it.
+ * Returns -1 if another conn with the same SSLproxy line exists, or on error.
+ */
+int
+pxy_thr_retconn_add(pxy_conn_ctx_t *ctx)
+{
+	pxy_thr_ctx_t *tctx = ctx->thr;
+	khiter_t k;
+	int ret;
+
+	if (!ctx->sslproxy_header)
+		return -1;
+
+	if (!tctx->retconns) {
+		tctx->retconns = kh_init(retconnmap_t);
+		if (!tctx->retconns)
+			return -1;
+	}
+
+	// The key is owned by the conn, and removed from the map before the conn frees it
+	k = kh_put(retconnmap_t, tctx->retconns, ctx->sslproxy_header, &ret);
+	if (ret <= 0) {
+		// -1 on error, 0 if the key is present in the map
+		return -1;
+	}
+	kh_val(tctx->retconns, k) = ctx;
+	ctx->retconn = 1;
+	return 0;
+}
+
+void
+pxy_thr_retconn_del(pxy_conn_ctx_t *ctx)
+{
+	if (!ctx->retconn)
+		return;
+	ctx->retconn = 0;
+
+	khiter_t k = kh_get(retconnmap_t, ctx->thr->retconns, ctx->sslproxy_header);
+	if (k != kh_end(ctx->thr->retconns) && kh_val(ctx->thr->retconns, k) == ctx) {
+		kh_del(retconnmap_t, ctx->thr->retconns, k);
+	}
+}
+
+pxy_conn_ctx_t *
+pxy_thr_retconn_get(pxy_thr_ctx_t *tctx, const char *sslproxy_header)
+{
+	if (!tctx->retconns)
+		return NULL;
+
+	khiter_t k = kh_get(retconnmap_t, tctx->retconns, sslproxy_header);
+	if (k == kh_end(tctx->retconns))
+		return NULL;
+	return kh_val(tctx->retconns, k);
+}
+
+/*
+ * Free the shared return listeners of the thread, and the child conns still
+ * waiting for their SSLproxy lines on them.
+ * Must be called after the thread has exited, but before freeing its evbase.
+ */
+void
+pxy_thr_retlisteners_free(pxy_thr_ctx_t *tctx)
+{
+	pxy_retconns_pending_free(tctx);
+
+	while (tctx->retlisteners) {
+		pxy_thr_retlistener_t *next = tctx->retlisteners->next;
+		// evcl was created with LEV_OPT_CLOSE_ON_FREE
+		evconnlistener_free(tctx->retlisteners->evcl);
+		event_free(tctx->retlisteners->backoff_ev);
+		sys_fd_count_add(-1);
+		free(tctx->retlisteners);
+		tctx->retlisteners = next;
+	}
+	if (tctx->retconns) {
+		kh_destroy(retconnmap_t, tctx->retconns);
+		tctx->retconns = NULL;
+	}
+}
+
+/*
+ * Seconds to keep a listener disabled after an accept error.
+ */
+#define PXY_THR_LISTENER_BACKOFF 1
+
+/*
+ * Re-enable a listener after the back-off period.
+ */
+static void
+pxy_thr_listener_backoffcb(UNUSED evutil_socket_t fd, UNUSED short what, void *arg)
+{
+	struct evconnlistener *evcl = arg;
+
+	log_finest_main_va("Re-enabling listener, fd=%d", evconnlistener_get_fd(evcl));
+	if (evconnlistener_enable(evcl) == -1) {
+		log_err_level_printf(LOG_CRIT, "Error re-enabling listener, fd=%d\n", evconnlistener_get_fd(evcl));
+	}
+}
+
+/*
+ * Create the timer which re-enables the listener after the back-off period,
+ * see pxy_thr_listener_backoff().
+ */
+struct event *
+pxy_thr_listener_backoff_new(struct event_base *evbase, struct evconnlistener *evcl)
+{
+	return evtimer_new(evbase, pxy_thr_listener_backoffcb, evcl);
+}
+
+/*
+ * Handle an error event on a listener running on the evbase of a conn
+ * handling thread, such as the per-thread and shared return listeners.
+ * Breaking the event loop would stop the thread along with all of its conns.
+ * Instead, disable the listener for a while, so that a persistent error,
+ * such as running out of fds, does not make it spin on accept.
+ */
+void
+pxy_thr_listener_backoff(struct evconnlistener *evcl, struct event *backoff_ev)
+{
+	int err = EVUTIL_SOCKET_ERROR();
+	struct timeval backoff = {PXY_THR_LISTENER_BACKOFF, 0};
+
+	log_err_level_printf(LOG_CRIT, "Error %d on listener, fd=%d: %s\n", err,
+	               evconnlistener_get_fd(evcl), evutil_socket_error_to_string(err));
+	if (evconnlistener_disable(evcl) == -1 ||
+	    evtimer_add(backoff_ev, &backoff) == -1) {
+		log_err_level_printf(LOG_CRIT, "Error disabling listener, fd=%d\n", evconnlistener_get_fd(evcl));
+	}
+}
+
 static void
 pxy_thr_get_expired_conns(pxy_thr_ctx_t *tctx, pxy_conn_ctx_t **expired_conns)
 {
 	*expired_conns = NULL;
 
 	if (tctx->conns) {
-		time_t now = time(NULL);
-
-		pxy_conn_ctx_t *ctx = tctx->conns;
-		while (ctx) {
-			time_t elapsed_time = now - ctx->atime;
-			if (elapsed_time > (time_t)tctx->thrmgr->global->conn_idle_timeout) {
-				ctx->next_expired = *expired_conns;
-				*expired_conns = ctx;
+		time_t now = pxy_thr_time();
+		pxy_conn_ctx_t *ctx;
+
+		// Visit the wheel slots which are due only, i.e. the conns which have not been accessed
+		// since the last time we checked, and whose idle time has exceeded the timeout
+		time_t due = now - (time_t)tctx->thrmgr->global->conn_idle_timeout - 1;
+		time_t t = tctx->wheel_time;
+		// Do not go around the wheel more than once, e.g. if the thread has not run the timer for long
+		if (due - t >= PXY_THR_WHEEL_SIZE)
+			t = due - PXY_THR_WHEEL_SIZE + 1;
+
+		for (; t <= due; t++) {
+			ctx = tctx->wheel[(size_t)t & PXY_THR_WHEEL_MASK];
+			while (ctx) {
+				time_t elapsed_time = now - ctx->atime;
+				if (elapsed_time > (time_t)tctx->thrmgr->global->conn_idle_timeout) {
+					ctx->next_expired = *expired_conns;
+					*expired_conns = ctx;
+				}
+				ctx = ctx->wheel_next;
 			}
-			ctx = ctx->next;
 		}
+		if (due >= tctx->wheel_time)
+			tctx->wheel_time = due + 1;
 
 		if (tctx->thrmgr->global->statslog) {
 			ctx = *expired_conns;
@@ -173,20 +502,53 @@ pxy_thr_get_expired_conns(pxy_thr_ctx_t *tctx, pxy_conn_ctx_t **expired_conns)
 	}
 }
 
-static evutil_socket_t
+#ifdef DEBUG_PROXY
+static void
 pxy_thr_print_children(pxy_conn_child_ctx_t *ctx)
 {
-	evutil_socket_t max_fd = 0;
 	while (ctx) {
 		// No need to log child stats
 		log_finest_main_va("CHILD CONN: thr=%d, id=%llu, cid=%d, src=%d, dst=%d, c=%d-%d",
 			ctx->conn->thr->id, ctx->conn->id, ctx->id, ctx->fd, ctx->dst_fd, ctx->src.closed, ctx->dst.closed);
-		max_fd = max(max_fd, max(ctx->fd, ctx->dst_fd));
 		ctx = ctx->next;
 	}
-	return max_fd;
 }
 
+/*
+ * Debug print all conns on the thread, this is the only place where we walk the whole conns list.
+ */
+static void
+pxy_thr_print_conns(pxy_thr_ctx_t *tctx, time_t now)
+{
+	pxy_conn_ctx_t *ctx = tctx->conns;
+	while (ctx) {
+		time_t atime = now - ctx->atime;
+		time_t ctime = now - ctx->ctime;
+
+#ifndef WITHOUT_USERAUTH
+		log_finest_main_va("PARENT CONN: thr=%d, id=%llu, fd=%d, child_fd=%d, dst=%d, srvdst=%d, child_src=%d, child_dst=%d, p=%d-%d-%d c=%d-%d, ce=%d cc=%d, at=%lld ct=%lld, src_addr=%s:%s, dst_addr=%s:%s, user=%s, valid=%d",
+			tctx->id, ctx->id, ctx->fd, ctx->child_fd, ctx->dst_fd, ctx->srvdst_fd, ctx->child_src_fd, ctx->child_dst_fd,
+			ctx->src.closed, ctx->dst.closed, ctx->srvdst.closed, ctx->children ? ctx->children->src.closed : 0, ctx->children ? ctx->children->dst.closed : 0,
+			ctx->children ? 1:0, ctx->child_count, (long long)atime, (long long)ctime,
+			STRORDASH(ctx->srchost_str), STRORDASH(ctx->srcport_str), STRORDASH(ctx->dsthost_str), STRORDASH(ctx->dstport_str),
+			STRORDASH(ctx->user), ctx->protoctx->is_valid);
+#else /* WITHOUT_USERAUTH */
+		log_finest_main_va("PARENT CONN: thr=%d, id=%llu, fd=%d, child_fd=%d, dst=%d, srvdst=%d, child_src=%d, child_dst=%d, p=%d-%d-%d c=%d-%d, ce=%d cc=%d, at=%lld ct=%lld, src_addr=%s:%s, dst_addr=%s:%s, valid=%d",
+			tctx->id, ctx->id, ctx->fd, ctx->child_fd, ctx->dst_fd, ctx->srvdst_fd, ctx->child_src_fd, ctx->child_dst_fd,
+			ctx->src.closed, ctx->dst.closed, ctx->srvdst.closed, ctx->children ? ctx->children->src.closed : 0, ctx->children ? ctx->children->dst.closed : 0,
+			ctx->children ? 1:0, ctx->child_count, (long long)atime, (long long)ctime,
+			STRORDASH(ctx->srchost_str), STRORDASH(ctx->srcport_str), STRORDASH(ctx->dsthost_str), STRORDASH(ctx->dstport_str),
+			ctx->protoctx->is_valid);
+#endif /* WITHOUT_USERAUTH */
+
+		if (ctx->children) {
+			pxy_thr_print_children(ctx->children);
+		}
+		ctx = ctx->next;
+	}
+}
+#endif /* DEBUG_PROXY */
+
 static void
 pxy_thr_print_info(pxy_thr_ctx_t *tctx)
 {
@@ -199,64 +561,70 @@ pxy_thr_print_info(pxy_thr_ctx_t *tctx)
 	char *smsg = NULL;
 
 	if (tctx->conns) {
-		time_t now = time(NULL);
+		time_t now = pxy_thr_time();
 
-		pxy_conn_ctx_t *ctx = tctx->conns;
-		while (ctx) {
-			time_t atime = now - ctx->atime;
-			time_t ctime = now - ctx->ctime;
+#ifdef DEBUG_PROXY
+		pxy_thr_print_conns(tctx, now);
+#endif /* DEBUG_PROXY */
 
-#ifndef WITHOUT_USERAUTH
-			log_finest_main_va("PARENT CONN: thr=%d, id=%llu, fd=%d, child_fd=%d, dst=%d, srvdst=%d, child_src=%d, child_dst=%d, p=%d-%d-%d c=%d-%d, ce=%d cc=%d, at=%lld ct=%lld, src_addr=%s:%s, dst_addr=%s:%s, user=%s, valid=%d",
-				tctx->id, ctx->id, ctx->fd, ctx->child_fd, ctx->dst_fd, ctx->srvdst_fd, ctx->child_src_fd, ctx->child_dst_fd,
-				ctx->src.closed, ctx->dst.closed, ctx->srvdst.closed, ctx->children ? ctx->children->src.closed : 0, ctx->children ? ctx->children->dst.closed : 0,
-				ctx->children ? 1:0, ctx->child_count, (long long)atime, (long long)ctime,
-				STRORDASH(ctx->srchost_str), STRORDASH(ctx->srcport_str), STRORDASH(ctx->dsthost_str), STRORDASH(ctx->dstport_str),
-				STRORDASH(ctx->user), ctx->protoctx->is_valid);
-#else /* WITHOUT_USERAUTH */
-			log_finest_main_va("PARENT CONN: thr=%d, id=%llu, fd=%d, child_fd=%d, dst=%d, srvdst=%d, child_src=%d, child_dst=%d, p=%d-%d-%d c=%d-%d, ce=%d cc=%d, at=%lld ct=%lld, src_addr=%s:%s, dst_addr=%s:%s, valid=%d",
-				tctx->id, ctx->id, ctx->fd, ctx->child_fd, ctx->dst_fd, ctx->srvdst_fd, ctx->child_src_fd, ctx->child_dst_fd,
-				ctx->src.closed, ctx->dst.closed, ctx->srvdst.closed, ctx->children ? ctx->children->src.closed : 0, ctx->children ? ctx->children->dst.closed : 0,
-				ctx->children ? 1:0, ctx->child_count, (long long)atime, (long long)ctime,
-				STRORDASH(ctx->srchost_str), STRORDASH(ctx->srcport_str), STRORDASH(ctx->dsthost_str), STRORDASH(ctx->dstport_str),
-				ctx->protoctx->is_valid);
-#endif /* WITHOUT_USERAUTH */
+		// The conns list is kept in ctime order by pxy_thr_attach(), the tail is the oldest conn
+		max_ctime = now - tctx->conns_tail->ctime;
 
-			// @attention Report idle connections only, i.e. the conns which have been idle since the last time we checked for expired conns
-			if (atime >= (time_t)tctx->thrmgr->global->expired_conn_check_period) {
-				if (asprintf(&smsg, "IDLE: atime=%lld, ctime=%lld, src_addr=%s:%s, dst_addr=%s:%s, "
+		// Expired conns have already been removed, so all the conns in the wheel are newer than wheel_time.
+		// Visit the slots of idle conns only; for the rest, find the oldest atime
+		time_t idle = now - (time_t)tctx->thrmgr->global->expired_conn_check_period;
+		for (time_t t = tctx->wheel_time; t <= now; t++) {
+			pxy_conn_ctx_t *ctx = tctx->wheel[(size_t)t & PXY_THR_WHEEL_MASK];
+			if (t > idle) {
+				if (max_atime)
+					break;
+				if (ctx) {
+					max_atime = now - ctx->atime;
+					break;
+				}
+				continue;
+			}
+
+			while (ctx) {
+				time_t atime = now - ctx->atime;
+				time_t ctime = now - ctx->ctime;
+
+				// @attention Report idle connections only, i.e. the conns which have been idle since the last time we checked for expired conns
+				if (atime >= (time_t)tctx->thrmgr->global->expired_conn_check_period) {
+					if (asprintf(&smsg, "IDLE: atime=%lld, ctime=%lld, src_addr=%s:%s, dst_addr=%s:%s, "
 #ifndef WITHOUT_USERAUTH
-						"user=%s, "
+							"user=%s, "
 #endif /* !WITHOUT_USERAUTH */
-						"valid=%d\n",
-						(long long)atime, (long long)ctime,
-						STRORDASH(ctx->srchost_str), STRORDASH(ctx->srcport_str), STRORDASH(ctx->dsthost_str), STRORDASH(ctx->dstport_str),
+							"valid=%d\n",
+							(long long)atime, (long long)ctime,
+							STRORDASH(ctx->srchost_str), STRORDASH(ctx->srcport_str), STRORDASH(ctx->dsthost_str), STRORDASH(ctx->dstport_str),
 #ifndef WITHOUT_USERAUTH
-						STRORDASH(ctx->user),
+							STRORDASH(ctx->user),
 #endif /* !WITHOUT_USERAUTH */
-						ctx->protoctx->is_valid) < 0) {
-					return;
-				}
-				if (log_conn(smsg) == -1) {
-					log_err_level_printf(LOG_WARNING, "Idle conn logging failed\n");
+							ctx->protoctx->is_valid) < 0) {
+						return;
+					}
+					if (log_conn(smsg) == -1) {
+						log_err_level_printf(LOG_WARNING, "Idle conn logging failed\n");
+					}
+					free(smsg);
+					smsg = NULL;
 				}
-				free(smsg);
-				smsg = NULL;
-			}
 
-			// child_src_fd and child_dst_fd fields are mostly for debugging purposes, used in debug printing parent conns.
-			// However, while an ssl child is closing, the children list may be empty, but child's ssl fd may be still open,
-			// hence we include those fields in this max comparisons too
-			max_fd = max(max_fd, max(ctx->fd, max(ctx->dst_fd, max(ctx->srvdst_fd, max(ctx->child_fd, max(ctx->child_src_fd, ctx->child_dst_fd))))));
-			max_atime = util_max(max_atime, atime);
-			max_ctime = util_max(max_ctime, ctime);
-
-			if (ctx->children) {
-				// @attention Do not pass pxy_thr_print_children() to MAX() or util_max() macro functions as param, or else it is called twice
-				// Use the inline max() function instead
-				max_fd = max(max_fd, pxy_thr_print_children(ctx->children));
+				// child_src_fd and child_dst_fd fields are mostly for debugging purposes, used in debug printing parent conns.
+				// However, while an ssl child is closing, the children list may be empty, but child's ssl fd may be still open,
+				// hence we include those fields in this max comparisons too.
+				// Active conns update thr max_fd in pxy_thr_touch()
+				max_fd = max(max_fd, max(ctx->fd, max(ctx->dst_fd, max(ctx->srvdst_fd, max(ctx->child_fd, max(ctx->child_src_fd, ctx->child_dst_fd))))));
+				max_atime = util_max(max_atime, atime);
+
+				if (ctx->children) {
+					// @attention Do not pass pxy_thr_get_children_max_fd() to MAX() or util_max() macro functions as param, or else it is called twice
+					// Use the inline max() function instead
+					max_fd = max(max_fd, pxy_thr_get_children_max_fd(ctx->children));
+				}
+				ctx = ctx->wheel_next;
 			}
-			ctx = ctx->next;
 		}
 	}
 
@@ -274,17 +642,145 @@ pxy_thr_print_info(pxy_thr_ctx_t *tctx)
 	}
 	free(smsg);
 
+	// ssl legs, and those which kernel TLS offloaded in the tx and rx directions
+	if (asprintf(&smsg, "STATS: tls: thr=%d, legs=%zu, ktx=%zu, krx=%zu, si=%u\n",
+			tctx->id, tctx->ssl_legs, tctx->ktls_tx, tctx->ktls_rx, tctx->stats_id) < 0) {
+		return;
+	}
+	if (log_stats(smsg) == -1) {
+		log_err_level_printf(LOG_WARNING, "Stats logging failed\n");
+	}
+	free(smsg);
+
+	if (asprintf(&smsg, "STATS: spec: thr=%d, hit=%zu, mis=%zu, si=%u\n",
+			tctx->id, tctx->spec_hits, tctx->spec_mismatches, tctx->stats_id) < 0) {
+		return;
+	}
+	if (log_stats(smsg) == -1) {
+		log_err_level_printf(LOG_WARNING, "Stats logging failed\n");
+	}
+	free(smsg);
+
+	if (asprintf(&smsg, "STATS: autopass: thr=%d, fail=%zu, conn=%zu, si=%u\n",
+			tctx->id, tctx->autopass_fails, tctx->autopass_conns, tctx->stats_id) < 0) {
+		return;
+	}
+	if (log_stats(smsg) == -1) {
+		log_err_level_printf(LOG_WARNING, "Stats logging failed\n");
+	}
+	free(smsg);
+
+	// The buffer budget is shared by all threads, res is the part of it taken by adaptive buffer limits
+	if (asprintf(&smsg, "STATS: outbuf: thr=%d, grw=%zu, shr=%zu, res=%zu, bud=%zu, si=%u\n",
+			tctx->id, tctx->outbuf_grown, tctx->outbuf_shrunk, __atomic_load_n(&tctx->thrmgr->outbuf_reserved, __ATOMIC_RELAXED), tctx->thrmgr->outbuf_budget, tctx->stats_id) < 0) {
+		return;
+	}
+	if (log_stats(smsg) == -1) {
+		log_err_level_printf(LOG_WARNING, "Stats logging failed\n");
+	}
+	free(smsg);
+
+	// The crypto pool is shared by all threads, so only the first thread reports its stats
+	if (tctx->id == 0 && tctx->thrmgr->cryptopool) {
+		cryptopool_stats_t cs;
+		cryptopool_get_stats(tctx->thrmgr->cryptopool, &cs);
+
+		if (asprintf(&smsg, "STATS: crypto: qd=%zu, mqd=%zu, jobs=%zu, rej=%zu, alat=%llu, mlat=%llu, si=%u\n",
+				cs.depth, cs.max_depth, cs.jobs, cs.rejected, cs.jobs ? cs.latency_sum / cs.jobs : 0, cs.max_latency, tctx->stats_id) < 0) {
+			return;
+		}
+		if (log_stats(smsg) == -1) {
+			log_err_level_printf(LOG_WARNING, "Stats logging failed\n");
+		}
+		free(smsg);
+	}
+
+	// The loggers are shared by all threads
+	if (tctx->id == 0) {
+		log_stats_loggers(tctx->stats_id);
+	}
+
+#ifndef WITHOUT_USERAUTH
+	// The users table is shared by all threads, rel and upd are its full and incremental refreshes, busy those deferred because the db was locked
+	if (tctx->id == 0 && tctx->thrmgr->usertbl) {
+		usertbl_stats_t us;
+		usertbl_get_stats(tctx->thrmgr->usertbl, &us);
+
+		if (asprintf(&smsg, "STATS: users: ent=%zu, rel=%zu, upd=%zu, busy=%zu, si=%u\n",
+				us.users, us.reloads, us.updates, us.busy, tctx->stats_id) < 0) {
+			return;
+		}
+		if (log_stats(smsg) == -1) {
+			log_err_level_printf(LOG_WARNING, "Stats logging failed\n");
+		}
+		free(smsg);
+	}
+#endif /* !WITHOUT_USERAUTH */
+
+	// Each thread has its own DNS cache, coal is the number of lookups which waited for a query in flight
+	if (tctx->dnscache) {
+		dnscache_stats_t ds;
+		dnscache_get_stats(tctx->dnscache, &ds);
+
+		if (asprintf(&smsg, "STATS: dns: thr=%d, hit=%zu, neg=%zu, miss=%zu, coal=%zu, pre=%zu, ent=%zu, si=%u\n",
+				tctx->id, ds.hits, ds.neg_hits, ds.misses, ds.coalesced, ds.prefetches, ds.entries, tctx->stats_id) < 0) {
+			return;
+		}
+		if (log_stats(smsg) == -1) {
+			log_err_level_printf(LOG_WARNING, "Stats logging failed\n");
+		}
+		free(smsg);
+	}
+
+	// The caches are shared by all threads too; mcs is the most contended shard, e the number of evicted entries
+	if (tctx->id == 0 && cachemgr_fkcrt) {
+		cache_stats_t fk, tg, ss, ds, sc, sn, pa;
+		cache_get_stats(cachemgr_fkcrt, &fk);
+		cache_get_stats(cachemgr_tgcrt, &tg);
+		cache_get_stats(cachemgr_ssess, &ss);
+		cache_get_stats(cachemgr_dsess, &ds);
+		cache_get_stats(cachemgr_sslctx, &sc);
+		cache_get_stats(cachemgr_snicrt, &sn);
+		cache_get_stats(cachemgr_pass, &pa);
+
+		if (asprintf(&smsg, "STATS: cache: fkl=%llu, fkc=%llu, fkmc=%llu, fkmcs=%u, fke=%llu, tgl=%llu, tgc=%llu, tgmc=%llu, tgmcs=%u, "
+				"ssl=%llu, ssc=%llu, ssmc=%llu, ssmcs=%u, sse=%llu, dsl=%llu, dsc=%llu, dsmc=%llu, dsmcs=%u, dse=%llu, "
+				"scl=%llu, scc=%llu, scmc=%llu, scmcs=%u, sce=%llu, snl=%llu, snc=%llu, snmc=%llu, snmcs=%u, sne=%llu, "
+				"pal=%llu, pac=%llu, pamc=%llu, pamcs=%u, pae=%llu, si=%u\n",
+				fk.locks, fk.contended, fk.max_contended, fk.max_shard, fk.evicted, tg.locks, tg.contended, tg.max_contended, tg.max_shard,
+				ss.locks, ss.contended, ss.max_contended, ss.max_shard, ss.evicted, ds.locks, ds.contended, ds.max_contended, ds.max_shard, ds.evicted,
+				sc.locks, sc.contended, sc.max_contended, sc.max_shard, sc.evicted, sn.locks, sn.contended, sn.max_contended, sn.max_shard, sn.evicted,
+				pa.locks, pa.contended, pa.max_contended, pa.max_shard, pa.evicted, tctx->stats_id) < 0) {
+			return;
+		}
+		if (log_stats(smsg) == -1) {
+			log_err_level_printf(LOG_WARNING, "Stats logging failed\n");
+		}
+		free(smsg);
+	}
+
 	tctx->stats_id++;
 
 	tctx->timedout_conns = 0;
 	tctx->errors = 0;
 	tctx->set_watermarks = 0;
 	tctx->unset_watermarks = 0;
+	tctx->outbuf_grown = 0;
+	tctx->outbuf_shrunk = 0;
+	tctx->ssl_legs = 0;
+	tctx->ktls_tx = 0;
+	tctx->ktls_rx = 0;
+	tctx->spec_hits = 0;
+	tctx->spec_mismatches = 0;
+	tctx->autopass_fails = 0;
+	tctx->autopass_conns = 0;
 
 	tctx->intif_in_bytes = 0;
 	tctx->intif_out_bytes = 0;
 	tctx->extif_in_bytes = 0;
 	tctx->extif_out_bytes = 0;
+	// The byte rate has already been updated with these byte counters
+	tctx->rate_bytes = 0;
 
 	// Reset these stats with the current values (do not reset to 0 directly, there may be active conns)
 	tctx->max_fd = max_fd;
@@ -302,12 +798,14 @@ pxy_thr_timer_cb(UNUSED evutil_socket_t fd, UNUSED short what, UNUSED void *arg)
 
 	log_finest_main_va("thr=%d, load=%zu, to=%u", tctx->id, tctx->load, tctx->timeout_count);
 
+	pxy_thr_update_byte_rate(tctx);
+
 	pxy_conn_ctx_t *expired = NULL;
 	pxy_thr_get_expired_conns(tctx, &expired);
 
 #ifdef DEBUG_PROXY
 	if (expired) {
-		time_t now = time(NULL);
+		time_t now = pxy_thr_time();
 #endif /* DEBUG_PROXY */
 		while (expired) {
 			pxy_conn_ctx_t *next = expired->next_expired;
@@ -346,10 +844,19 @@ pxy_thr(void *arg)
 	struct timeval timer_delay = {tctx->thrmgr->global->expired_conn_check_period, 0};
 	struct event *ev;
 
+	if (tctx->cpu != -1) {
+		if (sys_thread_pin(pthread_self(), tctx->cpu) == -1) {
+			log_err_level_printf(LOG_WARNING, "Failed to pin thr %d to cpu %d: %s\n", tctx->id, tctx->cpu, strerror(errno));
+		} else {
+			log_dbg_printf("Pinned thr %d to cpu %d\n", tctx->id, tctx->cpu);
+		}
+	}
+
 	ev = event_new(tctx->evbase, -1, EV_PERSIST, pxy_thr_timer_cb, tctx);
 	if (!ev)
 		return NULL;
 	evtimer_add(ev, &timer_delay);
+	tctx->wheel_time = pxy_thr_time();
 	tctx->running = 1;
 	event_base_dispatch(tctx->evbase);
 	event_free(ev);
@@ -30,6 +30,8 @@
 #define PXYTHR_H
 
 #include "attrib.h"
+#include "cryptopool.h"
+#include "dnscache.h"
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -41,14 +43,64 @@
 typedef struct pxy_conn_ctx pxy_conn_ctx_t;
 typedef struct pxy_thrmgr_ctx pxy_thrmgr_ctx_t;
 
+/*
+ * Number of slots in the per-thread timer wheel, one slot per second of atime.
+ * Must be a power of 2 greater than the max ConnIdleTimeout, so that a slot
+ * never holds conns from two different revolutions of the wheel.
+ */
+#define PXY_THR_WHEEL_SIZE 4096
+#define PXY_THR_WHEEL_MASK (PXY_THR_WHEEL_SIZE - 1)
+
+/*
+ * Shared return listener for child conns, one per thread and return address.
+ */
+typedef struct pxy_thr_retlistener {
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	evutil_socket_t fd;
+	struct evconnlistener *evcl;
+	struct event *backoff_ev;  /* re-enables the listener after an error */
+	struct pxy_thr_ctx *thr;
+	struct pxy_thr_retlistener *next;
+} pxy_thr_retlistener_t;
+
+struct kh_retconnmap_t_s;
+
+#define PXY_THR_CACHELINE_SIZE 64
+
+/*
+ * Load counters published by a thread for the thread manager to balance new
+ * conns on.  Each thread has its own slot on a separate cache line, so that
+ * updating the counters does not bounce the cache lines of other threads.
+ * Use pxy_thr_load_*() functions or atomic builtins to access the fields.
+ */
+typedef struct pxy_thr_load {
+	// Active parent and child conns, updated by the thread only
+	size_t conns;
+	// Conns assigned to the thread and not connected yet,
+	// incremented by the thread manager and decremented by the thread
+	size_t handshakes;
+	// Decaying average of bytes per second, updated by the thread only
+	unsigned long long byte_rate;
+} ALIGNED(PXY_THR_CACHELINE_SIZE) pxy_thr_load_t;
+
 typedef struct pxy_thr_ctx {
 	pthread_t thr;
 	int id;
+	// CPU the thread is pinned to, -1 if not pinned
+	int cpu;
 	pxy_thrmgr_ctx_t *thrmgr;
 	size_t load;
+	pxy_thr_load_t *ld;
 	struct event_base *evbase;
 	struct evdns_base *dnsbase;
+	// Cache of the answers to the SNI lookups of the thread
+	dnscache_t *dnscache;
+	// Completion queue for the jobs submitted to the crypto pool by the thread
+	cryptopool_compq_t *compq;
 	int running;
+	// Number of fds taken from the fd reserve of the thread
+	int fd_reserve_used;
 
 	// Statistics
 	evutil_socket_t max_fd;
@@ -57,26 +109,63 @@ typedef struct pxy_thr_ctx {
 	size_t errors;
 	size_t set_watermarks;
 	size_t unset_watermarks;
+	// Adaptive buffer limits grown and shrunk
+	size_t outbuf_grown;
+	size_t outbuf_shrunk;
+	// SSL conn legs connected, and those running with kTLS send and receive offload
+	size_t ssl_legs;
+	size_t ktls_tx;
+	size_t ktls_rx;
+	// Speculative client handshakes whose forged cert matched the server cert, and those which did not
+	size_t spec_hits;
+	size_t spec_mismatches;
+	// SSL interception failures recorded in the pass cache, and conns passed through by it
+	size_t autopass_fails;
+	size_t autopass_conns;
 	long long unsigned int intif_in_bytes;
 	long long unsigned int intif_out_bytes;
 	long long unsigned int extif_in_bytes;
 	long long unsigned int extif_out_bytes;
+	// Sum of the byte counters above as of the last byte rate update
+	long long unsigned int rate_bytes;
 	// Each stats has an id, incremented on each stats print
 	unsigned short stats_id;
 	// Used to print statistics, compared against stats_period
 	unsigned int timeout_count;
 
-	// List of active connections on the thread
+	// List of active connections on the thread, the tail is the oldest conn
 	pxy_conn_ctx_t *conns;
+	pxy_conn_ctx_t *conns_tail;
+
+	// Hashed timer wheel of active connections keyed on atime,
+	// so that idle and expired conns can be found without scanning the conns list
+	pxy_conn_ctx_t *wheel[PXY_THR_WHEEL_SIZE];
+	// The oldest atime which may still have conns in the wheel, see pxy_thr_time()
+	time_t wheel_time;
 
-#ifndef WITHOUT_USERAUTH
-	// Per-thread sqlite stmt is necessary to prevent multithreading issues between threads
-	struct sqlite3_stmt *get_user;
-#endif /* !WITHOUT_USERAUTH */
+	// Shared return listeners, and the map of SSLproxy lines to the parent conns
+	// waiting for child conns on them, used if SharedReturnListener is enabled
+	pxy_thr_retlistener_t *retlisteners;
+	struct kh_retconnmap_t_s *retconns;
+	// Child conns accepted on shared return listeners, waiting for their SSLproxy lines
+	struct pxy_retconn_pending *retconns_pending;
 } pxy_thr_ctx_t;
 
+time_t pxy_thr_time(void);
 void pxy_thr_attach(pxy_conn_ctx_t *) NONNULL(1);
 void pxy_thr_detach(pxy_conn_ctx_t *) NONNULL(1);
+void pxy_thr_touch(pxy_conn_ctx_t *) NONNULL(1);
+void pxy_thr_publish_load(pxy_thr_ctx_t *) NONNULL(1);
+void pxy_thr_handshake_start(pxy_conn_ctx_t *) NONNULL(1);
+void pxy_thr_handshake_done(pxy_conn_ctx_t *) NONNULL(1);
+
+int pxy_thr_retconn_add(pxy_conn_ctx_t *) NONNULL(1) WUNRES;
+void pxy_thr_retconn_del(pxy_conn_ctx_t *) NONNULL(1);
+pxy_conn_ctx_t *pxy_thr_retconn_get(pxy_thr_ctx_t *, const char *) NONNULL(1,2) WUNRES;
+void pxy_thr_retlisteners_free(pxy_thr_ctx_t *) NONNULL(1);
+
+struct event *pxy_thr_listener_backoff_new(struct event_base *, struct evconnlistener *) NONNULL(1,2) WUNRES;
+void pxy_thr_listener_backoff(struct evconnlistener *, struct event *) NONNULL(1,2);
 
 void *pxy_thr(void *);
 
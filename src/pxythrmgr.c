@@ -33,16 +33,98 @@
 #include "log.h"
 #include "pxyconn.h"
 
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <errno.h>
 #include <event2/bufferevent.h>
 
 /*
  * Proxy thread manager: manages the connection handling worker threads
  * and the per-thread resources (i.e. event bases).  The load is shared
- * across num_cpu * 2 connection handling threads, using the number of
- * currently assigned connections as the sole metric.
+ * across num_cpu * 2 connection handling threads by default, using one of the
+ * thread balancing policies below to assign new connections to threads.
+ * If WorkerCPUs is configured, each thread is pinned to a CPU, and its
+ * resources are allocated while the thrmgr runs on that CPU, so that the
+ * first-touch memory policy of the kernel places them on the NUMA node of
+ * the thread.
  */
 
+/*
+ * Thread balancing policy using the number of currently active connections
+ * as the sole metric, chooses the thread with the fewest connections.
+ */
+static int
+pxy_thrmgr_select_leastconn(pxy_thrmgr_ctx_t *ctx)
+{
+	size_t minload = __atomic_load_n(&ctx->loads[0].conns, __ATOMIC_RELAXED);
+
+#ifdef DEBUG_THREAD
+	log_dbg_printf("===> Proxy connection handler thread status:\nthr[0]: %zu\n", minload);
+#endif /* DEBUG_THREAD */
+
+	int thrid = 0;
+	for (int i = 1; i < ctx->num_thr; i++) {
+		size_t thrload = __atomic_load_n(&ctx->loads[i].conns, __ATOMIC_RELAXED);
+		if (minload > thrload) {
+			minload = thrload;
+			thrid = i;
+		}
+
+#ifdef DEBUG_THREAD
+		log_dbg_printf("thr[%d]: %zu\n", i, thrload);
+#endif /* DEBUG_THREAD */
+	}
+	return thrid;
+}
+
+/*
+ * Composite load score of a thread: active connections, plus handshakes in
+ * flight, which are the most CPU intensive phase of a conn, plus the byte rate
+ * in units of PXY_THRMGR_BYTE_RATE_UNIT.
+ */
+unsigned long long
+pxy_thrmgr_thr_score(pxy_thr_load_t *ld)
+{
+	return __atomic_load_n(&ld->conns, __ATOMIC_RELAXED) +
+		__atomic_load_n(&ld->handshakes, __ATOMIC_RELAXED) * PXY_THRMGR_HANDSHAKE_WEIGHT +
+		__atomic_load_n(&ld->byte_rate, __ATOMIC_RELAXED) / PXY_THRMGR_BYTE_RATE_UNIT;
+}
+
+/*
+ * Thread balancing policy using power-of-two-choices: samples two distinct
+ * threads at random and chooses the one with the lower load score.
+ * This reads two load slots only, instead of scanning all threads, and avoids
+ * herding new conns onto the same thread, because load slots may lag behind.
+ */
+static int
+pxy_thrmgr_select_p2c(pxy_thrmgr_ctx_t *ctx)
+{
+	if (ctx->num_thr == 1)
+		return 0;
+
+	// xorshift32, the listener thread is the only caller, so no need for locking
+	unsigned int r = ctx->rand_state;
+	r ^= r << 13;
+	r ^= r >> 17;
+	r ^= r << 5;
+	ctx->rand_state = r;
+
+	int a = r % ctx->num_thr;
+	int b = (r >> 16) % (ctx->num_thr - 1);
+	if (b >= a)
+		b++;
+
+	unsigned long long score_a = pxy_thrmgr_thr_score(&ctx->loads[a]);
+	unsigned long long score_b = pxy_thrmgr_thr_score(&ctx->loads[b]);
+
+#ifdef DEBUG_THREAD
+	log_dbg_printf("===> Proxy connection handler thread p2c: thr[%d]: %llu, thr[%d]: %llu\n", a, score_a, b, score_b);
+#endif /* DEBUG_THREAD */
+
+	return score_a <= score_b ? a : b;
+}
+
 /*
  * Create new thread manager but do not start any threads yet.
  * This gets called before forking to background.
@@ -57,10 +139,24 @@ pxy_thrmgr_new(global_t *global)
 	memset(ctx, 0, sizeof(pxy_thrmgr_ctx_t));
 
 	ctx->global = global;
-	ctx->num_thr = 2 * sys_get_cpu_cores();
+	ctx->num_thr = global->worker_threads ? (int)global->worker_threads : 2 * (int)sys_get_cpu_cores();
+	ctx->select_thr = global->thr_balance == THR_BALANCE_P2C ? pxy_thrmgr_select_p2c : pxy_thrmgr_select_leastconn;
+	ctx->rand_state = (unsigned int)time(NULL) | 1;
+	ctx->outbuf_budget = (size_t)global->outbuf_budget_mb * 1024 * 1024;
 	return ctx;
 }
 
+/*
+ * Restore the affinity of the thrmgr after allocating thread resources.
+ */
+static void
+pxy_thrmgr_unpin(pxy_thrmgr_ctx_t *ctx)
+{
+	if (ctx->global->worker_cpus && sys_thread_pin(pthread_self(), -1) == -1) {
+		log_err_level_printf(LOG_WARNING, "Failed to unpin thrmgr: %s\n", strerror(errno));
+	}
+}
+
 /*
  * Start the thread manager and associated threads.
  * This must be called after forking.
@@ -80,17 +176,54 @@ pxy_thrmgr_run(pxy_thrmgr_ctx_t *ctx)
 	}
 	memset(ctx->thr, 0, ctx->num_thr * sizeof(pxy_thr_ctx_t*));
 
+	if (ctx->global->crypto_threads) {
+		if (!(ctx->cryptopool = cryptopool_new(ctx->global->crypto_threads, PXY_THRMGR_CRYPTO_QUEUE_SIZE))) {
+			log_dbg_printf("Failed to create crypto pool\n");
+			goto leave;
+		}
+	}
+
+	if (posix_memalign((void **)&ctx->loads, PXY_THR_CACHELINE_SIZE, ctx->num_thr * sizeof(pxy_thr_load_t))) {
+		ctx->loads = NULL;
+		log_dbg_printf("Failed to allocate memory\n");
+		goto leave;
+	}
+	memset(ctx->loads, 0, ctx->num_thr * sizeof(pxy_thr_load_t));
+
+#ifndef WITHOUT_USERAUTH
+	// Each thread reads the users table through its own hazard slot, indexed by thread id
+	if (ctx->global->conn_opts->user_auth || global_has_userauth_spec(ctx->global)) {
+		if (!(ctx->usertbl = usertbl_new(ctx->global->userdb, ctx->num_thr))) {
+			log_err_level_printf(LOG_CRIT, "Failed to create users table\n");
+			goto leave;
+		}
+	}
+#endif /* !WITHOUT_USERAUTH */
+
 	for (i = 0; i < ctx->num_thr; i++) {
+		int cpu = ctx->global->worker_cpus ? ctx->global->worker_cpus[i % ctx->global->worker_cpus_count] : -1;
+		// Allocate the thread resources on the NUMA node of the thread
+		if (cpu != -1 && sys_thread_pin(pthread_self(), cpu) == -1) {
+			log_err_level_printf(LOG_WARNING, "Failed to pin thrmgr to cpu %d: %s\n", cpu, strerror(errno));
+		}
 		if (!(ctx->thr[i] = malloc(sizeof(pxy_thr_ctx_t)))) {
 			log_dbg_printf("Failed to allocate memory\n");
 			goto leave;
 		}
 		memset(ctx->thr[i], 0, sizeof(pxy_thr_ctx_t));
+		ctx->thr[i]->cpu = cpu;
 		ctx->thr[i]->evbase = event_base_new();
 		if (!ctx->thr[i]->evbase) {
 			log_dbg_printf("Failed to create evbase %d\n", i);
 			goto leave;
 		}
+		if (ctx->cryptopool) {
+			ctx->thr[i]->compq = cryptopool_compq_new(ctx->thr[i]->evbase);
+			if (!ctx->thr[i]->compq) {
+				log_dbg_printf("Failed to create crypto completion queue %d\n", i);
+				goto leave;
+			}
+		}
 		if (dns) {
 			/* only create dns base if we actually need it later */
 			ctx->thr[i]->dnsbase = evdns_base_new(ctx->thr[i]->evbase, 1);
@@ -98,25 +231,35 @@ pxy_thrmgr_run(pxy_thrmgr_ctx_t *ctx)
 				log_dbg_printf("Failed to create dnsbase %d\n", i);
 				goto leave;
 			}
+			ctx->thr[i]->dnscache = dnscache_new(ctx->thr[i]->evbase, ctx->thr[i]->dnsbase);
+			if (!ctx->thr[i]->dnscache) {
+				log_dbg_printf("Failed to create dnscache %d\n", i);
+				goto leave;
+			}
 		}
 		ctx->thr[i]->load = 0;
+		ctx->thr[i]->ld = &ctx->loads[i];
 		ctx->thr[i]->running = 0;
 		ctx->thr[i]->conns = NULL;
 		ctx->thr[i]->id = i;
 		ctx->thr[i]->timeout_count = 0;
 		ctx->thr[i]->thrmgr = ctx;
-
-#ifndef WITHOUT_USERAUTH
-		if ((ctx->global->conn_opts->user_auth || global_has_userauth_spec(ctx->global)) &&
-				sqlite3_prepare_v2(ctx->global->userdb, "SELECT user,ether,atime,desc FROM users WHERE ip = ?1", 100, &ctx->thr[i]->get_user, NULL)) {
-			log_err_level_printf(LOG_CRIT, "Error preparing get_user sql stmt: %s\n", sqlite3_errmsg(ctx->global->userdb));
-			goto leave;
-		}
-#endif /* !WITHOUT_USERAUTH */
 	}
+	pxy_thrmgr_unpin(ctx);
 
 	log_dbg_printf("Initialized %d connection handling threads\n", ctx->num_thr);
 
+	if (ctx->cryptopool && cryptopool_start(ctx->cryptopool) == -1) {
+		i = -1;
+		goto leave_thr;
+	}
+#ifndef WITHOUT_USERAUTH
+	if (ctx->usertbl && usertbl_start(ctx->usertbl) == -1) {
+		i = -1;
+		goto leave_thr;
+	}
+#endif /* !WITHOUT_USERAUTH */
+
 	for (i = 0; i < ctx->num_thr; i++) {
 		if (pthread_create(&ctx->thr[i]->thr, NULL, pxy_thr, ctx->thr[i]))
 			goto leave_thr;
@@ -125,6 +268,11 @@ pxy_thrmgr_run(pxy_thrmgr_ctx_t *ctx)
 		}
 	}
 
+	// Count the fds open so far, including those of the thread evbases, dnsbases, crypto pool, and
+	// completion queues, from now on fds are accounted for as they are opened and closed
+	// There cannot be any conns yet, the listeners do not run before we return
+	sys_fd_count_init();
+
 	log_dbg_printf("Started %d connection handling threads\n", ctx->num_thr);
 	return 0;
 
@@ -138,20 +286,31 @@ leave_thr:
 	i = ctx->num_thr - 1;
 
 leave:
+	pxy_thrmgr_unpin(ctx);
+	if (ctx->cryptopool) {
+		cryptopool_free(ctx->cryptopool);
+		ctx->cryptopool = NULL;
+	}
+#ifndef WITHOUT_USERAUTH
+	if (ctx->usertbl) {
+		usertbl_free(ctx->usertbl);
+		ctx->usertbl = NULL;
+	}
+#endif /* !WITHOUT_USERAUTH */
 	while (i >= 0) {
 		if (ctx->thr[i]) {
+			if (ctx->thr[i]->compq) {
+				cryptopool_compq_free(ctx->thr[i]->compq);
+			}
 			if (ctx->thr[i]->dnsbase) {
 				evdns_base_free(ctx->thr[i]->dnsbase, 0);
 			}
+			if (ctx->thr[i]->dnscache) {
+				dnscache_free(ctx->thr[i]->dnscache);
+			}
 			if (ctx->thr[i]->evbase) {
 				event_base_free(ctx->thr[i]->evbase);
 			}
-#ifndef WITHOUT_USERAUTH
-			if (ctx->global->userdb) {
-				// sqlite3.h: "Invoking sqlite3_finalize() on a NULL pointer is a harmless no-op."
-				sqlite3_finalize(ctx->thr[i]->get_user);
-			}
-#endif /* !WITHOUT_USERAUTH */
 			free(ctx->thr[i]);
 		}
 		i--;
@@ -160,6 +319,10 @@ leave:
 		free(ctx->thr);
 		ctx->thr = NULL;
 	}
+	if (ctx->loads) {
+		free(ctx->loads);
+		ctx->loads = NULL;
+	}
 	return -1;
 }
 
@@ -177,33 +340,45 @@ pxy_thrmgr_free(pxy_thrmgr_ctx_t *ctx)
 		for (int i = 0; i < ctx->num_thr; i++) {
 			pthread_join(ctx->thr[i]->thr, NULL);
 		}
+		// Stop the crypto threads before freeing the completion queues they post to
+		if (ctx->cryptopool) {
+			cryptopool_free(ctx->cryptopool);
+		}
+#ifndef WITHOUT_USERAUTH
+		if (ctx->usertbl) {
+			usertbl_free(ctx->usertbl);
+		}
+#endif /* !WITHOUT_USERAUTH */
 		for (int i = 0; i < ctx->num_thr; i++) {
+			pxy_thr_retlisteners_free(ctx->thr[i]);
+			if (ctx->thr[i]->compq) {
+				cryptopool_compq_free(ctx->thr[i]->compq);
+			}
 			if (ctx->thr[i]->dnsbase) {
 				evdns_base_free(ctx->thr[i]->dnsbase, 0);
 			}
+			if (ctx->thr[i]->dnscache) {
+				dnscache_free(ctx->thr[i]->dnscache);
+			}
 			if (ctx->thr[i]->evbase) {
 				event_base_free(ctx->thr[i]->evbase);
 			}
-#ifndef WITHOUT_USERAUTH
-			if (ctx->global->userdb) {
-				// sqlite3.h: "Invoking sqlite3_finalize() on a NULL pointer is a harmless no-op."
-				sqlite3_finalize(ctx->thr[i]->get_user);
-			}
-#endif /* !WITHOUT_USERAUTH */
 			free(ctx->thr[i]);
 		}
 		free(ctx->thr);
 	}
+	if (ctx->loads) {
+		free(ctx->loads);
+	}
 	free(ctx);
 }
 
 /*
- * Assign a new connection to a thread.  Chooses the thread with the fewest
- * currently active connections, returns the appropriate event bases.
+ * Assign a new connection to a thread using the thread balancing policy,
+ * and count it as a handshake in flight on that thread.
  * No need to be so accurate about balancing thread loads,
- * so does not use mutexes, thread or thrmgr level.
- * @todo Check if read accesses to thr load can cause any multithreading issues.
- * Returns the index of the chosen thread.
+ * so does not use mutexes, thread or thrmgr level; the threads publish their
+ * loads in their load slots using atomic operations.
  * This function cannot fail.
  */
 void
@@ -212,30 +387,58 @@ pxy_thrmgr_assign_thr(pxy_conn_ctx_t *ctx)
 	log_finest("ENTER");
 
 	pxy_thrmgr_ctx_t *tmctx = ctx->thrmgr;
-	size_t minload = tmctx->thr[0]->load;
+	int thrid = tmctx->select_thr(tmctx);
+
+	ctx->thr = tmctx->thr[thrid];
+	pxy_thr_handshake_start(ctx);
 
 #ifdef DEBUG_THREAD
-	log_dbg_printf("===> Proxy connection handler thread status:\nthr[0]: %zu\n", minload);
+	log_dbg_printf("thrid: %d\n", thrid);
 #endif /* DEBUG_THREAD */
+}
 
-	int thrid = 0;
-	for (int i = 1; i < tmctx->num_thr; i++) {
-		size_t thrload = tmctx->thr[i]->load;
-		if (minload > thrload) {
-			minload = thrload;
-			thrid = i;
-		}
+/*
+ * Account for n fds about to be opened by a conn handling thread.
+ * New parent conns can use the fds available in the common pool only,
+ * so that the child conns of existing conns can always use the reserve of
+ * their thread (use_reserve), even if new conns have exhausted the common
+ * pool.  This function is O(1), it does not scan the fd table.
+ * Returns the number of fds taken from the thread reserve, which should be
+ * passed to pxy_thrmgr_fd_release() later, or -1 if we are out of fds.
+ */
+int
+pxy_thrmgr_fd_acquire(pxy_thr_ctx_t *tctx, int n, int use_reserve)
+{
+	int count = sys_fd_count_add(n);
+	int reserve = tctx->thrmgr->num_thr * FD_RESERVE;
+	int avail = descriptor_table_size - FD_RESERVE - count;
 
-#ifdef DEBUG_THREAD
-		log_dbg_printf("thr[%d]: %zu\n", i, thrload);
-#endif /* DEBUG_THREAD */
+	log_finer_main_va("descriptor_table_size=%d, fd_count=%d, reserve=%d, thr_reserve_used=%d", descriptor_table_size, count, reserve, tctx->fd_reserve_used);
+
+	if (avail >= reserve) {
+		return 0;
+	}
+	// The thread reserve is used by the conns of this thread only, so there is no need for locking
+	if (use_reserve && avail >= 0 && tctx->fd_reserve_used + n <= FD_RESERVE) {
+		tctx->fd_reserve_used += n;
+		return n;
 	}
 
-	ctx->thr = tmctx->thr[thrid];
+	sys_fd_count_add(-n);
+	errno = EMFILE;
+	log_err_level_printf(LOG_CRIT, "Out of file descriptors\n");
+	return -1;
+}
 
-#ifdef DEBUG_THREAD
-	log_dbg_printf("thrid: %d\n", thrid);
-#endif /* DEBUG_THREAD */
+/*
+ * Account for n fds closed by a conn handling thread, reserved of which were
+ * taken from the thread reserve.
+ */
+void
+pxy_thrmgr_fd_release(pxy_thr_ctx_t *tctx, int n, int reserved)
+{
+	sys_fd_count_add(-n);
+	tctx->fd_reserve_used -= reserved;
 }
 
 /* vim: set noet ft=c: */
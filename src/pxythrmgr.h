@@ -33,14 +33,41 @@
 #include "opts.h"
 #include "attrib.h"
 #include "pxythr.h"
+#ifndef WITHOUT_USERAUTH
+#include "usertbl.h"
+#endif /* !WITHOUT_USERAUTH */
 
 extern int descriptor_table_size;
+// Number of fds reserved per thread for the child conns of existing conns,
+// also kept free as a margin for the fds which are not accounted for
 #define FD_RESERVE 10
 
+// Weight of a handshake in flight in the thread load score, relative to an active conn
+#define PXY_THRMGR_HANDSHAKE_WEIGHT 4
+// Byte rate (bytes/s) which weighs as much as an active conn in the thread load score
+#define PXY_THRMGR_BYTE_RATE_UNIT (64 * 1024)
+// Max number of jobs waiting for the crypto threads
+#define PXY_THRMGR_CRYPTO_QUEUE_SIZE 1024
+
 struct pxy_thrmgr_ctx {
 	int num_thr;
 	global_t *global;
 	pxy_thr_ctx_t **thr;
+	// Crypto worker pool, NULL if CryptoThreads is 0
+	cryptopool_t *cryptopool;
+	// Cache line aligned load slots of the threads, one per thread
+	pxy_thr_load_t *loads;
+	// Thread balancing policy, returns the index of the thread to assign a new conn to
+	int (*select_thr)(pxy_thrmgr_ctx_t *);
+	// State of the random number generator used by the p2c policy
+	unsigned int rand_state;
+	// Total size of adaptive buffer limits above OutbufLimit, and its max
+	size_t outbuf_reserved;
+	size_t outbuf_budget;
+#ifndef WITHOUT_USERAUTH
+	// In-memory users table read by the threads, NULL if no user auth
+	usertbl_t *usertbl;
+#endif /* !WITHOUT_USERAUTH */
 #ifdef DEBUG_PROXY
 	// Provides unique conn id, always goes up, never down, used in debugging only
 	// There is no risk of collision if/when it rolls back to 0
@@ -53,6 +80,10 @@ int pxy_thrmgr_run(pxy_thrmgr_ctx_t *) NONNULL(1) WUNRES;
 void pxy_thrmgr_free(pxy_thrmgr_ctx_t *) NONNULL(1);
 
 void pxy_thrmgr_assign_thr(pxy_conn_ctx_t *) NONNULL(1);
+unsigned long long pxy_thrmgr_thr_score(pxy_thr_load_t *) NONNULL(1) WUNRES;
+
+int pxy_thrmgr_fd_acquire(pxy_thr_ctx_t *, int, int) NONNULL(1) WUNRES;
+void pxy_thrmgr_fd_release(pxy_thr_ctx_t *, int, int) NONNULL(1);
 
 #endif /* !PXYTHRMGR_H */
 
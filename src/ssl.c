@@ -1545,6 +1545,19 @@ ssl_x509_refcount_inc(X509 *crt)
 #endif /* !OPENSSL_THREADS */
 }
 
+/*
+ * Increment the reference count of an SSL context in a thread-safe manner.
+ */
+void
+ssl_sslctx_refcount_inc(SSL_CTX *sslctx)
+{
+#if defined(OPENSSL_THREADS) && ((OPENSSL_VERSION_NUMBER < 0x10100000L) || (defined(LIBRESSL_VERSION_NUMBER) && LIBRESSL_VERSION_NUMBER < 0x20701000L))
+	CRYPTO_add(&sslctx->references, 1, CRYPTO_LOCK_SSL_CTX);
+#else /* !OPENSSL_THREADS */
+	SSL_CTX_up_ref(sslctx);
+#endif /* !OPENSSL_THREADS */
+}
+
 /*
  * Match a URL/URI hostname against a single certificate DNS name
  * using RFC 6125 rules (6.4.3 Checking of Wildcard Certificates):
@@ -1994,6 +2007,32 @@ len3(uint8_t p0, uint8_t p1, uint8_t p2) {
 	return (uint32_t)p2 + ((uint32_t)p1 << 8) + ((uint32_t)p0 << 16);
 }
 
+/*
+ * Determine the size of the TLS record or SSLv2 message at the start of buf
+ * which may carry a ClientHello, including its header.  This allows callers
+ * to read exactly the first record of a ClientHello from a socket as bytes
+ * arrive, and to parse it only once, with ssl_tls_clienthello_parse().
+ *
+ * Returns the size of the record, 0 if buf does not start with a record that
+ * can carry a ClientHello, or -1 if more bytes are needed to tell.  The first
+ * SSL_TLS_RECORD_HDR_SZ bytes are always enough.
+ */
+ssize_t
+ssl_tls_clienthello_recordsz(const unsigned char *buf, size_t sz)
+{
+	if (sz < 2)
+		return -1;
+	/* +0 0x80 +1 length: SSLv2 short header */
+	if (buf[0] == 0x80)
+		return 2 + buf[1];
+	/* +0 0x16 +1 0x03 +3 length: SSLv3/TLSv1.x handshake */
+	if (buf[0] != 0x16 || buf[1] != 0x03)
+		return 0;
+	if (sz < SSL_TLS_RECORD_HDR_SZ)
+		return -1;
+	return SSL_TLS_RECORD_HDR_SZ + len2(buf[3], buf[4]);
+}
+
 /*
  * Ugly hack to manually parse a clientHello message from a memory buffer.
  * This is needed in order to be able to support SNI and STARTTLS.
@@ -126,6 +126,14 @@ static inline int X509_PUBKEY_get0_param(ASN1_OBJECT **ppkalg, const unsigned ch
 #define CONST_SSL_METHOD const SSL_METHOD
 #endif /* >= OpensSL 1.0.0 */
 
+/*
+ * Kernel TLS offload is available if OpenSSL was built with it and can enable
+ * it on SSL_CTX level.
+ */
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+#define SSL_HAVE_KTLS
+#endif /* SSL_OP_ENABLE_KTLS && !OPENSSL_NO_KTLS */
+
 /*
  * Workaround for bug in OpenSSL 0.9.8y, 1.0.0k and 1.0.1e
  * http://bugs.debian.org/cgi-bin/bugreport.cgi?bug=703031
@@ -268,6 +276,7 @@ void ssl_x509_refcount_inc(X509 *) NONNULL(1);
 int ssl_x509chain_load(X509 **, STACK_OF(X509) **, const char *) NONNULL(2,3);
 int ssl_x509chain_use(SSL_CTX *, X509 *, STACK_OF(X509) *)
     NONNULL(1,2,3) WUNRES;
+void ssl_sslctx_refcount_inc(SSL_CTX *) NONNULL(1);
 
 char * ssl_session_to_str(SSL_SESSION *) NONNULL(1) MALLOC;
 int ssl_session_is_valid(SSL_SESSION *) NONNULL(1);
@@ -277,6 +286,9 @@ int ssl_is_ocspreq(const unsigned char *, size_t) NONNULL(1) WUNRES;
 int ssl_tls_clienthello_parse(const unsigned char *, ssize_t, int,
                               const unsigned char **, char **)
     NONNULL(1,4) WUNRES;
+#define SSL_TLS_RECORD_HDR_SZ 5
+ssize_t ssl_tls_clienthello_recordsz(const unsigned char *, size_t)
+    NONNULL(1) WUNRES;
 int ssl_dnsname_match(const char *, size_t, const char *, size_t)
     NONNULL(1,3) WUNRES;
 char * ssl_wildcardify(const char *) NONNULL(1) MALLOC;
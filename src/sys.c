@@ -51,6 +51,17 @@
 #include <string.h>
 #include <time.h>
 #include <errno.h>
+#include <limits.h>
+
+#ifdef __linux__
+#include <glob.h>
+#include <sched.h>
+#endif /* __linux__ */
+#ifdef __FreeBSD__
+#include <sys/cpuset.h>
+#include <pthread_np.h>
+typedef cpuset_t cpu_set_t;
+#endif /* __FreeBSD__ */
 
 #ifndef _SC_NPROCESSORS_ONLN
 #include <sys/sysctl.h>
@@ -581,6 +592,7 @@ sys_isdir(const char *path)
 /*
  * Create directory including parent directories with mode_t.
  * Mode of existing parent directories is not changed.
+ * Directories created concurrently by others are not treated as errors.
  * Returns 0 on success, -1 and sets errno on error.
  */
 int
@@ -605,7 +617,10 @@ sys_mkpath(const char *path, mode_t mode)
 		struct stat sbuf;
 		if (stat(parent, &sbuf) == -1) {
 			if (errno == ENOENT) {
-				if (mkdir(parent, mode) != 0)
+				/* another thread or process may have created
+				 * the directory since the stat() */
+				if (mkdir(parent, mode) != 0 &&
+				    (errno != EEXIST || !sys_isdir(parent)))
 					return -1;
 			} else {
 				return -1;
@@ -751,6 +766,193 @@ sys_get_cpu_cores(void)
 #endif /* !_SC_NPROCESSORS_ONLN */
 }
 
+/*
+ * Parse a list of CPU ids and ranges, such as "0-3,8,10-11", into a newly
+ * allocated array of CPU ids in the given order.
+ * Returns the number of CPU ids, or -1 on error.
+ */
+int
+sys_parse_cpulist(const char *list, int **cpus)
+{
+	const char *p = list;
+	int *v = NULL;
+	int n = 0;
+
+	while (*p) {
+		char *end;
+		long first, last;
+
+		first = strtol(p, &end, 10);
+		if (end == p || first < 0 || first > SYS_CPU_MAX)
+			goto err;
+		last = first;
+		p = end;
+		if (*p == '-') {
+			p++;
+			last = strtol(p, &end, 10);
+			if (end == p || last < first || last > SYS_CPU_MAX)
+				goto err;
+			p = end;
+		}
+
+		int *nv = realloc(v, (n + last - first + 1) * sizeof(int));
+		if (!nv)
+			goto err;
+		v = nv;
+		for (long cpu = first; cpu <= last; cpu++) {
+			v[n++] = cpu;
+		}
+
+		if (*p == ',') {
+			p++;
+			if (!*p)
+				goto err;
+		} else if (*p) {
+			goto err;
+		}
+	}
+	if (!n)
+		goto err;
+
+	*cpus = v;
+	return n;
+err:
+	if (v)
+		free(v);
+	return -1;
+}
+
+#ifdef SYS_HAVE_AFFINITY
+// Affinity of the process before pinning any thread, restored on unpinning
+static cpu_set_t sys_cpuset_orig;
+static int sys_cpuset_saved = 0;
+#endif /* SYS_HAVE_AFFINITY */
+
+/*
+ * Pin thread thr to the CPU with the given id, or unpin it if cpu is -1,
+ * i.e. restore the affinity the calling thread had on the first call.
+ * The first call should be made by the main thread, before pinning any other.
+ * Returns 0 on success, -1 on error or if not supported on this platform.
+ */
+int
+sys_thread_pin(UNUSED pthread_t thr, UNUSED int cpu)
+{
+#ifdef SYS_HAVE_AFFINITY
+	cpu_set_t set;
+	int rv;
+
+	if (!sys_cpuset_saved) {
+		if ((rv = pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), &sys_cpuset_orig))) {
+			errno = rv;
+			return -1;
+		}
+		sys_cpuset_saved = 1;
+	}
+
+	if (cpu == -1) {
+		set = sys_cpuset_orig;
+	} else {
+		if (cpu < 0 || cpu >= CPU_SETSIZE) {
+			errno = EINVAL;
+			return -1;
+		}
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+	}
+	if ((rv = pthread_setaffinity_np(thr, sizeof(cpu_set_t), &set))) {
+		errno = rv;
+		return -1;
+	}
+	return 0;
+#else /* !SYS_HAVE_AFFINITY */
+	errno = ENOTSUP;
+	return -1;
+#endif /* !SYS_HAVE_AFFINITY */
+}
+
+/*
+ * Process-wide number of open file descriptors.  Maintained by the callers
+ * opening and closing fds using sys_fd_count_add(), so that we do not need to
+ * scan the fd table to find out how many fds are in use.
+ */
+static int sys_fd_count = 0;
+
+#ifdef __linux__
+/*
+ * Copied from:
+ * https://github.com/tmux/tmux/blob/master/compat/getdtablecount.c
+ * 
+ * Copyright (c) 2017 Nicholas Marriott <nicholas.marriott@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+static int
+sys_getdtablecount(void)
+{
+	char path[PATH_MAX];
+	glob_t g;
+	int n = 0;
+
+	if (snprintf(path, sizeof path, "/proc/%ld/fd/*", (long)getpid()) < 0) {
+		log_err_level_printf(LOG_CRIT, "snprintf overflow\n");
+		return 0;
+	}
+	if (glob(path, 0, NULL, &g) == 0)
+		n = g.gl_pathc;
+	globfree(&g);
+	return n;
+}
+#else /* !__linux__ */
+static int
+sys_getdtablecount(void)
+{
+	int n = 0;
+	int size = getdtablesize();
+
+	for (int fd = 0; fd < size; fd++) {
+		if (fcntl(fd, F_GETFD) != -1)
+			n++;
+	}
+	return n;
+}
+#endif /* !__linux__ */
+
+/*
+ * Initialize the open fd count with the number of fds currently open.
+ * This scans the fd table, so it should be called once at startup only.
+ */
+void
+sys_fd_count_init(void)
+{
+	__atomic_store_n(&sys_fd_count, sys_getdtablecount(), __ATOMIC_RELAXED);
+}
+
+/*
+ * Add n to the open fd count, n is negative for closed fds.
+ * Returns the new open fd count.  This function is thread-safe.
+ */
+int
+sys_fd_count_add(int n)
+{
+	return __atomic_add_fetch(&sys_fd_count, n, __ATOMIC_RELAXED);
+}
+
+int
+sys_fd_count_get(void)
+{
+	return __atomic_load_n(&sys_fd_count, __ATOMIC_RELAXED);
+}
+
 /*
  * Send a message and optional file descriptor on a connected AF_UNIX
  * SOCKET_DGRAM socket s.  Returns the return value of sendmsg().
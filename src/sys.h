@@ -34,6 +34,18 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <stdint.h>
+#include <pthread.h>
+
+#if defined(__linux__) || defined(__FreeBSD__)
+#define SYS_HAVE_AFFINITY
+#endif /* __linux__ || __FreeBSD__ */
+
+#ifdef __linux__
+#define SYS_HAVE_SPLICE
+#endif /* __linux__ */
+
+// Highest CPU id accepted in CPU lists
+#define SYS_CPU_MAX 4095
 
 int sys_privdrop(const char *, const char *, const char *) WUNRES;
 
@@ -65,6 +77,12 @@ typedef int (*sys_dir_eachfile_cb_t)(const char *, void *) NONNULL(1) WUNRES;
 int sys_dir_eachfile(const char *, sys_dir_eachfile_cb_t, void *) NONNULL(1,2) WUNRES;
 
 uint32_t sys_get_cpu_cores(void) WUNRES;
+int sys_parse_cpulist(const char *, int **) NONNULL(1,2) WUNRES;
+int sys_thread_pin(pthread_t, int) WUNRES;
+
+void sys_fd_count_init(void);
+int sys_fd_count_add(int);
+int sys_fd_count_get(void) WUNRES;
 
 ssize_t sys_sendmsgfd(int, void *, size_t, int) NONNULL(2) WUNRES;
 ssize_t sys_recvmsgfd(int, void *, size_t, int *) NONNULL(2) WUNRES;
@@ -28,38 +28,68 @@
 
 #include "thrqueue.h"
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <sched.h>
 
 /*
- * Thread-safe, bounded-size queue based on pthreads mutex and conds.
- * Both enqueue and dequeue are available in a blocking and non-blocking
- * version.
+ * Thread-safe, bounded-size queue.  Enqueue and dequeue are lock-free on
+ * a ring of slots carrying sequence numbers, so any number of producers and
+ * consumers can use the queue concurrently without serializing on a mutex.
+ * The mutex and conds are only used to put threads to sleep when the queue
+ * is full or empty, and are only touched by the other side if it sees a
+ * sleeper.  Both enqueue and dequeue are available in a blocking and
+ * non-blocking version.
  */
 
+#define THRQUEUE_CACHELINE_SIZE 64
+
+typedef struct thrqueue_slot {
+	size_t seq;
+	void *item;
+} thrqueue_slot_t;
+
 struct thrqueue {
-	void **data;
-	size_t sz, n;
-	size_t in, out;
-	unsigned int block_enqueue : 1;
-	unsigned int block_dequeue : 1;
+	thrqueue_slot_t *slots;
+	size_t mask;
+	int block_enqueue;
+	int block_dequeue;
 	pthread_mutex_t mutex;
 	pthread_cond_t notempty;
 	pthread_cond_t notfull;
+
+	/* Written by producers */
+	size_t in ALIGNED(THRQUEUE_CACHELINE_SIZE);
+	int enq_waiting;
+	size_t full;
+
+	/* Written by consumers */
+	size_t out ALIGNED(THRQUEUE_CACHELINE_SIZE);
+	int deq_waiting;
+	size_t batches;
+	size_t items;
+	size_t max_batch;
+	size_t max_depth;
 };
 
 /*
  * Create a new thread-safe queue of size sz.
+ * The size is rounded up to the next power of two.
  */
 thrqueue_t *
 thrqueue_new(size_t sz)
 {
 	thrqueue_t *queue;
+	size_t n, i;
+
+	for (n = 2; n < sz; n <<= 1);
 
 	if (!(queue = malloc(sizeof(thrqueue_t))))
 		goto out0;
-	if (!(queue->data = malloc(sz * sizeof(void*))))
+	memset(queue, 0, sizeof(thrqueue_t));
+	if (!(queue->slots = malloc(n * sizeof(thrqueue_slot_t))))
 		goto out1;
 	if (pthread_mutex_init(&queue->mutex, NULL))
 		goto out2;
@@ -67,10 +97,11 @@ thrqueue_new(size_t sz)
 		goto out3;
 	if (pthread_cond_init(&queue->notfull, NULL))
 		goto out4;
-	queue->sz = sz;
-	queue->n = 0;
-	queue->in = 0;
-	queue->out = 0;
+	for (i = 0; i < n; i++) {
+		queue->slots[i].seq = i;
+		queue->slots[i].item = NULL;
+	}
+	queue->mask = n - 1;
 	queue->block_enqueue = 1;
 	queue->block_dequeue = 1;
 	return queue;
@@ -80,7 +111,7 @@ out4:
 out3:
 	pthread_mutex_destroy(&queue->mutex);
 out2:
-	free(queue->data);
+	free(queue->slots);
 out1:
 	free(queue);
 out0:
@@ -95,13 +126,99 @@ out0:
 void
 thrqueue_free(thrqueue_t *queue)
 {
-	free(queue->data);
+	free(queue->slots);
 	pthread_mutex_destroy(&queue->mutex);
 	pthread_cond_destroy(&queue->notempty);
 	pthread_cond_destroy(&queue->notfull);
 	free(queue);
 }
 
+/*
+ * Claim a free slot and publish item in it.
+ * A slot is free for position pos if its sequence number equals pos,
+ * and holds an item for position pos if its sequence number is pos + 1.
+ * Returns 0 on success, -1 if the queue is full.
+ */
+static int
+thrqueue_push(thrqueue_t *queue, void *item)
+{
+	thrqueue_slot_t *slot;
+	size_t pos, seq;
+	intptr_t diff;
+
+	pos = __atomic_load_n(&queue->in, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &queue->slots[pos & queue->mask];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		diff = (intptr_t)seq - (intptr_t)pos;
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&queue->in, &pos,
+			                                pos + 1, 1,
+			                                __ATOMIC_RELAXED,
+			                                __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			return -1;
+		} else {
+			pos = __atomic_load_n(&queue->in, __ATOMIC_RELAXED);
+		}
+	}
+	slot->item = item;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*
+ * Claim a filled slot and take its item, releasing the slot for the
+ * producers of the next round through the ring.
+ * Returns 0 on success, -1 if the queue is empty.
+ */
+static int
+thrqueue_pop(thrqueue_t *queue, void **item)
+{
+	thrqueue_slot_t *slot;
+	size_t pos, seq;
+	intptr_t diff;
+
+	pos = __atomic_load_n(&queue->out, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &queue->slots[pos & queue->mask];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		diff = (intptr_t)seq - (intptr_t)(pos + 1);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&queue->out, &pos,
+			                                pos + 1, 1,
+			                                __ATOMIC_RELAXED,
+			                                __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			return -1;
+		} else {
+			pos = __atomic_load_n(&queue->out, __ATOMIC_RELAXED);
+		}
+	}
+	*item = slot->item;
+	__atomic_store_n(&slot->seq, pos + queue->mask + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*
+ * Wake up threads sleeping on cond if the waiting counter says there are
+ * any.  The fence pairs with the one in the sleeping thread between
+ * announcing itself and rechecking the queue, so that either the sleeper
+ * sees our change to the queue or we see the sleeper.
+ */
+static void
+thrqueue_wakeup(thrqueue_t *queue, int *waiting, pthread_cond_t *cond)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(waiting, __ATOMIC_RELAXED))
+		return;
+	pthread_mutex_lock(&queue->mutex);
+	pthread_cond_broadcast(cond);
+	pthread_mutex_unlock(&queue->mutex);
+}
+
 /*
  * Enqueue an item into the queue.  Will block if the queue is full.
  * If enqueue has been switched to non-blocking mode, never blocks
@@ -111,19 +228,27 @@ thrqueue_free(thrqueue_t *queue)
 void *
 thrqueue_enqueue(thrqueue_t *queue, void *item)
 {
-	pthread_mutex_lock(&queue->mutex);
-	while (queue->n == queue->sz) {
-		if (!queue->block_enqueue) {
-			pthread_mutex_unlock(&queue->mutex);
-			return NULL;
+	if (thrqueue_push(queue, item) == -1) {
+		__atomic_add_fetch(&queue->full, 1, __ATOMIC_RELAXED);
+		pthread_mutex_lock(&queue->mutex);
+		__atomic_add_fetch(&queue->enq_waiting, 1, __ATOMIC_RELAXED);
+		for (;;) {
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			if (thrqueue_push(queue, item) == 0)
+				break;
+			if (!__atomic_load_n(&queue->block_enqueue,
+			                     __ATOMIC_RELAXED)) {
+				__atomic_sub_fetch(&queue->enq_waiting, 1,
+				                   __ATOMIC_RELAXED);
+				pthread_mutex_unlock(&queue->mutex);
+				return NULL;
+			}
+			pthread_cond_wait(&queue->notfull, &queue->mutex);
 		}
-		pthread_cond_wait(&queue->notfull, &queue->mutex);
+		__atomic_sub_fetch(&queue->enq_waiting, 1, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&queue->mutex);
 	}
-	queue->data[queue->in++] = item;
-	queue->in %= queue->sz;
-	queue->n++;
-	pthread_mutex_unlock(&queue->mutex);
-	pthread_cond_broadcast(&queue->notempty);
+	thrqueue_wakeup(queue, &queue->deq_waiting, &queue->notempty);
 	return item;
 }
 
@@ -135,19 +260,45 @@ thrqueue_enqueue(thrqueue_t *queue, void *item)
 void *
 thrqueue_enqueue_nb(thrqueue_t *queue, void *item)
 {
-	pthread_mutex_lock(&queue->mutex);
-	if (queue->n == queue->sz) {
-		pthread_mutex_unlock(&queue->mutex);
+	if (thrqueue_push(queue, item) == -1) {
+		__atomic_add_fetch(&queue->full, 1, __ATOMIC_RELAXED);
 		return NULL;
 	}
-	queue->data[queue->in++] = item;
-	queue->in %= queue->sz;
-	queue->n++;
-	pthread_mutex_unlock(&queue->mutex);
-	pthread_cond_signal(&queue->notempty);
+	thrqueue_wakeup(queue, &queue->deq_waiting, &queue->notempty);
 	return item;
 }
 
+/*
+ * Wait until the queue is not empty or dequeue has been switched to
+ * non-blocking mode.  Returns 0 if there may be items to dequeue, -1 if the
+ * queue is empty and dequeue does not block anymore.
+ */
+static int
+thrqueue_wait_notempty(thrqueue_t *queue)
+{
+	thrqueue_slot_t *slot;
+	size_t pos;
+	int rv = 0;
+
+	pthread_mutex_lock(&queue->mutex);
+	__atomic_add_fetch(&queue->deq_waiting, 1, __ATOMIC_RELAXED);
+	for (;;) {
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		pos = __atomic_load_n(&queue->out, __ATOMIC_RELAXED);
+		slot = &queue->slots[pos & queue->mask];
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == pos + 1)
+			break;
+		if (!__atomic_load_n(&queue->block_dequeue, __ATOMIC_RELAXED)) {
+			rv = -1;
+			break;
+		}
+		pthread_cond_wait(&queue->notempty, &queue->mutex);
+	}
+	__atomic_sub_fetch(&queue->deq_waiting, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&queue->mutex);
+	return rv;
+}
+
 /*
  * Dequeue an item from the queue.  Will block if the queue is empty.
  * If dequeue has been switched to non-blocking mode, never blocks
@@ -159,19 +310,11 @@ thrqueue_dequeue(thrqueue_t *queue)
 {
 	void *item;
 
-	pthread_mutex_lock(&queue->mutex);
-	while (queue->n == 0) {
-		if (!queue->block_dequeue) {
-			pthread_mutex_unlock(&queue->mutex);
+	while (thrqueue_pop(queue, &item) == -1) {
+		if (thrqueue_wait_notempty(queue) == -1)
 			return NULL;
-		}
-		pthread_cond_wait(&queue->notempty, &queue->mutex);
 	}
-	item = queue->data[queue->out++];
-	queue->out %= queue->sz;
-	queue->n--;
-	pthread_mutex_unlock(&queue->mutex);
-	pthread_cond_signal(&queue->notfull);
+	thrqueue_wakeup(queue, &queue->enq_waiting, &queue->notfull);
 	return item;
 }
 
@@ -185,19 +328,83 @@ thrqueue_dequeue_nb(thrqueue_t *queue)
 {
 	void *item;
 
-	pthread_mutex_lock(&queue->mutex);
-	if (queue->n == 0) {
-		pthread_mutex_unlock(&queue->mutex);
+	if (thrqueue_pop(queue, &item) == -1)
 		return NULL;
-	}
-	item = queue->data[queue->out++];
-	queue->out %= queue->sz;
-	queue->n--;
-	pthread_mutex_unlock(&queue->mutex);
-	pthread_cond_signal(&queue->notfull);
+	thrqueue_wakeup(queue, &queue->enq_waiting, &queue->notfull);
 	return item;
 }
 
+/*
+ * Dequeue up to max items from the queue into items, in queue order.
+ * Will block until at least one item is available.  If dequeue has been
+ * switched to non-blocking mode, never blocks but instead returns 0 if the
+ * queue is empty.  Producers waiting on a full queue are woken up once per
+ * batch instead of once per item.
+ * Returns the number of dequeued items.
+ */
+size_t
+thrqueue_dequeue_batch(thrqueue_t *queue, void **items, size_t max)
+{
+	size_t n, depth;
+
+	if (!max)
+		return 0;
+	while (thrqueue_pop(queue, &items[0]) == -1) {
+		if (thrqueue_wait_notempty(queue) == -1)
+			return 0;
+	}
+	depth = __atomic_load_n(&queue->in, __ATOMIC_RELAXED) -
+	        __atomic_load_n(&queue->out, __ATOMIC_RELAXED) + 1;
+	for (n = 1; n < max; n++) {
+		if (thrqueue_pop(queue, &items[n]) == -1)
+			break;
+	}
+	thrqueue_wakeup(queue, &queue->enq_waiting, &queue->notfull);
+
+	__atomic_add_fetch(&queue->batches, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&queue->items, n, __ATOMIC_RELAXED);
+	if (n > __atomic_load_n(&queue->max_batch, __ATOMIC_RELAXED))
+		__atomic_store_n(&queue->max_batch, n, __ATOMIC_RELAXED);
+	if (depth <= queue->mask + 1 &&
+	    depth > __atomic_load_n(&queue->max_depth, __ATOMIC_RELAXED))
+		__atomic_store_n(&queue->max_depth, depth, __ATOMIC_RELAXED);
+	return n;
+}
+
+/*
+ * Return the number of items in the queue.  The result is only a snapshot
+ * when other threads are using the queue concurrently.
+ */
+size_t
+thrqueue_depth(thrqueue_t *queue)
+{
+	size_t in, out;
+
+	out = __atomic_load_n(&queue->out, __ATOMIC_RELAXED);
+	in = __atomic_load_n(&queue->in, __ATOMIC_RELAXED);
+	return in > out ? in - out : 0;
+}
+
+/*
+ * Copy the queue statistics into stats and reset the counters.
+ * The depth is a snapshot and not reset.  The batch counters and maximum
+ * depth are only maintained by thrqueue_dequeue_batch().
+ */
+void
+thrqueue_get_stats(thrqueue_t *queue, thrqueue_stats_t *stats)
+{
+	stats->size = queue->mask + 1;
+	stats->depth = thrqueue_depth(queue);
+	stats->full = __atomic_exchange_n(&queue->full, 0, __ATOMIC_RELAXED);
+	stats->batches = __atomic_exchange_n(&queue->batches, 0,
+	                                     __ATOMIC_RELAXED);
+	stats->items = __atomic_exchange_n(&queue->items, 0, __ATOMIC_RELAXED);
+	stats->max_batch = __atomic_exchange_n(&queue->max_batch, 0,
+	                                       __ATOMIC_RELAXED);
+	stats->max_depth = __atomic_exchange_n(&queue->max_depth, 0,
+	                                       __ATOMIC_RELAXED);
+}
+
 /*
  * Permanently make all enqueue operations on queue non-blocking and wake
  * up all threads currently waiting for the queue to become not full.
@@ -207,8 +414,10 @@ thrqueue_dequeue_nb(thrqueue_t *queue)
 void
 thrqueue_unblock_enqueue(thrqueue_t *queue)
 {
-	queue->block_enqueue = 0;
+	pthread_mutex_lock(&queue->mutex);
+	__atomic_store_n(&queue->block_enqueue, 0, __ATOMIC_RELAXED);
 	pthread_cond_broadcast(&queue->notfull);
+	pthread_mutex_unlock(&queue->mutex);
 	sched_yield();
 }
 
@@ -221,8 +430,10 @@ thrqueue_unblock_enqueue(thrqueue_t *queue)
 void
 thrqueue_unblock_dequeue(thrqueue_t *queue)
 {
-	queue->block_dequeue = 0;
+	pthread_mutex_lock(&queue->mutex);
+	__atomic_store_n(&queue->block_dequeue, 0, __ATOMIC_RELAXED);
 	pthread_cond_broadcast(&queue->notempty);
+	pthread_mutex_unlock(&queue->mutex);
 	sched_yield();
 }
 
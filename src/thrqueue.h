@@ -35,6 +35,16 @@
 
 typedef struct thrqueue thrqueue_t;
 
+typedef struct thrqueue_stats {
+	size_t size;
+	size_t depth;
+	size_t max_depth;
+	size_t full;
+	size_t batches;
+	size_t items;
+	size_t max_batch;
+} thrqueue_stats_t;
+
 thrqueue_t * thrqueue_new(size_t) MALLOC;
 void thrqueue_free(thrqueue_t *) NONNULL(1);
 
@@ -42,6 +52,9 @@ void * thrqueue_enqueue(thrqueue_t *, void *) NONNULL(1) WUNRES;
 void * thrqueue_enqueue_nb(thrqueue_t *, void *) NONNULL(1) WUNRES;
 void * thrqueue_dequeue(thrqueue_t *) NONNULL(1) WUNRES;
 void * thrqueue_dequeue_nb(thrqueue_t *) NONNULL(1) WUNRES;
+size_t thrqueue_dequeue_batch(thrqueue_t *, void **, size_t) NONNULL(1,2) WUNRES;
+size_t thrqueue_depth(thrqueue_t *) NONNULL(1) WUNRES;
+void thrqueue_get_stats(thrqueue_t *, thrqueue_stats_t *) NONNULL(1,2);
 void thrqueue_unblock_enqueue(thrqueue_t *) NONNULL(1);
 void thrqueue_unblock_dequeue(thrqueue_t *) NONNULL(1);
 
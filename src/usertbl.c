@@ -0,0 +1,523 @@
+/*-
+ * SSLproxy - transparent SSL/TLS proxy
+ *
+ * Copyright (c) 2017-2025, Soner Tari <sonertari@gmail.com>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "usertbl.h"
+#include "log.h"
+
+#include "khash.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+
+#ifndef WITHOUT_USERAUTH
+/*
+ * In-memory copy of the users table of the user db, keyed by ip, so that
+ * the conn handling threads identify users by a hash lookup instead of
+ * querying the db, which may block them on the locks of the db file.
+ *
+ * A refresh thread polls the data_version of the db, and publishes a new
+ * snapshot of the table whenever another connection has changed it, such as
+ * the auth portal logging users in or the privsep server updating atimes.
+ * Snapshots are immutable once published by swapping the table pointer.
+ * Each reader announces the snapshot it is using in its own hazard slot, and
+ * the refresh thread frees the old snapshot only after no slot holds it.
+ * So readers never take a lock or wait for the refresh thread.
+ *
+ * Logins and atime updates set the atime of the row to the current time, so
+ * the refresh thread loads only the rows with an atime not older than the
+ * newest one loaded before, and merges them into a copy of the snapshot,
+ * which shares the unchanged rows.  Rows deleted, or inserted with an older
+ * atime, are detected by the row count and make it load the whole table.
+ *
+ * A miss is a miss: a user who has just logged in is found once the refresh
+ * thread has published the new row, within a poll interval, so that conn
+ * handling threads never block on the db.
+ */
+
+#define USERTBL_CACHELINE_SIZE 64
+
+// Row shared by the snapshots it is in, refs is used by the refresh thread only
+typedef struct usertbl_entry {
+	usertbl_user_t u;
+	char *ip;
+	unsigned int refs;
+} usertbl_entry_t;
+
+KHASH_INIT(usermap_t, char*, usertbl_entry_t*, 1, kh_str_hash_func, kh_str_hash_equal)
+
+typedef struct usertbl_snap {
+	khash_t(usermap_t) *map;
+} usertbl_snap_t;
+
+// Hazard slot of a reader, on its own cache line
+typedef struct usertbl_reader {
+	usertbl_snap_t *snap;
+} ALIGNED(USERTBL_CACHELINE_SIZE) usertbl_reader_t;
+
+struct usertbl {
+	sqlite3 *db;
+	sqlite3_stmt *select_users;
+	sqlite3_stmt *select_changed;
+	sqlite3_stmt *count_users;
+	sqlite3_stmt *data_version;
+	// Version of the db the snapshot was loaded at
+	int version;
+	// Newest atime in the snapshot
+	time_t atime;
+	usertbl_snap_t *snap;
+	unsigned int num_readers;
+	usertbl_reader_t *readers;
+	pthread_t thr;
+	int running;
+	int stop;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	// Written by the refresh thread only
+	usertbl_stats_t stats;
+};
+
+static void
+usertbl_entry_unref(usertbl_entry_t *e)
+{
+	if (--e->refs)
+		return;
+	free(e->u.user);
+	free(e->u.desc);
+	free(e->ip);
+	free(e);
+}
+
+static void
+usertbl_snap_free(usertbl_snap_t *snap)
+{
+	khiter_t k;
+
+	for (k = kh_begin(snap->map); k != kh_end(snap->map); ++k) {
+		if (kh_exist(snap->map, k)) {
+			usertbl_entry_unref(kh_val(snap->map, k));
+		}
+	}
+	kh_destroy(usermap_t, snap->map);
+	free(snap);
+}
+
+/*
+ * Create a snapshot sharing the rows of base, or an empty one if base is NULL.
+ */
+static usertbl_snap_t *
+usertbl_snap_new(usertbl_snap_t *base)
+{
+	usertbl_snap_t *snap;
+	khiter_t k, n;
+	int ret;
+
+	if (!(snap = malloc(sizeof(usertbl_snap_t))))
+		return NULL;
+	if (!(snap->map = kh_init(usermap_t))) {
+		free(snap);
+		return NULL;
+	}
+	if (!base)
+		return snap;
+
+	if (kh_resize(usermap_t, snap->map, kh_size(base->map)) == -1)
+		goto memout;
+	for (k = kh_begin(base->map); k != kh_end(base->map); ++k) {
+		if (!kh_exist(base->map, k))
+			continue;
+		usertbl_entry_t *e = kh_val(base->map, k);
+		n = kh_put(usermap_t, snap->map, e->ip, &ret);
+		if (ret == -1)
+			goto memout;
+		kh_val(snap->map, n) = e;
+		e->refs++;
+	}
+	return snap;
+
+memout:
+	usertbl_snap_free(snap);
+	return NULL;
+}
+
+/*
+ * Load the rows selected by stmt into snap, replacing the rows with the same
+ * ip, and raise *atime to the newest atime loaded.
+ * Returns 0 on success and -1 on error, with busy set if the db was busy or
+ * locked.
+ */
+static int
+usertbl_snap_load(usertbl_t *tbl, usertbl_snap_t *snap, sqlite3_stmt *stmt,
+                  time_t *atime, int *busy)
+{
+	int rc;
+
+	*busy = 0;
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		const char *ip = (const char *)sqlite3_column_text(stmt, 0);
+		const char *user = (const char *)sqlite3_column_text(stmt, 1);
+		const char *ether = (const char *)sqlite3_column_text(stmt, 2);
+		const char *desc = (const char *)sqlite3_column_text(stmt, 4);
+		usertbl_entry_t *e;
+		khiter_t k;
+		int ret;
+
+		if (!ip || !user)
+			continue;
+
+		if (!(e = malloc(sizeof(usertbl_entry_t))))
+			goto memout;
+		memset(e, 0, sizeof(usertbl_entry_t));
+		e->refs = 1;
+		e->u.user = strdup(user);
+		e->u.desc = strdup(desc ? desc : "");
+		e->ip = strdup(ip);
+		if (ether)
+			strncpy(e->u.ether, ether, sizeof(e->u.ether) - 1);
+		e->u.atime = (time_t)sqlite3_column_int64(stmt, 3);
+		if (!e->u.user || !e->u.desc || !e->ip) {
+			usertbl_entry_unref(e);
+			goto memout;
+		}
+
+		k = kh_put(usermap_t, snap->map, e->ip, &ret);
+		if (ret == -1) {
+			usertbl_entry_unref(e);
+			goto memout;
+		} else if (ret == 0) {
+			// The row has changed, or ip is not unique in the table and the last row wins
+			usertbl_entry_unref(kh_val(snap->map, k));
+			kh_key(snap->map, k) = e->ip;
+		}
+		kh_val(snap->map, k) = e;
+		if (e->u.atime > *atime)
+			*atime = e->u.atime;
+	}
+	sqlite3_reset(stmt);
+
+	if (rc != SQLITE_DONE) {
+		// Do not retry in case we cannot acquire db file or database: SQLITE_BUSY or SQLITE_LOCKED respectively
+		// The table is loaded again at the next poll
+		*busy = (rc == SQLITE_BUSY || rc == SQLITE_LOCKED);
+		if (!*busy) {
+			log_err_level_printf(LOG_WARNING, "Error loading users: %s\n", sqlite3_errmsg(tbl->db));
+		}
+		return -1;
+	}
+	return 0;
+
+memout:
+	sqlite3_reset(stmt);
+	return -1;
+}
+
+/*
+ * Returns the single int result of stmt, such as the data_version of the db
+ * or the row count of the users table, or -1 on error.
+ */
+static int
+usertbl_query_int(sqlite3_stmt *stmt)
+{
+	int rv = -1;
+
+	sqlite3_reset(stmt);
+	if (sqlite3_step(stmt) == SQLITE_ROW) {
+		rv = sqlite3_column_int(stmt, 0);
+	}
+	sqlite3_reset(stmt);
+	return rv;
+}
+
+/*
+ * Wait until no reader is using the snapshot, which has been unpublished.
+ */
+static void
+usertbl_synchronize(usertbl_t *tbl, usertbl_snap_t *snap)
+{
+	for (unsigned int i = 0; i < tbl->num_readers; i++) {
+		while (__atomic_load_n(&tbl->readers[i].snap, __ATOMIC_SEQ_CST) == snap) {
+			sched_yield();
+		}
+	}
+}
+
+/*
+ * Merge the rows changed since the last refresh into a copy of the snapshot.
+ * Returns NULL if the rows merged do not add up to the row count of the
+ * table, or on error, with busy set if the db was busy or locked.
+ */
+static usertbl_snap_t *
+usertbl_update(usertbl_t *tbl, time_t *atime, int *busy)
+{
+	usertbl_snap_t *snap;
+	int count;
+
+	*busy = 0;
+	if (!(snap = usertbl_snap_new(tbl->snap)))
+		return NULL;
+	sqlite3_reset(tbl->select_changed);
+	sqlite3_bind_int64(tbl->select_changed, 1, (sqlite3_int64)tbl->atime);
+	if (usertbl_snap_load(tbl, snap, tbl->select_changed, atime, busy) == -1)
+		goto err;
+	if ((count = usertbl_query_int(tbl->count_users)) == -1 ||
+	    (size_t)count != kh_size(snap->map))
+		goto err;
+	return snap;
+err:
+	usertbl_snap_free(snap);
+	return NULL;
+}
+
+/*
+ * Load the users table again if the db has changed since the last load,
+ * merging only the changed rows if possible.
+ * Must not be called concurrently with the refresh thread.
+ * Returns 1 if the table has been reloaded, 0 if unchanged, and -1 on error.
+ */
+int
+usertbl_refresh(usertbl_t *tbl)
+{
+	usertbl_snap_t *snap = NULL, *old;
+	time_t atime;
+	int version, busy = 0;
+
+	if ((version = usertbl_query_int(tbl->data_version)) == -1)
+		return -1;
+	if (tbl->snap && version == tbl->version)
+		return 0;
+
+	if (tbl->snap) {
+		atime = tbl->atime;
+		if ((snap = usertbl_update(tbl, &atime, &busy))) {
+			__atomic_add_fetch(&tbl->stats.updates, 1, __ATOMIC_RELAXED);
+		} else if (busy) {
+			__atomic_add_fetch(&tbl->stats.busy, 1, __ATOMIC_RELAXED);
+			return -1;
+		}
+	}
+	if (!snap) {
+		atime = 0;
+		if (!(snap = usertbl_snap_new(NULL)))
+			return -1;
+		sqlite3_reset(tbl->select_users);
+		if (usertbl_snap_load(tbl, snap, tbl->select_users, &atime, &busy) == -1) {
+			if (busy)
+				__atomic_add_fetch(&tbl->stats.busy, 1, __ATOMIC_RELAXED);
+			usertbl_snap_free(snap);
+			return -1;
+		}
+		__atomic_add_fetch(&tbl->stats.reloads, 1, __ATOMIC_RELAXED);
+	}
+
+	old = tbl->snap;
+	__atomic_store_n(&tbl->snap, snap, __ATOMIC_SEQ_CST);
+	tbl->version = version;
+	tbl->atime = atime;
+	__atomic_store_n(&tbl->stats.users, kh_size(snap->map), __ATOMIC_RELAXED);
+
+	if (old) {
+		usertbl_synchronize(tbl, old);
+		usertbl_snap_free(old);
+	}
+	return 1;
+}
+
+/*
+ * The db must outlive the table.  Readers are identified by their index,
+ * from 0 to num_readers - 1, each of which must be used by one thread only.
+ * The table is loaded once here, a busy db is loaded by the refresh thread.
+ */
+usertbl_t *
+usertbl_new(sqlite3 *db, unsigned int num_readers)
+{
+	usertbl_t *tbl;
+
+	if (!(tbl = malloc(sizeof(usertbl_t))))
+		return NULL;
+	memset(tbl, 0, sizeof(usertbl_t));
+	tbl->db = db;
+
+	if (posix_memalign((void **)&tbl->readers, USERTBL_CACHELINE_SIZE,
+	                   num_readers * sizeof(usertbl_reader_t))) {
+		tbl->readers = NULL;
+		goto err;
+	}
+	memset(tbl->readers, 0, num_readers * sizeof(usertbl_reader_t));
+	tbl->num_readers = num_readers;
+
+	if (sqlite3_prepare_v2(db, "SELECT ip,user,ether,atime,desc FROM users", -1, &tbl->select_users, NULL) ||
+	    sqlite3_prepare_v2(db, "SELECT ip,user,ether,atime,desc FROM users WHERE atime >= ?1", -1, &tbl->select_changed, NULL) ||
+	    sqlite3_prepare_v2(db, "SELECT COUNT(*) FROM users", -1, &tbl->count_users, NULL) ||
+	    sqlite3_prepare_v2(db, "PRAGMA data_version", -1, &tbl->data_version, NULL)) {
+		log_err_level_printf(LOG_CRIT, "Error preparing usertbl sql stmt: %s\n", sqlite3_errmsg(db));
+		goto err;
+	}
+	if (pthread_mutex_init(&tbl->mutex, NULL))
+		goto err;
+	if (pthread_cond_init(&tbl->cond, NULL)) {
+		pthread_mutex_destroy(&tbl->mutex);
+		goto err;
+	}
+
+	if (usertbl_refresh(tbl) == -1) {
+		log_err_level_printf(LOG_WARNING, "Cannot load users yet, will retry\n");
+	}
+	return tbl;
+err:
+	// sqlite3.h: "Invoking sqlite3_finalize() on a NULL pointer is a harmless no-op."
+	sqlite3_finalize(tbl->select_users);
+	sqlite3_finalize(tbl->select_changed);
+	sqlite3_finalize(tbl->count_users);
+	sqlite3_finalize(tbl->data_version);
+	free(tbl->readers);
+	free(tbl);
+	return NULL;
+}
+
+static void *
+usertbl_thr(void *arg)
+{
+	usertbl_t *tbl = arg;
+	struct timespec ts;
+
+	pthread_mutex_lock(&tbl->mutex);
+	while (!tbl->stop) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += USERTBL_POLL_MSEC * 1000000L;
+		ts.tv_sec += ts.tv_nsec / 1000000000L;
+		ts.tv_nsec %= 1000000000L;
+		pthread_cond_timedwait(&tbl->cond, &tbl->mutex, &ts);
+		if (tbl->stop)
+			break;
+		pthread_mutex_unlock(&tbl->mutex);
+
+		if (usertbl_refresh(tbl) == 1) {
+			log_dbg_printf("Refreshed %zu users\n", tbl->stats.users);
+		}
+
+		pthread_mutex_lock(&tbl->mutex);
+	}
+	pthread_mutex_unlock(&tbl->mutex);
+	return NULL;
+}
+
+/*
+ * Start the refresh thread.
+ * Returns 0 on success and -1 on error.
+ */
+int
+usertbl_start(usertbl_t *tbl)
+{
+	if (pthread_create(&tbl->thr, NULL, usertbl_thr, tbl))
+		return -1;
+	tbl->running = 1;
+	return 0;
+}
+
+/*
+ * Stop the refresh thread, if started, and free the table.
+ * There must be no readers left.
+ */
+void
+usertbl_free(usertbl_t *tbl)
+{
+	if (tbl->running) {
+		pthread_mutex_lock(&tbl->mutex);
+		tbl->stop = 1;
+		pthread_cond_signal(&tbl->cond);
+		pthread_mutex_unlock(&tbl->mutex);
+		pthread_join(tbl->thr, NULL);
+	}
+	if (tbl->snap)
+		usertbl_snap_free(tbl->snap);
+	sqlite3_finalize(tbl->select_users);
+	sqlite3_finalize(tbl->select_changed);
+	sqlite3_finalize(tbl->count_users);
+	sqlite3_finalize(tbl->data_version);
+	pthread_cond_destroy(&tbl->cond);
+	pthread_mutex_destroy(&tbl->mutex);
+	free(tbl->readers);
+	free(tbl);
+}
+
+/*
+ * Look up the user logged in from ip, using the hazard slot of reader.
+ * Fills in user with copies owned by the caller.
+ * Returns 1 if found, 0 if not found, and -1 on out of memory.
+ */
+int
+usertbl_lookup(usertbl_t *tbl, unsigned int reader, const char *ip, usertbl_user_t *user)
+{
+	usertbl_reader_t *r = &tbl->readers[reader];
+	usertbl_snap_t *snap;
+	khiter_t k;
+	int rv = 0;
+
+	// Announce the snapshot before using it, and make sure it is still
+	// the published one, otherwise the refresh thread may have missed it
+	do {
+		snap = __atomic_load_n(&tbl->snap, __ATOMIC_SEQ_CST);
+		__atomic_store_n(&r->snap, snap, __ATOMIC_SEQ_CST);
+	} while (snap != __atomic_load_n(&tbl->snap, __ATOMIC_SEQ_CST));
+
+	if (snap) {
+		k = kh_get(usermap_t, snap->map, (char *)ip);
+		if (k != kh_end(snap->map)) {
+			usertbl_user_t *u = &kh_val(snap->map, k)->u;
+			memcpy(user->ether, u->ether, sizeof(user->ether));
+			user->atime = u->atime;
+			user->user = strdup(u->user);
+			user->desc = strdup(u->desc);
+			if (!user->user || !user->desc) {
+				free(user->user);
+				free(user->desc);
+				user->user = NULL;
+				user->desc = NULL;
+				rv = -1;
+			} else {
+				rv = 1;
+			}
+		}
+	}
+
+	__atomic_store_n(&r->snap, NULL, __ATOMIC_RELEASE);
+	return rv;
+}
+
+void
+usertbl_get_stats(usertbl_t *tbl, usertbl_stats_t *stats)
+{
+	stats->users = __atomic_load_n(&tbl->stats.users, __ATOMIC_RELAXED);
+	stats->reloads = __atomic_load_n(&tbl->stats.reloads, __ATOMIC_RELAXED);
+	stats->updates = __atomic_load_n(&tbl->stats.updates, __ATOMIC_RELAXED);
+	stats->busy = __atomic_load_n(&tbl->stats.busy, __ATOMIC_RELAXED);
+}
+
+#endif /* !WITHOUT_USERAUTH */
+
+/* vim: set noet ft=c: */
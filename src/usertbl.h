@@ -0,0 +1,71 @@
+/*-
+ * SSLproxy - transparent SSL/TLS proxy
+ *
+ * Copyright (c) 2017-2025, Soner Tari <sonertari@gmail.com>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef USERTBL_H
+#define USERTBL_H
+
+#ifndef WITHOUT_USERAUTH
+#include "attrib.h"
+
+#include <time.h>
+#include <sqlite3.h>
+
+/*
+ * Interval in milliseconds of polling the user db for changes.
+ */
+#define USERTBL_POLL_MSEC 250
+
+typedef struct usertbl usertbl_t;
+
+// Copy of a users table row, user and desc are owned by the caller
+typedef struct usertbl_user {
+	char *user;
+	char ether[18];
+	time_t atime;
+	char *desc;
+} usertbl_user_t;
+
+typedef struct usertbl_stats {
+	size_t users;
+	// Full loads of the table, and merges of the changed rows only
+	size_t reloads;
+	size_t updates;
+	// Reloads given up because the db was busy or locked
+	size_t busy;
+} usertbl_stats_t;
+
+usertbl_t * usertbl_new(sqlite3 *, unsigned int) NONNULL(1) MALLOC;
+int usertbl_start(usertbl_t *) NONNULL(1) WUNRES;
+void usertbl_free(usertbl_t *) NONNULL(1);
+int usertbl_refresh(usertbl_t *) NONNULL(1) WUNRES;
+int usertbl_lookup(usertbl_t *, unsigned int, const char *, usertbl_user_t *) NONNULL(1,3,4) WUNRES;
+void usertbl_get_stats(usertbl_t *, usertbl_stats_t *) NONNULL(1,2);
+#endif /* !WITHOUT_USERAUTH */
+
+#endif /* !USERTBL_H */
+
+/* vim: set noet ft=c: */
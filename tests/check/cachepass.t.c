@@ -0,0 +1,238 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2017-2025, Soner Tari <sonertari@gmail.com>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "ssl.h"
+#include "cachemgr.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <pthread.h>
+
+#include <check.h>
+
+static struct sockaddr_storage addr;
+static socklen_t addrlen;
+static char sni[] = "daniel.roe.ch";
+
+static void
+cachemgr_setup(void)
+{
+	if ((ssl_init() == -1) || (cachemgr_preinit() == -1))
+		exit(EXIT_FAILURE);
+	addrlen = sizeof(struct sockaddr_in);
+	memset(&addr, 0, addrlen);
+	addr.ss_family = AF_INET;
+}
+
+static void
+cachemgr_teardown(void)
+{
+	cachemgr_fini();
+	ssl_fini();
+}
+
+START_TEST(cache_pass_01)
+{
+	pass_t *p;
+
+	cachemgr_pass_set((struct sockaddr *)&addr, addrlen, sni, 2, 60);
+	p = cachemgr_pass_get((struct sockaddr *)&addr, addrlen, sni);
+	ck_assert_msg(!!p, "cache did not return an entry");
+	ck_assert_msg(p->failures == 2, "cache did not return failures");
+	free(p);
+}
+END_TEST
+
+START_TEST(cache_pass_02)
+{
+	pass_t *p;
+
+	p = cachemgr_pass_get((struct sockaddr *)&addr, addrlen, sni);
+	ck_assert_msg(p == NULL, "entry was already in empty cache");
+}
+END_TEST
+
+START_TEST(cache_pass_03)
+{
+	pass_t *p;
+
+	cachemgr_pass_set((struct sockaddr *)&addr, addrlen, sni, 1, 60);
+	cachemgr_pass_del((struct sockaddr *)&addr, addrlen, sni);
+	p = cachemgr_pass_get((struct sockaddr *)&addr, addrlen, sni);
+	ck_assert_msg(p == NULL, "cache returned deleted entry");
+}
+END_TEST
+
+START_TEST(cache_pass_04)
+{
+	pass_t *p;
+
+	/* expires immediately */
+	cachemgr_pass_set((struct sockaddr *)&addr, addrlen, sni, 1, 0);
+	p = cachemgr_pass_get((struct sockaddr *)&addr, addrlen, sni);
+	ck_assert_msg(p == NULL, "cache returned expired entry");
+}
+END_TEST
+
+START_TEST(cache_pass_05)
+{
+	pass_t *p;
+
+	cachemgr_pass_set((struct sockaddr *)&addr, addrlen, sni, 1, 60);
+	p = cachemgr_pass_get((struct sockaddr *)&addr, addrlen, NULL);
+	ck_assert_msg(p == NULL, "cache returned entry without SNI");
+	p = cachemgr_pass_get((struct sockaddr *)&addr, addrlen, "www.roe.ch");
+	ck_assert_msg(p == NULL, "cache returned entry for other SNI");
+	((struct sockaddr_in *)&addr)->sin_port = htons(443);
+	p = cachemgr_pass_get((struct sockaddr *)&addr, addrlen, sni);
+	ck_assert_msg(p == NULL, "cache returned entry for other port");
+}
+END_TEST
+
+START_TEST(cache_pass_06)
+{
+	pass_t *p;
+	cache_stats_t stats;
+	char name[32];
+	size_t entries = 0;
+	int i;
+
+	cachemgr_set_pass_limit(2 * CACHE_SHARDS);
+	cache_get_stats(cachemgr_pass, &stats);
+	for (i = 0; i < 256; i++) {
+		snprintf(name, sizeof(name), "host%d.example.org", i);
+		cachemgr_pass_set((struct sockaddr *)&addr, addrlen, name, 1, 60);
+	}
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		ck_assert_msg(cachemgr_pass->shards[i].entries <= 2,
+		              "shard %d over limit", i);
+		entries += cachemgr_pass->shards[i].entries;
+	}
+	cache_get_stats(cachemgr_pass, &stats);
+	ck_assert_msg(stats.evicted == 256 - entries, "evicted mismatch");
+	p = cachemgr_pass_get((struct sockaddr *)&addr, addrlen, "host255.example.org");
+	ck_assert_msg(!!p, "most recent entry was evicted");
+	free(p);
+}
+END_TEST
+
+START_TEST(cache_pass_07)
+{
+	pass_t *p;
+
+	p = cachemgr_pass_add((struct sockaddr *)&addr, addrlen, sni, 1, 60);
+	ck_assert_msg(!!p && p->failures == 1, "first add not 1");
+	free(p);
+	p = cachemgr_pass_add((struct sockaddr *)&addr, addrlen, sni, 2, 60);
+	ck_assert_msg(!!p && p->failures == 3, "failures not added up");
+	free(p);
+	p = cachemgr_pass_get((struct sockaddr *)&addr, addrlen, sni);
+	ck_assert_msg(!!p && p->failures == 3, "cache did not return sum");
+	free(p);
+
+	/* expired records are not added to */
+	cachemgr_pass_set((struct sockaddr *)&addr, addrlen, sni, 5, 0);
+	p = cachemgr_pass_add((struct sockaddr *)&addr, addrlen, sni, 1, 60);
+	ck_assert_msg(!!p && p->failures == 1, "expired failures added");
+	free(p);
+}
+END_TEST
+
+#define PASS_THREADS 4
+#define PASS_ADDS 1000
+
+static void *
+cache_pass_add_thr(UNUSED void *arg)
+{
+	pass_t *p;
+	uintptr_t last = 0;
+
+	for (int i = 0; i < PASS_ADDS; i++) {
+		p = cachemgr_pass_add((struct sockaddr *)&addr, addrlen, sni,
+		                      1, 60);
+		if (!p)
+			return (void *)-1;
+		if (p->failures == PASS_THREADS * PASS_ADDS)
+			last = 1;
+		free(p);
+	}
+	return (void *)last;
+}
+
+START_TEST(cache_pass_08)
+{
+	pthread_t thr[PASS_THREADS];
+	pass_t *p;
+	void *rv;
+	int last = 0;
+
+	for (int i = 0; i < PASS_THREADS; i++) {
+		ck_assert_msg(!pthread_create(&thr[i], NULL, cache_pass_add_thr,
+		                              NULL), "cannot create thread");
+	}
+	for (int i = 0; i < PASS_THREADS; i++) {
+		ck_assert_msg(!pthread_join(thr[i], &rv), "cannot join thread");
+		ck_assert_msg(rv != (void *)-1, "add failed");
+		last += rv == (void *)1;
+	}
+	ck_assert_msg(last == 1, "final count not seen exactly once");
+	p = cachemgr_pass_get((struct sockaddr *)&addr, addrlen, sni);
+	ck_assert_msg(!!p && p->failures == PASS_THREADS * PASS_ADDS,
+	              "concurrent adds lost");
+	free(p);
+}
+END_TEST
+
+Suite *
+cachepass_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("cachepass");
+
+	tc = tcase_create("cache_pass");
+	tcase_add_checked_fixture(tc, cachemgr_setup, cachemgr_teardown);
+	tcase_add_test(tc, cache_pass_01);
+	tcase_add_test(tc, cache_pass_02);
+	tcase_add_test(tc, cache_pass_03);
+	tcase_add_test(tc, cache_pass_04);
+	tcase_add_test(tc, cache_pass_05);
+	tcase_add_test(tc, cache_pass_06);
+	tcase_add_test(tc, cache_pass_07);
+	tcase_add_test(tc, cache_pass_08);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,143 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2017-2025, Soner Tari <sonertari@gmail.com>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "ssl.h"
+#include "cachemgr.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <check.h>
+
+#define TESTCERT "pki/rsa.crt"
+#define TESTCERT2 "pki/server.crt"
+
+static void
+cachemgr_setup(void)
+{
+	if ((ssl_init() == -1) || (cachemgr_preinit() == -1))
+		exit(EXIT_FAILURE);
+}
+
+static void
+cachemgr_teardown(void)
+{
+	cachemgr_fini();
+	ssl_fini();
+}
+
+START_TEST(cache_snicrt_01)
+{
+	X509 *c1, *c2;
+	snicrt_t *s;
+	unsigned char fpr[SSL_X509_FPRSZ];
+
+	c1 = ssl_x509_load(TESTCERT);
+	ck_assert_msg(!!c1, "loading certificate failed");
+	c2 = ssl_x509_load(TESTCERT2);
+	ck_assert_msg(!!c2, "loading certificate failed");
+	cachemgr_snicrt_set("daniel.roe.ch", c1, c2);
+	s = cachemgr_snicrt_get("daniel.roe.ch");
+	ck_assert_msg(!!s, "cache did not return an entry");
+	ck_assert_msg(s->crt == c1, "cache did not return same pointer");
+	ck_assert_msg(ssl_x509_fingerprint_sha1(c2, fpr) == 0, "fingerprint failed");
+	ck_assert_msg(!memcmp(s->origfpr, fpr, SSL_X509_FPRSZ),
+	              "cache did not return original cert fingerprint");
+	snicrt_free(s);
+	X509_free(c1);
+	X509_free(c2);
+}
+END_TEST
+
+START_TEST(cache_snicrt_02)
+{
+	snicrt_t *s;
+
+	s = cachemgr_snicrt_get("daniel.roe.ch");
+	ck_assert_msg(s == NULL, "entry was already in empty cache");
+}
+END_TEST
+
+START_TEST(cache_snicrt_03)
+{
+	X509 *c1;
+	snicrt_t *s;
+
+	c1 = ssl_x509_load(TESTCERT);
+	ck_assert_msg(!!c1, "loading certificate failed");
+	cachemgr_snicrt_set("daniel.roe.ch", c1, c1);
+	cachemgr_snicrt_del("daniel.roe.ch");
+	s = cachemgr_snicrt_get("daniel.roe.ch");
+	ck_assert_msg(s == NULL, "cache returned deleted entry");
+	X509_free(c1);
+}
+END_TEST
+
+START_TEST(cache_snicrt_04)
+{
+	X509 *c1, *c2;
+	snicrt_t *s;
+
+	c1 = ssl_x509_load(TESTCERT);
+	ck_assert_msg(!!c1, "loading certificate failed");
+	c2 = ssl_x509_load(TESTCERT2);
+	ck_assert_msg(!!c2, "loading certificate failed");
+	cachemgr_snicrt_set("daniel.roe.ch", c1, c1);
+	cachemgr_snicrt_set("daniel.roe.ch", c2, c1);
+	s = cachemgr_snicrt_get("daniel.roe.ch");
+	ck_assert_msg(!!s, "cache did not return an entry");
+	ck_assert_msg(s->crt == c2, "cache did not replace entry");
+	snicrt_free(s);
+	s = cachemgr_snicrt_get("www.roe.ch");
+	ck_assert_msg(s == NULL, "cache returned entry for other SNI");
+	X509_free(c1);
+	X509_free(c2);
+}
+END_TEST
+
+Suite *
+cachesnicrt_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("cachesnicrt");
+
+	tc = tcase_create("cache_snicrt");
+	tcase_add_checked_fixture(tc, cachemgr_setup, cachemgr_teardown);
+	tcase_add_test(tc, cache_snicrt_01);
+	tcase_add_test(tc, cache_snicrt_02);
+	tcase_add_test(tc, cache_snicrt_03);
+	tcase_add_test(tc, cache_snicrt_04);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,141 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2017-2025, Soner Tari <sonertari@gmail.com>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "ssl.h"
+#include "cachemgr.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <check.h>
+
+#define TESTCERT "pki/rsa.crt"
+
+/* the cache only uses the identity of the conn options */
+static int conn_opts1;
+static int conn_opts2;
+
+static void
+cachemgr_setup(void)
+{
+	if ((ssl_init() == -1) || (cachemgr_preinit() == -1))
+		exit(EXIT_FAILURE);
+}
+
+static void
+cachemgr_teardown(void)
+{
+	cachemgr_fini();
+	ssl_fini();
+}
+
+static SSL_CTX *
+sslctx_new(X509 *crt)
+{
+	SSL_CTX *sslctx = SSL_CTX_new(TLS_method());
+
+	if (sslctx && SSL_CTX_use_certificate(sslctx, crt) != 1) {
+		SSL_CTX_free(sslctx);
+		return NULL;
+	}
+	return sslctx;
+}
+
+START_TEST(cache_sslctx_01)
+{
+	SSL_CTX *s1, *s2;
+	X509 *c1;
+
+	c1 = ssl_x509_load(TESTCERT);
+	ck_assert_msg(!!c1, "loading certificate failed");
+	s1 = sslctx_new(c1);
+	ck_assert_msg(!!s1, "creating SSL_CTX failed");
+	cachemgr_sslctx_set(c1, &conn_opts1, s1);
+	s2 = cachemgr_sslctx_get(c1, &conn_opts1);
+	ck_assert_msg(!!s2, "cache did not return an SSL_CTX");
+	ck_assert_msg(s2 == s1, "cache did not return same pointer");
+	SSL_CTX_free(s1);
+	SSL_CTX_free(s2);
+	X509_free(c1);
+}
+END_TEST
+
+START_TEST(cache_sslctx_02)
+{
+	SSL_CTX *s1, *s2;
+	X509 *c1;
+
+	c1 = ssl_x509_load(TESTCERT);
+	ck_assert_msg(!!c1, "loading certificate failed");
+	s1 = sslctx_new(c1);
+	ck_assert_msg(!!s1, "creating SSL_CTX failed");
+	cachemgr_sslctx_set(c1, &conn_opts1, s1);
+	s2 = cachemgr_sslctx_get(c1, &conn_opts2);
+	ck_assert_msg(s2 == NULL, "cache returned SSL_CTX of other conn opts");
+	SSL_CTX_free(s1);
+	X509_free(c1);
+}
+END_TEST
+
+START_TEST(cache_sslctx_03)
+{
+	SSL_CTX *s1, *s2;
+	X509 *c1;
+
+	c1 = ssl_x509_load(TESTCERT);
+	ck_assert_msg(!!c1, "loading certificate failed");
+	s1 = sslctx_new(c1);
+	ck_assert_msg(!!s1, "creating SSL_CTX failed");
+	cachemgr_sslctx_set(c1, &conn_opts1, s1);
+	cachemgr_sslctx_del(c1, &conn_opts1);
+	s2 = cachemgr_sslctx_get(c1, &conn_opts1);
+	ck_assert_msg(s2 == NULL, "cache returned deleted SSL_CTX");
+	SSL_CTX_free(s1);
+	X509_free(c1);
+}
+END_TEST
+
+Suite *
+cachesslctx_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("cachesslctx");
+
+	tc = tcase_create("cache_sslctx");
+	tcase_add_checked_fixture(tc, cachemgr_setup, cachemgr_teardown);
+	tcase_add_test(tc, cache_sslctx_01);
+	tcase_add_test(tc, cache_sslctx_02);
+	tcase_add_test(tc, cache_sslctx_03);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+/* vim: set noet ft=c: */
@@ -119,6 +119,105 @@ START_TEST(cache_tgcrt_04)
 }
 END_TEST
 
+START_TEST(cache_tgcrt_05)
+{
+	cert_t *c1, *c2;
+	cache_stats_t stats;
+	char cn[32];
+	int i;
+
+	c1 = cert_new_load(TESTCERT);
+	ck_assert_msg(!!c1, "loading certificate failed");
+	cache_get_stats(cachemgr_tgcrt, &stats);
+	for (i = 0; i < 256; i++) {
+		snprintf(cn, sizeof(cn), "host%d.example.org", i);
+		cachemgr_tgcrt_set(cn, c1);
+	}
+	ck_assert_msg(c1->references == 257, "refcount != 257");
+	for (i = 0; i < 256; i++) {
+		snprintf(cn, sizeof(cn), "host%d.example.org", i);
+		c2 = cachemgr_tgcrt_get(cn);
+		ck_assert_msg(c2 == c1, "cache did not return same pointer");
+		cert_free(c2);
+	}
+	cache_get_stats(cachemgr_tgcrt, &stats);
+	ck_assert_msg(stats.locks == 512, "locks != 512");
+	ck_assert_msg(stats.contended == 0, "contended != 0");
+	cache_get_stats(cachemgr_tgcrt, &stats);
+	ck_assert_msg(stats.locks == 0, "stats not reset");
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		cache_map_t map = cachemgr_tgcrt->shards[i].map;
+		cache_iter_t it;
+		int n = 0;
+
+		for (it = cachemgr_tgcrt->begin_cb(map);
+		     it != cachemgr_tgcrt->end_cb(map); it++) {
+			n += cachemgr_tgcrt->exist_cb(map, it);
+		}
+		ck_assert_msg(n > 0, "shard %d is empty", i);
+	}
+	cert_free(c1);
+}
+END_TEST
+
+START_TEST(cache_tgcrt_06)
+{
+	cert_t *c1, *c2;
+	cache_stats_t stats;
+	char cn[32];
+	size_t entries = 0;
+	int i;
+
+	c1 = cert_new_load(TESTCERT);
+	ck_assert_msg(!!c1, "loading certificate failed");
+	cache_set_limits(cachemgr_tgcrt, 2 * CACHE_SHARDS, 0);
+	cache_get_stats(cachemgr_tgcrt, &stats);
+	for (i = 0; i < 256; i++) {
+		snprintf(cn, sizeof(cn), "host%d.example.org", i);
+		cachemgr_tgcrt_set(cn, c1);
+	}
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		ck_assert_msg(cachemgr_tgcrt->shards[i].entries <= 2,
+		              "shard %d over limit", i);
+		entries += cachemgr_tgcrt->shards[i].entries;
+	}
+	ck_assert_msg(c1->references == entries + 1, "refcount mismatch");
+	cache_get_stats(cachemgr_tgcrt, &stats);
+	ck_assert_msg(stats.evicted == 256 - entries, "evicted mismatch");
+	c2 = cachemgr_tgcrt_get("host255.example.org");
+	ck_assert_msg(c2 == c1, "most recent entry was evicted");
+	cert_free(c2);
+	cert_free(c1);
+}
+END_TEST
+
+START_TEST(cache_tgcrt_07)
+{
+	cert_t *c1, *c2;
+	char cn[32];
+	int i;
+
+	c1 = cert_new_load(TESTCERT);
+	ck_assert_msg(!!c1, "loading certificate failed");
+	/* keys are counted as strlen + 1 bytes, allow one per shard */
+	cache_set_limits(cachemgr_tgcrt, 0, CACHE_SHARDS * 20);
+	for (i = 0; i < 256; i++) {
+		snprintf(cn, sizeof(cn), "host%03d.example.org", i);
+		cachemgr_tgcrt_set(cn, c1);
+	}
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		ck_assert_msg(cachemgr_tgcrt->shards[i].bytes <= 20,
+		              "shard %d over limit", i);
+		ck_assert_msg(cachemgr_tgcrt->shards[i].entries <= 1,
+		              "shard %d over limit", i);
+	}
+	c2 = cachemgr_tgcrt_get("host255.example.org");
+	ck_assert_msg(c2 == c1, "most recent entry was evicted");
+	cert_free(c2);
+	cert_free(c1);
+}
+END_TEST
+
 Suite *
 cachetgcrt_suite(void)
 {
@@ -133,6 +232,9 @@ cachetgcrt_suite(void)
 	tcase_add_test(tc, cache_tgcrt_02);
 	tcase_add_test(tc, cache_tgcrt_03);
 	tcase_add_test(tc, cache_tgcrt_04);
+	tcase_add_test(tc, cache_tgcrt_05);
+	tcase_add_test(tc, cache_tgcrt_06);
+	tcase_add_test(tc, cache_tgcrt_07);
 	suite_add_tcase(s, tc);
 
 	return s;
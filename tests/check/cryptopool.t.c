@@ -0,0 +1,172 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2017-2025, Soner Tari <sonertari@gmail.com>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "cryptopool.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <event2/thread.h>
+
+#include <check.h>
+
+typedef struct test_job {
+	cryptopool_job_t job;
+	int in;
+	int out;
+} test_job_t;
+
+static struct event_base *evbase;
+static int done_count;
+static int canceled_count;
+
+static void
+test_work(cryptopool_job_t *job)
+{
+	test_job_t *tj = (test_job_t *)job;
+	tj->out = tj->in * 2;
+}
+
+static void
+test_done(cryptopool_job_t *job, int canceled)
+{
+	test_job_t *tj = (test_job_t *)job;
+
+	if (canceled) {
+		canceled_count++;
+		return;
+	}
+	if (tj->out == tj->in * 2) {
+		done_count++;
+	}
+	if (done_count == 10) {
+		event_base_loopbreak(evbase);
+	}
+}
+
+START_TEST(cryptopool_01)
+{
+	cryptopool_t *pool;
+	cryptopool_compq_t *compq;
+	cryptopool_stats_t stats;
+	test_job_t jobs[10];
+	struct timeval timeout = {5, 0};
+
+	evthread_use_pthreads();
+	evbase = event_base_new();
+	ck_assert_msg(!!evbase, "no event base");
+	pool = cryptopool_new(2, 16);
+	ck_assert_msg(!!pool, "no pool");
+	compq = cryptopool_compq_new(evbase);
+	ck_assert_msg(!!compq, "no compq");
+	ck_assert_msg(cryptopool_start(pool) == 0, "pool not started");
+
+	done_count = 0;
+	memset(jobs, 0, sizeof(jobs));
+	for (int i = 0; i < 10; i++) {
+		jobs[i].job.work = test_work;
+		jobs[i].job.done = test_done;
+		jobs[i].in = i + 1;
+		ck_assert_msg(cryptopool_submit(pool, &jobs[i].job, compq) == 0, "job not submitted");
+	}
+
+	event_base_loopexit(evbase, &timeout);
+	event_base_dispatch(evbase);
+	ck_assert_msg(done_count == 10, "jobs not done");
+
+	cryptopool_get_stats(pool, &stats);
+	ck_assert_msg(stats.depth == 0, "wrong depth");
+	ck_assert_msg(stats.max_depth >= 1 && stats.max_depth <= 10, "wrong max depth");
+	ck_assert_msg(stats.jobs == 10, "wrong number of jobs");
+	ck_assert_msg(stats.rejected == 0, "wrong number of rejected jobs");
+	ck_assert_msg(stats.max_latency * stats.jobs >= stats.latency_sum, "wrong latency");
+
+	cryptopool_get_stats(pool, &stats);
+	ck_assert_msg(stats.jobs == 0, "stats not reset");
+
+	cryptopool_free(pool);
+	cryptopool_compq_free(compq);
+	event_base_free(evbase);
+}
+END_TEST
+
+START_TEST(cryptopool_02)
+{
+	cryptopool_t *pool;
+	cryptopool_compq_t *compq;
+	cryptopool_stats_t stats;
+	test_job_t jobs[3];
+
+	evthread_use_pthreads();
+	evbase = event_base_new();
+	ck_assert_msg(!!evbase, "no event base");
+	pool = cryptopool_new(1, 2);
+	ck_assert_msg(!!pool, "no pool");
+	compq = cryptopool_compq_new(evbase);
+	ck_assert_msg(!!compq, "no compq");
+
+	canceled_count = 0;
+	memset(jobs, 0, sizeof(jobs));
+	for (int i = 0; i < 3; i++) {
+		jobs[i].job.work = test_work;
+		jobs[i].job.done = test_done;
+	}
+	// Not started yet, so the queue fills up
+	ck_assert_msg(cryptopool_submit(pool, &jobs[0].job, compq) == 0, "job 0 not submitted");
+	ck_assert_msg(cryptopool_submit(pool, &jobs[1].job, compq) == 0, "job 1 not submitted");
+	ck_assert_msg(cryptopool_submit(pool, &jobs[2].job, compq) == -1, "job 2 submitted to full queue");
+
+	cryptopool_get_stats(pool, &stats);
+	ck_assert_msg(stats.depth == 2, "wrong depth");
+	ck_assert_msg(stats.rejected == 1, "wrong number of rejected jobs");
+
+	// Queued jobs are run on free, and canceled on compq free
+	ck_assert_msg(cryptopool_start(pool) == 0, "pool not started");
+	cryptopool_free(pool);
+	cryptopool_compq_free(compq);
+	ck_assert_msg(canceled_count == 2, "jobs not canceled");
+	event_base_free(evbase);
+}
+END_TEST
+
+Suite *
+cryptopool_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("cryptopool");
+
+	tc = tcase_create("cryptopool");
+	tcase_add_test(tc, cryptopool_01);
+	tcase_add_test(tc, cryptopool_02);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+/* vim: set noet ft=c: */
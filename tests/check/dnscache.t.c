@@ -0,0 +1,272 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2017-2025, Soner Tari <sonertari@gmail.com>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "dnscache.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <event2/event.h>
+#include <event2/dns.h>
+#include <event2/dns_struct.h>
+#include <event2/util.h>
+
+#include <check.h>
+
+static struct event_base *evbase;
+static struct evdns_base *dnsbase;
+static struct evdns_server_port *port;
+static evutil_socket_t sock;
+static int queries;
+static int answers;
+static int errors;
+static struct in_addr answer;
+
+/*
+ * Answer A queries for good.test, NXDOMAIN for everything else.
+ */
+static void
+test_server_cb(struct evdns_server_request *req, UNUSED void *arg)
+{
+	struct in_addr a;
+	int err = DNS_ERR_NOTEXIST;
+
+	queries++;
+	if (req->nquestions == 1 && req->questions[0]->type == EVDNS_TYPE_A &&
+	    !strcasecmp(req->questions[0]->name, "good.test")) {
+		// The case of the name is randomized by the resolver, reply in kind
+		inet_pton(AF_INET, "10.0.0.1", &a);
+		evdns_server_request_add_a_reply(req, req->questions[0]->name, 1, &a, 300);
+		err = DNS_ERR_NONE;
+	}
+	evdns_server_request_respond(req, err);
+}
+
+static void
+test_resolve_cb(int errcode, const struct sockaddr *addr, socklen_t addrlen, UNUSED void *arg)
+{
+	if (errcode) {
+		errors++;
+	} else if (addr->sa_family == AF_INET && addrlen == sizeof(struct sockaddr_in)) {
+		answer = ((const struct sockaddr_in *)addr)->sin_addr;
+		answers++;
+	}
+	if (answers + errors >= *(int *)arg) {
+		event_base_loopbreak(evbase);
+	}
+}
+
+static void
+dnscache_setup(void)
+{
+	struct sockaddr_in sin;
+	socklen_t sinlen = sizeof(sin);
+	char ns[32];
+
+	evbase = event_base_new();
+	dnsbase = evdns_base_new(evbase, 0);
+
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	bind(sock, (struct sockaddr *)&sin, sizeof(sin));
+	getsockname(sock, (struct sockaddr *)&sin, &sinlen);
+	evutil_make_socket_nonblocking(sock);
+	port = evdns_add_server_port_with_base(evbase, sock, 0, test_server_cb, NULL);
+
+	snprintf(ns, sizeof(ns), "127.0.0.1:%d", ntohs(sin.sin_port));
+	evdns_base_nameserver_ip_add(dnsbase, ns);
+
+	queries = answers = errors = 0;
+	memset(&answer, 0, sizeof(answer));
+}
+
+static void
+dnscache_teardown(void)
+{
+	evdns_base_free(dnsbase, 0);
+	evdns_close_server_port(port);
+	evutil_closesocket(sock);
+	event_base_free(evbase);
+}
+
+static void
+dnscache_dispatch(void)
+{
+	struct timeval timeout = {5, 0};
+
+	event_base_loopexit(evbase, &timeout);
+	event_base_dispatch(evbase);
+}
+
+START_TEST(dnscache_01)
+{
+	dnscache_t *cache;
+	dnscache_stats_t stats;
+	int expected = 1;
+
+	cache = dnscache_new(evbase, dnsbase);
+	ck_assert_msg(!!cache, "no cache");
+
+	ck_assert_msg(dnscache_resolve(cache, "192.0.2.1", AF_INET, test_resolve_cb, &expected) == 0, "resolve failed");
+	ck_assert_msg(answers == 1, "numeric name not answered immediately");
+	ck_assert_msg(answer.s_addr == inet_addr("192.0.2.1"), "wrong address");
+	ck_assert_msg(queries == 0, "numeric name queried");
+
+	ck_assert_msg(dnscache_resolve(cache, "localhost", AF_INET, test_resolve_cb, &expected) == 0, "resolve failed");
+	ck_assert_msg(answers == 2, "hosts name not answered immediately");
+	ck_assert_msg(answer.s_addr == htonl(INADDR_LOOPBACK), "wrong hosts address");
+	ck_assert_msg(queries == 0, "hosts name queried");
+
+	dnscache_get_stats(cache, &stats);
+	ck_assert_msg(stats.entries == 0, "numeric or hosts name cached");
+	ck_assert_msg(stats.misses == 0 && stats.hits == 0, "numeric or hosts name counted");
+
+	dnscache_free(cache);
+}
+END_TEST
+
+START_TEST(dnscache_02)
+{
+	dnscache_t *cache;
+	dnscache_stats_t stats;
+	int expected = 2;
+
+	cache = dnscache_new(evbase, dnsbase);
+	ck_assert_msg(!!cache, "no cache");
+
+	ck_assert_msg(dnscache_resolve(cache, "good.test", AF_INET, test_resolve_cb, &expected) == 0, "resolve failed");
+	ck_assert_msg(dnscache_resolve(cache, "good.test", AF_INET, test_resolve_cb, &expected) == 0, "resolve failed");
+	ck_assert_msg(answers == 0, "answered before query");
+	dnscache_dispatch();
+	ck_assert_msg(answers == 2, "waiters not answered");
+	ck_assert_msg(queries == 1, "in-flight queries not coalesced");
+	ck_assert_msg(answer.s_addr == inet_addr("10.0.0.1"), "wrong address");
+
+	expected = 3;
+	ck_assert_msg(dnscache_resolve(cache, "good.test", AF_INET, test_resolve_cb, &expected) == 0, "resolve failed");
+	ck_assert_msg(answers == 3, "cached answer not returned immediately");
+	ck_assert_msg(queries == 1, "cached name queried");
+
+	dnscache_get_stats(cache, &stats);
+	ck_assert_msg(stats.misses == 1, "wrong number of misses");
+	ck_assert_msg(stats.coalesced == 1, "wrong number of coalesced lookups");
+	ck_assert_msg(stats.hits == 1, "wrong number of hits");
+	ck_assert_msg(stats.entries == 1, "wrong number of entries");
+
+	dnscache_get_stats(cache, &stats);
+	ck_assert_msg(stats.hits == 0 && stats.misses == 0, "stats not reset");
+	ck_assert_msg(stats.entries == 1, "entries reset");
+
+	dnscache_free(cache);
+}
+END_TEST
+
+START_TEST(dnscache_03)
+{
+	dnscache_t *cache;
+	dnscache_stats_t stats;
+	int expected = 1;
+
+	cache = dnscache_new(evbase, dnsbase);
+	ck_assert_msg(!!cache, "no cache");
+
+	ck_assert_msg(dnscache_resolve(cache, "bad.test", AF_INET, test_resolve_cb, &expected) == 0, "resolve failed");
+	dnscache_dispatch();
+	ck_assert_msg(errors == 1, "nonexistent name resolved");
+	ck_assert_msg(queries == 1, "wrong number of queries");
+
+	expected = 2;
+	ck_assert_msg(dnscache_resolve(cache, "bad.test", AF_INET, test_resolve_cb, &expected) == 0, "resolve failed");
+	ck_assert_msg(errors == 2, "negative answer not returned immediately");
+	ck_assert_msg(queries == 1, "negatively cached name queried");
+
+	dnscache_get_stats(cache, &stats);
+	ck_assert_msg(stats.neg_hits == 1, "wrong number of negative hits");
+	ck_assert_msg(stats.hits == 0, "wrong number of hits");
+
+	dnscache_free(cache);
+}
+END_TEST
+
+START_TEST(dnscache_04)
+{
+	dnscache_t *cache;
+	int expected = 1;
+
+	cache = dnscache_new(evbase, dnsbase);
+	ck_assert_msg(!!cache, "no cache");
+
+	ck_assert_msg(dnscache_resolve(cache, "good.test", AF_UNIX, test_resolve_cb, &expected) == -1, "unsupported family accepted");
+	ck_assert_msg(answers == 0 && errors == 0, "callback called on error");
+
+	dnscache_free(cache);
+}
+END_TEST
+
+START_TEST(dnscache_05)
+{
+	dnscache_t *cache;
+	int expected = 1;
+
+	cache = dnscache_new(evbase, dnsbase);
+	ck_assert_msg(!!cache, "no cache");
+
+	// Entries with queries in flight are freed with the cache without calling back
+	ck_assert_msg(dnscache_resolve(cache, "good.test", AF_INET, test_resolve_cb, &expected) == 0, "resolve failed");
+	evdns_base_free(dnsbase, 0);
+	dnsbase = evdns_base_new(evbase, 0);
+	dnscache_free(cache);
+	ck_assert_msg(answers == 0 && errors == 0, "callback called on free");
+}
+END_TEST
+
+Suite *
+dnscache_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("dnscache");
+
+	tc = tcase_create("dnscache_resolve");
+	tcase_add_checked_fixture(tc, dnscache_setup, dnscache_teardown);
+	tcase_add_test(tc, dnscache_01);
+	tcase_add_test(tc, dnscache_02);
+	tcase_add_test(tc, dnscache_03);
+	tcase_add_test(tc, dnscache_04);
+	tcase_add_test(tc, dnscache_05);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+/* vim: set noet ft=c: */
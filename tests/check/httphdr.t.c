@@ -0,0 +1,219 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2017-2025, Soner Tari <sonertari@gmail.com>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "httphdr.h"
+
+#include <string.h>
+#include <event2/buffer.h>
+
+#include <check.h>
+
+static const char *req01 =
+	"GET / HTTP/1.1\r\n"
+	"Host: example.com\r\n"
+	"Connection: keep-alive\n"
+	"Upgrade: h2c\r\n"
+	"\r\n"
+	"body";
+
+static const char *filtered01 =
+	"GET / HTTP/1.1\r\n"
+	"Host: example.com\r\n"
+	"Connection: close\r\n"
+	"\r\n";
+
+typedef struct test_arg {
+	int lines;
+	char host[32];
+} test_arg_t;
+
+static int
+test_linecb(httphdr_line_t *line, void *arg)
+{
+	test_arg_t *a = arg;
+
+	a->lines++;
+	switch (line->id) {
+	case HTTPHDR_HOST:
+		if (line->value_len < sizeof(a->host)) {
+			memcpy(a->host, line->value, line->value_len);
+			a->host[line->value_len] = '\0';
+		}
+		return HTTPHDR_KEEP;
+	case HTTPHDR_CONNECTION:
+		line->insert = "Connection: close";
+		return HTTPHDR_DROP;
+	case HTTPHDR_UPGRADE:
+		return HTTPHDR_DROP;
+	default:
+		return line->len ? HTTPHDR_KEEP : HTTPHDR_DONE;
+	}
+}
+
+static char *
+test_evbuffer_str(struct evbuffer *buf)
+{
+	size_t sz = evbuffer_get_length(buf);
+	char *s = malloc(sz + 1);
+	evbuffer_copyout(buf, s, sz);
+	s[sz] = '\0';
+	return s;
+}
+
+START_TEST(httphdr_lookup_01)
+{
+	ck_assert_msg(httphdr_lookup("Host", 4) == HTTPHDR_HOST, "Host");
+	ck_assert_msg(httphdr_lookup("hOST", 4) == HTTPHDR_HOST, "hOST");
+	ck_assert_msg(httphdr_lookup("content-type", 12) == HTTPHDR_CONTENT_TYPE, "content-type");
+	ck_assert_msg(httphdr_lookup("Content-Length", 14) == HTTPHDR_CONTENT_LENGTH, "Content-Length");
+	ck_assert_msg(httphdr_lookup("Transfer-Encoding", 17) == HTTPHDR_TRANSFER_ENCODING, "Transfer-Encoding");
+	ck_assert_msg(httphdr_lookup("CONNECTION", 10) == HTTPHDR_CONNECTION, "CONNECTION");
+	ck_assert_msg(httphdr_lookup("Keep-Alive", 10) == HTTPHDR_KEEP_ALIVE, "Keep-Alive");
+	ck_assert_msg(httphdr_lookup("Upgrade", 7) == HTTPHDR_UPGRADE, "Upgrade");
+	ck_assert_msg(httphdr_lookup("Accept-Encoding", 15) == HTTPHDR_ACCEPT_ENCODING, "Accept-Encoding");
+	ck_assert_msg(httphdr_lookup("Referer", 7) == HTTPHDR_REFERER, "Referer");
+	ck_assert_msg(httphdr_lookup("Via", 3) == HTTPHDR_VIA, "Via");
+	ck_assert_msg(httphdr_lookup("X-Forwarded-For", 15) == HTTPHDR_X_FORWARDED_FOR, "X-Forwarded-For");
+	ck_assert_msg(httphdr_lookup("Public-Key-Pins", 15) == HTTPHDR_PUBLIC_KEY_PINS, "Public-Key-Pins");
+	ck_assert_msg(httphdr_lookup("Public-Key-Pins-Report-Only", 27) == HTTPHDR_PUBLIC_KEY_PINS_REPORT_ONLY, "Public-Key-Pins-Report-Only");
+	ck_assert_msg(httphdr_lookup("Strict-Transport-Security", 25) == HTTPHDR_STRICT_TRANSPORT_SECURITY, "Strict-Transport-Security");
+	ck_assert_msg(httphdr_lookup("Expect-CT", 9) == HTTPHDR_EXPECT_CT, "Expect-CT");
+	ck_assert_msg(httphdr_lookup("Alternate-Protocol", 18) == HTTPHDR_ALTERNATE_PROTOCOL, "Alternate-Protocol");
+	ck_assert_msg(httphdr_lookup("SSLproxy", 8) == HTTPHDR_SSLPROXY, "SSLproxy");
+}
+END_TEST
+
+START_TEST(httphdr_lookup_02)
+{
+	ck_assert_msg(httphdr_lookup("", 0) == HTTPHDR_UNKNOWN, "empty");
+	ck_assert_msg(httphdr_lookup("Hos", 3) == HTTPHDR_UNKNOWN, "Hos");
+	ck_assert_msg(httphdr_lookup("Hosts", 5) == HTTPHDR_UNKNOWN, "Hosts");
+	ck_assert_msg(httphdr_lookup("Hxst", 4) == HTTPHDR_UNKNOWN, "Hxst");
+	ck_assert_msg(httphdr_lookup("Accept", 6) == HTTPHDR_UNKNOWN, "Accept");
+	ck_assert_msg(httphdr_lookup("Host ", 5) == HTTPHDR_UNKNOWN, "Host ");
+}
+END_TEST
+
+START_TEST(httphdr_filter_01)
+{
+	struct evbuffer *in = evbuffer_new();
+	struct evbuffer *out = evbuffer_new();
+	httphdr_parser_t parser = {0};
+	test_arg_t arg = {0};
+	char *s;
+
+	evbuffer_add(in, req01, strlen(req01));
+	ck_assert_msg(httphdr_filter(in, out, &parser, test_linecb, &arg) == 1, "header not complete");
+	ck_assert_msg(arg.lines == 5, "wrong number of lines");
+	ck_assert_msg(!strcmp(arg.host, "example.com"), "wrong host value");
+	s = test_evbuffer_str(out);
+	ck_assert_msg(!strcmp(s, filtered01), "wrong filtered header");
+	free(s);
+	s = test_evbuffer_str(in);
+	ck_assert_msg(!strcmp(s, "body"), "body not left in inbuf");
+	free(s);
+	evbuffer_free(in);
+	evbuffer_free(out);
+}
+END_TEST
+
+START_TEST(httphdr_filter_02)
+{
+	struct evbuffer *in = evbuffer_new();
+	struct evbuffer *out = evbuffer_new();
+	httphdr_parser_t parser = {0};
+	test_arg_t arg = {0};
+	size_t i, len = strlen(req01) - 4;
+	int rv = 0;
+	char *s;
+
+	/* feed one byte at a time, lines must be passed once when complete */
+	for (i = 0; i < len; i++) {
+		ck_assert_msg(rv == 0, "header complete too early");
+		evbuffer_add(in, req01 + i, 1);
+		rv = httphdr_filter(in, out, &parser, test_linecb, &arg);
+		ck_assert_msg(parser.scanned == evbuffer_get_length(in), "wrong scanned size");
+	}
+	ck_assert_msg(rv == 1, "header not complete");
+	ck_assert_msg(arg.lines == 5, "wrong number of lines");
+	s = test_evbuffer_str(out);
+	ck_assert_msg(!strcmp(s, filtered01), "wrong filtered header");
+	free(s);
+	evbuffer_free(in);
+	evbuffer_free(out);
+}
+END_TEST
+
+START_TEST(httphdr_filter_03)
+{
+	struct evbuffer *in = evbuffer_new();
+	struct evbuffer *out = evbuffer_new();
+	httphdr_parser_t parser = {0};
+	test_arg_t arg = {0};
+	char *s;
+
+	/* lines and header names spanning segments */
+	evbuffer_add_reference(in, "GET / HTTP/1.1\r\nHo", 18, NULL, NULL);
+	evbuffer_add_reference(in, "st: exam", 8, NULL, NULL);
+	evbuffer_add_reference(in, "ple.com\r\nConnection: keep-alive\r", 32, NULL, NULL);
+	evbuffer_add_reference(in, "\n\r\n", 3, NULL, NULL);
+	ck_assert_msg(httphdr_filter(in, out, &parser, test_linecb, &arg) == 1, "header not complete");
+	ck_assert_msg(arg.lines == 4, "wrong number of lines");
+	ck_assert_msg(!strcmp(arg.host, "example.com"), "wrong host value");
+	s = test_evbuffer_str(out);
+	ck_assert_msg(!strcmp(s, filtered01), "wrong filtered header");
+	free(s);
+	ck_assert_msg(evbuffer_get_length(in) == 0, "data left in inbuf");
+	evbuffer_free(in);
+	evbuffer_free(out);
+}
+END_TEST
+
+Suite *
+httphdr_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("httphdr");
+
+	tc = tcase_create("httphdr_lookup");
+	tcase_add_test(tc, httphdr_lookup_01);
+	tcase_add_test(tc, httphdr_lookup_02);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("httphdr_filter");
+	tcase_add_test(tc, httphdr_filter_01);
+	tcase_add_test(tc, httphdr_filter_02);
+	tcase_add_test(tc, httphdr_filter_03);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+/* vim: set noet ft=c: */
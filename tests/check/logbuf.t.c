@@ -48,6 +48,66 @@ START_TEST(logbuf_make_contiguous_01)
 }
 END_TEST
 
+START_TEST(logbuf_new_ref_01)
+{
+	logbuf_t *lb, *lbref;
+
+	lb = logbuf_new_shared(9, NULL);
+	ck_assert_msg(!!lb, "logbuf_new_shared failed");
+	memcpy(lb->buf, "123456789", 9);
+	lbref = logbuf_new_ref(lb);
+	ck_assert_msg(!!lbref, "logbuf_new_ref failed");
+	ck_assert_msg(lbref->buf == lb->buf, "buffer copied");
+	ck_assert_msg(logbuf_size(lbref) == 9, "buffer size incorrect");
+	logbuf_free(lb);
+	ck_assert_msg(!memcmp(lbref->buf, "123456789", 9), "buffer value incorrect");
+	logbuf_free(lbref);
+}
+END_TEST
+
+START_TEST(logbuf_new_ref_02)
+{
+	logbuf_t *lb, *lbref;
+
+	lb = logbuf_new_shared(3, NULL);
+	ck_assert_msg(!!lb, "logbuf_new_shared failed");
+	memcpy(lb->buf, "789", 3);
+	lb = logbuf_new_printf(lb, "%s", "456");
+	lbref = logbuf_new_ref(lb);
+	ck_assert_msg(!!lbref, "logbuf_new_ref failed");
+	ck_assert_msg(lbref->buf != lb->buf, "private buffer not copied");
+	ck_assert_msg(lbref->next->buf == lb->next->buf, "shared buffer copied");
+	lbref = logbuf_make_contiguous(lbref);
+	ck_assert_msg(!!lbref, "logbuf_make_contiguous failed");
+	ck_assert_msg(!memcmp(lbref->buf, "456789", 6), "buffer value incorrect");
+	lb = logbuf_make_contiguous(lb);
+	ck_assert_msg(!!lb, "logbuf_make_contiguous failed");
+	ck_assert_msg(!memcmp(lb->buf, "456789", 6), "buffer value incorrect");
+	logbuf_free(lbref);
+	logbuf_free(lb);
+}
+END_TEST
+
+START_TEST(logbuf_make_contiguous_02)
+{
+	logbuf_t *lb, *lbref;
+
+	lb = logbuf_new_shared(3, NULL);
+	ck_assert_msg(!!lb, "logbuf_new_shared failed");
+	memcpy(lb->buf, "456", 3);
+	lbref = logbuf_new_ref(lb);
+	ck_assert_msg(!!lbref, "logbuf_new_ref failed");
+	lbref->next = logbuf_new_printf(NULL, "%s", "789");
+	lbref = logbuf_make_contiguous(lbref);
+	ck_assert_msg(!!lbref, "logbuf_make_contiguous failed");
+	ck_assert_msg(lbref->buf != lb->buf, "shared buffer modified");
+	ck_assert_msg(!memcmp(lbref->buf, "456789", 6), "buffer value incorrect");
+	ck_assert_msg(!memcmp(lb->buf, "456", 3), "shared buffer value incorrect");
+	logbuf_free(lbref);
+	logbuf_free(lb);
+}
+END_TEST
+
 Suite *
 logbuf_suite(void)
 {
@@ -58,6 +118,9 @@ logbuf_suite(void)
 
 	tc = tcase_create("");
 	tcase_add_test(tc, logbuf_make_contiguous_01);
+	tcase_add_test(tc, logbuf_make_contiguous_02);
+	tcase_add_test(tc, logbuf_new_ref_01);
+	tcase_add_test(tc, logbuf_new_ref_02);
 	suite_add_tcase(s, tc);
 
 	return s;
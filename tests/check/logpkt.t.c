@@ -0,0 +1,420 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2017-2025, Soner Tari <sonertari@gmail.com>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "logpkt.h"
+
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <check.h>
+
+#define ETHER_HDR_LEN	14
+#define IP4_HDR_LEN	20
+#define TCP_HDR_LEN	20
+#define PCAP_FILE_HDR_LEN	24
+#define PCAP_REC_HDR_LEN	16
+#define PCAPNG_SHB_LEN	28
+#define PCAPNG_IDB_LEN	20
+#define PCAPNG_EPB_HDR_LEN	28
+
+/* SYN handshake, two odd sized payloads with their ACKs, FIN handshake */
+#define PAYLOAD1	"abc"
+#define PAYLOAD2	"defgh"
+#define NPKTS		10
+
+static const uint8_t src_ether[ETHER_ADDR_LEN] = {2, 0, 0, 0, 0, 1};
+static const uint8_t dst_ether[ETHER_ADDR_LEN] = {2, 0, 0, 0, 0, 2};
+static char template[] = "/tmp/sslproxy.test.XXXXXX";
+static char *fn;
+static int fd;
+
+static void
+logpkt_setup(void)
+{
+	fn = strdup(template);
+	if (!fn)
+		exit(EXIT_FAILURE);
+	fd = mkstemp(fn);
+	if (fd == -1)
+		exit(EXIT_FAILURE);
+}
+
+static void
+logpkt_teardown(void)
+{
+	close(fd);
+	unlink(fn);
+	free(fn);
+}
+
+static uint32_t
+logpkt_get32(const uint8_t *p)
+{
+	uint32_t u;
+
+	memcpy(&u, p, sizeof(u));
+	return u;
+}
+
+/*
+ * Write a short conn with two odd sized payloads to fd in format and return
+ * the contents of the file in a newly allocated buffer of size *sz.
+ */
+static uint8_t *
+logpkt_write_conn(int format, size_t *sz)
+{
+	logpkt_ctx_t ctx;
+	struct sockaddr_in src, dst;
+	struct stat st;
+	uint8_t *buf;
+
+	memset(&src, 0, sizeof(src));
+	src.sin_family = AF_INET;
+	src.sin_addr.s_addr = htonl(0x7f000001);
+	src.sin_port = htons(40000);
+	memcpy(&dst, &src, sizeof(dst));
+	dst.sin_port = htons(443);
+
+	ck_assert_msg(logpkt_pcap_open_fd(fd, format) == 0, "open_fd failed");
+	logpkt_ctx_init(&ctx, NULL, 0, format, src_ether, dst_ether,
+	                (struct sockaddr *)&src, sizeof(src),
+	                (struct sockaddr *)&dst, sizeof(dst));
+	ck_assert_msg(logpkt_write_payload(&ctx, fd, LOGPKT_REQUEST,
+	                                   (const uint8_t *)PAYLOAD1,
+	                                   strlen(PAYLOAD1)) == 0,
+	              "write_payload failed");
+	ck_assert_msg(logpkt_write_payload(&ctx, fd, LOGPKT_RESPONSE,
+	                                   (const uint8_t *)PAYLOAD2,
+	                                   strlen(PAYLOAD2)) == 0,
+	              "write_payload failed");
+	ck_assert_msg(ctx.wlen > 0, "records not buffered");
+	ck_assert_msg(logpkt_write_close(&ctx, fd, LOGPKT_REQUEST) == 0,
+	              "write_close failed");
+	ck_assert_msg(!ctx.wbuf && !ctx.wlen, "buffer not released");
+
+	ck_assert_msg(fstat(fd, &st) == 0, "fstat failed");
+	*sz = st.st_size;
+	buf = malloc(*sz);
+	ck_assert_msg(!!buf, "malloc failed");
+	ck_assert_msg(pread(fd, buf, *sz, 0) == (ssize_t)*sz, "pread failed");
+	return buf;
+}
+
+/*
+ * Return the payload length of the frame of the given size.
+ */
+static size_t
+logpkt_frame_payload(size_t framesz)
+{
+	ck_assert_msg(framesz >= ETHER_HDR_LEN + IP4_HDR_LEN + TCP_HDR_LEN,
+	              "frame too short");
+	return framesz - ETHER_HDR_LEN - IP4_HDR_LEN - TCP_HDR_LEN;
+}
+
+START_TEST(logpkt_pcap_01)
+{
+	uint8_t *buf, *p;
+	size_t sz, incl_len, payloads = 0;
+	int n = 0;
+
+	buf = logpkt_write_conn(LOGPKT_FORMAT_PCAP, &sz);
+	ck_assert_msg(sz > PCAP_FILE_HDR_LEN, "file too short");
+	ck_assert_msg(logpkt_get32(buf) == 0xa1b2c3d4, "wrong magic");
+
+	/* records follow each other without padding */
+	p = buf + PCAP_FILE_HDR_LEN;
+	while (p < buf + sz) {
+		ck_assert_msg(p + PCAP_REC_HDR_LEN <= buf + sz,
+		              "truncated record header");
+		incl_len = logpkt_get32(p + 8);
+		ck_assert_msg(incl_len == logpkt_get32(p + 12),
+		              "incl_len != orig_len");
+		ck_assert_msg(p + PCAP_REC_HDR_LEN + incl_len <= buf + sz,
+		              "truncated record");
+		payloads += logpkt_frame_payload(incl_len);
+		p += PCAP_REC_HDR_LEN + incl_len;
+		n++;
+	}
+	ck_assert_msg(p == buf + sz, "trailing garbage");
+	ck_assert_msg(n == NPKTS, "wrong number of records");
+	ck_assert_msg(payloads == strlen(PAYLOAD1) + strlen(PAYLOAD2),
+	              "wrong payload length");
+	ck_assert_msg(!!memmem(buf, sz, PAYLOAD1, strlen(PAYLOAD1)),
+	              "payload 1 not found");
+	ck_assert_msg(!!memmem(buf, sz, PAYLOAD2, strlen(PAYLOAD2)),
+	              "payload 2 not found");
+	free(buf);
+}
+END_TEST
+
+START_TEST(logpkt_pcapng_01)
+{
+	uint8_t *buf, *p;
+	size_t sz, len, cap_len, payloads = 0;
+	int n = 0;
+
+	buf = logpkt_write_conn(LOGPKT_FORMAT_PCAPNG, &sz);
+	ck_assert_msg(sz > PCAPNG_SHB_LEN + PCAPNG_IDB_LEN, "file too short");
+
+	/* section header block */
+	ck_assert_msg(logpkt_get32(buf) == 0x0a0d0d0a, "wrong SHB type");
+	ck_assert_msg(logpkt_get32(buf + 4) == PCAPNG_SHB_LEN,
+	              "wrong SHB length");
+	ck_assert_msg(logpkt_get32(buf + 8) == 0x1a2b3c4d,
+	              "wrong byte order magic");
+	ck_assert_msg(logpkt_get32(buf + PCAPNG_SHB_LEN - 4) == PCAPNG_SHB_LEN,
+	              "wrong SHB trailing length");
+
+	/* interface description block */
+	p = buf + PCAPNG_SHB_LEN;
+	ck_assert_msg(logpkt_get32(p) == 1, "wrong IDB type");
+	ck_assert_msg(logpkt_get32(p + 4) == PCAPNG_IDB_LEN,
+	              "wrong IDB length");
+	ck_assert_msg(logpkt_get32(p + PCAPNG_IDB_LEN - 4) == PCAPNG_IDB_LEN,
+	              "wrong IDB trailing length");
+
+	/* enhanced packet blocks, padded to 32 bits */
+	p += PCAPNG_IDB_LEN;
+	while (p < buf + sz) {
+		ck_assert_msg(p + PCAPNG_EPB_HDR_LEN <= buf + sz,
+		              "truncated EPB header");
+		ck_assert_msg(logpkt_get32(p) == 6, "wrong EPB type");
+		len = logpkt_get32(p + 4);
+		cap_len = logpkt_get32(p + 20);
+		ck_assert_msg(cap_len == logpkt_get32(p + 24),
+		              "cap_len != orig_len");
+		ck_assert_msg(len % 4 == 0, "EPB not padded to 32 bits");
+		ck_assert_msg(len == ((PCAPNG_EPB_HDR_LEN + cap_len + 3) & ~3U)
+		                     + 4, "wrong EPB length");
+		ck_assert_msg(p + len <= buf + sz, "truncated EPB");
+		ck_assert_msg(logpkt_get32(p + len - 4) == len,
+		              "wrong EPB trailing length");
+		for (size_t i = PCAPNG_EPB_HDR_LEN + cap_len; i < len - 4; i++) {
+			ck_assert_msg(p[i] == 0, "EPB padding not zero");
+		}
+		payloads += logpkt_frame_payload(cap_len);
+		p += len;
+		n++;
+	}
+	ck_assert_msg(p == buf + sz, "trailing garbage");
+	ck_assert_msg(n == NPKTS, "wrong number of EPBs");
+	ck_assert_msg(payloads == strlen(PAYLOAD1) + strlen(PAYLOAD2),
+	              "wrong payload length");
+	free(buf);
+}
+END_TEST
+
+START_TEST(logpkt_pcap_flush_01)
+{
+	logpkt_ctx_t ctx;
+	struct sockaddr_in addr;
+	struct stat st;
+	off_t hdrsz;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	ck_assert_msg(logpkt_pcap_open_fd(fd, LOGPKT_FORMAT_PCAP) == 0,
+	              "open_fd failed");
+	ck_assert_msg(fstat(fd, &st) == 0, "fstat failed");
+	hdrsz = st.st_size;
+	ck_assert_msg(hdrsz == PCAP_FILE_HDR_LEN, "wrong file header size");
+
+	logpkt_ctx_init(&ctx, NULL, 0, LOGPKT_FORMAT_PCAP, src_ether, dst_ether,
+	                (struct sockaddr *)&addr, sizeof(addr),
+	                (struct sockaddr *)&addr, sizeof(addr));
+	ck_assert_msg(logpkt_write_payload(&ctx, fd, LOGPKT_REQUEST,
+	                                   (const uint8_t *)PAYLOAD1,
+	                                   strlen(PAYLOAD1)) == 0,
+	              "write_payload failed");
+	ck_assert_msg(ctx.wlen > 0 && ctx.wlen <= ctx.wsize,
+	              "records not buffered");
+	ck_assert_msg(fstat(fd, &st) == 0, "fstat failed");
+	ck_assert_msg(st.st_size == hdrsz, "records written unbuffered");
+
+	ck_assert_msg(logpkt_pcap_flush(&ctx, fd) == 0, "flush failed");
+	ck_assert_msg(!ctx.wbuf && !ctx.wlen && !ctx.wsize,
+	              "buffer not released");
+	ck_assert_msg(fstat(fd, &st) == 0, "fstat failed");
+	ck_assert_msg(st.st_size > hdrsz, "records not written");
+
+	/* reopening keeps the records and appends */
+	ck_assert_msg(logpkt_pcap_open_fd(fd, LOGPKT_FORMAT_PCAP) == 0,
+	              "reopen failed");
+	ck_assert_msg(lseek(fd, 0, SEEK_CUR) == st.st_size,
+	              "not positioned at end of file");
+	ck_assert_msg(logpkt_pcap_flush(&ctx, fd) == 0,
+	              "flush of empty buffer failed");
+	logpkt_ctx_fini(&ctx);
+}
+END_TEST
+
+START_TEST(logpkt_pcap_flush_02)
+{
+	logpkt_ctx_t ctx;
+	struct sockaddr_in addr;
+	struct stat st;
+	off_t hdrsz;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	ck_assert_msg(logpkt_pcap_open_fd(fd, LOGPKT_FORMAT_PCAP) == 0,
+	              "open_fd failed");
+	hdrsz = PCAP_FILE_HDR_LEN;
+
+	logpkt_ctx_init(&ctx, NULL, 0, LOGPKT_FORMAT_PCAP, src_ether, dst_ether,
+	                (struct sockaddr *)&addr, sizeof(addr),
+	                (struct sockaddr *)&addr, sizeof(addr));
+	ck_assert_msg(logpkt_write_payload(&ctx, fd, LOGPKT_REQUEST,
+	                                   (const uint8_t *)PAYLOAD1,
+	                                   strlen(PAYLOAD1)) == 0,
+	              "write_payload failed");
+	ck_assert_msg(ctx.wlen > 0, "records not buffered");
+
+	/* not due yet */
+	ck_assert_msg(logpkt_pcap_flush_expired(&ctx, fd, ctx.wtime) == 0,
+	              "flushed before due");
+	ck_assert_msg(ctx.wlen > 0, "records not kept");
+	ck_assert_msg(fstat(fd, &st) == 0, "fstat failed");
+	ck_assert_msg(st.st_size == hdrsz, "records written before due");
+
+	/* due without another write */
+	ck_assert_msg(logpkt_pcap_flush_expired(&ctx, fd, ctx.wtime + 1) == 1,
+	              "not flushed when due");
+	ck_assert_msg(!ctx.wbuf && !ctx.wlen, "buffer not released");
+	ck_assert_msg(fstat(fd, &st) == 0, "fstat failed");
+	ck_assert_msg(st.st_size > hdrsz, "records not written");
+	logpkt_ctx_fini(&ctx);
+}
+END_TEST
+
+/*
+ * Write a payload of size sz larger than an Ethernet frame in a new conn and
+ * return the largest frame size found in the file, checking that the
+ * payload was written completely.
+ */
+static size_t
+logpkt_write_large(int format, size_t sz)
+{
+	logpkt_ctx_t ctx;
+	struct sockaddr_in addr;
+	struct stat st;
+	uint8_t *payload, *buf, *p;
+	size_t filesz, hdrsz, reclen, framesz, maxframe = 0, payloads = 0;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	payload = malloc(sz);
+	ck_assert_msg(!!payload, "malloc failed");
+	memset(payload, 'x', sz);
+
+	ck_assert_msg(logpkt_pcap_open_fd(fd, format) == 0, "open_fd failed");
+	logpkt_ctx_init(&ctx, NULL, 0, format, src_ether, dst_ether,
+	                (struct sockaddr *)&addr, sizeof(addr),
+	                (struct sockaddr *)&addr, sizeof(addr));
+	ck_assert_msg(logpkt_write_payload(&ctx, fd, LOGPKT_REQUEST,
+	                                   payload, sz) == 0,
+	              "write_payload failed");
+	ck_assert_msg(logpkt_pcap_flush(&ctx, fd) == 0, "flush failed");
+	free(payload);
+
+	ck_assert_msg(fstat(fd, &st) == 0, "fstat failed");
+	filesz = st.st_size;
+	buf = malloc(filesz);
+	ck_assert_msg(!!buf, "malloc failed");
+	ck_assert_msg(pread(fd, buf, filesz, 0) == (ssize_t)filesz,
+	              "pread failed");
+
+	if (format == LOGPKT_FORMAT_PCAPNG) {
+		p = buf + PCAPNG_SHB_LEN + PCAPNG_IDB_LEN;
+		hdrsz = PCAPNG_EPB_HDR_LEN;
+	} else {
+		p = buf + PCAP_FILE_HDR_LEN;
+		hdrsz = PCAP_REC_HDR_LEN;
+	}
+	while (p < buf + filesz) {
+		if (format == LOGPKT_FORMAT_PCAPNG) {
+			reclen = logpkt_get32(p + 4);
+			framesz = logpkt_get32(p + 20);
+			ck_assert_msg(reclen == ((hdrsz + framesz + 3) & ~3U)
+			                        + 4, "wrong EPB length");
+		} else {
+			framesz = logpkt_get32(p + 8);
+			reclen = hdrsz + framesz;
+		}
+		ck_assert_msg(p + reclen <= buf + filesz, "truncated record");
+		if (framesz > maxframe)
+			maxframe = framesz;
+		payloads += logpkt_frame_payload(framesz);
+		p += reclen;
+	}
+	ck_assert_msg(p == buf + filesz, "trailing garbage");
+	ck_assert_msg(payloads == sz, "wrong payload length");
+	free(buf);
+	return maxframe;
+}
+
+START_TEST(logpkt_pcap_02)
+{
+	ck_assert_msg(logpkt_write_large(LOGPKT_FORMAT_PCAP, 100000) ==
+	              ETHER_HDR_LEN + 1500, "PCAP frame not limited to MTU");
+}
+END_TEST
+
+START_TEST(logpkt_pcapng_02)
+{
+	ck_assert_msg(logpkt_write_large(LOGPKT_FORMAT_PCAPNG, 100000) ==
+	              ETHER_HDR_LEN + 65535, "PCAPNG frame not of max IP size");
+}
+END_TEST
+
+Suite *
+logpkt_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("logpkt");
+
+	tc = tcase_create("logpkt");
+	tcase_add_checked_fixture(tc, logpkt_setup, logpkt_teardown);
+	tcase_add_test(tc, logpkt_pcap_01);
+	tcase_add_test(tc, logpkt_pcapng_01);
+	tcase_add_test(tc, logpkt_pcap_flush_01);
+	tcase_add_test(tc, logpkt_pcap_flush_02);
+	tcase_add_test(tc, logpkt_pcap_02);
+	tcase_add_test(tc, logpkt_pcapng_02);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+/* vim: set noet ft=c: */
@@ -70,18 +70,29 @@ Suite * filter_suite(void);
 Suite * filter_struct_suite(void);
 Suite * dynbuf_suite(void);
 Suite * logbuf_suite(void);
+Suite * logpkt_suite(void);
 Suite * cert_suite(void);
 Suite * cachemgr_suite(void);
 Suite * cachefkcrt_suite(void);
 Suite * cachetgcrt_suite(void);
 Suite * cachedsess_suite(void);
 Suite * cachessess_suite(void);
+Suite * cachesslctx_suite(void);
+Suite * cachesnicrt_suite(void);
+Suite * cachepass_suite(void);
 Suite * ssl_suite(void);
 Suite * sys_suite(void);
 Suite * base64_suite(void);
 Suite * url_suite(void);
+Suite * httphdr_suite(void);
 Suite * util_suite(void);
 Suite * pxythrmgr_suite(void);
+Suite * cryptopool_suite(void);
+Suite * dnscache_suite(void);
+Suite * thrqueue_suite(void);
+#ifndef WITHOUT_USERAUTH
+Suite * usertbl_suite(void);
+#endif /* !WITHOUT_USERAUTH */
 Suite * defaults_suite(void);
 Suite * proto_suite(void);
 
@@ -98,18 +109,29 @@ main(UNUSED int argc, UNUSED char *argv[])
 	srunner_add_suite(sr, filter_struct_suite());
 	srunner_add_suite(sr, dynbuf_suite());
 	srunner_add_suite(sr, logbuf_suite());
+	srunner_add_suite(sr, logpkt_suite());
 	srunner_add_suite(sr, cert_suite());
 	srunner_add_suite(sr, cachemgr_suite());
 	srunner_add_suite(sr, cachefkcrt_suite());
 	srunner_add_suite(sr, cachetgcrt_suite());
 	srunner_add_suite(sr, cachedsess_suite());
 	srunner_add_suite(sr, cachessess_suite());
+	srunner_add_suite(sr, cachesslctx_suite());
+	srunner_add_suite(sr, cachesnicrt_suite());
+	srunner_add_suite(sr, cachepass_suite());
 	srunner_add_suite(sr, ssl_suite());
 	srunner_add_suite(sr, sys_suite());
 	srunner_add_suite(sr, base64_suite());
 	srunner_add_suite(sr, url_suite());
+	srunner_add_suite(sr, httphdr_suite());
 	srunner_add_suite(sr, util_suite());
 	srunner_add_suite(sr, pxythrmgr_suite());
+	srunner_add_suite(sr, cryptopool_suite());
+	srunner_add_suite(sr, dnscache_suite());
+	srunner_add_suite(sr, thrqueue_suite());
+#ifndef WITHOUT_USERAUTH
+	srunner_add_suite(sr, usertbl_suite());
+#endif /* !WITHOUT_USERAUTH */
 	srunner_add_suite(sr, defaults_suite());
 	srunner_add_suite(sr, proto_suite());
 	srunner_run_all(sr, CK_NORMAL);
@@ -29,7 +29,19 @@
 #include "protohttp.h"
 #include "protopop3.h"
 #include "protosmtp.h"
-
+#include "prototcp.h"
+#include "protopassthrough.h"
+#include "filter.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/time.h>
+#ifdef SYS_HAVE_SPLICE
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#endif /* SYS_HAVE_SPLICE */
 #include <check.h>
 
 static void
@@ -61,6 +73,10 @@ proto_init(protocol_t proto)
 	memset(thrmgr->thr, 0, thrmgr->num_thr * sizeof(pxy_thr_ctx_t*));
 	thrmgr->thr[0] = malloc(sizeof(pxy_thr_ctx_t));
 	memset(thrmgr->thr[0], 0, sizeof(pxy_thr_ctx_t));
+	if (posix_memalign((void **)&thrmgr->loads, PXY_THR_CACHELINE_SIZE, thrmgr->num_thr * sizeof(pxy_thr_load_t)))
+		return NULL;
+	memset(thrmgr->loads, 0, thrmgr->num_thr * sizeof(pxy_thr_load_t));
+	thrmgr->thr[0]->ld = &thrmgr->loads[0];
 
 	proxyspec_t *spec = proxyspec_new(global, "sslproxy", NULL);
 	if (proto == PROTO_HTTP) {
@@ -308,6 +324,276 @@ START_TEST(protohttp_validate_10)
 }
 END_TEST
 
+static void
+proto_body_header(protohttp_body_t *body, httphdr_id_t id, const char *value)
+{
+	httphdr_line_t line;
+
+	memset(&line, 0, sizeof(httphdr_line_t));
+	line.id = id;
+	line.value = value;
+	line.value_len = strlen(value);
+	protohttp_body_header(body, &line);
+}
+
+START_TEST(protohttp_body_01)
+{
+	pxy_conn_ctx_t *ctx = proto_init(PROTO_HTTP);
+	protohttp_ctx_t *http_ctx = ctx->protoctx->arg;
+
+	proto_body_header(&http_ctx->req_body, HTTPHDR_CONTENT_LENGTH, "10");
+	ck_assert_msg(http_ctx->req_body.has_length == 1, "wrong has_length");
+	ck_assert_msg(http_ctx->req_body.bad_length == 0, "wrong bad_length");
+	ck_assert_msg(http_ctx->req_body.remaining == 10, "wrong remaining");
+
+	int rv = protohttp_body_request(http_ctx);
+	ck_assert_msg(rv == 0, "wrong return value");
+	ck_assert_msg(http_ctx->req_body.state == PROTOHTTP_BODY_LENGTH, "wrong state");
+
+	proto_free(ctx);
+}
+END_TEST
+
+START_TEST(protohttp_body_02)
+{
+	pxy_conn_ctx_t *ctx = proto_init(PROTO_HTTP);
+	protohttp_ctx_t *http_ctx = ctx->protoctx->arg;
+
+	proto_body_header(&http_ctx->req_body, HTTPHDR_TRANSFER_ENCODING, "gzip, chunked");
+	ck_assert_msg(http_ctx->req_body.has_te == 1, "wrong has_te");
+	ck_assert_msg(http_ctx->req_body.chunked == 1, "wrong chunked");
+
+	int rv = protohttp_body_request(http_ctx);
+	ck_assert_msg(rv == 0, "wrong return value");
+	ck_assert_msg(http_ctx->req_body.state == PROTOHTTP_BODY_CHUNK_SIZE, "wrong state");
+
+	proto_free(ctx);
+}
+END_TEST
+
+START_TEST(protohttp_body_03)
+{
+	pxy_conn_ctx_t *ctx = proto_init(PROTO_HTTP);
+	protohttp_ctx_t *http_ctx = ctx->protoctx->arg;
+
+	// Content-Length and Transfer-Encoding together are ambiguous
+	proto_body_header(&http_ctx->req_body, HTTPHDR_CONTENT_LENGTH, "10");
+	proto_body_header(&http_ctx->req_body, HTTPHDR_TRANSFER_ENCODING, "chunked");
+	int rv = protohttp_body_request(http_ctx);
+	ck_assert_msg(rv == -1, "both headers accepted");
+
+	// Non-chunked final transfer coding in a request
+	memset(&http_ctx->req_body, 0, sizeof(protohttp_body_t));
+	proto_body_header(&http_ctx->req_body, HTTPHDR_TRANSFER_ENCODING, "chunked, gzip");
+	rv = protohttp_body_request(http_ctx);
+	ck_assert_msg(rv == -1, "non-chunked final coding accepted");
+
+	proto_free(ctx);
+}
+END_TEST
+
+START_TEST(protohttp_body_04)
+{
+	pxy_conn_ctx_t *ctx = proto_init(PROTO_HTTP);
+	protohttp_ctx_t *http_ctx = ctx->protoctx->arg;
+
+	// Duplicate Content-Length lines with the same value
+	proto_body_header(&http_ctx->req_body, HTTPHDR_CONTENT_LENGTH, "10");
+	proto_body_header(&http_ctx->req_body, HTTPHDR_CONTENT_LENGTH, "10 ");
+	ck_assert_msg(http_ctx->req_body.bad_length == 0, "wrong bad_length");
+	int rv = protohttp_body_request(http_ctx);
+	ck_assert_msg(rv == 0, "equal duplicates rejected");
+	ck_assert_msg(http_ctx->req_body.remaining == 10, "wrong remaining");
+
+	// Duplicate Content-Length lines with different values
+	memset(&http_ctx->req_body, 0, sizeof(protohttp_body_t));
+	proto_body_header(&http_ctx->req_body, HTTPHDR_CONTENT_LENGTH, "10");
+	proto_body_header(&http_ctx->req_body, HTTPHDR_CONTENT_LENGTH, "11");
+	ck_assert_msg(http_ctx->req_body.bad_length == 1, "wrong bad_length");
+	rv = protohttp_body_request(http_ctx);
+	ck_assert_msg(rv == -1, "different duplicates accepted");
+
+	// Invalid Content-Length
+	memset(&http_ctx->req_body, 0, sizeof(protohttp_body_t));
+	proto_body_header(&http_ctx->req_body, HTTPHDR_CONTENT_LENGTH, "+10");
+	ck_assert_msg(http_ctx->req_body.bad_length == 1, "sign accepted");
+	memset(&http_ctx->req_body, 0, sizeof(protohttp_body_t));
+	proto_body_header(&http_ctx->req_body, HTTPHDR_CONTENT_LENGTH, "18446744073709551616");
+	ck_assert_msg(http_ctx->req_body.bad_length == 1, "overflow accepted");
+
+	proto_free(ctx);
+}
+END_TEST
+
+START_TEST(protohttp_chunk_size_01)
+{
+	long long unsigned int size;
+	const char *s;
+	int rv;
+
+	s = "1a";
+	rv = protohttp_parse_chunk_size(s, strlen(s), &size);
+	ck_assert_msg(rv == 0 && size == 26, "failed to parse chunk size");
+
+	s = "1A;name=value";
+	rv = protohttp_parse_chunk_size(s, strlen(s), &size);
+	ck_assert_msg(rv == 0 && size == 26, "failed to parse chunk size with ext");
+
+	s = "1a \t;name";
+	rv = protohttp_parse_chunk_size(s, strlen(s), &size);
+	ck_assert_msg(rv == 0 && size == 26, "failed to parse chunk size with ws");
+
+	// Padded beyond the length of the largest chunk size
+	s = "00000000000000000000000000000000000000000000000000000001a";
+	rv = protohttp_parse_chunk_size(s, strlen(s), &size);
+	ck_assert_msg(rv == 0 && size == 26, "failed to parse padded chunk size");
+
+	s = "ffffffffffffffff";
+	rv = protohttp_parse_chunk_size(s, strlen(s), &size);
+	ck_assert_msg(rv == 0 && size == ULLONG_MAX, "failed to parse max chunk size");
+
+	s = "0";
+	rv = protohttp_parse_chunk_size(s, strlen(s), &size);
+	ck_assert_msg(rv == 0 && size == 0, "failed to parse last chunk size");
+}
+END_TEST
+
+START_TEST(protohttp_chunk_size_02)
+{
+	long long unsigned int size = 1;
+	const char *s;
+	int rv;
+
+	s = "0x1a";
+	rv = protohttp_parse_chunk_size(s, strlen(s), &size);
+	ck_assert_msg(rv == -1, "0x prefix accepted");
+
+	s = "10000000000000000";
+	rv = protohttp_parse_chunk_size(s, strlen(s), &size);
+	ck_assert_msg(rv == -1, "overflow accepted");
+
+	s = "";
+	rv = protohttp_parse_chunk_size(s, strlen(s), &size);
+	ck_assert_msg(rv == -1, "empty chunk size accepted");
+
+	s = "g1";
+	rv = protohttp_parse_chunk_size(s, strlen(s), &size);
+	ck_assert_msg(rv == -1, "invalid chunk size accepted");
+
+	s = "+1a";
+	rv = protohttp_parse_chunk_size(s, strlen(s), &size);
+	ck_assert_msg(rv == -1, "sign accepted");
+
+	s = " 1a";
+	rv = protohttp_parse_chunk_size(s, strlen(s), &size);
+	ck_assert_msg(rv == -1, "leading ws accepted");
+
+	s = "1a,2";
+	rv = protohttp_parse_chunk_size(s, strlen(s), &size);
+	ck_assert_msg(rv == -1, "invalid delimiter accepted");
+
+	ck_assert_msg(size == 1, "size set on error");
+}
+END_TEST
+
+START_TEST(protohttp_chunk_size_03)
+{
+	struct evbuffer *inbuf = evbuffer_new();
+	struct evbuffer *outbuf = evbuffer_new();
+	protohttp_body_t body;
+	int rv;
+
+	// Padded chunk size line is parsed as a whole
+	memset(&body, 0, sizeof(protohttp_body_t));
+	body.state = PROTOHTTP_BODY_CHUNK_SIZE;
+	evbuffer_add_printf(inbuf, "%s\r\n0123456789abcdef0123456789\r\n0\r\n\r\nGET",
+	                    "00000000000000000000000000000000000000000000000000000001a");
+	rv = protohttp_forward_body(inbuf, outbuf, &body);
+	ck_assert_msg(rv == 1, "wrong return value");
+	ck_assert_msg(evbuffer_get_length(inbuf) == 3, "wrong body end");
+
+	// 0x prefix is not skipped
+	evbuffer_drain(inbuf, evbuffer_get_length(inbuf));
+	memset(&body, 0, sizeof(protohttp_body_t));
+	body.state = PROTOHTTP_BODY_CHUNK_SIZE;
+	evbuffer_add_printf(inbuf, "0x5\r\nhello\r\n0\r\n\r\n");
+	rv = protohttp_forward_body(inbuf, outbuf, &body);
+	ck_assert_msg(rv == -1, "0x prefix accepted");
+
+	// Oversized chunk size line, with or without line ending
+	evbuffer_drain(inbuf, evbuffer_get_length(inbuf));
+	memset(&body, 0, sizeof(protohttp_body_t));
+	body.state = PROTOHTTP_BODY_CHUNK_SIZE;
+	for (int i = 0; i < 5000; i++)
+		evbuffer_add(inbuf, "0", 1);
+	rv = protohttp_forward_body(inbuf, outbuf, &body);
+	ck_assert_msg(rv == -1, "oversized line without eol accepted");
+	evbuffer_add(inbuf, "1\r\n", 3);
+	rv = protohttp_forward_body(inbuf, outbuf, &body);
+	ck_assert_msg(rv == -1, "oversized line accepted");
+
+	evbuffer_free(inbuf);
+	evbuffer_free(outbuf);
+}
+END_TEST
+
+START_TEST(protohttp_refilter_01)
+{
+	pxy_conn_ctx_t *ctx = proto_init(PROTO_HTTP);
+	protohttp_ctx_t *http_ctx = ctx->protoctx->arg;
+	opts_t *opts = ctx->spec->opts;
+	conn_opts_t *conn_opts = ctx->conn_opts;
+	struct evbuffer *inbuf = evbuffer_new();
+	struct evbuffer *outbuf = evbuffer_new();
+
+	char s[] = "to host a.example log !connect";
+	int rv = filter_rule_set(opts, conn_opts, "Match", s, 0);
+	ck_assert_msg(rv == 0, "failed to parse rule");
+
+	tmp_opts_t *tmp_opts = malloc(sizeof(tmp_opts_t));
+	memset(tmp_opts, 0, sizeof(tmp_opts_t));
+	opts->filter = filter_set(opts->filter_rules, "sslproxy", tmp_opts);
+	ck_assert_msg(opts->filter != NULL, "failed to set filter");
+	tmp_opts_free(tmp_opts);
+
+	conn_opts->http_keepalive = 1;
+	ctx->log_connect = 1;
+	ctx->log_master = 1;
+	ctx->log_content = 1;
+	ctx->log_pcap = 1;
+	ctx->filter_precedence = 0;
+
+	evbuffer_add_printf(inbuf, "GET / HTTP/1.1\r\nHost: a.example\r\n\r\n");
+	rv = protohttp_filter_requests(inbuf, outbuf, http_ctx, CONN_TYPE_PARENT, ctx);
+	ck_assert_msg(rv == 0, "wrong return value");
+	ck_assert_msg(ctx->log_connect == 0, "first request not filtered");
+	ck_assert_msg(ctx->filter_precedence != 0, "wrong filter_precedence");
+
+	// Emulate the other changes a filter match may make
+	conn_opts_t *rule_conn_opts = conn_opts_new();
+	ctx->conn_opts = rule_conn_opts;
+	ctx->log_master = 0;
+	ctx->log_content = 0;
+	ctx->log_pcap = 0;
+
+	evbuffer_add_printf(inbuf, "GET / HTTP/1.1\r\nHost: b.example\r\n\r\n");
+	rv = protohttp_filter_requests(inbuf, outbuf, http_ctx, CONN_TYPE_PARENT, ctx);
+	ck_assert_msg(rv == 0, "wrong return value");
+	ck_assert_msg(ctx->log_connect == 1, "log_connect not restored");
+	ck_assert_msg(ctx->log_master == 1, "log_master not restored");
+	ck_assert_msg(ctx->log_content == 1, "log_content not restored");
+	ck_assert_msg(ctx->log_pcap == 1, "log_pcap not restored");
+	ck_assert_msg(ctx->filter_precedence == 0, "filter_precedence not restored");
+	ck_assert_msg(ctx->conn_opts == conn_opts, "conn_opts not restored");
+	ck_assert_msg(!strcmp(http_ctx->http_host, "b.example"), "wrong http_host");
+
+	conn_opts_free(rule_conn_opts);
+	evbuffer_free(inbuf);
+	evbuffer_free(outbuf);
+	proto_free(ctx);
+}
+END_TEST
+
 START_TEST(protopop3_validate_01)
 {
 	pxy_conn_ctx_t *ctx = proto_init(PROTO_POP3);
@@ -874,6 +1160,313 @@ START_TEST(protosmtp_validate_response_08)
 }
 END_TEST
 
+static long long
+proto_now_ms(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+START_TEST(prototcp_outbuf_01)
+{
+	pxy_conn_ctx_t *ctx = proto_init(PROTO_TCP);
+
+	// Not adaptive by default
+	ck_assert_msg(prototcp_outbuf_limit(ctx, &ctx->src) == OUTBUF_LIMIT, "wrong default limit");
+	ctx->src.wm_len = OUTBUF_LIMIT;
+	ctx->src.wm_time = proto_now_ms();
+	prototcp_outbuf_adapt(ctx, &ctx->src, 0);
+	ck_assert_msg(prototcp_outbuf_limit(ctx, &ctx->src) == OUTBUF_LIMIT, "limit adapted");
+
+	ctx->conn_opts->outbuf_limit = 65536;
+	ck_assert_msg(prototcp_outbuf_limit(ctx, &ctx->src) == 65536, "configured limit not used");
+
+	proto_free(ctx);
+}
+END_TEST
+
+START_TEST(prototcp_outbuf_02)
+{
+	pxy_conn_ctx_t *ctx = proto_init(PROTO_TCP);
+	ctx->thr->thrmgr = ctx->thrmgr;
+	ctx->conn_opts->adaptive_outbuf = 1;
+
+	// Slow drain shrinks the limit, without taking from the budget
+	prototcp_outbuf_throttled(ctx, &ctx->src, OUTBUF_LIMIT);
+	ctx->src.wm_time -= 1000;
+	prototcp_outbuf_adapt(ctx, &ctx->src, OUTBUF_LIMIT/2);
+	ck_assert_msg(prototcp_outbuf_limit(ctx, &ctx->src) < OUTBUF_LIMIT, "limit not shrunk");
+	ck_assert_msg(prototcp_outbuf_limit(ctx, &ctx->src) >= OUTBUF_ADAPTIVE_MIN, "limit below min");
+	ck_assert_msg(ctx->src.outbuf_reserved == 0, "budget taken on shrink");
+	ck_assert_msg(ctx->thrmgr->outbuf_reserved == 0, "wrong total reserved");
+	ck_assert_msg(ctx->thr->outbuf_shrunk == 1, "shrink not counted");
+
+	// Fast drain grows the limit, taking the growth beyond OutbufLimit from the budget
+	prototcp_outbuf_throttled(ctx, &ctx->dst, OUTBUF_LIMIT);
+	ctx->dst.wm_time = proto_now_ms() + 1000;
+	prototcp_outbuf_adapt(ctx, &ctx->dst, 0);
+	ck_assert_msg(prototcp_outbuf_limit(ctx, &ctx->dst) == OUTBUF_LIMIT * 3 / 2, "limit not grown");
+	ck_assert_msg(ctx->dst.outbuf_reserved == OUTBUF_LIMIT / 2, "wrong reserved");
+	ck_assert_msg(ctx->thrmgr->outbuf_reserved == OUTBUF_LIMIT / 2, "wrong total reserved");
+	ck_assert_msg(ctx->thr->outbuf_grown == 1, "growth not counted");
+
+	prototcp_outbuf_release(ctx, &ctx->dst);
+	ck_assert_msg(ctx->dst.outbuf_reserved == 0, "reserved not released");
+	ck_assert_msg(ctx->thrmgr->outbuf_reserved == 0, "total reserved not released");
+
+	proto_free(ctx);
+}
+END_TEST
+
+START_TEST(prototcp_outbuf_03)
+{
+	pxy_conn_ctx_t *ctx = proto_init(PROTO_TCP);
+	ctx->thr->thrmgr = ctx->thrmgr;
+	ctx->conn_opts->adaptive_outbuf = 1;
+	ctx->thrmgr->outbuf_budget = OUTBUF_LIMIT / 2 + 1;
+
+	prototcp_outbuf_throttled(ctx, &ctx->src, OUTBUF_LIMIT);
+	ctx->src.wm_time = proto_now_ms() + 1000;
+	prototcp_outbuf_adapt(ctx, &ctx->src, 0);
+	ck_assert_msg(ctx->thrmgr->outbuf_reserved == OUTBUF_LIMIT / 2, "wrong total reserved");
+
+	// Out of budget, the limit stays at OutbufLimit
+	prototcp_outbuf_throttled(ctx, &ctx->dst, OUTBUF_LIMIT);
+	ctx->dst.wm_time = proto_now_ms() + 1000;
+	prototcp_outbuf_adapt(ctx, &ctx->dst, 0);
+	ck_assert_msg(prototcp_outbuf_limit(ctx, &ctx->dst) == OUTBUF_LIMIT, "limit grown beyond budget");
+	ck_assert_msg(ctx->dst.outbuf_reserved == 0, "reserved beyond budget");
+	ck_assert_msg(ctx->thrmgr->outbuf_reserved == OUTBUF_LIMIT / 2, "wrong total reserved");
+
+	prototcp_outbuf_release(ctx, &ctx->src);
+	ck_assert_msg(ctx->thrmgr->outbuf_reserved == 0, "total reserved not released");
+
+	proto_free(ctx);
+}
+END_TEST
+
+#ifdef SYS_HAVE_SPLICE
+/*
+ * Set up the up direction of a splice relay from a socketpair to a pipe.
+ * The test writes to sv[0] as src and reads from out[0] as dst.  The out
+ * pipe is shrunk to one page, so that it fills up before the relay pipe.
+ */
+static pxy_conn_ctx_t *
+proto_splice_init(protopassthrough_splice_t *sp, int *sv, int *out)
+{
+	pxy_conn_ctx_t *ctx = proto_init(PROTO_TCP);
+	ctx->thr->evbase = event_base_new();
+
+	memset(sp, 0, sizeof(protopassthrough_splice_t));
+	sp->pipe[0] = sp->pipe[1] = -1;
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1 ||
+			evutil_make_socket_nonblocking(sv[1]) == -1 ||
+			pipe2(out, O_NONBLOCK) == -1 ||
+			fcntl(out[1], F_SETPIPE_SZ, 4096) == -1)
+		return NULL;
+	if (protopassthrough_splice_init(sp, ctx, sv[1], out[1], 1) == -1)
+		return NULL;
+	return ctx;
+}
+
+static void
+proto_splice_free(pxy_conn_ctx_t *ctx, protopassthrough_splice_t *sp, int *sv, int *out)
+{
+	protopassthrough_splice_free(sp);
+	close(sv[0]);
+	close(sv[1]);
+	close(out[0]);
+	close(out[1]);
+	proto_free(ctx);
+}
+
+/*
+ * Drain the out pipe and let the relay write the rest of the relay pipe,
+ * as the write event would.  Returns the number of bytes read.
+ */
+static size_t
+proto_splice_drain(protopassthrough_splice_t *sp, int *out, char *buf, size_t size)
+{
+	size_t len = 0;
+
+	for (int i = 0; i < 100 && len < size; i++) {
+		ssize_t n = read(out[0], buf + len, size - len);
+		if (n > 0)
+			len += n;
+		if (!sp->pending)
+			break;
+		ck_assert_msg(event_pending(sp->wev, EV_WRITE, NULL), "write event not pending");
+		ck_assert_msg(!event_pending(sp->rev, EV_READ, NULL), "read event pending while pipe not empty");
+		if (sp->eof) {
+			if (protopassthrough_splice_flush(sp) == 1)
+				break;
+		} else {
+			protopassthrough_splice_writecb(out[1], EV_WRITE, sp);
+		}
+	}
+	return len;
+}
+
+START_TEST(protopassthrough_splice_01)
+{
+	protopassthrough_splice_t sp;
+	int sv[2], out[2];
+	char buf[16];
+
+	pxy_conn_ctx_t *ctx = proto_splice_init(&sp, sv, out);
+	ck_assert_msg(ctx != NULL, "init failed");
+
+	ck_assert_msg(write(sv[0], "hello", 5) == 5, "write failed");
+	protopassthrough_splice_readcb(sv[1], EV_READ, &sp);
+	ck_assert_msg(sp.pending == 0, "data left in pipe");
+	ck_assert_msg(!sp.eof, "eof set");
+	ck_assert_msg(event_pending(sp.rev, EV_READ, NULL), "read event not pending");
+	ck_assert_msg(!event_pending(sp.wev, EV_WRITE, NULL), "write event pending");
+	ck_assert_msg(ctx->thr->intif_in_bytes == 5, "wrong intif in bytes");
+	ck_assert_msg(ctx->thr->extif_out_bytes == 5, "wrong extif out bytes");
+	ck_assert_msg(ctx->thr->extif_in_bytes == 0, "wrong extif in bytes");
+
+	ck_assert_msg(read(out[0], buf, sizeof(buf)) == 5, "wrong length relayed");
+	ck_assert_msg(!memcmp(buf, "hello", 5), "wrong data relayed");
+
+	// Nothing to read, the relay waits for the next read event
+	protopassthrough_splice_readcb(sv[1], EV_READ, &sp);
+	ck_assert_msg(sp.pending == 0, "data left in pipe");
+	ck_assert_msg(event_pending(sp.rev, EV_READ, NULL), "read event not pending");
+
+	proto_splice_free(ctx, &sp, sv, out);
+}
+END_TEST
+
+START_TEST(protopassthrough_splice_02)
+{
+	protopassthrough_splice_t sp;
+	int sv[2], out[2];
+	char wbuf[10240], rbuf[10240];
+
+	pxy_conn_ctx_t *ctx = proto_splice_init(&sp, sv, out);
+	ck_assert_msg(ctx != NULL, "init failed");
+
+	for (size_t i = 0; i < sizeof(wbuf); i++)
+		wbuf[i] = i % 251;
+	ck_assert_msg(write(sv[0], wbuf, sizeof(wbuf)) == sizeof(wbuf), "write failed");
+
+	// The out pipe fills up, so the relay stops reading and waits for write
+	protopassthrough_splice_readcb(sv[1], EV_READ, &sp);
+	ck_assert_msg(sp.pending > 0, "no backpressure");
+	ck_assert_msg(!event_pending(sp.rev, EV_READ, NULL), "read event pending");
+	ck_assert_msg(event_pending(sp.wev, EV_WRITE, NULL), "write event not pending");
+
+	size_t len = proto_splice_drain(&sp, out, rbuf, sizeof(rbuf));
+	ck_assert_msg(sp.pending == 0, "data left in pipe");
+	ck_assert_msg(event_pending(sp.rev, EV_READ, NULL), "read event not pending after flush");
+	ck_assert_msg(!event_pending(sp.wev, EV_WRITE, NULL), "write event pending after flush");
+
+	// Relay whatever the first splice() did not take from the socket
+	for (int i = 0; i < 100 && len < sizeof(rbuf); i++) {
+		protopassthrough_splice_readcb(sv[1], EV_READ, &sp);
+		len += proto_splice_drain(&sp, out, rbuf + len, sizeof(rbuf) - len);
+	}
+	ck_assert_msg(len == sizeof(wbuf), "wrong length relayed");
+	ck_assert_msg(!memcmp(rbuf, wbuf, sizeof(wbuf)), "wrong data relayed");
+	ck_assert_msg(ctx->thr->intif_in_bytes == sizeof(wbuf), "wrong intif in bytes");
+
+	proto_splice_free(ctx, &sp, sv, out);
+}
+END_TEST
+
+START_TEST(protopassthrough_splice_03)
+{
+	protopassthrough_splice_t sp;
+	int sv[2], out[2];
+	char wbuf[10240], rbuf[10240];
+
+	pxy_conn_ctx_t *ctx = proto_splice_init(&sp, sv, out);
+	ck_assert_msg(ctx != NULL, "init failed");
+
+	memset(wbuf, 'a', sizeof(wbuf));
+	ck_assert_msg(write(sv[0], wbuf, sizeof(wbuf)) == sizeof(wbuf), "write failed");
+	shutdown(sv[0], SHUT_WR);
+
+	// Eof while the pipe is not empty does not close the conn yet
+	for (int i = 0; i < 100 && !sp.eof; i++) {
+		protopassthrough_splice_readcb(sv[1], EV_READ, &sp);
+	}
+	ck_assert_msg(sp.eof, "eof not set");
+	ck_assert_msg(sp.pending > 0, "no data left in pipe");
+	ck_assert_msg(!event_pending(sp.rev, EV_READ, NULL), "read event pending after eof");
+
+	// The direction is done once the pipe is flushed
+	size_t len = proto_splice_drain(&sp, out, rbuf, sizeof(rbuf));
+	ck_assert_msg(sp.pending == 0, "data left in pipe");
+	ck_assert_msg(protopassthrough_splice_flush(&sp) == 1, "direction not done");
+	ck_assert_msg(!event_pending(sp.rev, EV_READ, NULL), "read event pending after eof");
+	ck_assert_msg(!event_pending(sp.wev, EV_WRITE, NULL), "write event pending after flush");
+	if (len < sizeof(rbuf)) {
+		ssize_t n = read(out[0], rbuf + len, sizeof(rbuf) - len);
+		if (n > 0)
+			len += n;
+	}
+	ck_assert_msg(len == sizeof(wbuf), "wrong length relayed");
+
+	proto_splice_free(ctx, &sp, sv, out);
+}
+END_TEST
+
+START_TEST(protopassthrough_splice_04)
+{
+	protopassthrough_ctx_t pctx;
+	int sv[2], dv[2];
+	char buf[16];
+
+	pxy_conn_ctx_t *ctx = proto_init(PROTO_TCP);
+	ctx->thr->evbase = event_base_new();
+
+	// The test writes to and reads from sv[0] as the client and dv[0] as the server
+	memset(&pctx, 0, sizeof(pctx));
+	pctx.dst = &ctx->dst;
+	pctx.up.pipe[0] = pctx.up.pipe[1] = -1;
+	pctx.down.pipe[0] = pctx.down.pipe[1] = -1;
+	ck_assert_msg(socketpair(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK, 0, sv) == 0, "socketpair failed");
+	ck_assert_msg(socketpair(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK, 0, dv) == 0, "socketpair failed");
+	ck_assert_msg(protopassthrough_splice_init(&pctx.up, ctx, sv[1], dv[1], 1) == 0, "init up failed");
+	ck_assert_msg(protopassthrough_splice_init(&pctx.down, ctx, dv[1], sv[1], 0) == 0, "init down failed");
+	ctx->protoctx->arg = &pctx;
+
+	// Eof from the client is passed on to the server, the conn stays open
+	ck_assert_msg(write(sv[0], "request", 7) == 7, "write failed");
+	shutdown(sv[0], SHUT_WR);
+	for (int i = 0; i < 100 && !pctx.up.done; i++) {
+		protopassthrough_splice_readcb(sv[1], EV_READ, &pctx.up);
+	}
+	ck_assert_msg(pctx.up.done, "up not done");
+	ck_assert_msg(!pctx.down.done, "down done");
+	ck_assert_msg(!ctx->src.closed && !ctx->dst.closed, "conn closed on half-close");
+	ck_assert_msg(read(dv[0], buf, sizeof(buf)) == 7, "wrong length relayed up");
+	ck_assert_msg(read(dv[0], buf, sizeof(buf)) == 0, "eof not passed on to server");
+
+	// The server can still respond
+	ck_assert_msg(write(dv[0], "response", 8) == 8, "write failed");
+	protopassthrough_splice_readcb(dv[1], EV_READ, &pctx.down);
+	ck_assert_msg(pctx.down.pending == 0, "data left in pipe");
+	ck_assert_msg(event_pending(pctx.down.rev, EV_READ, NULL), "read event not pending");
+	ck_assert_msg(read(sv[0], buf, sizeof(buf)) == 8, "wrong length relayed down");
+	ck_assert_msg(!memcmp(buf, "response", 8), "wrong data relayed down");
+
+	ctx->protoctx->arg = NULL;
+	protopassthrough_splice_free(&pctx.up);
+	protopassthrough_splice_free(&pctx.down);
+	close(sv[0]);
+	close(sv[1]);
+	close(dv[0]);
+	close(dv[1]);
+	proto_free(ctx);
+}
+END_TEST
+#endif /* SYS_HAVE_SPLICE */
+
 Suite *
 proto_suite(void)
 {
@@ -882,6 +1475,21 @@ proto_suite(void)
 
 	s = suite_create("proto");
 
+	tc = tcase_create("prototcp_outbuf");
+	tcase_add_test(tc, prototcp_outbuf_01);
+	tcase_add_test(tc, prototcp_outbuf_02);
+	tcase_add_test(tc, prototcp_outbuf_03);
+	suite_add_tcase(s, tc);
+
+#ifdef SYS_HAVE_SPLICE
+	tc = tcase_create("protopassthrough_splice");
+	tcase_add_test(tc, protopassthrough_splice_01);
+	tcase_add_test(tc, protopassthrough_splice_02);
+	tcase_add_test(tc, protopassthrough_splice_03);
+	tcase_add_test(tc, protopassthrough_splice_04);
+	suite_add_tcase(s, tc);
+#endif /* SYS_HAVE_SPLICE */
+
 	tc = tcase_create("protohttp_validate");
 	tcase_add_test(tc, protohttp_validate_01);
 	tcase_add_test(tc, protohttp_validate_02);
@@ -895,6 +1503,17 @@ proto_suite(void)
 	tcase_add_test(tc, protohttp_validate_10);
 	suite_add_tcase(s, tc);
 
+	tc = tcase_create("protohttp_body");
+	tcase_add_test(tc, protohttp_body_01);
+	tcase_add_test(tc, protohttp_body_02);
+	tcase_add_test(tc, protohttp_body_03);
+	tcase_add_test(tc, protohttp_body_04);
+	tcase_add_test(tc, protohttp_chunk_size_01);
+	tcase_add_test(tc, protohttp_chunk_size_02);
+	tcase_add_test(tc, protohttp_chunk_size_03);
+	tcase_add_test(tc, protohttp_refilter_01);
+	suite_add_tcase(s, tc);
+
 	tc = tcase_create("protopop3_validate");
 	tcase_add_test(tc, protopop3_validate_01);
 	tcase_add_test(tc, protopop3_validate_02);
@@ -27,7 +27,10 @@
  */
 
 #include "pxythrmgr.h"
+#include "pxyconn.h"
 
+#include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 
 #include <check.h>
@@ -107,6 +110,122 @@ START_TEST(pxythrmgr_libevent_05)
 }
 END_TEST
 
+START_TEST(pxythr_wheel_01)
+{
+	pxy_thr_ctx_t *thr;
+	pxy_thr_load_t ld;
+	pxy_conn_ctx_t c1, c2, c3;
+	// In the past on the monotonic clock, so that touching a conn moves it
+	time_t t = pxy_thr_time() - 10;
+
+	thr = malloc(sizeof(pxy_thr_ctx_t));
+	ck_assert_msg(!!thr, "no thr ctx");
+	memset(thr, 0, sizeof(pxy_thr_ctx_t));
+	memset(&ld, 0, sizeof(ld));
+	thr->ld = &ld;
+	memset(&c1, 0, sizeof(c1));
+	memset(&c2, 0, sizeof(c2));
+	memset(&c3, 0, sizeof(c3));
+	c1.thr = c2.thr = c3.thr = thr;
+	c1.atime = t;
+	c2.atime = t;
+	c3.atime = t + PXY_THR_WHEEL_SIZE - 1;
+
+	pxy_thr_attach(&c1);
+	pxy_thr_attach(&c2);
+	pxy_thr_attach(&c3);
+	ck_assert_msg(thr->load == 3, "wrong load");
+	ck_assert_msg(ld.conns == 3, "wrong published load");
+	ck_assert_msg(thr->conns == &c3, "wrong conns head");
+	ck_assert_msg(thr->conns_tail == &c1, "wrong conns tail");
+	ck_assert_msg(thr->wheel[(size_t)t & PXY_THR_WHEEL_MASK] == &c2, "wrong slot head");
+	ck_assert_msg(c2.wheel_next == &c1, "wrong slot list");
+	ck_assert_msg(thr->wheel[(size_t)(t - 1) & PXY_THR_WHEEL_MASK] == &c3, "wrong slot for c3");
+
+	pxy_thr_detach(&c1);
+	ck_assert_msg(thr->conns_tail == &c2, "wrong conns tail after detach");
+	ck_assert_msg(thr->wheel[(size_t)t & PXY_THR_WHEEL_MASK] == &c2, "wrong slot head after detach");
+	ck_assert_msg(!c2.wheel_next, "stale slot list after detach");
+
+	// Touching a detached conn must leave the wheel alone
+	pxy_thr_touch(&c1);
+	ck_assert_msg(thr->wheel[(size_t)t & PXY_THR_WHEEL_MASK] == &c2, "slot head lost by touching detached conn");
+	ck_assert_msg(thr->wheel[(size_t)c1.atime & PXY_THR_WHEEL_MASK] != &c1, "detached conn linked by touch");
+
+	pxy_thr_touch(&c2);
+	ck_assert_msg(c2.atime != t, "atime not updated");
+	ck_assert_msg(c2.atime <= pxy_thr_time(), "atime not on the monotonic clock");
+	ck_assert_msg(!thr->wheel[(size_t)t & PXY_THR_WHEEL_MASK], "conn not moved out of slot");
+	ck_assert_msg(thr->wheel[(size_t)c2.atime & PXY_THR_WHEEL_MASK] == &c2, "conn not moved into slot");
+
+	pxy_thr_detach(&c2);
+	pxy_thr_detach(&c3);
+	ck_assert_msg(thr->load == 0, "wrong load after detach");
+	ck_assert_msg(ld.conns == 0, "wrong published load after detach");
+	ck_assert_msg(!thr->conns && !thr->conns_tail, "conns list not empty");
+	for (int i = 0; i < PXY_THR_WHEEL_SIZE; i++) {
+		ck_assert_msg(!thr->wheel[i], "wheel not empty");
+	}
+	free(thr);
+}
+END_TEST
+
+START_TEST(pxythrmgr_balance_01)
+{
+	global_t *global;
+	pxy_thrmgr_ctx_t *tmctx;
+	pxy_thr_ctx_t thr[2];
+	pxy_conn_ctx_t c[8];
+
+	global = global_new();
+	ck_assert_msg(!!global, "no global");
+	global->thr_balance = THR_BALANCE_P2C;
+	tmctx = pxy_thrmgr_new(global);
+	ck_assert_msg(!!tmctx, "no thrmgr");
+
+	tmctx->num_thr = 2;
+	tmctx->thr = malloc(2 * sizeof(pxy_thr_ctx_t *));
+	ck_assert_msg(!!tmctx->thr, "no thr array");
+	ck_assert_msg(!posix_memalign((void **)&tmctx->loads, PXY_THR_CACHELINE_SIZE, 2 * sizeof(pxy_thr_load_t)), "no load slots");
+	ck_assert_msg(((uintptr_t)&tmctx->loads[1] & (PXY_THR_CACHELINE_SIZE - 1)) == 0, "load slot not aligned");
+	memset(tmctx->loads, 0, 2 * sizeof(pxy_thr_load_t));
+	memset(thr, 0, sizeof(thr));
+	for (int i = 0; i < 2; i++) {
+		thr[i].id = i;
+		thr[i].ld = &tmctx->loads[i];
+		tmctx->thr[i] = &thr[i];
+	}
+
+	// thr 0 has fewer conns, but streams more bytes
+	tmctx->loads[0].conns = 1;
+	tmctx->loads[0].byte_rate = 100ULL * PXY_THRMGR_BYTE_RATE_UNIT;
+	tmctx->loads[1].conns = 10;
+	ck_assert_msg(pxy_thrmgr_thr_score(&tmctx->loads[0]) == 101, "wrong score 0");
+	ck_assert_msg(pxy_thrmgr_thr_score(&tmctx->loads[1]) == 10, "wrong score 1");
+
+	for (int i = 0; i < 8; i++) {
+		memset(&c[i], 0, sizeof(c[i]));
+		c[i].thrmgr = tmctx;
+		pxy_thrmgr_assign_thr(&c[i]);
+		ck_assert_msg(c[i].thr == &thr[1], "wrong thr");
+		ck_assert_msg(c[i].handshaking, "handshake not started");
+	}
+	ck_assert_msg(tmctx->loads[1].handshakes == 8, "wrong handshakes");
+	ck_assert_msg(pxy_thrmgr_thr_score(&tmctx->loads[1]) == 10 + 8 * PXY_THRMGR_HANDSHAKE_WEIGHT, "wrong score with handshakes");
+
+	for (int i = 0; i < 8; i++) {
+		pxy_thr_handshake_done(&c[i]);
+		pxy_thr_handshake_done(&c[i]);
+	}
+	ck_assert_msg(tmctx->loads[1].handshakes == 0, "wrong handshakes after done");
+
+	free(tmctx->loads);
+	free(tmctx->thr);
+	free(tmctx);
+	global_free(global);
+}
+END_TEST
+
 Suite *
 pxythrmgr_suite(void)
 {
@@ -123,6 +242,14 @@ pxythrmgr_suite(void)
 	tcase_add_test(tc, pxythrmgr_libevent_05);
 	suite_add_tcase(s, tc);
 
+	tc = tcase_create("pxythr_wheel");
+	tcase_add_test(tc, pxythr_wheel_01);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("pxythrmgr_balance");
+	tcase_add_test(tc, pxythrmgr_balance_01);
+	suite_add_tcase(s, tc);
+
 	return s;
 }
 
@@ -535,6 +535,41 @@ START_TEST(ssl_tls_clienthello_parse_10)
 }
 END_TEST
 
+START_TEST(ssl_tls_clienthello_recordsz_00)
+{
+	ssize_t sz;
+
+	sz = ssl_tls_clienthello_recordsz(clienthello00, 1);
+	ck_assert_msg(sz == -1, "sz not -1");
+	sz = ssl_tls_clienthello_recordsz(clienthello00, SSL_TLS_RECORD_HDR_SZ);
+	ck_assert_msg(sz == sizeof(clienthello00) - 1, "wrong SSLv2 record size");
+}
+END_TEST
+
+START_TEST(ssl_tls_clienthello_recordsz_01)
+{
+	ssize_t sz;
+
+	sz = ssl_tls_clienthello_recordsz(clienthello02, 4);
+	ck_assert_msg(sz == -1, "sz not -1");
+	sz = ssl_tls_clienthello_recordsz(clienthello02, SSL_TLS_RECORD_HDR_SZ);
+	ck_assert_msg(sz == sizeof(clienthello02) - 1, "wrong TLS record size");
+	sz = ssl_tls_clienthello_recordsz(clienthello02, sizeof(clienthello02) - 1);
+	ck_assert_msg(sz == sizeof(clienthello02) - 1, "wrong TLS record size");
+}
+END_TEST
+
+START_TEST(ssl_tls_clienthello_recordsz_02)
+{
+	ssize_t sz;
+
+	sz = ssl_tls_clienthello_recordsz((const unsigned char *)"GET / HTTP/1.1\r\n", 16);
+	ck_assert_msg(sz == 0, "sz not 0");
+	sz = ssl_tls_clienthello_recordsz((const unsigned char *)"\x16\x02\x00\x00\x10", 5);
+	ck_assert_msg(sz == 0, "sz not 0");
+}
+END_TEST
+
 START_TEST(ssl_key_identifier_sha1_01)
 {
 	X509 *c;
@@ -820,6 +855,9 @@ ssl_suite(void)
 	tcase_add_test(tc, ssl_tls_clienthello_parse_08);
 	tcase_add_test(tc, ssl_tls_clienthello_parse_09);
 	tcase_add_test(tc, ssl_tls_clienthello_parse_10);
+	tcase_add_test(tc, ssl_tls_clienthello_recordsz_00);
+	tcase_add_test(tc, ssl_tls_clienthello_recordsz_01);
+	tcase_add_test(tc, ssl_tls_clienthello_recordsz_02);
 	suite_add_tcase(s, tc);
 
 	tc = tcase_create("ssl_key_identifier_sha1");
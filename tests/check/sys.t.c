@@ -175,6 +175,39 @@ START_TEST(sys_mkpath_01)
 }
 END_TEST
 
+static void *
+sys_mkpath_thr(void *arg)
+{
+	long rv = 0;
+
+	for (int i = 0; i < 100; i++) {
+		char *dir;
+		if (asprintf(&dir, "%s/%i/a/bb/ccc", (char *)arg, i) == -1)
+			return (void *)-1;
+		if (sys_mkpath(dir, DFLT_DIRMODE) == -1)
+			rv = -1;
+		free(dir);
+	}
+	return (void *)rv;
+}
+
+START_TEST(sys_mkpath_02)
+{
+	pthread_t tid[4];
+	void *rv;
+
+	for (size_t i = 0; i < sizeof(tid)/sizeof(tid[0]); i++) {
+		ck_assert_msg(!pthread_create(&tid[i], NULL, sys_mkpath_thr,
+		                              basedir),
+		              "Cannot create thread");
+	}
+	for (size_t i = 0; i < sizeof(tid)/sizeof(tid[0]); i++) {
+		ck_assert_msg(!pthread_join(tid[i], &rv), "Cannot join thread");
+		ck_assert_msg(rv == NULL, "concurrent sys_mkpath failed");
+	}
+}
+END_TEST
+
 START_TEST(sys_realdir_01)
 {
 	char *rd;
@@ -244,6 +277,69 @@ START_TEST(sys_get_cpu_cores_01)
 }
 END_TEST
 
+START_TEST(sys_parse_cpulist_01)
+{
+	int *cpus;
+	int n;
+
+	n = sys_parse_cpulist("0-3,8,10-11", &cpus);
+	ck_assert_msg(n == 7, "Wrong number of cpus");
+	ck_assert_msg(cpus[0] == 0 && cpus[3] == 3, "Wrong first range");
+	ck_assert_msg(cpus[4] == 8, "Wrong single cpu");
+	ck_assert_msg(cpus[5] == 10 && cpus[6] == 11, "Wrong last range");
+	free(cpus);
+
+	n = sys_parse_cpulist("5", &cpus);
+	ck_assert_msg(n == 1 && cpus[0] == 5, "Wrong single cpu list");
+	free(cpus);
+}
+END_TEST
+
+START_TEST(sys_parse_cpulist_02)
+{
+	int *cpus;
+
+	ck_assert_msg(sys_parse_cpulist("", &cpus) == -1, "Empty list accepted");
+	ck_assert_msg(sys_parse_cpulist("1,", &cpus) == -1, "Trailing comma accepted");
+	ck_assert_msg(sys_parse_cpulist("3-1", &cpus) == -1, "Reverse range accepted");
+	ck_assert_msg(sys_parse_cpulist("1-", &cpus) == -1, "Open range accepted");
+	ck_assert_msg(sys_parse_cpulist("a", &cpus) == -1, "Garbage accepted");
+	ck_assert_msg(sys_parse_cpulist("1;2", &cpus) == -1, "Bad separator accepted");
+	ck_assert_msg(sys_parse_cpulist("-1", &cpus) == -1, "Negative cpu accepted");
+	ck_assert_msg(sys_parse_cpulist("0-99999", &cpus) == -1, "Huge cpu accepted");
+}
+END_TEST
+
+#ifdef SYS_HAVE_AFFINITY
+START_TEST(sys_thread_pin_01)
+{
+	ck_assert_msg(sys_thread_pin(pthread_self(), 0) == 0, "Cannot pin to cpu 0");
+	ck_assert_msg(sys_thread_pin(pthread_self(), -1) == 0, "Cannot unpin");
+	ck_assert_msg(sys_thread_pin(pthread_self(), -2) == -1, "Invalid cpu accepted");
+}
+END_TEST
+#endif /* SYS_HAVE_AFFINITY */
+
+START_TEST(sys_fd_count_01)
+{
+	int n, fd;
+
+	sys_fd_count_init();
+	n = sys_fd_count_get();
+	ck_assert_msg(n >= 3, "Too few open fds");
+
+	fd = open("/dev/null", O_RDONLY);
+	ck_assert_msg(fd != -1, "Cannot open /dev/null");
+	sys_fd_count_init();
+	ck_assert_msg(sys_fd_count_get() == n + 1, "Open fd not counted");
+	close(fd);
+
+	ck_assert_msg(sys_fd_count_add(-1) == n, "Wrong fd count after add");
+	ck_assert_msg(sys_fd_count_add(2) == n + 2, "Wrong fd count after add");
+	ck_assert_msg(sys_fd_count_get() == n + 2, "Wrong fd count");
+}
+END_TEST
+
 void *
 thrmain(void *arg)
 {
@@ -335,6 +431,7 @@ sys_suite(void)
 	tc = tcase_create("sys_mkpath");
 	tcase_add_unchecked_fixture(tc, sys_mkpath_setup, sys_mkpath_teardown);
 	tcase_add_test(tc, sys_mkpath_01);
+	tcase_add_test(tc, sys_mkpath_02);
 	suite_add_tcase(s, tc);
 
 	tc = tcase_create("sys_realdir");
@@ -352,6 +449,21 @@ sys_suite(void)
 	tcase_add_test(tc, sys_get_cpu_cores_01);
 	suite_add_tcase(s, tc);
 
+	tc = tcase_create("sys_parse_cpulist");
+	tcase_add_test(tc, sys_parse_cpulist_01);
+	tcase_add_test(tc, sys_parse_cpulist_02);
+	suite_add_tcase(s, tc);
+
+#ifdef SYS_HAVE_AFFINITY
+	tc = tcase_create("sys_thread_pin");
+	tcase_add_test(tc, sys_thread_pin_01);
+	suite_add_tcase(s, tc);
+#endif /* SYS_HAVE_AFFINITY */
+
+	tc = tcase_create("sys_fd_count");
+	tcase_add_test(tc, sys_fd_count_01);
+	suite_add_tcase(s, tc);
+
 	tc = tcase_create("pthread_create");
 	tcase_add_test(tc, pthread_create_01);
 	suite_add_tcase(s, tc);
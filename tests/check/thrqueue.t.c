@@ -0,0 +1,176 @@
+/*-
+ * SSLsplit - transparent SSL/TLS interception
+ * https://www.roe.ch/SSLsplit
+ *
+ * Copyright (c) 2017-2025, Soner Tari <sonertari@gmail.com>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "thrqueue.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include <check.h>
+
+#define PRODUCERS 4
+#define ITEMS 100000
+
+static thrqueue_t *queue;
+
+static void
+thrqueue_setup(void)
+{
+	queue = thrqueue_new(8);
+	if (!queue)
+		exit(EXIT_FAILURE);
+}
+
+static void
+thrqueue_teardown(void)
+{
+	thrqueue_free(queue);
+}
+
+/*
+ * Each producer enqueues ITEMS items encoding its id and a sequence number.
+ */
+static void *
+thrqueue_producer(void *arg)
+{
+	uintptr_t id = (uintptr_t)arg;
+	uintptr_t i;
+
+	for (i = 1; i <= ITEMS; i++) {
+		if (!thrqueue_enqueue(queue, (void *)((id << 24) | i)))
+			return (void *)1;
+	}
+	return NULL;
+}
+
+START_TEST(thrqueue_01)
+{
+	uintptr_t i;
+	void *item;
+
+	for (i = 1; i <= 8; i++) {
+		ck_assert_msg(thrqueue_enqueue_nb(queue, (void *)i) == (void *)i,
+		              "enqueue failed");
+	}
+	ck_assert_msg(!thrqueue_enqueue_nb(queue, (void *)9), "enqueue on full");
+	for (i = 1; i <= 8; i++) {
+		item = thrqueue_dequeue_nb(queue);
+		ck_assert_msg(item == (void *)i, "wrong order");
+	}
+	ck_assert_msg(!thrqueue_dequeue_nb(queue), "dequeue on empty");
+}
+END_TEST
+
+START_TEST(thrqueue_02)
+{
+	thrqueue_stats_t stats;
+	void *items[8];
+	uintptr_t i;
+	size_t n;
+
+	for (i = 1; i <= 5; i++) {
+		ck_assert_msg(thrqueue_enqueue(queue, (void *)i) == (void *)i,
+		              "enqueue failed");
+	}
+	n = thrqueue_dequeue_batch(queue, items, 3);
+	ck_assert_msg(n == 3, "wrong batch size %zu", n);
+	n = thrqueue_dequeue_batch(queue, items + 3, 5);
+	ck_assert_msg(n == 2, "wrong batch size %zu", n);
+	for (i = 0; i < 5; i++) {
+		ck_assert_msg(items[i] == (void *)(i + 1), "wrong order");
+	}
+	thrqueue_get_stats(queue, &stats);
+	ck_assert_msg(stats.batches == 2, "batches not counted");
+	ck_assert_msg(stats.items == 5, "items not counted");
+	ck_assert_msg(stats.max_batch == 3, "max batch not kept");
+	ck_assert_msg(stats.max_depth == 5, "max depth not kept");
+	ck_assert_msg(stats.depth == 0, "queue not empty");
+	thrqueue_get_stats(queue, &stats);
+	ck_assert_msg(stats.batches == 0 && stats.max_batch == 0,
+	              "stats not reset");
+
+	thrqueue_unblock_dequeue(queue);
+	n = thrqueue_dequeue_batch(queue, items, 8);
+	ck_assert_msg(n == 0, "dequeue blocked after unblock");
+	ck_assert_msg(!thrqueue_dequeue(queue), "dequeue blocked after unblock");
+}
+END_TEST
+
+START_TEST(thrqueue_03)
+{
+	pthread_t thr[PRODUCERS];
+	uintptr_t last[PRODUCERS] = {0};
+	void *items[16];
+	void *rv;
+	uintptr_t id, seq;
+	size_t n, i, total = 0;
+
+	for (id = 0; id < PRODUCERS; id++) {
+		ck_assert_msg(!pthread_create(&thr[id], NULL, thrqueue_producer,
+		                              (void *)id), "pthread_create");
+	}
+	while (total < PRODUCERS * ITEMS) {
+		n = thrqueue_dequeue_batch(queue, items, 16);
+		ck_assert_msg(n > 0 && n <= 16, "wrong batch size %zu", n);
+		for (i = 0; i < n; i++) {
+			id = (uintptr_t)items[i] >> 24;
+			seq = (uintptr_t)items[i] & 0xFFFFFF;
+			ck_assert_msg(id < PRODUCERS, "bad item");
+			ck_assert_msg(seq == last[id] + 1, "lost or reordered item");
+			last[id] = seq;
+		}
+		total += n;
+	}
+	for (id = 0; id < PRODUCERS; id++) {
+		pthread_join(thr[id], &rv);
+		ck_assert_msg(rv == NULL, "enqueue failed");
+	}
+	ck_assert_msg(!thrqueue_dequeue_nb(queue), "extra items");
+}
+END_TEST
+
+Suite *
+thrqueue_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("thrqueue");
+
+	tc = tcase_create("thrqueue");
+	tcase_add_checked_fixture(tc, thrqueue_setup, thrqueue_teardown);
+	tcase_add_test(tc, thrqueue_01);
+	tcase_add_test(tc, thrqueue_02);
+	tcase_add_test(tc, thrqueue_03);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+/* vim: set noet ft=c: */
@@ -0,0 +1,248 @@
+/*-
+ * SSLproxy - transparent SSL/TLS proxy
+ *
+ * Copyright (c) 2017-2025, Soner Tari <sonertari@gmail.com>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "usertbl.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <check.h>
+
+#ifndef WITHOUT_USERAUTH
+static char dbpath[] = "/tmp/sslproxy_test_usertbl.XXXXXX";
+static sqlite3 *db;
+// Another connection, as the auth portal writing to the db
+static sqlite3 *portal;
+static usertbl_t *tbl;
+
+static void
+usertbl_exec(const char *sql)
+{
+	char *err = NULL;
+
+	ck_assert_msg(sqlite3_exec(portal, sql, NULL, NULL, &err) == SQLITE_OK,
+	              "exec failed: %s", err ? err : "?");
+}
+
+static void
+usertbl_setup(void)
+{
+	int fd;
+
+	strcpy(dbpath + sizeof(dbpath) - 7, "XXXXXX");
+	fd = mkstemp(dbpath);
+	ck_assert_msg(fd != -1, "mkstemp failed");
+	close(fd);
+	ck_assert_msg(sqlite3_open(dbpath, &portal) == SQLITE_OK, "open failed");
+	usertbl_exec("CREATE TABLE users (ip CHAR(45) PRIMARY KEY, user CHAR(31) NOT NULL, "
+	             "ether CHAR(17) NOT NULL, atime INT NOT NULL, desc CHAR(50))");
+	usertbl_exec("INSERT INTO users VALUES ('192.168.0.1', 'user1', '00:11:22:33:44:55', 1000, 'admin')");
+	usertbl_exec("INSERT INTO users VALUES ('192.168.0.2', 'user2', '00:11:22:33:44:66', 2000, NULL)");
+	ck_assert_msg(sqlite3_open(dbpath, &db) == SQLITE_OK, "open failed");
+	tbl = usertbl_new(db, 2);
+	ck_assert_msg(tbl != NULL, "usertbl_new failed");
+}
+
+static void
+usertbl_teardown(void)
+{
+	usertbl_free(tbl);
+	sqlite3_close(db);
+	sqlite3_close(portal);
+	unlink(dbpath);
+}
+
+START_TEST(usertbl_01)
+{
+	usertbl_user_t u;
+
+	memset(&u, 0, sizeof(u));
+	ck_assert_msg(usertbl_lookup(tbl, 0, "192.168.0.1", &u) == 1, "user not found");
+	ck_assert_msg(!strcmp(u.user, "user1"), "wrong user");
+	ck_assert_msg(!strcmp(u.ether, "00:11:22:33:44:55"), "wrong ether");
+	ck_assert_msg(!strcmp(u.desc, "admin"), "wrong desc");
+	ck_assert_msg(u.atime == 1000, "wrong atime");
+	free(u.user);
+	free(u.desc);
+
+	memset(&u, 0, sizeof(u));
+	ck_assert_msg(usertbl_lookup(tbl, 1, "192.168.0.2", &u) == 1, "user not found");
+	ck_assert_msg(!strcmp(u.user, "user2"), "wrong user");
+	ck_assert_msg(!strcmp(u.desc, ""), "wrong desc");
+	free(u.user);
+	free(u.desc);
+
+	memset(&u, 0, sizeof(u));
+	ck_assert_msg(usertbl_lookup(tbl, 0, "192.168.0.3", &u) == 0, "unknown user found");
+	ck_assert_msg(!u.user && !u.desc, "unknown user filled in");
+}
+END_TEST
+
+START_TEST(usertbl_02)
+{
+	usertbl_user_t u;
+	usertbl_stats_t stats;
+
+	ck_assert_msg(usertbl_refresh(tbl) == 0, "reloaded unchanged db");
+
+	usertbl_exec("UPDATE users SET atime = 3000 WHERE ip = '192.168.0.1'");
+	usertbl_exec("DELETE FROM users WHERE ip = '192.168.0.2'");
+	usertbl_exec("INSERT INTO users VALUES ('192.168.0.3', 'user3', '00:11:22:33:44:77', 4000, 'user')");
+	ck_assert_msg(usertbl_refresh(tbl) == 1, "changed db not reloaded");
+	ck_assert_msg(usertbl_refresh(tbl) == 0, "reloaded twice");
+
+	memset(&u, 0, sizeof(u));
+	ck_assert_msg(usertbl_lookup(tbl, 0, "192.168.0.1", &u) == 1, "user not found");
+	ck_assert_msg(u.atime == 3000, "atime not updated");
+	free(u.user);
+	free(u.desc);
+	ck_assert_msg(usertbl_lookup(tbl, 0, "192.168.0.2", &u) == 0, "deleted user found");
+	ck_assert_msg(usertbl_lookup(tbl, 0, "192.168.0.3", &u) == 1, "new user not found");
+	ck_assert_msg(!strcmp(u.user, "user3"), "wrong user");
+	free(u.user);
+	free(u.desc);
+
+	// The deleted row makes the row count mismatch, so the table is reloaded
+	usertbl_get_stats(tbl, &stats);
+	ck_assert_msg(stats.users == 2, "wrong number of users %zu", stats.users);
+	ck_assert_msg(stats.reloads == 2, "wrong number of reloads %zu", stats.reloads);
+	ck_assert_msg(stats.updates == 0, "wrong number of updates %zu", stats.updates);
+}
+END_TEST
+
+START_TEST(usertbl_03)
+{
+	usertbl_user_t u;
+	usertbl_stats_t stats;
+	int i, found = 0;
+
+	ck_assert_msg(usertbl_start(tbl) == 0, "usertbl_start failed");
+	usertbl_exec("INSERT INTO users VALUES ('192.168.0.3', 'user3', '00:11:22:33:44:77', 4000, 'user')");
+
+	// The refresh thread reloads the table within a few poll intervals
+	for (i = 0; i < 200 && !found; i++) {
+		usertbl_get_stats(tbl, &stats);
+		found = stats.users == 3;
+		if (!found) {
+			usleep(10000);
+		}
+	}
+	ck_assert_msg(found == 1, "new user not loaded by the refresh thread");
+
+	memset(&u, 0, sizeof(u));
+	ck_assert_msg(usertbl_lookup(tbl, 1, "192.168.0.3", &u) == 1, "new user not found");
+	free(u.user);
+	free(u.desc);
+}
+END_TEST
+
+START_TEST(usertbl_04)
+{
+	usertbl_user_t u;
+
+	// Not in the snapshot yet, a miss until the next refresh
+	usertbl_exec("INSERT INTO users VALUES ('192.168.0.3', 'user3', '00:11:22:33:44:77', 4000, NULL)");
+
+	memset(&u, 0, sizeof(u));
+	ck_assert_msg(usertbl_lookup(tbl, 1, "192.168.0.3", &u) == 0, "user found before refresh");
+	ck_assert_msg(!u.user && !u.desc, "unknown user filled in");
+
+	ck_assert_msg(usertbl_refresh(tbl) == 1, "changed db not reloaded");
+	ck_assert_msg(usertbl_lookup(tbl, 1, "192.168.0.3", &u) == 1, "new user not found");
+	ck_assert_msg(!strcmp(u.user, "user3"), "wrong user");
+	ck_assert_msg(!strcmp(u.desc, ""), "wrong desc");
+	free(u.user);
+	free(u.desc);
+}
+END_TEST
+
+START_TEST(usertbl_05)
+{
+	usertbl_user_t u;
+	usertbl_stats_t stats;
+
+	// Atime updates and logins are merged into the snapshot
+	usertbl_exec("UPDATE users SET atime = 3000 WHERE ip = '192.168.0.1'");
+	usertbl_exec("INSERT INTO users VALUES ('192.168.0.3', 'user3', '00:11:22:33:44:77', 3000, 'user')");
+	ck_assert_msg(usertbl_refresh(tbl) == 1, "changed db not refreshed");
+
+	memset(&u, 0, sizeof(u));
+	ck_assert_msg(usertbl_lookup(tbl, 0, "192.168.0.1", &u) == 1, "user not found");
+	ck_assert_msg(u.atime == 3000, "atime not updated");
+	free(u.user);
+	free(u.desc);
+	ck_assert_msg(usertbl_lookup(tbl, 0, "192.168.0.2", &u) == 1, "unchanged user not found");
+	ck_assert_msg(!strcmp(u.user, "user2"), "wrong user");
+	free(u.user);
+	free(u.desc);
+	ck_assert_msg(usertbl_lookup(tbl, 0, "192.168.0.3", &u) == 1, "new user not found");
+	free(u.user);
+	free(u.desc);
+
+	usertbl_get_stats(tbl, &stats);
+	ck_assert_msg(stats.users == 3, "wrong number of users %zu", stats.users);
+	ck_assert_msg(stats.reloads == 1, "wrong number of reloads %zu", stats.reloads);
+	ck_assert_msg(stats.updates == 1, "wrong number of updates %zu", stats.updates);
+
+	// Rows inserted with an older atime are found by the row count
+	usertbl_exec("INSERT INTO users VALUES ('192.168.0.4', 'user4', '00:11:22:33:44:88', 500, NULL)");
+	ck_assert_msg(usertbl_refresh(tbl) == 1, "changed db not refreshed");
+	ck_assert_msg(usertbl_lookup(tbl, 0, "192.168.0.4", &u) == 1, "old user not found");
+	free(u.user);
+	free(u.desc);
+
+	usertbl_get_stats(tbl, &stats);
+	ck_assert_msg(stats.users == 4, "wrong number of users %zu", stats.users);
+	ck_assert_msg(stats.reloads == 2, "wrong number of reloads %zu", stats.reloads);
+}
+END_TEST
+
+Suite *
+usertbl_suite(void)
+{
+	Suite *s;
+	TCase *tc;
+
+	s = suite_create("usertbl");
+
+	tc = tcase_create("usertbl");
+	tcase_add_checked_fixture(tc, usertbl_setup, usertbl_teardown);
+	tcase_add_test(tc, usertbl_01);
+	tcase_add_test(tc, usertbl_02);
+	tcase_add_test(tc, usertbl_03);
+	tcase_add_test(tc, usertbl_04);
+	tcase_add_test(tc, usertbl_05);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+#endif /* !WITHOUT_USERAUTH */
+
+/* vim: set noet ft=c: */